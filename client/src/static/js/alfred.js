@@ -26,6 +26,10 @@ submitButton.addEventListener('click', function() {
 })
 
 let data, exampleData, readGroups, summary
+let visRequest = 0
+
+// Files written by `alfred qc -f chunked` start with this magic
+const chunkMagic = 'ALFJSONC'
 
 const inputFile = document.getElementById('inputFile')
 const chartsContainer = document.getElementById('charts-container')
@@ -93,6 +97,77 @@ function Select(element, options = {}) {
 }
 
 function readFile(file) {
+  return readSlice(file, 0, chunkMagic.length).then(header => {
+    if (new TextDecoder().decode(header) === chunkMagic) {
+      return readChunkedFile(file)
+    }
+    return readJsonFile(file)
+  })
+}
+
+function readSlice(file, start, end) {
+  const fileReader = new FileReader()
+  fileReader.readAsArrayBuffer(file.slice(start, end))
+  return new Promise((resolve, reject) => {
+    fileReader.onload = event => resolve(event.target.result)
+    fileReader.onerror = () => reject(`Error(${file.name}): cannot read file.`)
+  })
+}
+
+function readChunk(source, range) {
+  const start = source.offset + range[0]
+  return readSlice(source.file, start, start + range[1]).then(buffer =>
+    JSON.parse(pako.ungzip(new Uint8Array(buffer), { to: 'string' }))
+  )
+}
+
+// Only the index and the summaries are read up front, metrics follow when they are shown
+function readChunkedFile(file) {
+  const headerLength = chunkMagic.length + 4
+  return readSlice(file, 0, headerLength)
+    .then(header => {
+      const indexLength = new DataView(header).getUint32(chunkMagic.length, true)
+      const source = { file, offset: headerLength + indexLength }
+      return readSlice(file, headerLength, source.offset).then(buffer => {
+        const index = JSON.parse(new TextDecoder().decode(buffer))
+        return Promise.all(
+          index.samples.map(sample =>
+            readChunk(source, sample.summary).then(summary => ({
+              id: sample.id,
+              summary,
+              readGroups: sample.readGroups.map(rg => ({
+                id: rg.id,
+                metrics: rg.metrics.map(metric => ({
+                  id: metric.id,
+                  title: metric.title,
+                  type: metric.type,
+                  chunk: metric.chunk,
+                  source
+                }))
+              }))
+            }))
+          )
+        )
+      })
+    })
+    .then(samples => ({ samples }))
+    .catch(() =>
+      Promise.reject(`Error(${file.name}): not a valid chunked JSON file.`)
+    )
+}
+
+function loadMetric(metric) {
+  if (!metric.chunk) {
+    return Promise.resolve(metric)
+  }
+  return readChunk(metric.source, metric.chunk).then(content => {
+    delete metric.chunk
+    delete metric.source
+    return Object.assign(metric, content)
+  })
+}
+
+function readJsonFile(file) {
   const fileReader = new FileReader()
   const isGzip = file.name.endsWith('.gz')
 
@@ -292,18 +367,26 @@ const chartDispatch = {
 }
 
 function vis(data, sample, readGroup) {
-  hideElement(resultInfo)
-  hideElement(resultError)
-  showElement(resultContainer)
-
   const dataRg = data.samples
     .filter(s => s.id === sample)
     .find(s => s.readGroups.find(rg => rg.id === readGroup))
     .readGroups.find(rg => rg.id === readGroup)
 
-  for (const metric of dataRg.metrics) {
-    chartDispatch[metric.type](metric, chartsContainer)
-  }
+  // A later selection replaces the charts of a selection that is still loading
+  const request = ++visRequest
+  Promise.all(dataRg.metrics.map(loadMetric))
+    .then(metrics => {
+      if (request !== visRequest) {
+        return
+      }
+      hideElement(resultInfo)
+      hideElement(resultError)
+      showElement(resultContainer)
+      for (const metric of metrics) {
+        chartDispatch[metric.type](metric, chartsContainer)
+      }
+    })
+    .catch(error => showError(error))
 }
 
 function chart(metricData, parent) {
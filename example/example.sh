@@ -93,7 +93,7 @@ then
 	    fi
 	    ${BASEDIR}/../src/alfred qc -r GRCh38_full_analysis_set_plus_decoy_hla.fa -f json -o ${SAMPLE}.exome.illumina.pe.json.gz -b ${BASEDIR}/../maps/exonic.hg38.bed.gz ${SAMPLE}.alt_bwamem_GRCh38DH.20150826.GBR.exome.cram
 	done
-	python ${BASEDIR}/../scripts/merge.py *.exome.illumina.pe.json.gz | gzip -c > dna.exome.illumina.pe.ms.json.gz
+	${BASEDIR}/../src/alfred merge_json -o dna.exome.illumina.pe.ms.json.gz *.exome.illumina.pe.json.gz
 	rm *.exome.illumina.pe.json.gz
     fi
 
@@ -109,7 +109,7 @@ then
 	    fi
 	    ${BASEDIR}/../src/alfred qc -r GRCh38_full_analysis_set_plus_decoy_hla.fa -f json -o ${SAMPLE}.wgs.illumina.pe.json.gz ${SAMPLE}.alt_bwamem_GRCh38DH.20150715.CHS.high_coverage.cram
 	done
-	python ${BASEDIR}/../scripts/merge.py *.wgs.illumina.pe.json.gz | gzip -c > dna.wgs.illumina.pe.ms.json.gz
+	${BASEDIR}/../src/alfred merge_json -o dna.wgs.illumina.pe.ms.json.gz *.wgs.illumina.pe.json.gz
 	rm *.wgs.illumina.pe.json.gz
     fi
 
@@ -125,7 +125,7 @@ then
 	    fi
 	    ${BASEDIR}/../src/alfred qc -r GRCh38_full_analysis_set_plus_decoy_hla.fa -f json -o ${SAMPLE}.wgs.illumina.mp.json.gz ${SAMPLE}.alt_bwamem_GRCh38DH.20150724.CHS.sv_7kb_mate.cram
 	done
-	python ${BASEDIR}/../scripts/merge.py *.wgs.illumina.mp.json.gz | gzip -c > dna.wgs.illumina.mp.ms.json.gz
+	${BASEDIR}/../src/alfred merge_json -o dna.wgs.illumina.mp.ms.json.gz *.wgs.illumina.mp.json.gz
 	rm *.wgs.illumina.mp.json.gz
     fi
 
@@ -141,7 +141,7 @@ then
 	    fi
 	    ${BASEDIR}/../src/alfred qc -a ${SAMPLE} -r hg19.fa -f json -o ${SAMPLE}.rna.illumina.pe.json.gz ${SAMPLE}.bam
 	done
-	python ${BASEDIR}/../scripts/merge.py *.rna.illumina.pe.json.gz | gzip -c > rna.illumina.pe.ms.json.gz
+	${BASEDIR}/../src/alfred merge_json -o rna.illumina.pe.ms.json.gz *.rna.illumina.pe.json.gz
 	rm *.rna.illumina.pe.json.gz
     fi
 
@@ -157,7 +157,7 @@ then
 	    fi
 	    ${BASEDIR}/../src/alfred qc -r GRCh38_full_analysis_set_plus_decoy_hla.fa -f json -o ${SAMPLE}.hic.illumina.pe.json.gz ${SAMPLE}_Hi-C_biorep2_merged_filtered.bam
 	done
-	python ${BASEDIR}/../scripts/merge.py *.hic.illumina.pe.json.gz | gzip -c > hic.illumina.pe.ms.json.gz
+	${BASEDIR}/../src/alfred merge_json -o hic.illumina.pe.ms.json.gz *.hic.illumina.pe.json.gz
 	rm *.hic.illumina.pe.json.gz
     fi
 
@@ -182,7 +182,7 @@ then
 	    fi
 	    ${BASEDIR}/../src/alfred qc -r GRCh38_full_analysis_set_plus_decoy_hla.fa -f json -o ${SAMPLE}.dna.wgs.pacbio.se.json.gz ${SAMPLE}_bwamem_GRCh38DH_YRI_20160905_pacbio.bam
 	done
-	python ${BASEDIR}/../scripts/merge.py *.dna.wgs.pacbio.se.json.gz | gzip -c > dna.wgs.pacbio.se.ms.json.gz
+	${BASEDIR}/../src/alfred merge_json -o dna.wgs.pacbio.se.ms.json.gz *.dna.wgs.pacbio.se.json.gz
 	rm *.dna.wgs.pacbio.se.json.gz
     fi
 elif [ ${1} == "runtime" ]
@@ -0,0 +1,26 @@
+#! /bin/bash
+
+# Throughput of alfred qc for common metric sets
+# Usage: ./scripts/qcbench.sh <ref.fa> <align.bam>
+
+if [ $# -ne 2 ]
+then
+    echo "Usage: $0 <ref.fa> <align.bam>"
+    exit -1
+fi
+
+ALFRED=$(dirname $0)/../src/alfred
+REF=${1}
+BAM=${2}
+OUT=$(mktemp -d)
+READS=$(samtools view -c ${BAM})
+
+echo -e "metrics\tseconds\treadsPerSecond"
+for METRICS in all coverage isize coverage,isize coverage,gc bases errors gc umi,haplotype
+do
+    START=$(date +%s.%N)
+    ${ALFRED} qc -r ${REF} --metrics ${METRICS} -o ${OUT}/qc.tsv.gz ${BAM} > /dev/null || exit 1
+    END=$(date +%s.%N)
+    awk -v m=${METRICS} -v s=${START} -v e=${END} -v n=${READS} 'BEGIN {printf "%s\t%.2f\t%.0f\n", m, e - s, n / (e - s);}'
+done
+rm -rf ${OUT}
@@ -53,10 +53,17 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include "count_dna.h"
 #include "count_junction.h"
 #include "annotate.h"
+#include "motifindex.h"
 #include "tracks.h"
 #include "split.h"
 #include "ase.h"
 #include "qc.h"
+#include "run.h"
+#include "coverage.h"
+#include "merge_shards.h"
+#include "merge_json.h"
+#include "serve.h"
+#include "batch.h"
 
 using namespace bamstats;
 
@@ -84,13 +91,67 @@ displayUsage() {
   std::cout << "    count_jct    counting RNA split-reads at exon junctions" << std::endl;
   std::cout << "    tracks       create browser tracks" << std::endl;
   std::cout << "    annotate     annotate peaks" << std::endl;
+  std::cout << "    motif_index  index genome-wide motif hits" << std::endl;
   std::cout << "    split        split BAM into haplotypes" << std::endl;
   std::cout << "    ase          allele-specific expression" << std::endl;
+  std::cout << "    run          one-pass qc, count_dna, count_rna and tracks" << std::endl;
+  std::cout << "    coverage     coverage cache for count_dna and tracks" << std::endl;
+  std::cout << "    merge_shards merge the partial outputs of a sharded run" << std::endl;
+  std::cout << "    merge_json   merge qc JSON files of many samples" << std::endl;
+  std::cout << "    serve        run jobs in a resident process with cached references" << std::endl;
+  std::cout << "    batch        run the jobs of a sample manifest" << std::endl;
   std::cout << std::endl;
   std::cout << std::endl;
 }
 
 
+// Commands that alfred serve can run as jobs, argv[0] is the command
+inline int
+dispatchCommand(int argc, char **argv) {
+  if ((std::string(argv[0]) == "qc")) {
+    return qc(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "count_rna")) {
+    return count_rna(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "count_dna")) {
+    return count_dna(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "count_jct")) {
+    return count_junction(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "tracks")) {
+    return tracks(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "annotate")) {
+    return annotate(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "motif_index")) {
+    return motif_index(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "split")) {
+    return split(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "ase")) {
+    return ase(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "run")) {
+    return run(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "coverage")) {
+    return coverage(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "merge_shards")) {
+    return merge_shards(argc,argv);
+  }
+  else if ((std::string(argv[0]) == "merge_json")) {
+    return merge_json(argc,argv);
+  }
+  std::cerr << "Unrecognized command " << std::string(argv[0]) << std::endl;
+  return 1;
+}
+
+
 int main(int argc, char **argv) {
   if (argc < 2) {
     asciiArt();
@@ -116,30 +177,11 @@ int main(int argc, char **argv) {
     gplV3();
     return 0;
   }
-  else if ((std::string(argv[1]) == "qc")) {
-    return qc(argc-1,argv+1);
-  }
-  else if ((std::string(argv[1]) == "count_rna")) {
-    return count_rna(argc-1,argv+1);
+  else if ((std::string(argv[1]) == "serve")) {
+    return serve(argc-1,argv+1,dispatchCommand);
   }
-  else if ((std::string(argv[1]) == "count_dna")) {
-    return count_dna(argc-1,argv+1);
+  else if ((std::string(argv[1]) == "batch")) {
+    return batch(argc-1,argv+1,dispatchCommand);
   }
-  else if ((std::string(argv[1]) == "count_jct")) {
-    return count_junction(argc-1,argv+1);
-  }
-  else if ((std::string(argv[1]) == "tracks")) {
-    return tracks(argc-1,argv+1);
-  }
-  else if ((std::string(argv[1]) == "annotate")) {
-    return annotate(argc-1,argv+1);
-  }
-  else if ((std::string(argv[1]) == "split")) {
-    return split(argc-1,argv+1);
-  }
-  else if ((std::string(argv[1]) == "ase")) {
-    return ase(argc-1,argv+1);
-  }
-  std::cerr << "Unrecognized command " << std::string(argv[1]) << std::endl;
-  return 1;
+  return dispatchCommand(argc-1,argv+1);
 }
@@ -25,6 +25,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #define ANNOTATE_H
 
 #include <limits>
+#include <sstream>
 
 #include <boost/icl/split_interval_map.hpp>
 #include <boost/dynamic_bitset.hpp>
@@ -32,6 +33,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <boost/progress.hpp>
+#include <boost/thread.hpp>
 
 #include <htslib/sam.h>
 #include <htslib/faidx.h>
@@ -42,16 +44,32 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include "gff3.h"
 #include "bed.h"
 #include "motif.h"
+#include "motifindex.h"
+#include "intervaltree.h"
 
 namespace bamstats
 {
 
+  struct Peak {
+    int32_t start;
+    int32_t end;
+    uint32_t idx;
+    std::string name;
+
+    Peak(int32_t s, int32_t e, uint32_t i, std::string const& n) : start(s), end(e), idx(i), name(n) {}
+  };
+  
   struct AnnotateConfig {
     typedef std::map<std::string, int32_t> TChrMap;
-    uint8_t inputFileFormat;   // 0 = gtf, 1 = bed, 2 = gff3, 3 = motif file
+    typedef std::vector<Peak> TChrPeaks;
+    uint8_t inputFileFormat;   // 0 = gtf, 1 = bed, 2 = gff3, 3 = motif file, 4 = motif index
+    uint16_t nthreads;
     int32_t maxDistance;
+    uint32_t npeaks;
     float motifScoreQuantile;
+    double motifPvalue;
     TChrMap nchr;
+    std::vector<TChrPeaks> peaks;
     std::string idname;
     std::string feature;
     boost::filesystem::path motifFile;
@@ -63,116 +81,115 @@ namespace bamstats
   };
 
 
+  template<typename TConfig, typename TChromosomeRegions, typename TGeneIds>
+  inline void
+  _annotateChromosome(TConfig const& c, std::string const& chrName, int32_t refIndex, TChromosomeRegions const& chrRegions, TGeneIds const& geneIds, std::vector<std::string>& rows) {
+    // Index features
+    typedef IntervalTree<IntervalLabel> TIntervalTree;
+    TIntervalTree itree(chrRegions);
+    std::vector<uint32_t> hits;
+
+    // Annotate peaks
+    for(uint32_t k = 0; k < c.peaks[refIndex].size(); ++k) {
+      Peak const& pk = c.peaks[refIndex][k];
+
+      // Find features within maxDistance
+      typedef std::map<int32_t, int32_t> TFeatureDist;
+      TFeatureDist featureDist;  // No feature by default
+      itree.overlap(std::max(0, pk.start - c.maxDistance), pk.end + c.maxDistance, hits);
+      for(uint32_t i = 0; i < hits.size(); ++i) {
+	IntervalLabel const& feat = itree.itv[hits[i]];
+
+	// Get distance
+	int32_t locdist = 0;
+	if (feat.end < pk.start) { locdist = feat.end - pk.start; }
+	if (pk.end < feat.start) { locdist = feat.start - pk.end; }
+	featureDist[feat.lid] = locdist;
+      }
+
+      // Output overlapping features
+      std::ostringstream row;
+      row << chrName << "\t" << pk.start << "\t" << pk.end << "\t" << pk.name << "\t";
+      // Feature names
+      if (featureDist.empty()) {
+	row << "NA";
+      } else {
+	bool firstF = true;
+	for(typename TFeatureDist::const_iterator itF = featureDist.begin(); itF != featureDist.end(); ++itF) {
+	  if (!firstF) row << ',';
+	  else firstF = false;
+	  row << geneIds[itF->first];
+	}
+      }
+      row << "\t";
+      // Feature distances
+      if (featureDist.empty()) {
+	row << "NA";
+      } else {
+	bool firstF = true;
+	for(typename TFeatureDist::const_iterator itF = featureDist.begin(); itF != featureDist.end(); ++itF) {
+	  if (!firstF) row << ',';
+	  else firstF = false;
+	  row << itF->second;
+	}
+      }
+      rows[pk.idx] = row.str();
+    }
+  }
+
+  template<typename TConfig, typename TGenomicRegions, typename TGeneIds>
+  struct AnnotateWorker {
+    TConfig const& c;
+    std::vector<std::string> const& chrNames;
+    TGenomicRegions const& gRegions;
+    TGeneIds const& geneIds;
+    std::vector<std::string>& rows;
+    int32_t& nextChr;
+    boost::mutex& mtx;
+    boost::progress_display& show_progress;
+
+    AnnotateWorker(TConfig const& cf, std::vector<std::string> const& cn, TGenomicRegions const& gr, TGeneIds const& gi, std::vector<std::string>& r, int32_t& nc, boost::mutex& m, boost::progress_display& sp) : c(cf), chrNames(cn), gRegions(gr), geneIds(gi), rows(r), nextChr(nc), mtx(m), show_progress(sp) {}
+
+    void operator()() {
+      while (true) {
+	int32_t refIndex = 0;
+	{
+	  boost::mutex::scoped_lock lock(mtx);
+	  if (nextChr >= (int32_t) chrNames.size()) return;
+	  refIndex = nextChr++;
+	  ++show_progress;
+	}
+	_annotateChromosome(c, chrNames[refIndex], refIndex, gRegions[refIndex], geneIds, rows);
+      }
+    }
+  };
+
   template<typename TConfig, typename TGenomicRegions, typename TGeneIds>
   inline int32_t
-  bed_anno(TConfig const& c, TGenomicRegions& gRegions, TGeneIds& geneIds) {
-    typedef typename TGenomicRegions::value_type TChromosomeRegions;
+  bed_anno(TConfig const& c, TGenomicRegions const& gRegions, TGeneIds const& geneIds) {
 
     // Parse BED file
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BED file parsing" << std::endl;
     boost::progress_display show_progress(c.nchr.size());
 
-    // Distance vector
-    std::vector<int32_t> dist(geneIds.size(), 0);
+    // Chromosome names
+    std::vector<std::string> chrNames(c.nchr.size());
+    for(typename TConfig::TChrMap::const_iterator itChr = c.nchr.begin(); itChr != c.nchr.end(); ++itChr) chrNames[itChr->second] = itChr->first;
+
+    // Annotate chromosomes in parallel, rows are kept by input line
+    std::vector<std::string> rows(c.npeaks);
+    int32_t nextChr = 0;
+    boost::mutex mtx;
+    boost::thread_group workers;
+    for(uint16_t t = 0; t < std::max((uint16_t) 1, c.nthreads); ++t) workers.create_thread(AnnotateWorker<TConfig, TGenomicRegions, TGeneIds>(c, chrNames, gRegions, geneIds, rows, nextChr, mtx, show_progress));
+    workers.join_all();
     
-    // Open output file
+    // Output in input order
     std::ofstream ofile(c.outfile.string().c_str());
     ofile << "chrom\tstart\tend\tid\tfeature\tdistance" << std::endl;
-    
-    // Iterate chromosomese
-    for(int32_t refIndex=0; refIndex < (int32_t) c.nchr.size(); ++refIndex) {
-      ++show_progress;
-
-      // Sort by position
-      std::sort(gRegions[refIndex].begin(), gRegions[refIndex].end(), SortIntervalStart<IntervalLabel>());
-
-      // Flag feature positions
-      typedef boost::dynamic_bitset<> TBitSet;
-      TBitSet featureBitMap(250000000);
-      for(uint32_t i = 0; i < gRegions[refIndex].size(); ++i)
-	for(int32_t k = gRegions[refIndex][i].start; k < gRegions[refIndex][i].end; ++k) featureBitMap[k] = 1;
-
-      // Annotate intervals
-      std::ifstream chrFile(c.infile.string().c_str(), std::ifstream::in);
-      if (chrFile.is_open()) {
-	while (chrFile.good()) {
-	  std::string chrFromFile;
-	  getline(chrFile, chrFromFile);
-	  typedef boost::tokenizer< boost::char_separator<char> > Tokenizer;
-	  boost::char_separator<char> sep(" \t,;");
-	  Tokenizer tokens(chrFromFile, sep);
-	  Tokenizer::iterator tokIter = tokens.begin();
-	  if (tokIter!=tokens.end()) {
-	    std::string chrName = *tokIter++;
-	    if (c.nchr.find(chrName)->second != refIndex) continue;
-	    int32_t start = boost::lexical_cast<int32_t>(*tokIter++);
-	    int32_t end = boost::lexical_cast<int32_t>(*tokIter++);
-	    std::string name = "NA";
-	    if (tokIter != tokens.end()) name = *tokIter++;
-	    if (start >= end) continue;  // Bed has right-open intervals
-	    typedef std::vector<int32_t> TFeaturePos;
-	    TFeaturePos featurepos;
-	    int32_t realstart = std::max(0, start - c.maxDistance);
-	    int32_t realend = std::min(250000000, end + c.maxDistance);
-	    for(int32_t i = realstart; i<realend; ++i)
-	      if (featureBitMap[i]) featurepos.push_back(i);
-
-	    // Find feature
-	    typedef std::set<int32_t> TFeatureIds;
-	    TFeatureIds featureid;  // No feature by default
-	    if (!featurepos.empty()) {
-	      int32_t fpfirst = featurepos[0];
-	      int32_t fplast = featurepos[featurepos.size()-1];
-	      for(typename TChromosomeRegions::const_iterator vIt = gRegions[refIndex].begin(); vIt != gRegions[refIndex].end(); ++vIt) {
-		if (vIt->end <= fpfirst) continue;
-		if (vIt->start > fplast) break; // Sorted intervals so we can stop searching
-		for(TFeaturePos::const_iterator fIt = featurepos.begin(); fIt != featurepos.end(); ++fIt) {
-		  if ((vIt->start <= *fIt) && (vIt->end > *fIt)) {
-		    featureid.insert(vIt->lid);
-
-		    // Get distance
-		    int32_t locdist = 0;
-		    if (vIt->end < start) { locdist = vIt->end - start; }
-		    if (end < vIt->start) { locdist = vIt->start - end; }
-		    dist[vIt->lid] = locdist;
-		    break;
-		  }
-		}
-	      }
-	    }
-
-	    // Output overlapping features
-	    ofile << chrName << "\t" << start << "\t" << end << "\t" << name << "\t";
-	    // Feature names
-	    if (featureid.empty()) {
-	      ofile << "NA";
-	    } else {
-	      bool firstF = true;
-	      for(typename TFeatureIds::const_iterator itF = featureid.begin(); itF != featureid.end(); ++itF) {
-		if (!firstF) ofile << ',';
-		else firstF = false;
-		ofile << geneIds[*itF];
-	      }
-	    }
-	    ofile << "\t";
-	    // Feature distances
-	    if (featureid.empty()) {
-	      ofile << "NA";
-	    } else {
-	      bool firstF = true;
-	      for(typename TFeatureIds::const_iterator itF = featureid.begin(); itF != featureid.end(); ++itF) {
-		if (!firstF) ofile << ',';
-		else firstF = false;
-		ofile << dist[*itF];
-	      }
-	    }
-	    ofile << std::endl;
-	  }
-	}
-	chrFile.close();
-      }
-    }
+    for(uint32_t i = 0; i < rows.size(); ++i)
+      if (!rows[i].empty()) ofile << rows[i] << '\n';
     ofile.close();
     
     return 0;
@@ -191,23 +208,36 @@ namespace bamstats
     // Parse GTF file
     typedef std::vector<IntervalLabel> TChromosomeRegions;
     typedef std::vector<TChromosomeRegions> TGenomicRegions;
-    TGenomicRegions gRegions;
-    gRegions.resize(c.nchr.size(), TChromosomeRegions());
     typedef std::vector<std::string> TGeneIds;
-    TGeneIds geneIds;
-    int32_t tf = 0;
-    if (c.inputFileFormat == 0) tf = parseGTF(c, gRegions, geneIds);
-    else if (c.inputFileFormat == 1) tf = parseBED(c, gRegions, geneIds);
-    else if (c.inputFileFormat == 2) tf = parseGFF3(c, gRegions, geneIds);
-    else if (c.inputFileFormat == 3) tf = parseJaspar(c, gRegions, geneIds);
-    if (tf == 0) {
-      std::cerr << "Error parsing GTF/GFF3/BED file!" << std::endl;
-      std::cerr << "Please check that the chromosome names agree (chr1 versus 1) between input and annotation file." << std::endl;
-      return 1;
+    typedef std::pair<TGenomicRegions, TGeneIds> TAnnotation;
+    boost::shared_ptr<TAnnotation const> anno;
+    // Motif hits are restricted to the peaks and are not cached
+    std::string key = (c.inputFileFormat > 2) ? std::string() : annotationKey("anno", c);
+    if (!cacheLookup(key, anno)) {
+      boost::shared_ptr<TAnnotation> parsed(new TAnnotation());
+      TGenomicRegions& gRegions = parsed->first;
+      TGeneIds& geneIds = parsed->second;
+      gRegions.resize(c.nchr.size(), TChromosomeRegions());
+      int32_t tf = 0;
+      if (c.inputFileFormat == 0) tf = parseGTF(c, gRegions, geneIds);
+      else if (c.inputFileFormat == 1) tf = parseBED(c, gRegions, geneIds);
+      else if (c.inputFileFormat == 2) tf = parseGFF3(c, gRegions, geneIds);
+      else if (c.inputFileFormat == 3) tf = parseJaspar(c, gRegions, geneIds);
+      else if (c.inputFileFormat == 4) tf = parseMotifIndex(c, gRegions, geneIds);
+      if (tf == 0) {
+	std::cerr << "Error parsing GTF/GFF3/BED file!" << std::endl;
+	std::cerr << "Please check that the chromosome names agree (chr1 versus 1) between input and annotation file." << std::endl;
+	return 1;
+      }
+      uint64_t nbytes = 0;
+      for(uint32_t i = 0; i < gRegions.size(); ++i) nbytes += sizeof(TChromosomeRegions) + gRegions[i].size() * sizeof(IntervalLabel);
+      for(uint32_t i = 0; i < geneIds.size(); ++i) nbytes += sizeof(std::string) + geneIds[i].size();
+      cacheStore(key, boost::shared_ptr<TAnnotation const>(parsed), nbytes);
+      anno = parsed;
     }
 
     // Feature annotation
-    int32_t retparse = bed_anno(c, gRegions, geneIds);
+    int32_t retparse = bed_anno(c, anno->first, anno->second);
     if (retparse != 0) {
       std::cerr << "Error in BED annotation!" << std::endl;
       return 1;
@@ -234,6 +264,7 @@ namespace bamstats
       ("help,?", "show help message")
       ("distance,d", boost::program_options::value<int32_t>(&c.maxDistance)->default_value(0), "max. distance (0: overlapping features only)")
       ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("anno.bed"), "output file")
+      ("threads,t", boost::program_options::value<uint16_t>(&c.nthreads)->default_value(1), "number of threads")
       ;
 
     boost::program_options::options_description gtfopt("GTF/GFF3 annotation file options");
@@ -245,9 +276,10 @@ namespace bamstats
 
     boost::program_options::options_description motifopt("Motif annotation file options");
     motifopt.add_options()
-      ("motif,m", boost::program_options::value<boost::filesystem::path>(&c.motifFile), "motif file in jaspar or raw format")
+      ("motif,m", boost::program_options::value<boost::filesystem::path>(&c.motifFile), "motif file in jaspar or raw format, or motif index")
       ("reference,r", boost::program_options::value<boost::filesystem::path>(&c.genome), "reference file")
       ("quantile,q", boost::program_options::value<float>(&c.motifScoreQuantile)->default_value(0.95), "motif quantile score [0,1]")
+      ("pvalue,p", boost::program_options::value<double>(&c.motifPvalue)->default_value(0), "motif p-value threshold, replaces the quantile score if >0")
       ;
     
     
@@ -280,18 +312,26 @@ namespace bamstats
       std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] -g <hg19.gtf.gz> <peaks.bed>" << std::endl;
       std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] -b <hg19.bed.gz> <peaks.bed>" << std::endl;
       std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] -m <motif.jaspar.gz> -r <genome.fa> <peaks.bed>" << std::endl;
+      std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] -m <motif.idx> <peaks.bed>" << std::endl;
       std::cout << visible_options << "\n";
       return 1;
     }
 
+    // Check p-value
+    if ((c.motifPvalue < 0) || (c.motifPvalue >= 1)) {
+      std::cerr << "Motif p-value threshold must be in [0,1)." << std::endl;
+      return 1;
+    }
+
     // Input BED file
     if (!(boost::filesystem::exists(c.infile) && boost::filesystem::is_regular_file(c.infile) && boost::filesystem::file_size(c.infile))) {
       std::cerr << "Input BED file is missing." << std::endl;
       return 1;
     } else {
-      std::string oldChr = "";
-      typedef std::set<std::string> TChrSet;
-      TChrSet chrSet;
+      // Load peaks once and bucket them by chromosome
+      typedef std::map<std::string, AnnotateConfig::TChrPeaks> TChrPeakMap;
+      TChrPeakMap chrPeaks;
+      c.npeaks = 0;
       std::ifstream chrFile(c.infile.string().c_str(), std::ifstream::in);
       if (chrFile.is_open()) {
 	while (chrFile.good()) {
@@ -303,13 +343,25 @@ namespace bamstats
 	  Tokenizer::iterator tokIter = tokens.begin();
 	  if (tokIter!=tokens.end()) {
 	    std::string chrName = *tokIter++;
-	    if (chrName != oldChr) chrSet.insert(chrName);
+	    AnnotateConfig::TChrPeaks& pks = chrPeaks[chrName];
+	    if (tokIter == tokens.end()) continue;
+	    int32_t start = boost::lexical_cast<int32_t>(*tokIter++);
+	    if (tokIter == tokens.end()) continue;
+	    int32_t end = boost::lexical_cast<int32_t>(*tokIter++);
+	    std::string name = "NA";
+	    if (tokIter != tokens.end()) name = *tokIter++;
+	    if (start >= end) continue;  // Bed has right-open intervals
+	    pks.push_back(Peak(start, end, c.npeaks++, name));
 	  }
 	}
 	chrFile.close();
       }
       int32_t refIndex = 0;
-      for(TChrSet::iterator itc = chrSet.begin(); itc != chrSet.end(); ++itc, ++refIndex) c.nchr.insert(std::make_pair(*itc, refIndex));
+      for(TChrPeakMap::iterator itc = chrPeaks.begin(); itc != chrPeaks.end(); ++itc, ++refIndex) {
+	c.nchr.insert(std::make_pair(itc->first, refIndex));
+	c.peaks.push_back(AnnotateConfig::TChrPeaks());
+	c.peaks.back().swap(itc->second);
+      }
     }
     
     // Check region file
@@ -318,6 +370,18 @@ namespace bamstats
 	if (!(boost::filesystem::exists(c.motifFile) && boost::filesystem::is_regular_file(c.motifFile) && boost::filesystem::file_size(c.motifFile))) {
 	  std::cerr << "Input gtf/bed/motif annotation file is missing." << std::endl;
 	  return 1;
+	} else if (_isMotifIndex(c.motifFile)) {
+	  // Precomputed hits, the index fixes the motif thresholds
+	  c.inputFileFormat = 4;
+	  MotifIndex mi;
+	  if (!_readMotifIndex(c.motifFile, mi)) {
+	    std::cerr << "Motif index cannot be parsed: " << c.motifFile.string() << std::endl;
+	    return 1;
+	  }
+	  if ((!vm["quantile"].defaulted()) && (mi.quantile != c.motifScoreQuantile)) std::cerr << "Warning: Motif index was built with quantile " << mi.quantile << ", ignoring -q " << c.motifScoreQuantile << std::endl;
+	  if ((!vm["pvalue"].defaulted()) && (mi.pvalue != c.motifPvalue)) std::cerr << "Warning: Motif index was built with p-value " << mi.pvalue << ", ignoring -p " << c.motifPvalue << std::endl;
+	  c.motifScoreQuantile = mi.quantile;
+	  c.motifPvalue = mi.pvalue;
 	} else {
 	  c.inputFileFormat = 3;
 	  if ((!(vm.count("reference")))  || (!(boost::filesystem::exists(c.genome) && boost::filesystem::is_regular_file(c.genome) && boost::filesystem::file_size(c.genome)))) {
@@ -336,6 +400,7 @@ namespace bamstats
 	      std::string chrName(itC->first);
 	      if (!faidx_has_seq(fai, chrName.c_str())) {
 		 std::cerr << "Chromosome from bed file " << chrName << " is NOT present in your reference file " << c.genome.string() << std::endl;
+		 fai_destroy(fai);
 		 return 1;
 	      }
 	    }
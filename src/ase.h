@@ -27,6 +27,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <sstream>
 
 #include <boost/math/distributions/binomial.hpp>
 #include <boost/program_options/cmdline.hpp>
@@ -44,6 +45,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <boost/random.hpp>
 #include <boost/generator_iterator.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <boost/tokenizer.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/progress.hpp>
 #include <htslib/faidx.h>
@@ -52,6 +54,10 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #include "util.h"
 #include "variants.h"
+#include "pipeline.h"
+#include "input.h"
+#include "checkpoint.h"
+#include "cache.h"
 
 namespace bamstats {
 
@@ -59,6 +65,8 @@ namespace bamstats {
   struct AseConfig {
     bool isPhased;
     bool outputAll;
+    bool hasManifest;
+    uint16_t nthreads;
     unsigned short minMapQual;
     unsigned short minBaseQual;
     std::string sample;
@@ -66,217 +74,270 @@ namespace bamstats {
     boost::filesystem::path genome;
     boost::filesystem::path bamfile;
     boost::filesystem::path vcffile;
+    boost::filesystem::path manifest;
+    std::vector<std::string> samples;
+    std::vector<boost::filesystem::path> bamfiles;
+    Checkpoint checkpoint;
   };
 
+  // REF and ALT support of a single read, false on unknown CIGAR operations
+  template<typename TConfig, typename TPhasedVariants, typename TAlleleSupport>
+  inline bool
+  _alleleSupport(TConfig const& c, bam1_t* r, char const* seq, TPhasedVariants const& pv, TAlleleSupport& ref, TAlleleSupport& alt) {
+    if (r->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) return true;
+    if ((r->core.qual < c.minMapQual) || (r->core.tid<0)) return true;
+    if ((r->core.flag & BAM_FPAIRED) && (r->core.flag & BAM_FMUNMAP)) return true;
+
+    // Fetch contained variants
+    uint32_t vIdx = pv.lowerBound(r->core.pos);
+    uint32_t vIdxEnd = pv.upperBound(lastAlignedPosition(r));
+    if (vIdx < vIdxEnd) {
+      // Read sequence is only decoded for non-SNV markers
+      std::string sequence;
+      uint8_t* qualptr = bam_get_qual(r);
+	  
+      // Parse CIGAR
+      uint32_t* cigar = bam_get_cigar(r);
+      for(;vIdx < vIdxEnd; ++vIdx) {
+	int32_t gp = r->core.pos; // Genomic position
+	int32_t sp = 0; // Sequence position
+	bool varFound = false;
+	for (std::size_t i = 0; ((i < r->core.n_cigar) && (!varFound)); ++i) {
+	  if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CINS) sp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CDEL) gp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) gp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP) {
+	    //Nop
+	  } else if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
+	    if (gp + (int32_t) bam_cigar_oplen(cigar[i]) < pv.pos[vIdx]) {
+	      gp += bam_cigar_oplen(cigar[i]);
+	      sp += bam_cigar_oplen(cigar[i]);
+	    } else {
+	      for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]); ++k, ++sp, ++gp) {
+		if (gp == pv.pos[vIdx]) {
+		  varFound = true;
+		  if (qualptr[sp] >= c.minBaseQual) {
+		    int32_t allele = _readAllele(pv, vIdx, seq, r, sp, sequence);
+		    if (allele == 1) ++ref[vIdx];
+		    else if (allele == 2) ++alt[vIdx];
+		  }
+		}
+	      }
+	    }
+	  }
+	  else {
+	    std::cerr << "Unknown Cigar options" << std::endl;
+	    return false;
+	  }
+	}
+      }
+    }
+    return true;
+  }
+
+  // Per-thread allele counts
+  template<typename TConfig, typename TPhasedVariants>
+  struct AlleleSupportWorker {
+    typedef std::vector<uint32_t> TAlleleSupport;
+    TConfig const* c;
+    char const* seq;
+    TPhasedVariants const* pv;
+    TAlleleSupport ref;
+    TAlleleSupport alt;
+
+    AlleleSupportWorker(TConfig const& conf, char const* s, TPhasedVariants const& p) : c(&conf), seq(s), pv(&p), ref(p.size(), 0), alt(p.size(), 0) {}
+
+    inline bool
+    operator()(bam1_t* r) {
+      return _alleleSupport(*c, r, seq, *pv, ref, alt);
+    }
+  };
+
+  template<typename TConfig, typename TPhasedVariants, typename TAlleleSupport>
+  inline bool
+  _alleleSupport(TConfig const& c, samFile* samfile, hts_idx_t* idx, bam_hdr_t* hdr, int32_t refIndex, char const* seq, TPhasedVariants const& pv, TAlleleSupport& ref, TAlleleSupport& alt) {
+    typedef AlleleSupportWorker<TConfig, TPhasedVariants> TWorker;
+    std::vector<TWorker> workers(std::max((uint16_t) 1, c.nthreads), TWorker(c, seq, pv));
+    hts_itr_t* itr = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
+    if (!processBamRecords(samfile, hdr, itr, workers)) return false;
+    for(uint32_t t = 0; t < workers.size(); ++t) {
+      for(uint32_t i = 0; i < pv.size(); ++i) {
+	ref[i] += workers[t].ref[i];
+	alt[i] += workers[t].alt[i];
+      }
+    }
+    return true;
+  }
+
   template<typename TConfig>
   inline int32_t
-  aseRun(TConfig& c) {
+  aseRun(TConfig& c, InputContext& in) {
 
 #ifdef PROFILE
     ProfilerStart("alfred.prof");
 #endif
     
-    // Load bam files
-    samFile* samfile = sam_open(c.bamfile.string().c_str(), "r");
-    hts_set_fai_filename(samfile, c.genome.string().c_str());
-    hts_idx_t* idx = sam_index_load(samfile, c.bamfile.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
+    // Load bam files, reads are fetched per chromosome so existing indices are required
+    typedef std::vector<samFile*> TSamFile;
+    typedef std::vector<hts_idx_t*> TIndex;
+    typedef std::vector<bam_hdr_t*> THeader;
+    TSamFile samfile(c.bamfiles.size());
+    TIndex idx(c.bamfiles.size());
+    THeader hdr(c.bamfiles.size());
+    for(uint32_t file_c = 0; file_c < c.bamfiles.size(); ++file_c) {
+      BamInput* bam = in.bam(c.bamfiles[file_c], false);
+      if (bam == NULL) return 1;
+      idx[file_c] = bam->index(false);
+      if (idx[file_c] == NULL) return 1;
+      samfile[file_c] = bam->samfile;
+      hdr[file_c] = bam->hdr;
+      hts_set_fai_filename(samfile[file_c], c.genome.string().c_str());
+    }
 
     // Load bcf file
-    htsFile* ibcffile = bcf_open(c.vcffile.string().c_str(), "r");
-    hts_idx_t* bcfidx = bcf_index_load(c.vcffile.string().c_str());
-    bcf_hdr_t* bcfhdr = bcf_hdr_read(ibcffile);
+    htsFile* ibcffile = in.bcffile;
+    hts_idx_t* bcfidx = in.bcfidx;
+    bcf_hdr_t* bcfhdr = in.bcfhdr;
+
+    // Sample columns in the BCF
+    std::vector<int32_t> sampleIndex(c.samples.size(), -1);
+    for(uint32_t file_c = 0; file_c < c.samples.size(); ++file_c)
+      for (int i = 0; i < bcf_hdr_nsamples(bcfhdr); ++i)
+	if (bcfhdr->samples[i] == c.samples[file_c]) sampleIndex[file_c] = i;
     
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Assign reads to haplotypes" << std::endl;
-    boost::progress_display show_progress(hdr->n_targets);
+    boost::progress_display show_progress(hdr[0]->n_targets);
 
     // Allele support file
     boost::iostreams::filtering_ostream dataOut;
     dataOut.push(boost::iostreams::gzip_compressor());
     dataOut.push(boost::iostreams::file_sink(c.as.string().c_str(), std::ios_base::out | std::ios_base::binary));
+    if (c.hasManifest) dataOut << "sample\t";
     dataOut << "chr\tpos\tid\tref\talt\tdepth\trefsupport\taltsupport\tgt\taf\tpvalue" << std::endl;
+
+    // Resume after the last completed chromosome, rows of completed chromosomes are replayed
+    int32_t doneIndex = -1;
+    std::vector<int32_t> parts;
+    if (c.checkpoint.enabled) {
+      CheckpointReader ckpt;
+      if (ckpt.open(c.checkpoint.file("ase.ckpt"), c.checkpoint.key)) {
+	ckpt.io(doneIndex);
+	ckpt.io(parts);
+	for(uint32_t k = 0; (ckpt.ok) && (k < parts.size()); ++k) {
+	  CheckpointReader part;
+	  std::string rows;
+	  if (part.open(c.checkpoint.file("ase." + boost::lexical_cast<std::string>(parts[k]) + ".part"), c.checkpoint.key)) part.io(rows);
+	  if (!part.ok) ckpt.ok = false;
+	  else dataOut << rows;
+	}
+	if (!ckpt.ok) {
+	  std::cerr << "Checkpoint " << c.checkpoint.file("ase.ckpt").string() << " is incomplete, please remove it!" << std::endl;
+	  return 1;
+	}
+      }
+    }
+
+    // Binomial test p-values, cached across chromosomes
+    BinomialTest btest(0.5);
   
     // Assign reads to SNPs
-    faidx_t* fai = fai_load(c.genome.string().c_str());
-    for (int refIndex = 0; refIndex<hdr->n_targets; ++refIndex) {
-      std::string chrName(hdr->target_name[refIndex]);
+    faidx_t* fai = in.fai;
+    for (int refIndex = 0; refIndex<hdr[0]->n_targets; ++refIndex) {
+      std::string chrName(hdr[0]->target_name[refIndex]);
       ++show_progress;
+      if (refIndex <= doneIndex) continue;
 
-      // Load het. markers
-      typedef std::vector<BiallelicVariant> TPhasedVariants;
-      TPhasedVariants pv;
-      if (!_loadVariants(ibcffile, bcfidx, bcfhdr, c.sample, chrName, pv)) continue;
-      if (pv.empty()) continue;
-
-      // Sort variants
-      std::sort(pv.begin(), pv.end(), SortVariants<BiallelicVariant>());
+      // Load het. markers of all samples
+      typedef std::vector<std::pair<uint32_t, bool> > THetSites;
+      typedef std::vector<THetSites> TSampleHets;
+      VariantTable sites;
+      std::vector<std::string> ids;
+      TSampleHets hets;
+      if (!_loadVariants(ibcffile, bcfidx, bcfhdr, sampleIndex, chrName, sites, ids, hets)) continue;
+      if (sites.empty()) continue;
 
       // Load reference
-      int32_t seqlen = -1;
-      char* seq = NULL;
-      seq = faidx_fetch_seq(fai, chrName.c_str(), 0, hdr->target_len[refIndex], &seqlen);
+      ChromosomeSequence chrSeq(fai, c.genome, chrName);
+
+      // With checkpoints, rows of a chromosome are kept until it is complete
+      std::ostringstream chrOut;
+      std::ostream& out = (c.checkpoint.enabled) ? static_cast<std::ostream&>(chrOut) : static_cast<std::ostream&>(dataOut);
+
+      for(uint32_t file_c = 0; file_c < c.bamfiles.size(); ++file_c) {
+	if (hets[file_c].empty()) continue;
+	int32_t tid = bam_name2id(hdr[file_c], chrName.c_str());
+	if (tid < 0) continue;
+
+	// Het. markers of this sample, the index iterator returns them sorted by position
+	VariantTable pv;
+	pv.pos.reserve(hets[file_c].size());
+	pv.code.reserve(hets[file_c].size());
+	for(uint32_t i = 0; i < hets[file_c].size(); ++i) pv.append(sites, hets[file_c][i].first, hets[file_c][i].second);
       
-      // Annotate REF and ALT support
-      typedef std::vector<uint32_t> TAlleleSupport;
-      TAlleleSupport ref(pv.size(), 0);
-      TAlleleSupport alt(pv.size(), 0);
-      hts_itr_t* itr = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-      bam1_t* r = bam_init1();
-      while (sam_itr_next(samfile, itr, r) >= 0) {
-	if (r->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
-	if ((r->core.qual < c.minMapQual) || (r->core.tid<0)) continue;
-	if ((r->core.flag & BAM_FPAIRED) && (r->core.flag & BAM_FMUNMAP)) continue;
-
-	// Fetch contained variants
-	TPhasedVariants::const_iterator vIt = std::lower_bound(pv.begin(), pv.end(), BiallelicVariant(r->core.pos), SortVariants<BiallelicVariant>());
-	TPhasedVariants::const_iterator vItEnd = std::upper_bound(pv.begin(), pv.end(), BiallelicVariant(lastAlignedPosition(r)), SortVariants<BiallelicVariant>());
-	if (vIt != vItEnd) {
-	  // Get read sequence
-	  std::string sequence;
-	  sequence.resize(r->core.l_qseq);
-	  uint8_t* seqptr = bam_get_seq(r);
-	  for (int32_t i = 0; i < r->core.l_qseq; ++i) sequence[i] = "=ACMGRSVTWYHKDBN"[bam_seqi(seqptr, i)];
-
-	  // Get base qualities
-	  typedef std::vector<uint8_t> TQuality;
-	  TQuality quality;
-	  quality.resize(r->core.l_qseq);
-	  uint8_t* qualptr = bam_get_qual(r);
-	  for (int i = 0; i < r->core.l_qseq; ++i) quality[i] = qualptr[i];
-	  
-	  // Parse CIGAR
-	  uint32_t* cigar = bam_get_cigar(r);
-	  for(;vIt != vItEnd; ++vIt) {
-	    int32_t gp = r->core.pos; // Genomic position
-	    int32_t sp = 0; // Sequence position
-	    bool varFound = false;
-	    for (std::size_t i = 0; ((i < r->core.n_cigar) && (!varFound)); ++i) {
-	      if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CINS) sp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CDEL) gp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) gp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP) {
-		//Nop
-	      } else if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
-		if (gp + (int32_t) bam_cigar_oplen(cigar[i]) < vIt->pos) {
-		  gp += bam_cigar_oplen(cigar[i]);
-		  sp += bam_cigar_oplen(cigar[i]);
-		} else {
-		  for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]); ++k, ++sp, ++gp) {
-		    if (gp == vIt->pos) {
-		      varFound = true;
-		      if (quality[sp] >= c.minBaseQual) {
-			// Check REF allele
-			if (vIt->ref == std::string(seq + gp, seq + gp + vIt->ref.size())) {
-			  // Check ALT allele
-			  if ((sp + vIt->alt.size() < sequence.size()) && (sp + vIt->ref.size() < sequence.size())) {
-			    if (vIt->ref.size() == vIt->alt.size()) {
-			      // SNP
-			      if ((sequence.substr(sp, vIt->alt.size()) == vIt->alt) && (sequence.substr(sp, vIt->ref.size()) != vIt->ref)) {
-				++alt[vIt-pv.begin()];
-			      } else if ((sequence.substr(sp, vIt->alt.size()) != vIt->alt) && (sequence.substr(sp, vIt->ref.size()) == vIt->ref)) {
-				++ref[vIt-pv.begin()];
-			      }
-			    }
-			  } else if (vIt->ref.size() < vIt->alt.size()) {
-			    // Insertion
-			    int32_t diff = vIt->alt.size() - vIt->ref.size();
-			    std::string refProbe = vIt->ref + std::string(seq + gp + vIt->ref.size(), seq + gp + vIt->ref.size() + diff);
-			    if ((sequence.substr(sp, vIt->alt.size()) == vIt->alt) && (sequence.substr(sp, vIt->alt.size()) != refProbe)) {
-			      ++alt[vIt-pv.begin()];
-			    } else if ((sequence.substr(sp, vIt->alt.size()) != vIt->alt) && (sequence.substr(sp, vIt->alt.size()) == refProbe)) {
-			      ++ref[vIt-pv.begin()];
-			    }
-			  } else {
-			    // Deletion
-			    int32_t diff = vIt->ref.size() - vIt->alt.size();
-			    std::string altProbe = vIt->alt + std::string(seq + gp + vIt->ref.size(), seq + gp + vIt->ref.size() + diff);
-			    if ((sequence.substr(sp, vIt->ref.size()) == altProbe) && (sequence.substr(sp, vIt->ref.size()) != vIt->ref)) {
-			      ++alt[vIt-pv.begin()];
-			    } else if ((sequence.substr(sp, vIt->ref.size()) != altProbe) && (sequence.substr(sp, vIt->ref.size()) == vIt->ref)) {
-			      ++ref[vIt-pv.begin()];
-			    }
-			  }
-			}
-		      }
-		    }
-		  }
-		}
-	      }
-	      else {
-		std::cerr << "Unknown Cigar options" << std::endl;
-		return 1;
-	      }
-	    }
-	  }
-	}
-      }
-      bam_destroy1(r);
-      hts_itr_destroy(itr);
-      if (seqlen) free(seq);
-
-      // Output (phased) allele support
-      hts_itr_t* itervcf = bcf_itr_querys(bcfidx, bcfhdr, chrName.c_str());
-      if (itervcf != NULL) {
-	bcf1_t* recvcf = bcf_init1();
+	// Annotate REF and ALT support
+	typedef std::vector<uint32_t> TAlleleSupport;
+	TAlleleSupport ref(pv.size(), 0);
+	TAlleleSupport alt(pv.size(), 0);
+	if (!_alleleSupport(c, samfile[file_c], idx[file_c], hdr[file_c], tid, chrSeq.seq, pv, ref, alt)) return 1;
+
+	// Allelic imbalance p-values
+	TAlleleSupport depth(pv.size(), 0);
+	for (uint32_t i = 0; i<pv.size(); ++i) depth[i] = ref[i] + alt[i];
+	std::vector<double> pvalues;
+	btest.batch(alt, depth, pvalues);
+
+	// Output (phased) allele support
 	for (uint32_t i = 0; i<pv.size(); ++i) {
-	  // Fetch variant annotation from VCF
-	  int32_t itrRet = 0;
-	  do {
-	    itrRet = bcf_itr_next(ibcffile, itervcf, recvcf);
-	    if (itrRet >= 0) {
-	      bcf_unpack(recvcf, BCF_UN_SHR);
-	      std::vector<std::string> alleles;
-	      for(std::size_t k = 0; k<recvcf->n_allele; ++k) alleles.push_back(std::string(recvcf->d.allele[k]));
-	      if ((recvcf->pos == pv[i].pos) && (pv[i].ref == alleles[0]) && (pv[i].alt == alleles[1])) break;
-	    } else {
-	      std::cerr << "Error: Variant not found! " << chrName << ":" << (pv[i].pos + 1) << std::endl;
-	      return 1;
-	    }
-	  } while (itrRet >= 0);
-	  uint32_t totalcov = ref[i] + alt[i];
+	  std::string const& id = ids[hets[file_c][i].first];
+	  uint32_t totalcov = depth[i];
 	  std::string hapstr = "0/1";
 	  if (c.isPhased) {
-	    if (pv[i].hap) hapstr = "1|0";
+	    if (pv.hap(i)) hapstr = "1|0";
 	    else hapstr = "0|1";
 	  }
+	  if ((totalcov > 0) || (c.outputAll)) {
+	    if (c.hasManifest) out << c.samples[file_c] << "\t";
+	    out << chrName << "\t" << (pv.pos[i] + 1) << "\t" << id << "\t" << pv.ref(i) << "\t" << pv.alt(i) << "\t" << totalcov << "\t" << ref[i] << "\t" << alt[i] << "\t" << hapstr << "\t";
+	  }
 	  if (totalcov > 0) {
 	    double h1af = 0;
 	    double vaf = (double) alt[i] / (double) totalcov;
-	    if (pv[i].hap) h1af = (double) alt[i] / (double) totalcov;
+	    if (pv.hap(i)) h1af = (double) alt[i] / (double) totalcov;
 	    else h1af = (double) ref[i] / (double) totalcov;
-	    double pval = binomTest(alt[i], totalcov, 0.5);
-	    dataOut << chrName << "\t" << (pv[i].pos + 1) << "\t" << recvcf->d.id << "\t" << pv[i].ref << "\t" << pv[i].alt << "\t" << totalcov << "\t" << ref[i] << "\t" << alt[i] << "\t" << hapstr << "\t";
-	    if (c.isPhased) dataOut << h1af << "\t";
-	    else dataOut << vaf << "\t";
-	    dataOut << pval << std::endl;
-	  } else {
-	    if (c.outputAll) {
-	      // No coverage
-	      dataOut << chrName << "\t" << (pv[i].pos + 1) << "\t" << recvcf->d.id << "\t" << pv[i].ref << "\t" << pv[i].alt << "\t" << totalcov << "\t" << ref[i] << "\t" << alt[i] << "\t" << hapstr << "\tNA\tNA" << std::endl;
-	    }
+	    if (c.isPhased) out << h1af << "\t";
+	    else out << vaf << "\t";
+	    out << pvalues[i] << std::endl;
+	  } else if (c.outputAll) {
+	    // No coverage
+	    out << "NA\tNA" << std::endl;
 	  }
 	}
-	bcf_destroy(recvcf);
-	hts_itr_destroy(itervcf);
       }
-    }
-    fai_destroy(fai);
 
-    // Close bam
-    bam_hdr_destroy(hdr);
-    hts_idx_destroy(idx);
-    sam_close(samfile);
+      // Store the rows of this chromosome, then the list of completed chromosomes
+      if (c.checkpoint.enabled) {
+	std::string rows = chrOut.str();
+	dataOut << rows;
+	CheckpointWriter part;
+	if (!part.open(c.checkpoint.file("ase." + boost::lexical_cast<std::string>(refIndex) + ".part"), c.checkpoint.key)) return 1;
+	part.io(rows);
+	if (!part.commit()) return 1;
+	parts.push_back(refIndex);
+	CheckpointWriter ckpt;
+	if (!ckpt.open(c.checkpoint.file("ase.ckpt"), c.checkpoint.key)) return 1;
+	ckpt.io(refIndex);
+	ckpt.io(parts);
+	if (!ckpt.commit()) return 1;
+      }
+    }
 
     // Close output allele file
     dataOut.pop();
-
-    // Close BCF
-    bcf_hdr_destroy(bcfhdr);
-    hts_idx_destroy(bcfidx);
-    bcf_close(ibcffile);
+    for(uint32_t k = 0; k < parts.size(); ++k) c.checkpoint.clear("ase." + boost::lexical_cast<std::string>(parts[k]) + ".part");
+    c.checkpoint.clear("ase.ckpt");
     
     // End
     now = boost::posix_time::second_clock::local_time();
@@ -292,6 +353,8 @@ namespace bamstats {
 
   int ase(int argc, char **argv) {
     AseConfig c;
+    InputContext in;
+    boost::filesystem::path checkpointDir;
 
     // Parameter
     boost::program_options::options_description generic("Generic options");
@@ -303,8 +366,11 @@ namespace bamstats {
       ("sample,s", boost::program_options::value<std::string>(&c.sample)->default_value("NA12878"), "sample name")
       ("ase,a", boost::program_options::value<boost::filesystem::path>(&c.as)->default_value("as.tsv.gz"), "allele-specific output file")
       ("vcffile,v", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input (phased) BCF file")
+      ("manifest,t", boost::program_options::value<boost::filesystem::path>(&c.manifest), "tab-separated sample to BAM manifest (multi-sample mode)")
       ("phased,p", "BCF file is phased and BAM is haplo-tagged")
       ("full,f", "output all het. input SNPs")
+      ("threads", boost::program_options::value<uint16_t>(&c.nthreads)->default_value(1), "number of read processing threads")
+      ("checkpoint-dir", boost::program_options::value<boost::filesystem::path>(&checkpointDir), "resume an interrupted run from this directory (optional)")
       ;
     
     boost::program_options::options_description hidden("Hidden options");
@@ -324,12 +390,47 @@ namespace bamstats {
     boost::program_options::notify(vm);
     
     // Check command line arguments
-    if ((vm.count("help")) || (!vm.count("input-file")) || (!vm.count("reference")) || (!vm.count("vcffile"))) {
+    if ((vm.count("help")) || ((!vm.count("input-file")) && (!vm.count("manifest"))) || (!vm.count("reference")) || (!vm.count("vcffile"))) {
       std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] -r <ref.fa> -s NA12878 -v <snps.bcf> -a <ase.tsv> <input.bam>" << std::endl;
+      std::cout << "       alfred " << argv[0] << " [OPTIONS] -r <ref.fa> -v <snps.bcf> -a <ase.tsv> -t <manifest.tsv>" << std::endl;
       std::cout << visible_options << "\n";
       return 1;
     }
 
+    // Sample to BAM manifest
+    if (vm.count("manifest")) {
+      c.hasManifest = true;
+      if (!(boost::filesystem::exists(c.manifest) && boost::filesystem::is_regular_file(c.manifest) && boost::filesystem::file_size(c.manifest))) {
+	std::cerr << "Manifest file is missing: " << c.manifest.string() << std::endl;
+	return 1;
+      }
+      std::ifstream manifestFile(c.manifest.string().c_str());
+      std::string line;
+      while(std::getline(manifestFile, line)) {
+	if ((line.empty()) || (line[0] == '#')) continue;
+	typedef boost::tokenizer< boost::char_separator<char> > Tokenizer;
+	boost::char_separator<char> sep(" \t");
+	Tokenizer tokens(line, sep);
+	Tokenizer::iterator tokIter = tokens.begin();
+	if (tokIter == tokens.end()) continue;
+	std::string sampleName = *tokIter++;
+	if (tokIter == tokens.end()) {
+	  std::cerr << "BAM file is missing in manifest for sample " << sampleName << std::endl;
+	  return 1;
+	}
+	c.samples.push_back(sampleName);
+	c.bamfiles.push_back(boost::filesystem::path(*tokIter));
+      }
+      if (c.samples.empty()) {
+	std::cerr << "Manifest has no samples: " << c.manifest.string() << std::endl;
+	return 1;
+      }
+    } else {
+      c.hasManifest = false;
+      c.samples.push_back(c.sample);
+      c.bamfiles.push_back(c.bamfile);
+    }
+
     // Phased running mode?
     if (!vm.count("phased")) c.isPhased = false;
     else c.isPhased = true;
@@ -339,55 +440,31 @@ namespace bamstats {
     else c.outputAll = true;
     
     // Check input BAM file
-    if (vm.count("input-file")) {
-      if (!(boost::filesystem::exists(c.bamfile) && boost::filesystem::is_regular_file(c.bamfile) && boost::filesystem::file_size(c.bamfile))) {
-	std::cerr << "Input BAM file is missing: " << c.bamfile.string() << std::endl;
-	return 1;
-      }
-      samFile* samfile = sam_open(c.bamfile.string().c_str(), "r");
-      if (samfile == NULL) {
-      std::cerr << "Fail to open file " << c.bamfile.string() << std::endl;
-      return 1;
-      }
-      hts_idx_t* idx = sam_index_load(samfile, c.bamfile.string().c_str());
-      if (idx == NULL) {
-	std::cerr << "Fail to open index for " << c.bamfile.string() << std::endl;
-	return 1;
-      }
-      bam_hdr_t* hdr = sam_hdr_read(samfile);
-      if (hdr == NULL) {
-	std::cerr << "Fail to open header for " << c.bamfile.string() << std::endl;
-	return 1;
-      }
-      bam_hdr_destroy(hdr);
-      hts_idx_destroy(idx);
-      sam_close(samfile);
-    }
+    for(uint32_t file_c = 0; file_c < c.bamfiles.size(); ++file_c)
+      if (in.bam(c.bamfiles[file_c], false) == NULL) return 1;
+
+    // Check reference
+    if (!in.genome(c.genome)) return 1;
     
     // Check VCF/BCF file
-    if (vm.count("vcffile")) {
-      if (!(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
-	std::cerr << "Input SNP VCF/BCF file is missing: " << c.vcffile.string() << std::endl;
-	return 1;
-      }
-      htsFile* ifile = bcf_open(c.vcffile.string().c_str(), "r");
-      if (ifile == NULL) {
-	std::cerr << "Fail to open file " << c.vcffile.string() << std::endl;
-	return 1;
-      }
-      hts_idx_t* bcfidx = bcf_index_load(c.vcffile.string().c_str());
-      if (bcfidx == NULL) {
-	std::cerr << "Fail to open index file for " << c.vcffile.string() << std::endl;
-	return 1;
-      }
-      bcf_hdr_t* hdr = bcf_hdr_read(ifile);
-      if (hdr == NULL) {
-	std::cerr << "Fail to open header for " << c.vcffile.string() << std::endl;
+    if (!in.variants(c.vcffile)) return 1;
+    for(uint32_t file_c = 0; file_c < c.samples.size(); ++file_c) {
+      bool sampleFound = false;
+      for (int i = 0; i < bcf_hdr_nsamples(in.bcfhdr); ++i)
+	if (in.bcfhdr->samples[i] == c.samples[file_c]) sampleFound = true;
+      if (!sampleFound) {
+	std::cerr << "Sample " << c.samples[file_c] << " is missing in " << c.vcffile.string() << std::endl;
 	return 1;
       }
-      bcf_hdr_destroy(hdr);
-    hts_idx_destroy(bcfidx);
-    bcf_close(ifile);
+    }
+
+    // Checkpoints, taken after each chromosome
+    if (vm.count("checkpoint-dir")) {
+      std::vector<boost::filesystem::path> inputs(c.bamfiles);
+      inputs.push_back(c.genome);
+      inputs.push_back(c.vcffile);
+      if (c.hasManifest) inputs.push_back(c.manifest);
+      if (!c.checkpoint.init(checkpointDir, checkpointKey(argc, argv, inputs))) return 1;
     }
     
     // Show cmd
@@ -396,7 +473,7 @@ namespace bamstats {
     for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
     std::cout << std::endl;
     
-    return aseRun(c);
+    return aseRun(c, in);
   }
 
 
@@ -25,6 +25,9 @@ Contact: Tobias Rausch (rausch@embl.de)
 #define BAMSTATS_H
 
 #include <limits>
+#include <list>
+#include <fstream>
+#include <algorithm>
 
 #include <boost/dynamic_bitset.hpp>
 #include <boost/unordered_map.hpp>
@@ -41,9 +44,14 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #include "tenX.h"
 #include "util.h"
+#include "pipeline.h"
+#include "input.h"
 #include "json.h"
 #include "tsv.h"
 #include "qcstruct.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "cache.h"
 
 namespace bamstats
 {
@@ -76,51 +84,201 @@ namespace bamstats
     }
   }
 
-  template<typename TConfig>
-  inline int32_t
-  bamStatsRun(TConfig& c) {
-    // Load bam file
-    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-    hts_set_fai_filename(samfile, c.genome.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
-
-    // Collect reference features
-    ReferenceFeatures rf(hdr->n_targets);
-
-    // Parse regions from BED file or create one region per chromosome
-    if (c.hasRegionFile) {
-      if (is_gz(c.regionFile)) {
-	std::ifstream file(c.regionFile.string().c_str(), std::ios_base::in | std::ios_base::binary);
-	boost::iostreams::filtering_streambuf<boost::iostreams::input> dataIn;
-	dataIn.push(boost::iostreams::gzip_decompressor());
-	dataIn.push(file);
-	std::istream instream(&dataIn);
-	std::string line;
-	while(std::getline(instream, line)) {
-	  typedef boost::tokenizer< boost::char_separator<char> > Tokenizer;
-	  boost::char_separator<char> sep(" \t,;");
-	  Tokenizer tokens(line, sep);
-	  Tokenizer::iterator tokIter = tokens.begin();
-	  std::string chrName = *tokIter++;
-	  // Map chromosome names to the bam header chromosome IDs
-	  int32_t chrid = bam_name2id(hdr, chrName.c_str());
-	  // Valid ID?
-	  if (chrid >= 0) {
-	    if (tokIter!=tokens.end()) {
-	      int32_t start = boost::lexical_cast<int32_t>(*tokIter++);
-	      int32_t end = boost::lexical_cast<int32_t>(*tokIter++);
-	      rf.gRegions[chrid].push_back(Interval(start, end));
-	    }
-	  }
-	}
-	dataIn.pop();
-      } else {
-	// Parse regions from BED file
-	std::ifstream bedFile(c.regionFile.string().c_str(), std::ifstream::in);
-	if (bedFile.is_open()) {
-	  while (bedFile.good()) {
-	    std::string line;
-	    getline(bedFile, line);
+  // Reference blocks with least-recently-used eviction, for alignments that do not arrive in coordinate order
+  struct ReferenceCache {
+    typedef std::pair<int32_t, uint32_t> TBlockKey;
+    typedef std::list<TBlockKey> TLru;
+    typedef boost::unordered_map<TBlockKey, std::pair<std::string, TLru::iterator> > TBlocks;
+
+    faidx_t* fai;
+    bam_hdr_t* hdr;
+    uint32_t blockSize;
+    uint32_t maxBlocks;
+    TBlocks blocks;
+    TLru lru;
+
+    ReferenceCache(faidx_t* f, bam_hdr_t* h) : fai(f), hdr(h), blockSize(65536), maxBlocks(1024) {}
+
+    inline std::string const&
+    _block(int32_t const tid, uint32_t const b) {
+      TBlockKey key(tid, b);
+      TBlocks::iterator it = blocks.find(key);
+      if (it != blocks.end()) {
+	lru.splice(lru.begin(), lru, it->second.second);
+	return it->second.first;
+      }
+      if (blocks.size() >= maxBlocks) {
+	blocks.erase(lru.back());
+	lru.pop_back();
+      }
+      int32_t seqlen = -1;
+      char* seq = faidx_fetch_seq(fai, hdr->target_name[tid], b * blockSize, (b + 1) * blockSize - 1, &seqlen);
+      lru.push_front(key);
+      std::pair<std::string, TLru::iterator>& blk = blocks[key];
+      if (seq != NULL) {
+	if (seqlen > 0) blk.first.assign(seq, seqlen);
+	free(seq);
+      }
+      blk.second = lru.begin();
+      return blk.first;
+    }
+
+    // Reference bases [start, end) of chromosome tid
+    inline std::string
+    fetch(int32_t const tid, int32_t const start, int32_t const end) {
+      std::string slice;
+      for(int32_t pos = start; pos < end; ) {
+	uint32_t b = pos / blockSize;
+	std::string const& blk = _block(tid, b);
+	int32_t offset = pos - b * blockSize;
+	int32_t len = std::min(end - pos, (int32_t) blk.size() - offset);
+	if (len <= 0) break;
+	slice.append(blk, offset, len);
+	pos += len;
+      }
+      return slice;
+    }
+  };
+
+  // Aligned blocks in arbitrary order, spilled to disk in buckets of consecutive chromosomes
+  struct CoverageBuckets {
+    struct Event {
+      int32_t tid;
+      uint32_t pos;
+      uint16_t rg;
+      int16_t delta;
+    };
+
+    struct EventTidLess {
+      inline bool operator()(Event const& a, Event const& b) const { return a.tid < b.tid; }
+    };
+
+    std::vector<uint32_t> bucket;
+    std::vector<std::vector<Event> > buffer;
+    std::vector<boost::filesystem::path> files;
+    std::vector<std::ofstream*> out;
+
+    CoverageBuckets() {}
+
+    ~CoverageBuckets() {
+      for(uint32_t i = 0; i < out.size(); ++i) {
+	delete out[i];
+	boost::filesystem::remove(files[i]);
+      }
+    }
+
+    inline void
+    open(std::string const& prefix, bam_hdr_t* hdr, uint32_t const nbuckets) {
+      uint64_t genomelen = 0;
+      for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) genomelen += hdr->target_len[refIndex];
+      uint64_t target = genomelen / nbuckets + 1;
+      uint64_t cumsum = 0;
+      bucket.resize(hdr->n_targets, 0);
+      for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+	bucket[refIndex] = cumsum / target;
+	cumsum += hdr->target_len[refIndex];
+      }
+      uint32_t n = (hdr->n_targets > 0) ? bucket[hdr->n_targets - 1] + 1 : 0;
+      buffer.resize(n);
+      for(uint32_t i = 0; i < n; ++i) {
+	files.push_back(boost::filesystem::path(prefix + ".bucket" + boost::lexical_cast<std::string>(i) + ".tmp"));
+	out.push_back(new std::ofstream(files[i].string().c_str(), std::ios_base::out | std::ios_base::binary));
+      }
+    }
+
+    inline void
+    _flush(uint32_t const b) {
+      if (!buffer[b].empty()) out[b]->write((char*) &buffer[b][0], buffer[b].size() * sizeof(Event));
+      buffer[b].clear();
+    }
+
+    // Coverage +1 on [start, end)
+    inline void
+    add(int32_t const tid, uint16_t const rg, uint32_t const start, uint32_t const end) {
+      uint32_t b = bucket[tid];
+      Event ev;
+      ev.tid = tid;
+      ev.rg = rg;
+      ev.pos = start;
+      ev.delta = 1;
+      buffer[b].push_back(ev);
+      ev.pos = end;
+      ev.delta = -1;
+      buffer[b].push_back(ev);
+      if (buffer[b].size() >= 65536) _flush(b);
+    }
+
+    // All events of one bucket, sorted by chromosome
+    inline void
+    load(uint32_t const b, std::vector<Event>& events) {
+      _flush(b);
+      out[b]->close();
+      events.clear();
+      std::ifstream in(files[b].string().c_str(), std::ios_base::in | std::ios_base::binary);
+      Event ev;
+      while (in.read((char*) &ev, sizeof(Event))) events.push_back(ev);
+      in.close();
+      boost::filesystem::remove(files[b]);
+      std::stable_sort(events.begin(), events.end(), EventTidLess());
+    }
+  };
+
+
+  // TMetrics is the compile-time set of metric groups, groups outside of it are compiled out of the record loop
+  template<typename TConfig, uint32_t TMetrics = qcAll>
+  struct QcAnalysis {
+    typedef boost::dynamic_bitset<> TBitSet;
+    typedef boost::unordered_map<std::string, ReadGroupStats> TRGMap;
+
+    TConfig& c;
+    bam_hdr_t* hdr;
+    faidx_t* fai;
+    char* seq;
+    boost::shared_ptr<std::string const> seqHold;  // Set if seq belongs to the alfred serve cache
+    int32_t refIndex;
+    ReferenceFeatures rf;
+    BedCounts be;
+    TRGMap rgMap;
+    typename TRGMap::iterator rgDefault;  // Only read group if read groups are ignored
+    TBitSet nrun;   // N-content of the current chromosome
+    TBitSet gcref;  // GC-content of the current chromosome
+
+    // Unsorted input
+    ReferenceCache refCache;
+    CoverageBuckets covBuckets;
+    boost::unordered_map<std::string, uint16_t> rgIds;
+    std::vector<bool> seen;
+
+    QcAnalysis(TConfig& conf, bam_hdr_t* h, faidx_t* f) : c(conf), hdr(h), fai(f), seq(NULL), refIndex(-1), rf(h->n_targets), be(h->n_targets, 25, 20), refCache(f, h) {}
+
+    ~QcAnalysis() {
+      releaseChromosome(seq, seqHold);
+    }
+
+    // Metric group enabled at compile time and selected at run time
+    inline bool
+    _on(uint32_t const metric) const {
+      return (TMetrics & metric) && (c.metrics & metric);
+    }
+
+    // Sequence, qualities and RG, MI, HP and PS tags are all evaluated
+    static int32_t
+    requiredFields() {
+      return samCoreFields | SAM_TLEN | SAM_SEQ | SAM_QUAL | SAM_AUX | SAM_RGAUX;
+    }
+
+    bool
+    init() {
+      // Parse regions from BED file or create one region per chromosome
+      if (c.hasRegionFile) {
+	if (is_gz(c.regionFile)) {
+	  std::ifstream file(c.regionFile.string().c_str(), std::ios_base::in | std::ios_base::binary);
+	  boost::iostreams::filtering_streambuf<boost::iostreams::input> dataIn;
+	  dataIn.push(boost::iostreams::gzip_decompressor());
+	  dataIn.push(file);
+	  std::istream instream(&dataIn);
+	  std::string line;
+	  while(std::getline(instream, line)) {
 	    typedef boost::tokenizer< boost::char_separator<char> > Tokenizer;
 	    boost::char_separator<char> sep(" \t,;");
 	    Tokenizer tokens(line, sep);
@@ -137,201 +295,256 @@ namespace bamstats
 	      }
 	    }
 	  }
-	  bedFile.close();
+	  dataIn.pop();
+	} else {
+	  // Parse regions from BED file
+	  std::ifstream bedFile(c.regionFile.string().c_str(), std::ifstream::in);
+	  if (bedFile.is_open()) {
+	    while (bedFile.good()) {
+	      std::string line;
+	      getline(bedFile, line);
+	      typedef boost::tokenizer< boost::char_separator<char> > Tokenizer;
+	      boost::char_separator<char> sep(" \t,;");
+	      Tokenizer tokens(line, sep);
+	      Tokenizer::iterator tokIter = tokens.begin();
+	      std::string chrName = *tokIter++;
+	      // Map chromosome names to the bam header chromosome IDs
+	      int32_t chrid = bam_name2id(hdr, chrName.c_str());
+	      // Valid ID?
+	      if (chrid >= 0) {
+		if (tokIter!=tokens.end()) {
+		  int32_t start = boost::lexical_cast<int32_t>(*tokIter++);
+		  int32_t end = boost::lexical_cast<int32_t>(*tokIter++);
+		  rf.gRegions[chrid].push_back(Interval(start, end));
+		}
+	      }
+	    }
+	    bedFile.close();
+	  }
 	}
-      }
 
-      // Get total bed size
-      for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
-	typedef boost::dynamic_bitset<> TBitSet;
-	TBitSet bedcovered(hdr->target_len[refIndex]);
-	for(uint32_t i = 0; i < rf.gRegions[refIndex].size(); ++i)
-	  for(int32_t k = rf.gRegions[refIndex][i].start; (k < rf.gRegions[refIndex][i].end) && (k < (int32_t) hdr->target_len[refIndex]); ++k) bedcovered[k] = 1;
-	rf.totalBedSize += bedcovered.count();
-      }
-    }
-    
-    // Debug code
-    //uint32_t rIndex = 0;
-    //for(TGenomicRegions::const_iterator itG = rf.gRegions.begin(); itG != rf.gRegions.end(); ++itG, ++rIndex) {
-    //for(TChromosomeRegions::const_iterator itC = itG->begin(); itC != itG->end(); ++itC) {
-    //std::cout << rIndex << ',' << hdr->target_name[rIndex] << ',' << itC->start << ',' << itC->end << std::endl;
-    //}
-    //}
-
-    // BED file statistics
-    BedCounts be(hdr->n_targets, 25, 20);
-    
-    // Read group statistics
-    typedef std::set<std::string> TRgSet;
-    TRgSet rgs;
-    getRGs(std::string(hdr->text), rgs);
-    if (c.ignoreRG) rgs.insert("DefaultLib");
-    if ((c.singleRG) && (rgs.find(c.rgname) == rgs.end())) {
-	std::cerr << "Read group is not present in BAM file: " << c.rgname << std::endl;
-	return 1;
-    }
-    typedef boost::unordered_map<std::string, ReadGroupStats> TRGMap;
-    TRGMap rgMap;
-    for(typename TRgSet::const_iterator itRg = rgs.begin(); itRg != rgs.end(); ++itRg) {
-      if (((c.ignoreRG) && (*itRg == "DefaultLib")) || ((c.singleRG) && (*itRg == c.rgname)) || ((!c.ignoreRG) && (!c.singleRG))) {
-	rgMap.insert(std::make_pair(*itRg, ReadGroupStats(hdr->n_targets)));
+	// Get total bed size
 	for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
-	  typename BedCounts::TRgBpMap::iterator itChr = be.gCov[refIndex].insert(std::make_pair(*itRg, typename BedCounts::TBpCov())).first;
-	  itChr->second.resize(rf.gRegions[refIndex].size());
-	  typename BedCounts::TOnTargetMap::iterator itOT = be.onTarget.insert(std::make_pair(*itRg, typename BedCounts::TOnTargetBp())).first;
-	  itOT->second.resize(be.onTSize, 0);
+	  typedef boost::dynamic_bitset<> TBitSet;
+	  TBitSet bedcovered(hdr->target_len[refIndex]);
+	  for(uint32_t i = 0; i < rf.gRegions[refIndex].size(); ++i)
+	    for(int32_t k = rf.gRegions[refIndex][i].start; (k < rf.gRegions[refIndex][i].end) && (k < (int32_t) hdr->target_len[refIndex]); ++k) bedcovered[k] = 1;
+	  rf.totalBedSize += bedcovered.count();
 	}
       }
-    }
 
-    // Parse reference and BAM file
-    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
-    boost::progress_display show_progress( hdr->n_targets );
-
-    // GC- and N-content
-    typedef boost::dynamic_bitset<> TBitSet;
-    TBitSet nrun;
-    TBitSet gcref;
+      // Read group statistics
+      typedef std::set<std::string> TRgSet;
+      TRgSet rgs;
+      getRGs(std::string(hdr->text), rgs);
+      if (c.ignoreRG) rgs.insert("DefaultLib");
+      if ((c.singleRG) && (rgs.find(c.rgname) == rgs.end())) {
+	  std::cerr << "Read group is not present in BAM file: " << c.rgname << std::endl;
+	  return false;
+      }
+      for(typename TRgSet::const_iterator itRg = rgs.begin(); itRg != rgs.end(); ++itRg) {
+	if (((c.ignoreRG) && (*itRg == "DefaultLib")) || ((c.singleRG) && (*itRg == c.rgname)) || ((!c.ignoreRG) && (!c.singleRG))) {
+	  rgMap.insert(std::make_pair(*itRg, ReadGroupStats(hdr->n_targets)));
+	  for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+	    typename BedCounts::TRgBpMap::iterator itChr = be.gCov[refIndex].insert(std::make_pair(*itRg, typename BedCounts::TBpCov())).first;
+	    itChr->second.resize(rf.gRegions[refIndex].size());
+	    typename BedCounts::TOnTargetMap::iterator itOT = be.onTarget.insert(std::make_pair(*itRg, typename BedCounts::TOnTargetBp())).first;
+	    itOT->second.resize(be.onTSize, 0);
+	  }
+	}
+      }
+      if (c.ignoreRG) rgDefault = rgMap.find("DefaultLib");
 
-    // Find N95 chromosome length
-    {
-      std::vector<uint32_t> chrlen(hdr->n_targets, 0);
-      uint64_t genomelen = 0;
-      for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
-	chrlen[refIndex] = hdr->target_len[refIndex];
-	genomelen += hdr->target_len[refIndex];
+      // Find N95 chromosome length
+      {
+	std::vector<uint32_t> chrlen(hdr->n_targets, 0);
+	uint64_t genomelen = 0;
+	for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+	  chrlen[refIndex] = hdr->target_len[refIndex];
+	  genomelen += hdr->target_len[refIndex];
+	}
+	std::sort(chrlen.begin(), chrlen.end(), std::greater<uint32_t>());
+	uint64_t cumsum = 0;
+	for(uint32_t i = 0; i < chrlen.size(); ++i) {
+	  cumsum += chrlen[i];
+	  if (cumsum > genomelen * c.nXChrLen) {
+	    if (chrlen[i] < c.minChrLen) c.minChrLen = chrlen[i];
+	    break;
+	  }
+	}
       }
-      std::sort(chrlen.begin(), chrlen.end(), std::greater<uint32_t>());
-      uint64_t cumsum = 0;
-      for(uint32_t i = 0; i < chrlen.size(); ++i) {
-	cumsum += chrlen[i];
-	if (cumsum > genomelen * c.nXChrLen) {
-	  if (chrlen[i] < c.minChrLen) c.minChrLen = chrlen[i];
-	  break;
+
+      // Coverage of unsorted input is only summarized once all alignments are seen
+      if (c.unsorted) {
+	if (rgMap.size() > std::numeric_limits<uint16_t>::max()) {
+	  std::cerr << "Too many read groups for unsorted input!" << std::endl;
+	  return false;
 	}
+	uint16_t rgId = 0;
+	for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg, ++rgId) rgIds.insert(std::make_pair(itRg->first, rgId));
+	seen.resize(hdr->n_targets, false);
+	if (_on(qcCoverage)) covBuckets.open(c.outfile.string(), hdr, 64);
       }
+      return true;
     }
 
-    // Parse genome
-    int32_t refIndex = -1;
-    char* seq = NULL;
-    faidx_t* fai = fai_load(c.genome.string().c_str());
-    bam1_t* rec = bam_init1();
-    while (sam_read1(samfile, hdr, rec) >= 0) {
-      // New chromosome?
-      if ((!(rec->core.flag & BAM_FUNMAP)) && (rec->core.tid != refIndex)) {
-	++show_progress;
-	
-	// Summarize bp-level coverage
-	if (refIndex != -1) {
-	  for(typename TRGMap::iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-	    if ((c.hasRegionFile) && (!rf.gRegions[refIndex].empty())) _summarizeBedCoverage(rf.gRegions[refIndex], itRg->second.bc.cov, refIndex, itRg->first, be);
-	    for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	      if (itRg->second.bc.cov[i] >= 1) {
-		++itRg->second.bc.nd;
-		if (itRg->second.bc.cov[i] == 1) ++itRg->second.bc.n1;
-		if (itRg->second.bc.cov[i] == 2) ++itRg->second.bc.n2;
-	      }
-	      if (!nrun[i]) ++itRg->second.bc.bpWithCoverage[itRg->second.bc.cov[i]];
-	    }
-	    itRg->second.bc.cov.clear();
-	  }
-	  if (seq != NULL) free(seq);
+    // Rebuild bp-level coverage of one chromosome from the spilled aligned blocks
+    void
+    _bucketCoverage(std::vector<CoverageBuckets::Event> const& events) {
+      typedef std::vector<CoverageBuckets::Event>::const_iterator TEventIter;
+      CoverageBuckets::Event key;
+      key.tid = refIndex;
+      std::pair<TEventIter, TEventIter> range = std::equal_range(events.begin(), events.end(), key, CoverageBuckets::EventTidLess());
+
+      // Group the events of the chromosome by read group in one pass
+      std::vector<uint32_t> offset(rgIds.size() + 1, 0);
+      for(TEventIter it = range.first; it != range.second; ++it) ++offset[it->rg + 1];
+      for(uint32_t i = 1; i < offset.size(); ++i) offset[i] += offset[i - 1];
+      std::vector<CoverageBuckets::Event> byRg(range.second - range.first);
+      std::vector<uint32_t> next(offset.begin(), offset.end() - 1);
+      for(TEventIter it = range.first; it != range.second; ++it) byRg[next[it->rg]++] = *it;
+      std::vector<int32_t> diff(hdr->target_len[refIndex] + 1, 0);
+      for(typename TRGMap::iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	uint16_t rgId = rgIds[itRg->first];
+	std::fill(diff.begin(), diff.end(), 0);
+	for(uint32_t k = offset[rgId]; k < offset[rgId + 1]; ++k) diff[byRg[k].pos] += byRg[k].delta;
+	int32_t cumsum = 0;
+	for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
+	  cumsum += diff[i];
+	  itRg->second.bc.cov[i] = std::min((uint32_t) cumsum, itRg->second.bc.maxCoverage);
 	}
-	refIndex = rec->core.tid;
-	
-	// Load chromosome
-	int32_t seqlen = -1;
-	std::string tname(hdr->target_name[refIndex]);
-	seq = faidx_fetch_seq(fai, tname.c_str(), 0, hdr->target_len[refIndex], &seqlen);
-
-	// Set N-mask
-	nrun.clear();
-	nrun.resize(hdr->target_len[refIndex], false);
-	gcref.clear();
-	gcref.resize(hdr->target_len[refIndex], false);
-	rf.referencebp += hdr->target_len[refIndex];
+      }
+    }
+
+    // Summarize bp-level coverage of the current chromosome
+    void
+    _summarizeChromosome() {
+      for(typename TRGMap::iterator itRg = rgMap.begin(); (_on(qcCoverage)) && (itRg != rgMap.end()); ++itRg) {
+	if ((c.hasRegionFile) && (!rf.gRegions[refIndex].empty())) _summarizeBedCoverage(rf.gRegions[refIndex], itRg->second.bc.cov, refIndex, itRg->first, be);
 	for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	  if ((seq[i] == 'c') || (seq[i] == 'C') || (seq[i] == 'g') || (seq[i] == 'G')) gcref[i] = 1;
-	  if ((seq[i] == 'n') || (seq[i] == 'N')) {
-	    nrun[i] = 1;
-	    ++rf.ncount;
+	  if (itRg->second.bc.cov[i] >= 1) {
+	    ++itRg->second.bc.nd;
+	    if (itRg->second.bc.cov[i] == 1) ++itRg->second.bc.n1;
+	    if (itRg->second.bc.cov[i] == 2) ++itRg->second.bc.n2;
 	  }
+	  if (!nrun[i]) ++itRg->second.bc.bpWithCoverage[itRg->second.bc.cov[i]];
 	}
-	// Reference GC
-	rf.chrGC[refIndex].ncount = nrun.count();
-	rf.chrGC[refIndex].gccount = gcref.count();
-	if ((hdr->target_len[refIndex] > 101) && (hdr->target_len[refIndex] >= c.minChrLen)) {
-	  uint32_t nsum = 0;
-	  uint32_t gcsum = 0;
-	  uint32_t halfwin = 50;
-	  for(uint32_t pos = halfwin; pos < hdr->target_len[refIndex] - halfwin; ++pos) {
-	    if (pos == halfwin) {
-	      for(uint32_t i = pos - halfwin; i<pos+halfwin+1; ++i) {
-		nsum += nrun[i];
-		gcsum += gcref[i];
-	      }
-	    } else {
-	      nsum -= nrun[pos - halfwin - 1];
-	      gcsum -= gcref[pos - halfwin - 1];
-	      nsum += nrun[pos + halfwin];
-	      gcsum += gcref[pos + halfwin];
+	itRg->second.bc.cov.clear();
+      }
+      releaseChromosome(seq, seqHold);
+    }
+
+    void
+    _loadChromosome(int32_t tid) {
+      refIndex = tid;
+
+      // Load chromosome
+      std::string tname(hdr->target_name[refIndex]);
+      seq = fetchChromosome(fai, c.genome, tname, seqHold);
+
+      // Set N-mask
+      nrun.clear();
+      nrun.resize(hdr->target_len[refIndex], false);
+      gcref.clear();
+      gcref.resize(hdr->target_len[refIndex], false);
+      rf.referencebp += hdr->target_len[refIndex];
+      for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
+	if ((seq[i] == 'c') || (seq[i] == 'C') || (seq[i] == 'g') || (seq[i] == 'G')) gcref[i] = 1;
+	if ((seq[i] == 'n') || (seq[i] == 'N')) {
+	  nrun[i] = 1;
+	  ++rf.ncount;
+	}
+      }
+      // Reference GC
+      rf.chrGC[refIndex].ncount = nrun.count();
+      rf.chrGC[refIndex].gccount = gcref.count();
+      if ((_on(qcGC)) && (hdr->target_len[refIndex] > 101) && (hdr->target_len[refIndex] >= c.minChrLen)) {
+	uint32_t nsum = 0;
+	uint32_t gcsum = 0;
+	uint32_t halfwin = 50;
+	for(uint32_t pos = halfwin; pos < hdr->target_len[refIndex] - halfwin; ++pos) {
+	  if (pos == halfwin) {
+	    for(uint32_t i = pos - halfwin; i<pos+halfwin+1; ++i) {
+	      nsum += nrun[i];
+	      gcsum += gcref[i];
 	    }
-	    if (!nsum) ++rf.refGcContent[gcsum];
+	  } else {
+	    nsum -= nrun[pos - halfwin - 1];
+	    gcsum -= gcref[pos - halfwin - 1];
+	    nsum += nrun[pos + halfwin];
+	    gcsum += gcref[pos + halfwin];
 	  }
-	  if ((c.hasRegionFile) && (!rf.gRegions[refIndex].empty())) {
-	    // Target GC
-	    for(uint32_t k = 0; k < rf.gRegions[refIndex].size(); ++k) {
-	      nsum = 0;
-	      gcsum = 0;
-	      int32_t regstart = std::max(rf.gRegions[refIndex][k].start, (int32_t) halfwin);
-	      int32_t regend = std::min(rf.gRegions[refIndex][k].end, (int32_t) (hdr->target_len[refIndex] - halfwin));
-	      if (regstart < regend) {
-		for(int32_t pos = regstart; pos < regend; ++pos) {
-		  if (pos == regstart) {
-		    for(int32_t i = pos - halfwin; i < (int32_t) (pos+halfwin+1); ++i) {
-		      nsum += nrun[i];
-		      gcsum += gcref[i];
-		    }
-		  } else {
-		    nsum -= nrun[pos - halfwin - 1];
-		    gcsum -= gcref[pos - halfwin - 1];
-		    nsum += nrun[pos + halfwin];
-		    gcsum += gcref[pos + halfwin];
+	  if (!nsum) ++rf.refGcContent[gcsum];
+	}
+	if ((c.hasRegionFile) && (!rf.gRegions[refIndex].empty())) {
+	  // Target GC
+	  for(uint32_t k = 0; k < rf.gRegions[refIndex].size(); ++k) {
+	    nsum = 0;
+	    gcsum = 0;
+	    int32_t regstart = std::max(rf.gRegions[refIndex][k].start, (int32_t) halfwin);
+	    int32_t regend = std::min(rf.gRegions[refIndex][k].end, (int32_t) (hdr->target_len[refIndex] - halfwin));
+	    if (regstart < regend) {
+	      for(int32_t pos = regstart; pos < regend; ++pos) {
+		if (pos == regstart) {
+		  for(int32_t i = pos - halfwin; i < (int32_t) (pos+halfwin+1); ++i) {
+		    nsum += nrun[i];
+		    gcsum += gcref[i];
 		  }
-		  if (!nsum) ++be.bedGcContent[gcsum];
+		} else {
+		  nsum -= nrun[pos - halfwin - 1];
+		  gcsum -= gcref[pos - halfwin - 1];
+		  nsum += nrun[pos + halfwin];
+		  gcsum += gcref[pos + halfwin];
 		}
+		if (!nsum) ++be.bedGcContent[gcsum];
 	      }
 	    }
 	  }
 	}
+      }
 	
-	// Resize coverage vectors
+      // Resize coverage vectors
+      if (_on(qcCoverage)) {
 	for(typename TRGMap::iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) itRg->second.bc.cov.resize(hdr->target_len[refIndex], 0);
       }
+    }
+
+    // Records need to arrive in coordinate order, unmapped reads last, unless the input is flagged as unsorted
+    bool
+    process(bam1_t* rec) {
+      // New chromosome?
+      if ((!(rec->core.flag & BAM_FUNMAP)) && (rec->core.tid != refIndex)) {
+	if (c.unsorted) {
+	  refIndex = rec->core.tid;
+	  seen[refIndex] = true;
+	} else {
+	  if (refIndex != -1) _summarizeChromosome();
+	  if (_on(qcReference)) _loadChromosome(rec->core.tid);
+	  else refIndex = rec->core.tid;
+	}
+      }
       
       // Get the library information
-      std::string rG = "DefaultLib";
+      typename TRGMap::iterator itRg = rgDefault;
       if (!c.ignoreRG) {
+	std::string rG = "DefaultLib";
 	uint8_t *rgptr = bam_aux_get(rec, "RG");
 	if (rgptr) {
 	  char* rg = (char*) (rgptr + 1);
 	  rG = std::string(rg);
 	}
-	if ((c.singleRG) && (rG != c.rgname)) continue;
-      }
-      typename TRGMap::iterator itRg = rgMap.find(rG);
-      if (itRg == rgMap.end()) {
-	std::cerr << "Missing read group: " << rG << std::endl;
-	return 1;
+	if ((c.singleRG) && (rG != c.rgname)) return true;
+	itRg = rgMap.find(rG);
+	if (itRg == rgMap.end()) {
+	  std::cerr << "Missing read group: " << rG << std::endl;
+	  return false;
+	}
       }
 
       // Alignments behind the reference end
       if ((!(rec->core.flag & BAM_FUNMAP)) && (((rec->core.pos >= (int32_t) hdr->target_len[refIndex]) || (lastAlignedPosition(rec) > hdr->target_len[refIndex])))) {
 	std::cerr << "Alignment is past the reference end: " << hdr->target_name[refIndex] << ':' << rec->core.pos << std::endl;
-	continue;
+	return true;
       }
 
       // Paired counts
@@ -343,7 +556,7 @@ namespace bamstats
 	    ++itRg->second.pc.mappedSameChr;
 	    if (rec->core.flag & BAM_FPROPER_PAIR) ++itRg->second.pc.mappedProper;
 	  }
-	  if (rec->core.pos > rec->core.mpos) {
+	  if ((_on(qcInsertSize)) && (rec->core.pos > rec->core.mpos)) {
 	    ++itRg->second.pc.totalISizeCount;
 	    int32_t outerISize = rec->core.pos - rec->core.mpos + alignmentLength(rec);
 	    switch(layout(rec)) {
@@ -385,13 +598,13 @@ namespace bamstats
 	  ++itRg->second.rc.mappedchr[refIndex];
 	}
 	if (rec->core.flag & BAM_FSECONDARY) {
-	  if (!c.secondary) continue;
+	  if (!c.secondary) return true;
 	  // Evaluate secondary alignments
 	  // Sequence and quality strings might be '*' for secondary alignments
 	} else if (rec->core.flag & BAM_FSUPPLEMENTARY) {
-	  if (!c.supplementary) continue;
+	  if (!c.supplementary) return true;
 	  // Evaluate supplementary alignments
-	} else continue;
+	} else return true;
       }
       ++itRg->second.qc.qcount[(int32_t) rec->core.qual];
       ++itRg->second.rc.mappedchr[refIndex];
@@ -409,7 +622,8 @@ namespace bamstats
       }
 
       // Fetch molecule identifier
-      uint8_t* miptr = bam_aux_get(rec, "MI");
+      uint8_t* miptr = NULL;
+      if (_on(qcUMI)) miptr = bam_aux_get(rec, "MI");
       if (miptr) {
 	c.isMitagged = true;
 	++itRg->second.rc.mitagged;
@@ -422,7 +636,8 @@ namespace bamstats
       }
       
       // Fetch haplotype tag
-      uint8_t* hpptr = bam_aux_get(rec, "HP");
+      uint8_t* hpptr = NULL;
+      if (_on(qcHaplotype)) hpptr = bam_aux_get(rec, "HP");
       if (hpptr) {
 	c.isHaplotagged = true;
 	++itRg->second.rc.haplotagged;
@@ -443,14 +658,17 @@ namespace bamstats
       // Get the read sequence
       typedef std::vector<uint8_t> TQuality;
       TQuality quality;
-      quality.resize(rec->core.l_qseq);
       std::string sequence;
-      sequence.resize(rec->core.l_qseq);
+      if (_on(qcSequence)) {
+	quality.resize(rec->core.l_qseq);
+	sequence.resize(rec->core.l_qseq);
+      }
       uint8_t* seqptr = bam_get_seq(rec);
       uint8_t* qualptr = bam_get_qual(rec);
-      for (int32_t i = 0; i < rec->core.l_qseq; ++i) {
+      for (int32_t i = 0; (_on(qcSequence)) && (i < rec->core.l_qseq); ++i) {
 	quality[i] = qualptr[i];
 	sequence[i] = "=ACMGRSVTWYHKDBN"[bam_seqi(seqptr, i)];
+	if (!_on(qcBaseComposition)) continue;
 	//char c = 33 + quality[i];
 	int32_t relpos = i;
 	if (rec->core.flag & BAM_FREVERSE) {
@@ -490,13 +708,22 @@ namespace bamstats
       }
 
       // Sequence GC content
-      {
+      if (_on(qcGC)) {
 	int32_t halfwin = 50;
 	int32_t pos = rec->core.pos + 51;
 	if (rec->core.flag & BAM_FREVERSE) pos = rec->core.pos - 51;
 	int32_t fragstart = pos - halfwin;
 	int32_t fragend = pos + halfwin + 1;
-	if ((fragstart >= 0) && (fragend < (int32_t) hdr->target_len[refIndex])) {
+	if ((fragstart >= 0) && (fragend < (int32_t) hdr->target_len[refIndex]) && (c.unsorted)) {
+	  std::string window = refCache.fetch(refIndex, fragstart, fragend);
+	  int32_t ncount = 0;
+	  int32_t gccont = 0;
+	  for(uint32_t i = 0; i < window.size(); ++i) {
+	    if ((window[i] == 'n') || (window[i] == 'N')) ++ncount;
+	    else if ((window[i] == 'c') || (window[i] == 'C') || (window[i] == 'g') || (window[i] == 'G')) ++gccont;
+	  }
+	  if (!ncount) ++itRg->second.rc.gcContent[gccont];
+	} else if ((fragstart >= 0) && (fragend < (int32_t) hdr->target_len[refIndex])) {
 	  int32_t ncount = 0;
 	  for(int32_t i = fragstart; i < fragend; ++i) {
 	    if (nrun[i]) ++ncount;
@@ -512,7 +739,11 @@ namespace bamstats
       }
       
       // Get the reference slice
-      std::string refslice = boost::to_upper_copy(std::string(seq + rec->core.pos, seq + lastAlignedPosition(rec)));
+      std::string refslice;
+      if (_on(qcErrors)) {
+	if (c.unsorted) refslice = boost::to_upper_copy(refCache.fetch(refIndex, rec->core.pos, lastAlignedPosition(rec)));
+	else refslice = boost::to_upper_copy(std::string(seq + rec->core.pos, seq + lastAlignedPosition(rec)));
+      }
       
       // Debug 
       //std::cout << matchCount << ',' << mismatchCount << ',' << delCount << ',' << insCount << ',' << softClipCount << ',' << hardClipCount << std::endl;
@@ -523,42 +754,53 @@ namespace bamstats
       uint32_t sp = 0; // sequence pointer
 
       
-      // Parse the CIGAR
+      // Parse the CIGAR, spilled coverage is keyed by the read group id
+      uint16_t rgId = 0;
+      if ((_on(qcCoverage)) && (c.unsorted)) rgId = rgIds[itRg->first];
       uint32_t* cigar = bam_get_cigar(rec);
       bool spliced = false;
       for (std::size_t i = 0; i < rec->core.n_cigar; ++i) {
 	if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
+	  if ((_on(qcCoverage)) && (c.unsorted)) covBuckets.add(refIndex, rgId, rec->core.pos + rp, rec->core.pos + rp + bam_cigar_oplen(cigar[i]));
+	  else if (_on(qcCoverage)) {
+	    // Count bp-level coverage
+	    for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]);++k) {
+	      if (itRg->second.bc.cov[rec->core.pos + rp + k] < itRg->second.bc.maxCoverage) ++itRg->second.bc.cov[rec->core.pos + rp + k];
+	    }
+	  }
 	  // match or mismatch
-	  for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]);++k) {
-	    if (rec->core.l_qseq) {
-	      if (sequence[sp] == refslice[rp]) ++itRg->second.bc.matchCount;
+	  if ((_on(qcErrors)) && (rec->core.l_qseq)) {
+	    for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]);++k) {
+	      if (sequence[sp + k] == refslice[rp + k]) ++itRg->second.bc.matchCount;
 	      else ++itRg->second.bc.mismatchCount;
-	    } else {
-	      if (bam_cigar_op(cigar[i]) == BAM_CEQUAL) ++itRg->second.bc.matchCount;
-	      else if (bam_cigar_op(cigar[i]) == BAM_CDIFF) ++itRg->second.bc.mismatchCount;
 	    }
-	    // Count bp-level coverage
-	    if (itRg->second.bc.cov[rec->core.pos + rp] < itRg->second.bc.maxCoverage) ++itRg->second.bc.cov[rec->core.pos + rp];
-	    ++sp;
-	    ++rp;
+	  } else if (_on(qcErrors)) {
+	    if (bam_cigar_op(cigar[i]) == BAM_CEQUAL) itRg->second.bc.matchCount += bam_cigar_oplen(cigar[i]);
+	    else if (bam_cigar_op(cigar[i]) == BAM_CDIFF) itRg->second.bc.mismatchCount += bam_cigar_oplen(cigar[i]);
 	  }
+	  sp += bam_cigar_oplen(cigar[i]);
+	  rp += bam_cigar_oplen(cigar[i]);
 	} else if (bam_cigar_op(cigar[i]) == BAM_CDEL) {
-	  ++itRg->second.bc.delCount;
-	  if (rec->core.l_qseq) ++itRg->second.bc.delHomACGTN[homopolymerContext(sequence, sp, 3)];
-	  if (bam_cigar_oplen(cigar[i]) < itRg->second.bc.maxIndelSize) ++itRg->second.bc.delSize[bam_cigar_oplen(cigar[i])];
-	  else ++itRg->second.bc.delSize[itRg->second.bc.maxIndelSize];
+	  if (_on(qcErrors)) {
+	    ++itRg->second.bc.delCount;
+	    if (rec->core.l_qseq) ++itRg->second.bc.delHomACGTN[homopolymerContext(sequence, sp, 3)];
+	    if (bam_cigar_oplen(cigar[i]) < itRg->second.bc.maxIndelSize) ++itRg->second.bc.delSize[bam_cigar_oplen(cigar[i])];
+	    else ++itRg->second.bc.delSize[itRg->second.bc.maxIndelSize];
+	  }
 	  rp += bam_cigar_oplen(cigar[i]);
 	} else if (bam_cigar_op(cigar[i]) == BAM_CINS) {
-	  ++itRg->second.bc.insCount;
-	  if (rec->core.l_qseq) ++itRg->second.bc.insHomACGTN[homopolymerContext(sequence, sp, 3)];
-	  if (bam_cigar_oplen(cigar[i]) < itRg->second.bc.maxIndelSize) ++itRg->second.bc.insSize[bam_cigar_oplen(cigar[i])];
-	  else ++itRg->second.bc.insSize[itRg->second.bc.maxIndelSize];
+	  if (_on(qcErrors)) {
+	    ++itRg->second.bc.insCount;
+	    if (rec->core.l_qseq) ++itRg->second.bc.insHomACGTN[homopolymerContext(sequence, sp, 3)];
+	    if (bam_cigar_oplen(cigar[i]) < itRg->second.bc.maxIndelSize) ++itRg->second.bc.insSize[bam_cigar_oplen(cigar[i])];
+	    else ++itRg->second.bc.insSize[itRg->second.bc.maxIndelSize];
+	  }
 	  sp += bam_cigar_oplen(cigar[i]);
 	} else if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) {
-	  ++itRg->second.bc.softClipCount;
+	  if (_on(qcErrors)) ++itRg->second.bc.softClipCount;
 	  sp += bam_cigar_oplen(cigar[i]);
 	} else if(bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP) {
-	  ++itRg->second.bc.hardClipCount;
+	  if (_on(qcErrors)) ++itRg->second.bc.hardClipCount;
 	} else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) {
 	  if (!spliced) {
 	    ++itRg->second.rc.spliced;
@@ -567,41 +809,166 @@ namespace bamstats
 	  rp += bam_cigar_oplen(cigar[i]);
 	} else {
 	  std::cerr << "Unknown Cigar options" << std::endl;
-	  return 1;
+	  return false;
 	}
       }
+      return true;
     }
-    
-    // Summarize bp-level coverage
-    if (refIndex != -1) {
-      for(typename TRGMap::iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-	if ((c.hasRegionFile) && (!rf.gRegions[refIndex].empty())) _summarizeBedCoverage(rf.gRegions[refIndex], itRg->second.bc.cov, refIndex, itRg->first, be);
-	for(uint32_t i = 0; i < hdr->target_len[refIndex]; ++i) {
-	  if (itRg->second.bc.cov[i] >= 1) {
-	    ++itRg->second.bc.nd;
-	    if (itRg->second.bc.cov[i] == 1) ++itRg->second.bc.n1;
-	    if (itRg->second.bc.cov[i] == 2) ++itRg->second.bc.n2;
+
+    // Summarize the current chromosome ahead of the next one, used before a checkpoint
+    void
+    closeChromosome() {
+      if (refIndex != -1) _summarizeChromosome();
+      refIndex = -1;
+    }
+
+    // State at a chromosome boundary, read groups and target regions are set up by init()
+    template<typename TArchive>
+    void
+    io(TArchive& ar) {
+      ar.io(rgMap);
+      ar.io(rf);
+      ar.io(be);
+      ar.io(c.isMitagged);
+      ar.io(c.isHaplotagged);
+    }
+
+    void
+    finish() {
+      if ((c.unsorted) && (!_on(qcCoverage))) {
+	// Reference statistics of chromosomes with alignments
+	for(int32_t tid = 0; (_on(qcReference)) && (tid < hdr->n_targets); ++tid) {
+	  if (!seen[tid]) continue;
+	  _loadChromosome(tid);
+	  _summarizeChromosome();
+	}
+      } else if (c.unsorted) {
+	// Chromosomes with alignments, bucket by bucket
+	std::vector<CoverageBuckets::Event> events;
+	for(uint32_t b = 0; b < covBuckets.out.size(); ++b) {
+	  covBuckets.load(b, events);
+	  for(int32_t tid = 0; tid < hdr->n_targets; ++tid) {
+	    if ((covBuckets.bucket[tid] != b) || (!seen[tid])) continue;
+	    _loadChromosome(tid);
+	    _bucketCoverage(events);
+	    _summarizeChromosome();
 	  }
-	  if (!nrun[i]) ++itRg->second.bc.bpWithCoverage[itRg->second.bc.cov[i]];
 	}
-	itRg->second.bc.cov.clear();
+      } else if (refIndex != -1) _summarizeChromosome();
+      output();
+    }
+
+    void
+    output() {
+      if (c.format == "json") qcJsonOut(c, hdr, rgMap, be, rf);
+      else if (c.format == "chunked") qcJsonChunkedOut(c, hdr, rgMap, be, rf);
+      else if (c.format == "both") {
+	qcJsonOut(c, hdr, rgMap, be, rf);
+	qcTsvOut(c, hdr, rgMap, be, rf);
+      } else qcTsvOut(c, hdr, rgMap, be, rf);
+    }
+  };
+
+
+  template<uint32_t TMetrics, typename TConfig>
+  inline int32_t
+  bamStatsRun(TConfig& c, InputContext& in) {
+    // Alignments are read sequentially, no index required
+    BamInput* bam = in.bam(c.bamFile, true);
+    if (bam == NULL) return 1;
+    samFile* samfile = bam->samfile;
+    bam_hdr_t* hdr = bam->hdr;
+    hts_set_fai_filename(samfile, c.genome.string().c_str());
+
+    QcAnalysis<TConfig, TMetrics> qa(c, hdr, in.fai);
+    if (!qa.init()) return 1;
+
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    if (c.shard.merging()) {
+      // Sum up the partial outputs of a sharded run
+      std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Merge shards" << std::endl;
+      for(uint32_t k = 0; k < c.shard.parts.size(); ++k) {
+	CheckpointReader part;
+	if (!c.shard.open(part, k)) return 1;
+	qa.io(part);
+	if (!part.ok) {
+	  std::cerr << "Partial output " << c.shard.parts[k].string() << " is truncated!" << std::endl;
+	  return 1;
+	}
       }
-      if (seq != NULL) free(seq);
+      qa.output();
+    } else if (c.shard.index) {
+      // Chromosomes of this shard are fetched through the index
+      hts_idx_t* idx = bam->index(false);
+      if (idx == NULL) return 1;
+      std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
+      boost::progress_display show_progress( c.shard.end - c.shard.begin );
+      for(int32_t refIndex = c.shard.begin; refIndex <= c.shard.end; ++refIndex) {
+	hts_itr_t* iter = NULL;
+	if (refIndex < c.shard.end) {
+	  ++show_progress;
+	  iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
+	} else if (c.shard.last()) iter = sam_itr_queryi(idx, HTS_IDX_NOCOOR, 0, 0);
+	if (iter == NULL) continue;
+	BamRecordStream stream(samfile, hdr, iter);
+	bam1_t* rec = NULL;
+	while ((rec = stream.next()) != NULL) {
+	  if (!qa.process(rec)) return 1;
+	}
+      }
+      qa.closeChromosome();
+      CheckpointWriter part;
+      if (!c.shard.open(part, c.outfile)) return 1;
+      qa.io(part);
+      if (!part.commit()) return 1;
+    } else {
+      // Resume after the last completed chromosome
+      int32_t doneIndex = -1;
+      if (c.checkpoint.enabled) {
+	CheckpointReader ckpt;
+	if (ckpt.open(c.checkpoint.file("qc.ckpt"), c.checkpoint.key)) {
+	  ckpt.io(doneIndex);
+	  qa.io(ckpt);
+	  if (!ckpt.ok) {
+	    std::cerr << "Checkpoint " << c.checkpoint.file("qc.ckpt").string() << " is truncated, please remove it!" << std::endl;
+	    return 1;
+	  }
+	  seekAfter(samfile, bam->existingIndex(), hdr, doneIndex);
+	  std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Resuming after " << hdr->target_name[doneIndex] << std::endl;
+	}
+      }
+
+      // Parse reference and BAM file
+      std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
+      boost::progress_display show_progress( hdr->n_targets );
+      BamRecordStream stream(samfile, hdr, NULL);
+      bam1_t* rec = NULL;
+      boost::posix_time::ptime lastCheckpoint = now;
+      int32_t lastTid = -1;  // Unmapped reads placed at their mate come first on a chromosome, too
+      while ((rec = stream.next()) != NULL) {
+	if ((rec->core.tid >= 0) && (rec->core.tid <= doneIndex)) continue;
+	int32_t lastIndex = qa.refIndex;
+	if ((c.checkpoint.enabled) && (lastTid != -1) && (rec->core.tid >= 0) && (rec->core.tid != lastTid)) {
+	  now = boost::posix_time::second_clock::local_time();
+	  if ((now - lastCheckpoint).total_seconds() >= (int64_t) c.checkpoint.interval) {
+	    qa.closeChromosome();
+	    lastIndex = qa.refIndex;
+	    CheckpointWriter ckpt;
+	    if (!ckpt.open(c.checkpoint.file("qc.ckpt"), c.checkpoint.key)) return 1;
+	    ckpt.io(lastTid);
+	    qa.io(ckpt);
+	    if (!ckpt.commit()) return 1;
+	    lastCheckpoint = now;
+	  }
+	}
+	if (rec->core.tid >= 0) lastTid = rec->core.tid;
+	if (!qa.process(rec)) return 1;
+	if ((!c.unsorted) && (qa.refIndex != lastIndex)) ++show_progress;
+      }
+      qa.finish();
+      c.checkpoint.clear("qc.ckpt");
     }
 
-    // Output
-    if (c.format == "json") qcJsonOut(c, hdr, rgMap, be, rf);
-    else if (c.format == "both") {
-      qcJsonOut(c, hdr, rgMap, be, rf);
-      qcTsvOut(c, hdr, rgMap, be, rf);
-    } else qcTsvOut(c, hdr, rgMap, be, rf);
-    
-    // clean-up
-    bam_destroy1(rec);
-    fai_destroy(fai);
-    bam_hdr_destroy(hdr);
-    sam_close(samfile);
-    
     now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
     
@@ -613,6 +980,30 @@ namespace bamstats
     return 0;
   }
 
+  template<typename TConfig>
+  inline int32_t
+  bamStatsRun(TConfig& c, InputContext& in) {
+    // Common metric sets get their own record loop, any other set uses the generic loop with run-time checks
+    switch(c.metrics) {
+    case qcCoverage:
+      return bamStatsRun<qcCoverage>(c, in);
+    case qcCoverage | qcInsertSize:
+      return bamStatsRun<qcCoverage | qcInsertSize>(c, in);
+    case qcCoverage | qcGC:
+      return bamStatsRun<qcCoverage | qcGC>(c, in);
+    case qcInsertSize:
+      return bamStatsRun<qcInsertSize>(c, in);
+    case qcBaseComposition:
+      return bamStatsRun<qcBaseComposition>(c, in);
+    case qcErrors:
+      return bamStatsRun<qcErrors>(c, in);
+    case qcGC:
+      return bamStatsRun<qcGC>(c, in);
+    default:
+      return bamStatsRun<qcAll>(c, in);
+    }
+  }
+
 }
 
 #endif
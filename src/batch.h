@@ -0,0 +1,514 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <streambuf>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <htslib/sam.h>
+
+#include "version.h"
+#include "util.h"
+#include "cache.h"
+#include "covcache.h"
+#include "input.h"
+#include "shard.h"
+#include "serve.h"
+
+namespace bamstats
+{
+
+  struct BatchConfig {
+    uint16_t nthreads;
+    uint32_t nshards;
+    uint32_t memory;  // MB shared by all running tasks
+    uint32_t taskMemory;  // MB of a task without an estimate in the manifest
+    uint32_t cacheSize;  // MB
+    boost::filesystem::path logdir;
+    boost::filesystem::path manifest;
+  };
+
+  // One manifest line, sharded jobs finish with a merge_shards task
+  struct BatchJob {
+    std::string sample;
+    std::string command;
+    std::vector<std::string> args;
+    uint32_t memory;
+    uint32_t nshards;
+    uint32_t pending;  // Shards still to finish
+    int32_t code;
+    boost::filesystem::path output;  // Base name of the partial outputs
+  };
+
+  // Shard 1..n of a job, 0 for an unsharded job or the merge of a sharded one
+  struct BatchTask {
+    uint32_t job;
+    uint32_t shard;
+
+    BatchTask(uint32_t const j, uint32_t const s) : job(j), shard(s) {}
+  };
+
+  inline void
+  _noCleanup(std::string*) {}
+
+  // Output of the calling thread goes to the buffer of its task, other threads write to the original stream
+  struct TaskStreamBuf : public std::streambuf {
+    std::streambuf* orig;
+    boost::thread_specific_ptr<std::string> target;
+    boost::mutex mtx;
+
+    explicit TaskStreamBuf(std::streambuf* o) : orig(o), target(_noCleanup) {}
+
+    virtual int
+    overflow(int ch) {
+      if (ch == traits_type::eof()) return traits_type::not_eof(ch);
+      char c = ch;
+      xsputn(&c, 1);
+      return ch;
+    }
+
+    virtual std::streamsize
+    xsputn(char const* s, std::streamsize n) {
+      std::string* t = target.get();
+      if (t != NULL) t->append(s, n);
+      else {
+	boost::mutex::scoped_lock lock(mtx);
+	orig->sputn(s, n);
+      }
+      return n;
+    }
+
+    virtual int
+    sync() {
+      if (target.get() != NULL) return 0;
+      boost::mutex::scoped_lock lock(mtx);
+      return orig->pubsync();
+    }
+  };
+
+  // Output file of the shardable commands, partial outputs are named after it
+  inline boost::filesystem::path
+  _shardOutput(std::string const& command, std::vector<std::string> const& args) {
+    std::string shortOpt = "-o";
+    std::string longOpt = (command == "count_jct") ? "--outintra" : "--outfile";
+    std::string path = "qc.tsv.gz";
+    if (command == "count_dna") path = "cov.gz";
+    else if (command == "count_rna") path = "gene.count";
+    else if (command == "count_jct") path = "intra.tsv";
+    for(uint32_t i = 0; i < args.size(); ++i) {
+      if (((args[i] == shortOpt) || (args[i] == longOpt)) && (i + 1 < args.size())) path = args[++i];
+      else if (args[i].compare(0, longOpt.size() + 1, longOpt + "=") == 0) path = args[i].substr(longOpt.size() + 1);
+      else if ((args[i].size() > 2) && (args[i].compare(0, 2, shortOpt) == 0)) path = args[i].substr(2);
+    }
+    return path;
+  }
+
+  // Positional input file of a shardable command, only qc has options without a value
+  inline std::string
+  _inputFile(std::string const& command, std::vector<std::string> const& args) {
+    std::string input;
+    for(uint32_t i = 0; i < args.size(); ++i) {
+      std::string const& a = args[i];
+      if ((a.size() < 2) || (a[0] != '-')) input = a;
+      else if ((a.find('=') != std::string::npos) || ((a.size() > 2) && (a[1] != '-'))) continue;
+      else {
+	bool flag = ((a == "-?") || (a == "--help"));
+	if (command == "qc") flag = ((flag) || (a == "-s") || (a == "--secondary") || (a == "-u") || (a == "--supplementary") || (a == "-i") || (a == "--ignore") || (a == "--unsorted"));
+	if (!flag) ++i;
+      }
+    }
+    return input;
+  }
+
+  // Commands that build a missing index get it here, before their shards run concurrently
+  inline bool
+  _hasIndex(std::string const& path, bool const build) {
+    BamInput bam;
+    bam.path = path;
+    bam.samfile = sam_open(path.c_str(), "r");
+    if (bam.samfile == NULL) return false;
+    if (build) return (bam.index(true) != NULL);
+    return (bam.existingIndex() != NULL);
+  }
+
+  // Empty if the shard parsers accept the job, otherwise why it runs unsharded
+  inline std::string
+  _unshardable(std::string const& command, std::vector<std::string> const& args) {
+    for(uint32_t i = 0; i < args.size(); ++i) {
+      if ((args[i] == "--shard") || (args[i].compare(0, 8, "--shard=") == 0)) return "it is a shard already";
+      if ((command == "qc") && (args[i] == "--unsorted")) return "the input is unsorted";
+      if ((command == "qc") && ((args[i] == "--checkpoint-dir") || (args[i].compare(0, 17, "--checkpoint-dir=") == 0))) return "it takes checkpoints";
+    }
+    std::string input = _inputFile(command, args);
+    if ((input.empty()) || (input == "-")) return "the input is streamed";
+    if ((command == "count_rna") && (input.size() > 3) && (input.substr(input.size() - 3) == "bed")) return "the input is a BED file";
+    if ((command == "count_dna") && (isCoverageCache(input))) return "the input is a coverage cache";
+    if (!_hasIndex(input, (command != "qc"))) return "the input has no index";
+    return "";
+  }
+
+  // Lines are sample, command, memory in MB ("-" for the default) and the arguments, all separated by tabs
+  // {sample} in an argument is replaced by the sample name
+  template<typename TConfig>
+  inline bool
+  parseManifest(TConfig const& c, std::vector<BatchJob>& jobs) {
+    std::ifstream in(c.manifest.string().c_str());
+    if (!in.good()) {
+      std::cerr << "Manifest is missing: " << c.manifest.string() << std::endl;
+      return false;
+    }
+    std::string line;
+    uint32_t lineno = 0;
+    while (std::getline(in, line)) {
+      ++lineno;
+      if ((!line.empty()) && (line[line.size() - 1] == '\r')) line.resize(line.size() - 1);
+      if ((line.empty()) || (line[0] == '#')) continue;
+      std::vector<std::string> fields;
+      boost::split(fields, line, boost::is_any_of("\t"));
+      if ((fields.size() < 3) || (fields[0].empty()) || (fields[1].empty())) {
+	std::cerr << "Manifest line " << lineno << " needs sample, command and memory columns!" << std::endl;
+	return false;
+      }
+      BatchJob job;
+      job.sample = fields[0];
+      job.command = fields[1];
+      job.memory = c.taskMemory;
+      if ((fields[2] != "-") && (!fields[2].empty())) {
+	try {
+	  job.memory = boost::lexical_cast<uint32_t>(fields[2]);
+	} catch (boost::bad_lexical_cast&) {
+	  std::cerr << "Manifest line " << lineno << " has an invalid memory estimate: " << fields[2] << std::endl;
+	  return false;
+	}
+      }
+      for(uint32_t i = 3; i < fields.size(); ++i) {
+	boost::replace_all(fields[i], "{sample}", job.sample);
+	job.args.push_back(fields[i]);
+      }
+      job.nshards = 0;
+      bool shardable = ((job.command == "qc") || (job.command == "count_dna") || (job.command == "count_rna") || (job.command == "count_jct"));
+      if ((shardable) && (c.nshards > 1)) {
+	std::string why = _unshardable(job.command, job.args);
+	if (why.empty()) job.nshards = c.nshards;
+	else std::cerr << "Job " << job.sample << ' ' << job.command << " runs unsharded, " << why << std::endl;
+      }
+      job.pending = job.nshards;
+      job.code = 0;
+      if (job.nshards) job.output = _shardOutput(job.command, job.args);
+      jobs.push_back(job);
+    }
+    return true;
+  }
+
+  // Every worker takes the newest task of its own queue and steals the oldest task of another queue when it runs dry
+  // A task only starts if its memory estimate fits into the budget, unless nothing else is running
+  struct BatchScheduler {
+    boost::mutex mtx;
+    boost::condition_variable cond;
+    std::vector<std::deque<BatchTask> > queues;
+    std::vector<BatchJob>& jobs;
+    uint64_t budget;
+    uint64_t inuse;
+    uint32_t running;
+    uint32_t remaining;  // Tasks not finished, including merges that are not queued yet
+
+    BatchScheduler(std::vector<BatchJob>& j, uint32_t const nworkers, uint64_t const b) : queues(nworkers), jobs(j), budget(b), inuse(0), running(0), remaining(0) {
+      uint32_t w = 0;
+      for(uint32_t i = 0; i < jobs.size(); ++i) {
+	if (jobs[i].nshards) {
+	  for(uint32_t s = 1; s <= jobs[i].nshards; ++s, ++w) queues[w % nworkers].push_back(BatchTask(i, s));
+	  remaining += jobs[i].nshards + 1;
+	} else {
+	  queues[(w++) % nworkers].push_back(BatchTask(i, 0));
+	  ++remaining;
+	}
+      }
+    }
+
+    inline bool
+    _fits(BatchTask const& t) const {
+      return ((running == 0) || (inuse + jobs[t.job].memory <= budget));
+    }
+
+    // False once all tasks are done
+    inline bool
+    next(uint32_t const worker, BatchTask& task) {
+      boost::mutex::scoped_lock lock(mtx);
+      while (remaining) {
+	std::deque<BatchTask>& own = queues[worker];
+	for(std::deque<BatchTask>::reverse_iterator it = own.rbegin(); it != own.rend(); ++it) {
+	  if (_fits(*it)) {
+	    task = *it;
+	    own.erase((++it).base());
+	    return _start(task);
+	  }
+	}
+	for(uint32_t k = 1; k < queues.size(); ++k) {
+	  std::deque<BatchTask>& victim = queues[(worker + k) % queues.size()];
+	  for(std::deque<BatchTask>::iterator it = victim.begin(); it != victim.end(); ++it) {
+	    if (_fits(*it)) {
+	      task = *it;
+	      victim.erase(it);
+	      return _start(task);
+	    }
+	  }
+	}
+	cond.wait(lock);
+      }
+      return false;
+    }
+
+    inline bool
+    _start(BatchTask const& task) {
+      inuse += jobs[task.job].memory;
+      ++running;
+      return true;
+    }
+
+    // The last shard of a job queues its merge with the worker that ran it
+    inline void
+    done(uint32_t const worker, BatchTask const& task, int32_t const code) {
+      boost::mutex::scoped_lock lock(mtx);
+      BatchJob& job = jobs[task.job];
+      inuse -= job.memory;
+      --running;
+      --remaining;
+      if (code) job.code = code;
+      if ((job.nshards) && (task.shard)) {
+	if (--job.pending == 0) {
+	  if (job.code) --remaining;
+	  else queues[worker].push_back(BatchTask(task.job, 0));
+	}
+      }
+      cond.notify_all();
+    }
+  };
+
+  struct BatchWorker {
+    uint32_t id;
+    BatchScheduler& scheduler;
+    TCommandFn dispatch;
+    TaskStreamBuf& outbuf;
+    TaskStreamBuf& errbuf;
+    boost::filesystem::path logdir;
+    boost::mutex& logMtx;
+
+    BatchWorker(uint32_t const i, BatchScheduler& s, TCommandFn d, TaskStreamBuf& ob, TaskStreamBuf& eb, boost::filesystem::path const& l, boost::mutex& m) : id(i), scheduler(s), dispatch(d), outbuf(ob), errbuf(eb), logdir(l), logMtx(m) {}
+
+    void operator()() {
+      BatchTask task(0, 0);
+      while (scheduler.next(id, task)) {
+	BatchJob const& job = scheduler.jobs[task.job];
+
+	// Command line of the task, the merge of a sharded job reads its partial outputs
+	std::vector<std::string> args;
+	std::vector<boost::filesystem::path> parts;
+	if ((job.nshards) && (!task.shard)) {
+	  args.push_back("merge_shards");
+	  for(uint32_t s = 1; s <= job.nshards; ++s) {
+	    Shard sh;
+	    sh.index = s;
+	    sh.count = job.nshards;
+	    parts.push_back(sh.partial(job.output));
+	    args.push_back(parts.back().string());
+	  }
+	} else {
+	  args.push_back(job.command);
+	  args.insert(args.end(), job.args.begin(), job.args.end());
+	  if (task.shard) {
+	    args.push_back("--shard");
+	    args.push_back(boost::lexical_cast<std::string>(task.shard) + "/" + boost::lexical_cast<std::string>(job.nshards));
+	  }
+	}
+	std::vector<char*> argv(args.size() + 1, (char*) NULL);
+	for(uint32_t i = 0; i < args.size(); ++i) argv[i] = &args[i][0];
+
+	// Standard output and error of the task
+	std::string out;
+	std::string err;
+	outbuf.target.reset(&out);
+	errbuf.target.reset(&err);
+	int32_t code = 1;
+	try {
+	  code = dispatch(args.size(), &argv[0]);
+	} catch (std::exception const& e) {
+	  err += std::string("Task failed: ") + e.what() + '\n';
+	}
+	outbuf.target.reset();
+	errbuf.target.reset();
+	if (code == 0) {
+	  for(uint32_t i = 0; i < parts.size(); ++i) boost::filesystem::remove(parts[i]);
+	}
+
+	// Tasks of a job append to its log files in the order they finish
+	{
+	  boost::mutex::scoped_lock lock(logMtx);
+	  std::string base = (logdir / (job.sample + "." + job.command)).string();
+	  if (!out.empty()) {
+	    std::ofstream outfile((base + ".out").c_str(), std::ios_base::app);
+	    outfile << out;
+	  }
+	  if (!err.empty()) {
+	    std::ofstream errfile((base + ".err").c_str(), std::ios_base::app);
+	    errfile << err;
+	  }
+	  boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+	  std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << job.sample << ' ' << args[0];
+	  if (task.shard) std::cout << ' ' << task.shard << '/' << job.nshards;
+	  std::cout << " exit " << code << std::endl;
+	}
+	scheduler.done(id, task, code);
+      }
+    }
+  };
+
+  template<typename TConfig>
+  inline int32_t
+  batchRun(TConfig const& c, TCommandFn dispatch) {
+    std::vector<BatchJob> jobs;
+    if (!parseManifest(c, jobs)) return 1;
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(c.logdir, ec);
+    if (!boost::filesystem::is_directory(c.logdir)) {
+      std::cerr << "Log directory cannot be created: " << c.logdir.string() << std::endl;
+      return 1;
+    }
+    for(uint32_t i = 0; i < jobs.size(); ++i) {
+      std::string base = (c.logdir / (jobs[i].sample + "." + jobs[i].command)).string();
+      boost::filesystem::remove(base + ".out");
+      boost::filesystem::remove(base + ".err");
+    }
+
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Running " << jobs.size() << " jobs" << std::endl;
+
+    // Tasks share parsed references and annotations
+    ResourceCache cache((uint64_t) c.cacheSize * 1024 * 1024);
+    sharedCache() = &cache;
+    TaskStreamBuf outbuf(std::cout.rdbuf());
+    TaskStreamBuf errbuf(std::cerr.rdbuf());
+    std::cout.rdbuf(&outbuf);
+    std::cerr.rdbuf(&errbuf);
+
+    uint16_t nthreads = std::max((uint16_t) 1, c.nthreads);
+    BatchScheduler scheduler(jobs, nthreads, (uint64_t) c.memory);
+    boost::mutex logMtx;
+    boost::thread_group workers;
+    for(uint16_t t = 0; t < nthreads; ++t) workers.create_thread(BatchWorker(t, scheduler, dispatch, outbuf, errbuf, c.logdir, logMtx));
+    workers.join_all();
+
+    std::cout.rdbuf(outbuf.orig);
+    std::cerr.rdbuf(errbuf.orig);
+    sharedCache() = NULL;
+
+    // Summary
+    uint32_t failed = 0;
+    for(uint32_t i = 0; i < jobs.size(); ++i) {
+      if (jobs[i].code) {
+	++failed;
+	std::cerr << "Job " << jobs[i].sample << ' ' << jobs[i].command << " failed, see " << (c.logdir / (jobs[i].sample + "." + jobs[i].command + ".err")).string() << std::endl;
+      }
+    }
+    now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << (jobs.size() - failed) << " of " << jobs.size() << " jobs succeeded" << std::endl;
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+    return (failed) ? 1 : 0;
+  }
+
+
+  int batch(int argc, char **argv, TCommandFn dispatch) {
+    BatchConfig c;
+
+    // Parameter
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ("threads,t", boost::program_options::value<uint16_t>(&c.nthreads)->default_value(4), "number of concurrent tasks")
+      ("shards,s", boost::program_options::value<uint32_t>(&c.nshards), "chromosome shards of qc, count_dna, count_rna and count_jct jobs [default: threads]")
+      ("memory,m", boost::program_options::value<uint32_t>(&c.memory)->default_value(16384), "memory budget of running tasks in MB")
+      ("task-memory,e", boost::program_options::value<uint32_t>(&c.taskMemory)->default_value(2048), "memory of a task without estimate in the manifest in MB")
+      ("cache,c", boost::program_options::value<uint32_t>(&c.cacheSize)->default_value(4096), "memory for shared references and annotations in MB")
+      ("logdir,l", boost::program_options::value<boost::filesystem::path>(&c.logdir)->default_value("batch_logs"), "directory for the standard output and error of each job")
+      ;
+
+    boost::program_options::options_description hidden("Hidden options");
+    hidden.add_options()
+      ("input-file", boost::program_options::value<boost::filesystem::path>(&c.manifest), "manifest")
+      ;
+
+    boost::program_options::positional_options_description pos_args;
+    pos_args.add("input-file", -1);
+
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic).add(hidden);
+    boost::program_options::options_description visible_options;
+    visible_options.add(generic);
+
+    // Parse command-line
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmdline_options).positional(pos_args).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if ((vm.count("help")) || (!vm.count("input-file"))) {
+      std::cout << std::endl;
+      std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] <manifest.tsv>" << std::endl;
+      std::cout << visible_options << "\n";
+      std::cout << "Manifest lines: sample<TAB>command<TAB>memory MB or -<TAB>argument<TAB>argument..." << std::endl;
+      std::cout << std::endl;
+      return 1;
+    }
+    if (!vm.count("shards")) c.nshards = c.nthreads;
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "alfred ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    return batchRun(c, dispatch);
+  }
+
+}
+
+#endif
@@ -0,0 +1,199 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <htslib/faidx.h>
+
+
+namespace bamstats
+{
+
+  // Parsed inputs that outlive a single command, only alfred serve creates a cache
+  // Entries are immutable once stored, eviction drops the cache's reference and running jobs keep theirs
+  struct ResourceCache {
+    typedef boost::shared_ptr<void const> TResource;
+    typedef std::list<std::string> TLru;
+
+    struct Entry {
+      TResource res;
+      uint64_t bytes;
+      TLru::iterator pos;
+    };
+    typedef std::map<std::string, Entry> TEntries;
+
+    boost::mutex mtx;
+    uint64_t maxBytes;
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    TEntries entries;
+    TLru lru;
+
+    explicit ResourceCache(uint64_t const mb) : maxBytes(mb), bytes(0), hits(0), misses(0) {}
+
+    inline TResource
+    find(std::string const& key) {
+      boost::mutex::scoped_lock lock(mtx);
+      TEntries::iterator it = entries.find(key);
+      if (it == entries.end()) {
+	++misses;
+	return TResource();
+      }
+      ++hits;
+      lru.splice(lru.begin(), lru, it->second.pos);
+      return it->second.res;
+    }
+
+    // Least recently used entries are evicted until the cache fits, a single oversized entry is not kept
+    inline void
+    insert(std::string const& key, TResource const& res, uint64_t const nbytes) {
+      boost::mutex::scoped_lock lock(mtx);
+      if (nbytes > maxBytes) return;
+      TEntries::iterator it = entries.find(key);
+      if (it != entries.end()) _erase(it);
+      lru.push_front(key);
+      Entry& e = entries[key];
+      e.res = res;
+      e.bytes = nbytes;
+      e.pos = lru.begin();
+      bytes += nbytes;
+      while (bytes > maxBytes) _erase(entries.find(lru.back()));
+    }
+
+    inline void
+    _erase(TEntries::iterator it) {
+      bytes -= it->second.bytes;
+      lru.erase(it->second.pos);
+      entries.erase(it);
+    }
+
+  private:
+    ResourceCache(ResourceCache const&);
+    ResourceCache& operator=(ResourceCache const&);
+  };
+
+  // Cache of the running alfred serve, NULL for stand-alone commands
+  inline ResourceCache*&
+  sharedCache() {
+    static ResourceCache* cache = NULL;
+    return cache;
+  }
+
+  // Path, size and modification time, a changed file gets a new key
+  inline std::string
+  fileKey(boost::filesystem::path const& p) {
+    std::string key = boost::filesystem::absolute(p).string();
+    if ((boost::filesystem::exists(p)) && (boost::filesystem::is_regular_file(p))) key += '\t' + boost::lexical_cast<std::string>(boost::filesystem::file_size(p)) + '\t' + boost::lexical_cast<std::string>(boost::filesystem::last_write_time(p));
+    return key;
+  }
+
+  // False without a cache, an empty key is never cached
+  template<typename T>
+  inline bool
+  cacheLookup(std::string const& key, boost::shared_ptr<T const>& value) {
+    if ((sharedCache() == NULL) || (key.empty())) return false;
+    ResourceCache::TResource res = sharedCache()->find(key);
+    if (!res) return false;
+    value = boost::static_pointer_cast<T const>(res);
+    return true;
+  }
+
+  template<typename T>
+  inline void
+  cacheStore(std::string const& key, boost::shared_ptr<T const> const& value, uint64_t const nbytes) {
+    if ((sharedCache() != NULL) && (!key.empty())) sharedCache()->insert(key, value, nbytes);
+  }
+
+  // Gene and BED annotations only depend on the file, the selected features and the chromosomes
+  // kind separates commands that parse the same file into different structures
+  template<typename TConfig>
+  inline std::string
+  annotationKey(std::string const& kind, TConfig const& c) {
+    if (sharedCache() == NULL) return "";
+    std::string key = kind + '\t' + boost::lexical_cast<std::string>((int32_t) c.inputFileFormat) + '\t';
+    key += fileKey((c.inputFileFormat == 1) ? c.bedFile : c.gtfFile) + '\t' + c.idname + '\t' + c.feature;
+    std::vector<std::string> chrNames(c.nchr.size());
+    for(typename TConfig::TChrMap::const_iterator itChr = c.nchr.begin(); itChr != c.nchr.end(); ++itChr) chrNames[itChr->second] = itChr->first;
+    for(uint32_t i = 0; i < chrNames.size(); ++i) key += '\t' + chrNames[i];
+    return key;
+  }
+
+  // Whole chromosome from the FASTA index, a cached copy is held by hold and must not be freed
+  inline char*
+  fetchChromosome(faidx_t* fai, boost::filesystem::path const& genome, std::string const& tname, boost::shared_ptr<std::string const>& hold) {
+    std::string key;
+    if (sharedCache() != NULL) key = "chr\t" + fileKey(genome) + '\t' + tname;
+    if (cacheLookup(key, hold)) return const_cast<char*>(hold->c_str());
+    int32_t seqlen = -1;
+    char* seq = faidx_fetch_seq(fai, tname.c_str(), 0, faidx_seq_len(fai, tname.c_str()) + 1, &seqlen);
+    if ((seq == NULL) || (key.empty())) return seq;
+    boost::shared_ptr<std::string const> cached(new std::string(seq, std::max(seqlen, 0)));
+    free(seq);
+    cacheStore(key, cached, cached->size());
+    hold = cached;
+    return const_cast<char*>(hold->c_str());
+  }
+
+  inline void
+  releaseChromosome(char*& seq, boost::shared_ptr<std::string const>& hold) {
+    if (hold) hold.reset();
+    else if (seq != NULL) free(seq);
+    seq = NULL;
+  }
+
+  // Chromosome of a scope, released on every exit path
+  struct ChromosomeSequence {
+    boost::shared_ptr<std::string const> hold;
+    char* seq;
+
+    ChromosomeSequence(faidx_t* fai, boost::filesystem::path const& genome, std::string const& tname) : seq(fetchChromosome(fai, genome, tname, hold)) {}
+
+    ~ChromosomeSequence() {
+      releaseChromosome(seq, hold);
+    }
+
+  private:
+    ChromosomeSequence(ChromosomeSequence const&);
+    ChromosomeSequence& operator=(ChromosomeSequence const&);
+  };
+
+}
+
+#endif
@@ -0,0 +1,406 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/dynamic_bitset.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/type_traits/is_arithmetic.hpp>
+#include <boost/utility/enable_if.hpp>
+
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+
+
+namespace bamstats
+{
+
+  // Checkpoint layout: magic, run key, then the state of the command in the order of its io() calls
+  // A checkpoint is written to <name>.tmp, synced and renamed, so a crash leaves either the old or the new state
+  static char const checkpointMagic[8] = {'A', 'L', 'F', 'C', 'K', 'P', 'T', '1'};
+
+  // The command line and the size and modification time of all input files identify a run
+  inline std::string
+  checkpointKey(int argc, char** argv, std::vector<boost::filesystem::path> const& inputs) {
+    std::string key;
+    for(int i = 0; i < argc; ++i) key += std::string(argv[i]) + '\n';
+    for(uint32_t i = 0; i < inputs.size(); ++i) {
+      if ((boost::filesystem::exists(inputs[i])) && (boost::filesystem::is_regular_file(inputs[i]))) {
+	key += inputs[i].string() + '\t' + boost::lexical_cast<std::string>(boost::filesystem::file_size(inputs[i])) + '\t' + boost::lexical_cast<std::string>(boost::filesystem::last_write_time(inputs[i])) + '\n';
+      }
+    }
+    return key;
+  }
+
+  // Plain numbers are stored as they are, structs provide their own checkpointIO overload next to their definition
+  template<typename TArchive, typename T>
+  inline typename boost::enable_if<boost::is_arithmetic<T> >::type
+  checkpointIO(TArchive& ar, T& v) {
+    ar.number(v);
+  }
+
+  struct CheckpointWriter {
+    FILE* f;
+    boost::filesystem::path path;
+    boost::filesystem::path tmp;
+
+    CheckpointWriter() : f(NULL) {}
+
+    ~CheckpointWriter() {
+      if (f != NULL) {
+	fclose(f);
+	boost::filesystem::remove(tmp);
+      }
+    }
+
+    bool
+    open(boost::filesystem::path const& p, std::string const& key) {
+      path = p;
+      tmp = boost::filesystem::path(p.string() + ".tmp");
+      f = fopen(tmp.string().c_str(), "wb");
+      if (f == NULL) {
+	std::cerr << "Fail to open checkpoint file " << tmp.string() << std::endl;
+	return false;
+      }
+      fwrite(checkpointMagic, 1, sizeof(checkpointMagic), f);
+      std::string k(key);
+      io(k);
+      return true;
+    }
+
+    void
+    raw(void* v, std::size_t const n) {
+      fwrite(v, 1, n, f);
+    }
+
+    template<typename T>
+    void
+    number(T& v) {
+      raw(&v, sizeof(T));
+    }
+
+    template<typename T>
+    void
+    io(T& v) {
+      checkpointIO(*this, v);
+    }
+
+    void
+    io(std::string& v) {
+      uint64_t n = v.size();
+      io(n);
+      if (n) fwrite(v.c_str(), 1, n, f);
+    }
+
+    template<typename T>
+    void
+    io(std::vector<T>& v) {
+      uint64_t n = v.size();
+      io(n);
+      for(uint64_t i = 0; i < n; ++i) io(v[i]);
+    }
+
+    template<typename TKey, typename TValue>
+    void
+    io(std::pair<TKey, TValue>& v) {
+      io(v.first);
+      io(v.second);
+    }
+
+    template<typename TKey, typename TValue>
+    void
+    io(std::map<TKey, TValue>& v) {
+      uint64_t n = v.size();
+      io(n);
+      for(typename std::map<TKey, TValue>::iterator it = v.begin(); it != v.end(); ++it) {
+	TKey k = it->first;
+	io(k);
+	io(it->second);
+      }
+    }
+
+    // Keys of hashed maps are written with their values, the reader only updates existing keys
+    template<typename TKey, typename TValue>
+    void
+    io(boost::unordered_map<TKey, TValue>& v) {
+      uint64_t n = v.size();
+      io(n);
+      for(typename boost::unordered_map<TKey, TValue>::iterator it = v.begin(); it != v.end(); ++it) {
+	TKey k = it->first;
+	io(k);
+	io(it->second);
+      }
+    }
+
+    void
+    io(boost::dynamic_bitset<>& v) {
+      uint64_t n = v.size();
+      io(n);
+      std::vector<boost::dynamic_bitset<>::block_type> blocks(v.num_blocks());
+      boost::to_block_range(v, blocks.begin());
+      for(uint64_t i = 0; i < blocks.size(); ++i) io(blocks[i]);
+    }
+
+    // Sync and move the checkpoint into place
+    bool
+    commit() {
+      bool ok = ((fflush(f) == 0) && (fsync(fileno(f)) == 0) && (!ferror(f)));
+      fclose(f);
+      f = NULL;
+      if ((!ok) || (std::rename(tmp.string().c_str(), path.string().c_str()) != 0)) {
+	std::cerr << "Fail to write checkpoint file " << path.string() << std::endl;
+	boost::filesystem::remove(tmp);
+	return false;
+      }
+      return true;
+    }
+
+  private:
+    CheckpointWriter(CheckpointWriter const&);
+    CheckpointWriter& operator=(CheckpointWriter const&);
+  };
+
+
+  // Reads a checkpoint back, with accumulate set numbers are added to the current state and bit sets are or-ed
+  struct CheckpointReader {
+    FILE* f;
+    bool ok;
+    bool accumulate;
+    std::string key;
+
+    CheckpointReader() : f(NULL), ok(false), accumulate(false) {}
+
+    ~CheckpointReader() {
+      if (f != NULL) fclose(f);
+    }
+
+    // Any run, the key is available afterwards
+    bool
+    open(boost::filesystem::path const& p) {
+      if (!boost::filesystem::exists(p)) return false;
+      f = fopen(p.string().c_str(), "rb");
+      if (f == NULL) return false;
+      char magic[8];
+      ok = (fread(magic, 1, sizeof(magic), f) == sizeof(magic)) && (!memcmp(magic, checkpointMagic, sizeof(magic)));
+      if (ok) io(key);
+      return ok;
+    }
+
+    // False if there is no checkpoint or it belongs to a different run
+    bool
+    open(boost::filesystem::path const& p, std::string const& k) {
+      if (!boost::filesystem::exists(p)) return false;
+      if ((!open(p)) || (key != k)) {
+	std::cerr << "Checkpoint " << p.string() << " belongs to a different run, starting from the beginning" << std::endl;
+	return false;
+      }
+      return true;
+    }
+
+    void
+    raw(void* v, std::size_t const n) {
+      if ((ok) && (fread(v, 1, n, f) != n)) ok = false;
+    }
+
+    template<typename T>
+    void
+    number(T& v) {
+      T x = T();
+      raw(&x, sizeof(T));
+      if (accumulate) v += x;
+      else v = x;
+    }
+
+    void
+    number(bool& v) {
+      bool x = false;
+      raw(&x, sizeof(bool));
+      v = (accumulate) ? (v || x) : x;
+    }
+
+    template<typename T>
+    void
+    io(T& v) {
+      checkpointIO(*this, v);
+    }
+
+    void
+    io(std::string& v) {
+      uint64_t n = 0;
+      io(n);
+      v.resize(n);
+      if ((ok) && (n) && (fread(&v[0], 1, n, f) != n)) ok = false;
+    }
+
+    template<typename T>
+    void
+    io(std::vector<T>& v) {
+      uint64_t n = 0;
+      io(n);
+      if (!ok) return;
+      if ((!accumulate) || (v.size() < n)) v.resize(n);
+      for(uint64_t i = 0; (ok) && (i < n); ++i) io(v[i]);
+    }
+
+    template<typename TKey, typename TValue>
+    void
+    io(std::pair<TKey, TValue>& v) {
+      io(v.first);
+      io(v.second);
+    }
+
+    template<typename TKey, typename TValue>
+    void
+    io(std::map<TKey, TValue>& v) {
+      uint64_t n = 0;
+      io(n);
+      if (!accumulate) v.clear();
+      for(uint64_t i = 0; (ok) && (i < n); ++i) {
+	TKey k = TKey();
+	io(k);
+	io(v[k]);
+      }
+    }
+
+    // Iteration order of hashed maps depends on the insertion history, so the keys have to exist already
+    template<typename TKey, typename TValue>
+    void
+    io(boost::unordered_map<TKey, TValue>& v) {
+      uint64_t n = 0;
+      io(n);
+      if (n != v.size()) ok = false;
+      for(uint64_t i = 0; (ok) && (i < n); ++i) {
+	TKey k = TKey();
+	io(k);
+	typename boost::unordered_map<TKey, TValue>::iterator it = v.find(k);
+	if (it == v.end()) ok = false;
+	else io(it->second);
+      }
+    }
+
+    void
+    io(boost::dynamic_bitset<>& v) {
+      uint64_t n = 0;
+      io(n);
+      if (!ok) return;
+      boost::dynamic_bitset<> b(n);
+      std::vector<boost::dynamic_bitset<>::block_type> blocks(b.num_blocks(), 0);
+      for(uint64_t i = 0; (ok) && (i < blocks.size()); ++i) io(blocks[i]);
+      if (!ok) return;
+      boost::from_block_range(blocks.begin(), blocks.end(), b);
+      if (!accumulate) v = b;
+      else if (n) {
+	// Sets such as the UMIs are only sized once they are used, so parts can differ in size
+	if (v.size() < n) v.resize(n);
+	if (b.size() < v.size()) b.resize(v.size());
+	v |= b;
+      }
+    }
+
+  private:
+    CheckpointReader(CheckpointReader const&);
+    CheckpointReader& operator=(CheckpointReader const&);
+  };
+
+
+  // Per-command checkpoint settings, disabled unless --checkpoint-dir is given
+  struct Checkpoint {
+    bool enabled;
+    uint32_t interval;
+    boost::filesystem::path dir;
+    std::string key;
+
+    Checkpoint() : enabled(false), interval(0) {}
+
+    bool
+    init(boost::filesystem::path const& d, std::string const& k) {
+      dir = d;
+      key = k;
+      enabled = true;
+      boost::system::error_code ec;
+      boost::filesystem::create_directories(dir, ec);
+      if (!boost::filesystem::is_directory(dir)) {
+	std::cerr << "Checkpoint directory cannot be created: " << dir.string() << std::endl;
+	return false;
+      }
+      return true;
+    }
+
+    inline boost::filesystem::path
+    file(std::string const& name) const {
+      return dir / name;
+    }
+
+    // A finished run leaves no state behind
+    inline void
+    clear(std::string const& name) const {
+      if (enabled) boost::filesystem::remove(file(name));
+    }
+  };
+
+
+  // Pushes all records written so far to the operating system, the BAM file then ends at a block boundary
+  inline bool
+  flushBam(samFile* fp) {
+    return ((bgzf_flush(fp->fp.bgzf) == 0) && (hflush(fp->fp.bgzf->fp) == 0));
+  }
+
+  // Cuts an output file back to its size at the last checkpoint, false if it is shorter than that
+  inline bool
+  truncateOutput(boost::filesystem::path const& p, uint64_t const size) {
+    if ((!boost::filesystem::exists(p)) || (boost::filesystem::file_size(p) < size)) return false;
+    boost::filesystem::resize_file(p, size);
+    return true;
+  }
+
+  // Positions a sequential BAM reader at the first chromosome after doneIndex, using the index if one exists
+  // Records of earlier chromosomes still have to be skipped by the caller, the seek is only a shortcut
+  inline void
+  seekAfter(samFile* samfile, hts_idx_t* idx, bam_hdr_t* hdr, int32_t const doneIndex) {
+    if ((idx == NULL) || (doneIndex < 0) || (hts_get_format(samfile)->format != bam)) return;
+    for(int32_t refIndex = doneIndex + 1; refIndex < hdr->n_targets; ++refIndex) {
+      hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
+      if (iter == NULL) continue;
+      bool found = (iter->n_off > 0);
+      if (found) bgzf_seek(samfile->fp.bgzf, iter->off[0].u, SEEK_SET);
+      hts_itr_destroy(iter);
+      if (found) return;
+    }
+  }
+
+}
+
+#endif
@@ -37,6 +37,10 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #include "version.h"
 #include "util.h"
+#include "pipeline.h"
+#include "input.h"
+#include "covcache.h"
+#include "shard.h"
 
 
 namespace bamstats
@@ -48,8 +52,10 @@ namespace bamstats
     uint32_t window_num;
     uint16_t minQual;
     bool hasIntervalFile;
+    bool hasCoverageCache;
     std::string sampleName;
     std::vector<bool> validChr;
+    Shard shard;
     boost::filesystem::path bamFile;
     boost::filesystem::path outfile;
     boost::filesystem::path int_file;
@@ -165,29 +171,184 @@ namespace bamstats
   }
 
   
+  template<typename TConfig>
+  struct DnaCountAnalysis {
+    typedef uint16_t TCount;
+    typedef std::vector<TCount> TCoverage;
+    typedef boost::unordered_map<std::size_t, bool> TMateMap;
+
+    TConfig const& c;
+    bam_hdr_t* hdr;
+    bool cram;
+    bool mapped;
+    int32_t refIndex;
+    int32_t nextIndex;  // First chromosome not yet reported
+    int32_t lastAlignedPos;
+    std::set<std::size_t> lastAlignedPosReads;
+    TMateMap mateMap;
+    TCoverage cov;
+    CoverageWriter* cache;  // Mid-point counts go to a coverage cache instead of windows
+    CheckpointWriter* part;  // Window counts go to the partial output of a shard
+    boost::iostreams::filtering_ostream dataOut;
+
+    DnaCountAnalysis(TConfig const& conf, bam_hdr_t* h, CoverageWriter* w = NULL, CheckpointWriter* p = NULL) : c(conf), hdr(h), cram(false), mapped(false), refIndex(-1), nextIndex(0), lastAlignedPos(0), cache(w), part(p) {
+      // CRAM input reports all windows, BAM input skips chromosomes without mapped reads
+      std::string suffix("cram");
+      std::string str(c.bamFile.string());
+      if ((str.size() >= suffix.size()) && (str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0)) cram = true;
+      if ((cache != NULL) || (part != NULL)) return;
+
+      // Open output file
+      dataOut.push(boost::iostreams::gzip_compressor());
+      dataOut.push(boost::iostreams::file_sink(c.outfile.string().c_str(), std::ios_base::out | std::ios_base::binary));
+      dataOut << "chr\tstart\tend\tid\t" << c.sampleName << std::endl;
+    }
+
+    static int32_t
+    requiredFields() {
+      return samCoreFields;
+    }
+
+    bool
+    _intervals(int32_t tid, std::vector<ItvChr>& itv) const {
+      if (!createIntervals(c, std::string(hdr->target_name[tid]), hdr->target_len[tid], itv)) {
+	std::cerr << "Interval parsing failed!" << std::endl;
+	return false;
+      }
+      std::sort(itv.begin(), itv.end(), SortIntervalStart<ItvChr>());
+      return true;
+    }
+
+    void
+    _writeWindows(int32_t tid, std::vector<ItvChr> const& itv, std::vector<uint64_t> const& covsum) {
+      for(uint32_t i = 0; i < itv.size(); ++i) {
+	dataOut << std::string(hdr->target_name[tid]) << "\t" << itv[i].start << "\t" << itv[i].end << "\t" << itv[i].id << "\t" << covsum[i] << std::endl;
+      }
+    }
+
+    bool
+    _countWindows(int32_t tid) {
+      // Assign read counts
+      std::vector<ItvChr> itv;
+      if (!_intervals(tid, itv)) return false;
+      std::vector<uint64_t> covsum(itv.size(), 0);
+      for(uint32_t i = 0; i < itv.size(); ++i)
+	for(int32_t k = itv[i].start; k < itv[i].end; ++k) covsum[i] += cov[k];
+      if (part != NULL) {
+	part->io(tid);
+	part->io(covsum);
+      } else _writeWindows(tid, itv, covsum);
+      return true;
+    }
+
+    // Report the current chromosome and any chromosome before upto without alignments
+    bool
+    _flush(int32_t upto) {
+      if (refIndex >= 0) {
+	if ((cache != NULL) && (c.validChr[refIndex])) {
+	  if (!cache->write(refIndex, ((mapped) || (cram)), cov)) return false;
+	} else if ((c.validChr[refIndex]) && ((mapped) || (cram))) {
+	  if (!_countWindows(refIndex)) return false;
+	}
+	nextIndex = refIndex + 1;
+      }
+      for(; nextIndex < upto; ++nextIndex) {
+	if ((cache != NULL) && (cram)) {
+	  if (!cache->write(nextIndex, true, TCoverage())) return false;
+	} else if ((cram) && (c.validChr[nextIndex])) {
+	  cov.assign(hdr->target_len[nextIndex], 0);
+	  if (!_countWindows(nextIndex)) return false;
+	}
+      }
+      cov.clear();
+      mateMap.clear();
+      lastAlignedPosReads.clear();
+      lastAlignedPos = 0;
+      mapped = false;
+      return true;
+    }
+
+    // Records need to arrive in coordinate order
+    bool
+    process(bam1_t* rec) {
+      if (rec->core.tid != refIndex) {
+	if (!_flush((rec->core.tid < 0) ? hdr->n_targets : rec->core.tid)) return false;
+	refIndex = rec->core.tid;
+	if ((refIndex >= 0) && (c.validChr[refIndex])) cov.resize(hdr->target_len[refIndex], 0);
+      }
+      if ((refIndex < 0) || (!c.validChr[refIndex])) return true;
+      if (!(rec->core.flag & BAM_FUNMAP)) mapped = true;
+
+      uint32_t maxCoverage = std::numeric_limits<TCount>::max();
+      if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) return true;
+      if ((rec->core.flag & BAM_FPAIRED) && ((rec->core.flag & BAM_FMUNMAP) || (rec->core.tid != rec->core.mtid))) return true;
+      if (rec->core.qual < c.minQual) return true;
+
+      if (rec->core.flag & BAM_FPAIRED) {
+	// Clean-up the read store for identical alignment positions
+	if (rec->core.pos > lastAlignedPos) {
+	  lastAlignedPosReads.clear();
+	  lastAlignedPos = rec->core.pos;
+	}
+	
+	if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
+	  // First read
+	  lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
+	  std::size_t hv = hash_pair(rec);
+	  mateMap[hv] = true;
+	} else {
+	  // Second read
+	  std::size_t hv = hash_pair_mate(rec);
+	  if ((mateMap.find(hv) == mateMap.end()) || (!mateMap[hv])) return true; // Mate discarded
+	  mateMap[hv] = false;
+
+	  // Count mid point
+	  int32_t midPoint = rec->core.pos + halfAlignmentLength(rec);
+	  if ((midPoint < (int32_t) hdr->target_len[refIndex]) && (cov[midPoint] < maxCoverage - 1)) ++cov[midPoint];
+	}
+      } else {
+	// Count mid point
+	int32_t midPoint = rec->core.pos + halfAlignmentLength(rec);
+	if ((midPoint < (int32_t) hdr->target_len[refIndex]) && (cov[midPoint] < maxCoverage - 1)) ++cov[midPoint];
+      }
+      return true;
+    }
+
+    bool
+    finish() {
+      if (!_flush(hdr->n_targets)) return false;
+      refIndex = -1;
+      if (part != NULL) {
+	int32_t eof = -1;
+	part->io(eof);
+      } else if (cache == NULL) dataOut.pop();
+      return true;
+    }
+  };
+
+  
   template<typename TConfig>
   inline int32_t
-  bam_dna_counter(TConfig const& c) {
+  bam_dna_counter(TConfig const& c, InputContext& in) {
     
     // Load bam file
-    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-    hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
+    BamInput* bam = in.bam(c.bamFile, false);
+    if (bam == NULL) return 1;
+    hts_idx_t* idx = bam->index(true);
+    if (idx == NULL) return 1;
+    samFile* samfile = bam->samfile;
+    bam_hdr_t* hdr = bam->hdr;
+    requireFields(samfile, DnaCountAnalysis<TConfig>::requiredFields());
 
     // Parse BAM file
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
     boost::progress_display show_progress( hdr->n_targets );
 
-    // Mate map
-    typedef boost::unordered_map<std::size_t, bool> TMateMap;
-    TMateMap mateMap;
-
-    // Open output file
-    boost::iostreams::filtering_ostream dataOut;
-    dataOut.push(boost::iostreams::gzip_compressor());
-    dataOut.push(boost::iostreams::file_sink(c.outfile.string().c_str(), std::ios_base::out | std::ios_base::binary));
-    dataOut << "chr\tstart\tend\tid\t" << c.sampleName << std::endl;
+    // Midpoint counter, a shard stores the window counts in its partial output
+    CheckpointWriter part;
+    if ((c.shard.index) && (!c.shard.open(part, c.outfile))) return 1;
+    DnaCountAnalysis<TConfig> da(c, hdr, NULL, (c.shard.index) ? &part : NULL);
     
     // Iterate chromosomes
     for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
@@ -197,98 +358,98 @@ namespace bamstats
       if (!c.validChr[refIndex]) continue;
 
       // Check we have mapped reads on this chromosome
-      bool nodata = true;
-      std::string suffix("cram");
-      std::string str(c.bamFile.string());
-      if ((str.size() >= suffix.size()) && (str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0)) nodata = false;
-      uint64_t mapped = 0;
-      uint64_t unmapped = 0;
-      hts_idx_get_stat(idx, refIndex, &mapped, &unmapped);
-      if (mapped) nodata = false;
-      if (nodata) continue;
-
-      // Coverage track
-      typedef uint16_t TCount;
-      uint32_t maxCoverage = std::numeric_limits<TCount>::max();
-      typedef std::vector<TCount> TCoverage;
-      TCoverage cov(hdr->target_len[refIndex], 0);
-      
+      if (!da.cram) {
+	uint64_t mapped = 0;
+	uint64_t unmapped = 0;
+	hts_idx_get_stat(idx, refIndex, &mapped, &unmapped);
+	if (!mapped) continue;
+      }
+
       // Count reads
-      hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-      bam1_t* rec = bam_init1();
-      int32_t lastAlignedPos = 0;
-      std::set<std::size_t> lastAlignedPosReads;
-      while (sam_itr_next(samfile, iter, rec) >= 0) {
-	if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
-	if ((rec->core.flag & BAM_FPAIRED) && ((rec->core.flag & BAM_FMUNMAP) || (rec->core.tid != rec->core.mtid))) continue;
-	if (rec->core.qual < c.minQual) continue;
-
-	if (rec->core.flag & BAM_FPAIRED) {
-	  // Clean-up the read store for identical alignment positions
-	  if (rec->core.pos > lastAlignedPos) {
-	    lastAlignedPosReads.clear();
-	    lastAlignedPos = rec->core.pos;
-	  }
-	
-	  if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
-	    // First read
-	    lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
-	    std::size_t hv = hash_pair(rec);
-	    mateMap[hv] = true;
-	  } else {
-	    // Second read
-	    std::size_t hv = hash_pair_mate(rec);
-	    if ((mateMap.find(hv) == mateMap.end()) || (!mateMap[hv])) continue; // Mate discarded
-	    mateMap[hv] = false;
-
-	    // Count mid point
-	    int32_t midPoint = rec->core.pos + halfAlignmentLength(rec);
-	    if ((midPoint < (int32_t) hdr->target_len[refIndex]) && (cov[midPoint] < maxCoverage - 1)) ++cov[midPoint];
-	  }
-	} else {
-	  // Count mid point
-	  int32_t midPoint = rec->core.pos + halfAlignmentLength(rec);
-	  if ((midPoint < (int32_t) hdr->target_len[refIndex]) && (cov[midPoint] < maxCoverage - 1)) ++cov[midPoint];
-	}
+      BamRecordStream stream(samfile, hdr, sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]));
+      bam1_t* rec = NULL;
+      while ((rec = stream.next()) != NULL) {
+	if (!da.process(rec)) return 1;
       }
-      // Clean-up
-      bam_destroy1(rec);
-      hts_itr_destroy(iter);
-      mateMap.clear();
+    }
+    if (!da.finish()) return 1;
+    if ((c.shard.index) && (!part.commit())) return 1;
+    
+    return 0;
+  }
 
-      // Assign read counts
-      std::vector<ItvChr> itv;
-      if (!createIntervals(c, std::string(hdr->target_name[refIndex]), hdr->target_len[refIndex], itv)) {
-	std::cerr << "Interval parsing failed!" << std::endl;
-	return 1;
+
+  // Window counts from the partial outputs of a sharded run
+  template<typename TConfig>
+  inline int32_t
+  shard_dna_counter(TConfig const& c, InputContext& in) {
+    bam_hdr_t* hdr = in.bam(c.bamFile, false)->hdr;
+    DnaCountAnalysis<TConfig> da(c, hdr);
+    for(uint32_t k = 0; k < c.shard.parts.size(); ++k) {
+      CheckpointReader part;
+      if (!c.shard.open(part, k)) return 1;
+      part.accumulate = false;
+      int32_t tid = -1;
+      std::vector<uint64_t> covsum;
+      for(part.io(tid); (part.ok) && (tid >= 0) && (tid < hdr->n_targets); part.io(tid)) {
+	std::vector<ItvChr> itv;
+	if (!da._intervals(tid, itv)) return 1;
+	part.io(covsum);
+	if (covsum.size() != itv.size()) part.ok = false;
+	if (!part.ok) break;
+	da._writeWindows(tid, itv, covsum);
       }
-      std::sort(itv.begin(), itv.end(), SortIntervalStart<ItvChr>());
-      for(uint32_t i = 0; i < itv.size(); ++i) {
-	uint64_t covsum = 0;
-	for(int32_t k = itv[i].start; k < itv[i].end; ++k) covsum += cov[k];
-	dataOut << std::string(hdr->target_name[refIndex]) << "\t" << itv[i].start << "\t" << itv[i].end << "\t" << itv[i].id << "\t" << covsum << std::endl;
+      if ((!part.ok) || (tid != -1)) {
+	std::cerr << "Partial output " << c.shard.parts[k].string() << " is truncated or does not match the windows!" << std::endl;
+	return 1;
       }
     }
-	  
-    // clean-up
-    bam_hdr_destroy(hdr);
-    hts_idx_destroy(idx);
-    sam_close(samfile);
-    dataOut.pop();
-    
+
+    // Partial outputs hold every reported chromosome, including the empty ones of CRAM input
+    da.nextIndex = hdr->n_targets;
+    if (!da.finish()) return 1;
+    return 0;
+  }
+
+
+  // Window counts from the mid-point counts of a coverage cache
+  template<typename TConfig>
+  inline int32_t
+  cache_dna_counter(TConfig const& c) {
+    CoverageReader cache;
+    if (!cache.open(c.bamFile, "dna", c.minQual)) return 1;
+    bam_hdr_t* hdr = cache.hdr;
+
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Coverage cache parsing" << std::endl;
+    boost::progress_display show_progress( hdr->n_targets );
+    DnaCountAnalysis<TConfig> da(c, hdr);
+    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
+      ++show_progress;
+      if (!c.validChr[refIndex]) continue;
+      bool mapped = false;
+      if (!cache.read(refIndex, mapped, da.cov)) return 1;
+      if ((mapped) && (!da._countWindows(refIndex))) return 1;
+    }
+    da.cov.clear();
+    da.nextIndex = hdr->n_targets;
+    if (!da.finish()) return 1;
     return 0;
   }
 
   
   template<typename TConfig>
   inline int32_t
-  countDNARun(TConfig const& c) {
+  countDNARun(TConfig const& c, InputContext& in) {
 
 #ifdef PROFILE
     ProfilerStart("alfred.prof");
 #endif
 
-    int32_t retparse = bam_dna_counter(c);
+    int32_t retparse = 1;
+    if (c.shard.merging()) retparse = shard_dna_counter(c, in);
+    else if (c.hasCoverageCache) retparse = cache_dna_counter(c);
+    else retparse = bam_dna_counter(c, in);
     if (retparse != 0) {
       std::cerr << "Error in read counting!" << std::endl;
       return 1;
@@ -305,8 +466,8 @@ namespace bamstats
   }
 
 
-  int count_dna(int argc, char **argv) {
-    CountDNAConfig c;
+  int parseCountDNA(int argc, char **argv, CountDNAConfig& c, InputContext& in) {
+    std::string shard;
 
     // Parameter
     boost::program_options::options_description generic("Generic options");
@@ -314,6 +475,7 @@ namespace bamstats
       ("help,?", "show help message")
       ("map-qual,m", boost::program_options::value<uint16_t>(&c.minQual)->default_value(10), "min. mapping quality")
       ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("cov.gz"), "coverage output file")
+      ("shard", boost::program_options::value<std::string>(&shard), "only process shard i/n of the genome, merge with merge_shards (optional)")
       ;
 
     boost::program_options::options_description window("Window options");
@@ -351,32 +513,18 @@ namespace bamstats
       return 1;
     }
 
-    // Check bam file
-    if (!(boost::filesystem::exists(c.bamFile) && boost::filesystem::is_regular_file(c.bamFile) && boost::filesystem::file_size(c.bamFile))) {
-      std::cerr << "Alignment file is missing: " << c.bamFile.string() << std::endl;
-      return 1;
-    } else {
-      samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-      if (samfile == NULL) {
-	std::cerr << "Fail to open file " << c.bamFile.string() << std::endl;
-	return 1;
-      }
-      hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-      if (idx == NULL) {
-	if (bam_index_build(c.bamFile.string().c_str(), 0) != 0) {
-	  std::cerr << "Fail to open index for " << c.bamFile.string() << std::endl;
-	  return 1;
-	}
-      }
-      bam_hdr_t* hdr = sam_hdr_read(samfile);
-      if (hdr == NULL) {
-	std::cerr << "Fail to open header for " << c.bamFile.string() << std::endl;
-	return 1;
-      }
+    // Check bam file or coverage cache, the index is only loaded once counting starts
+    CoverageReader cache;
+    c.hasCoverageCache = isCoverageCache(c.bamFile);
+    if ((c.hasCoverageCache) && (!cache.open(c.bamFile, "dna", c.minQual))) return 1;
+    else if ((!c.hasCoverageCache) && (in.bam(c.bamFile, false) == NULL)) return 1;
+    else {
+      bam_hdr_t* hdr = (c.hasCoverageCache) ? cache.hdr : in.bam(c.bamFile, false)->hdr;
 
       // Get sample name
       std::string sampleName;
-      if (!getSMTag(std::string(hdr->text), c.bamFile.stem().string(), sampleName)) {
+      if (c.hasCoverageCache) c.sampleName = cache.sampleName;
+      else if (!getSMTag(std::string(hdr->text), c.bamFile.stem().string(), sampleName)) {
 	std::cerr << "Only one sample (@RG:SM) is allowed per input BAM file " << c.bamFile.string() << std::endl;
 	return 1;
       } else c.sampleName = sampleName;
@@ -446,13 +594,33 @@ namespace bamstats
 	c.validChr.resize(hdr->n_targets, true); // All chromosomes need to be parsed
 	c.hasIntervalFile = false;
       }
+    }
 
-      // Clean-up
-      bam_hdr_destroy(hdr);
-      hts_idx_destroy(idx);
-      sam_close(samfile);
+    // Shard of a distributed run, chromosomes of other shards are skipped
+    c.shard.key = shardKey(argc, argv);
+    if (vm.count("shard")) {
+      if (!parseShard(shard, c.shard)) return 1;
+      if (c.hasCoverageCache) {
+	std::cerr << "Shards require a BAM/CRAM input file!" << std::endl;
+	return 1;
+      }
+      BamInput* bam = in.bam(c.bamFile, false);
+      hts_idx_t* idx = bam->index(true);
+      if (idx == NULL) return 1;
+      assignShard(idx, bam->hdr, c.shard);
+      for(int32_t refIndex = 0; refIndex < (int32_t) c.validChr.size(); ++refIndex)
+	if (!c.shard.contains(refIndex)) c.validChr[refIndex] = false;
     }
 
+    return 0;
+  }
+
+
+  int count_dna(int argc, char **argv) {
+    CountDNAConfig c;
+    InputContext in;
+    if (parseCountDNA(argc, argv, c, in)) return 1;
+
     // Show cmd
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
@@ -460,7 +628,7 @@ namespace bamstats
     for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
     std::cout << std::endl;
 
-    return countDNARun(c);
+    return countDNARun(c, in);
   }
 
   
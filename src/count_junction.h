@@ -38,9 +38,13 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #include "version.h"
 #include "util.h"
+#include "pipeline.h"
+#include "input.h"
 #include "gtf.h"
 #include "gff3.h"
 #include "bed.h"
+#include "shard.h"
+#include "cache.h"
 
 
 namespace bamstats
@@ -79,19 +83,24 @@ namespace bamstats
     boost::filesystem::path outintra;
     boost::filesystem::path outinter;
     boost::filesystem::path outnovel;
+    Shard shard;
   };
 
 
   template<typename TConfig, typename TGenomicRegions, typename TGenomicExonJunction>
   inline int32_t
-  countExonJct(TConfig const& c, TGenomicRegions& gRegions, TGenomicExonJunction& ejct, TGenomicExonJunction& njct) {
+  countExonJct(TConfig const& c, InputContext& in, TGenomicRegions const& gRegions, TGenomicExonJunction& ejct, TGenomicExonJunction& njct) {
     typedef typename TGenomicRegions::value_type TChromosomeRegions;
     typedef typename TGenomicExonJunction::value_type TExonJctMap;
     
-    // Load bam file
-    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-    hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
+    // Load bam file, junctions need no sequence, qualities or tags
+    BamInput* bam = in.bam(c.bamFile, false);
+    if (bam == NULL) return 1;
+    hts_idx_t* idx = bam->index(true);
+    if (idx == NULL) return 1;
+    samFile* samfile = bam->samfile;
+    bam_hdr_t* hdr = bam->hdr;
+    requireFields(samfile, samCoreFields);
 
     // Parse BAM file
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
@@ -105,10 +114,9 @@ namespace bamstats
     uint32_t minClipLength = 25;
     for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
       ++show_progress;
-      if (gRegions[refIndex].empty()) continue;
+      if ((gRegions[refIndex].empty()) || (!c.shard.contains(refIndex))) continue;
 
-      // Sort by position
-      std::sort(gRegions[refIndex].begin(), gRegions[refIndex].end(), SortIntervalStart<IntervalLabelId>());
+      // Regions are sorted by position
       int32_t maxExonLength = 0;
       for(uint32_t i = 0; i < gRegions[refIndex].size(); ++i) {
 	if ((gRegions[refIndex][i].end - gRegions[refIndex][i].start) > maxExonLength) {
@@ -125,18 +133,12 @@ namespace bamstats
       }
 
       // Count reads
-      hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-      bam1_t* rec = bam_init1();
-      while (sam_itr_next(samfile, iter, rec) >= 0) {
+      BamRecordStream stream(samfile, hdr, sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]));
+      bam1_t* rec = NULL;
+      while ((rec = stream.next()) != NULL) {
 	if (rec->core.flag & (BAM_FQCFAIL | BAM_FDUP | BAM_FUNMAP)) continue;
 	if (rec->core.qual < c.minQual) continue; // Low quality read
 
-	// Get read sequence
-	std::string sequence;
-	sequence.resize(rec->core.l_qseq);
-	uint8_t* seqptr = bam_get_seq(rec);
-	for (int32_t i = 0; i < rec->core.l_qseq; ++i) sequence[i] = "=ACMGRSVTWYHKDBN"[bam_seqi(seqptr, i)];
-
 	// Collect all exons this read spans
 	TSpGpSet spgpset;
 	
@@ -216,9 +218,6 @@ namespace bamstats
 	  else clipReads[hr].insert(spgpset.begin(), spgpset.end());
 	}
       }
-      // Clean-up
-      bam_destroy1(rec);
-      hts_itr_destroy(iter);
     }
 
     // Post-process the soft-clipped reads
@@ -228,36 +227,48 @@ namespace bamstats
       }
       //std::cerr << std::endl;
     }
-
-    // clean-up
-    bam_hdr_destroy(hdr);
-    hts_idx_destroy(idx);
-    sam_close(samfile);
     return 0;
   }
   
   template<typename TConfig>
   inline int32_t
-  countJunctionRun(TConfig const& c) {
+  countJunctionRun(TConfig const& c, InputContext& in) {
 
 #ifdef PROFILE
     ProfilerStart("alfred.prof");
 #endif
 
-    // Parse GTF file
+    // Parse GTF file, regions are sorted by position
     typedef std::vector<IntervalLabelId> TChromosomeRegions;
     typedef std::vector<TChromosomeRegions> TGenomicRegions;
-    TGenomicRegions gRegions(c.nchr.size(), TChromosomeRegions());
     typedef std::vector<std::string> TGeneIds;
-    TGeneIds geneIds;
-    int32_t tf = 0;
-    if (c.inputFileFormat == 0) tf = parseGTFAll(c, gRegions, geneIds);
-    else if (c.inputFileFormat == 1) tf = parseBEDAll(c, gRegions, geneIds);
-    else if (c.inputFileFormat == 2) tf = parseGFF3All(c, gRegions, geneIds);
-    if (tf == 0) {
-      std::cerr << "Error parsing GTF/GFF3/BED file!" << std::endl;
-      return 1;
+    typedef std::pair<TGenomicRegions, TGeneIds> TAnnotation;
+    boost::shared_ptr<TAnnotation const> anno;
+    std::string key = annotationKey("jct", c);
+    if (!cacheLookup(key, anno)) {
+      boost::shared_ptr<TAnnotation> parsed(new TAnnotation());
+      TGenomicRegions& regions = parsed->first;
+      TGeneIds& ids = parsed->second;
+      regions.resize(c.nchr.size(), TChromosomeRegions());
+      int32_t tf = 0;
+      if (c.inputFileFormat == 0) tf = parseGTFAll(c, regions, ids);
+      else if (c.inputFileFormat == 1) tf = parseBEDAll(c, regions, ids);
+      else if (c.inputFileFormat == 2) tf = parseGFF3All(c, regions, ids);
+      if (tf == 0) {
+	std::cerr << "Error parsing GTF/GFF3/BED file!" << std::endl;
+	return 1;
+      }
+      uint64_t nbytes = 0;
+      for(uint32_t i = 0; i < regions.size(); ++i) {
+	std::sort(regions[i].begin(), regions[i].end(), SortIntervalStart<IntervalLabelId>());
+	nbytes += sizeof(TChromosomeRegions) + regions[i].size() * sizeof(IntervalLabelId);
+      }
+      for(uint32_t i = 0; i < ids.size(); ++i) nbytes += sizeof(std::string) + ids[i].size();
+      cacheStore(key, boost::shared_ptr<TAnnotation const>(parsed), nbytes);
+      anno = parsed;
     }
+    TGenomicRegions const& gRegions = anno->first;
+    TGeneIds const& geneIds = anno->second;
 
     // Exon junction counting
     typedef std::pair<int32_t, int32_t> TExonPair;
@@ -265,10 +276,34 @@ namespace bamstats
     typedef std::vector<TExonJctCount> TGenomicExonJctCount;
     TGenomicExonJctCount ejct(c.nchr.size(), TExonJctCount());
     TGenomicExonJctCount njct(c.nchr.size(), TExonJctCount());
-    int32_t retparse = countExonJct(c, gRegions, ejct, njct);
-    if (retparse != 0) {
-      std::cerr << "Error exon junction counting!" << std::endl;
-      return 1;
+    if (c.shard.merging()) {
+      // Sum the junction counts of all shards
+      for(uint32_t k = 0; k < c.shard.parts.size(); ++k) {
+	CheckpointReader part;
+	if (!c.shard.open(part, k)) return 1;
+	part.io(ejct);
+	part.io(njct);
+	if ((!part.ok) || (ejct.size() != c.nchr.size()) || (njct.size() != c.nchr.size())) {
+	  std::cerr << "Partial output " << c.shard.parts[k].string() << " is truncated or does not match the annotation!" << std::endl;
+	  return 1;
+	}
+      }
+    } else {
+      int32_t retparse = countExonJct(c, in, gRegions, ejct, njct);
+      if (retparse != 0) {
+	std::cerr << "Error exon junction counting!" << std::endl;
+	return 1;
+      }
+    }
+
+    // A shard only stores its junction counts
+    if (c.shard.index) {
+      CheckpointWriter part;
+      if (!c.shard.open(part, c.outintra)) return 1;
+      part.io(ejct);
+      part.io(njct);
+      if (!part.commit()) return 1;
+      return 0;
     }
 
     // Mapping refIndex -> chromosome name
@@ -295,8 +330,8 @@ namespace bamstats
       if (gRegions[refIndex].empty()) continue;
 
       // Output intra-gene exon-exon junction support
-      for(typename TChromosomeRegions::iterator itR = gRegions[refIndex].begin(); itR != gRegions[refIndex].end(); ++itR) {
-	typename TChromosomeRegions::iterator itRNext = itR;
+      for(typename TChromosomeRegions::const_iterator itR = gRegions[refIndex].begin(); itR != gRegions[refIndex].end(); ++itR) {
+	typename TChromosomeRegions::const_iterator itRNext = itR;
 	++itRNext;
 	for(; itRNext != gRegions[refIndex].end(); ++itRNext) {
 	  if ((itR->lid == itRNext->lid) && (itR->end < itRNext->start)) {
@@ -426,8 +461,8 @@ namespace bamstats
   }
 
 
-  int count_junction(int argc, char **argv) {
-    CountJunctionConfig c;
+  int parseCountJunction(int argc, char **argv, CountJunctionConfig& c, InputContext& in) {
+    std::string shard;
 
     // Parameter
     boost::program_options::options_description generic("Generic options");
@@ -438,6 +473,7 @@ namespace bamstats
       ("outintra,o", boost::program_options::value<boost::filesystem::path>(&c.outintra)->default_value("intra.tsv"), "intra-gene exon-exon junction reads")
       ("outinter,p", boost::program_options::value<boost::filesystem::path>(&c.outinter)->default_value("inter.tsv"), "inter-gene exon-exon junction reads")
       ("outnovel,n", boost::program_options::value<boost::filesystem::path>(&c.outnovel), "output file for not annotated intra-chromosomal junction reads")
+      ("shard", boost::program_options::value<std::string>(&shard), "only process shard i/n of the genome, merge with merge_shards (optional)")
       ;
 
     boost::program_options::options_description gtfopt("GTF/GFF3 input file options");
@@ -482,24 +518,11 @@ namespace bamstats
     if (vm.count("outnovel")) c.novelJct = true;
     else c.novelJct = false;
 
-    // Check bam file
-    if (!(boost::filesystem::exists(c.bamFile) && boost::filesystem::is_regular_file(c.bamFile) && boost::filesystem::file_size(c.bamFile))) {
-      std::cerr << "Alignment file is missing: " << c.bamFile.string() << std::endl;
-      return 1;
-    } else {
-      samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-      if (samfile == NULL) {
-	std::cerr << "Fail to open file " << c.bamFile.string() << std::endl;
-	return 1;
-      }
-      hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-      if (idx == NULL) {
-	if (bam_index_build(c.bamFile.string().c_str(), 0) != 0) {
-	  std::cerr << "Fail to open index for " << c.bamFile.string() << std::endl;
-	  return 1;
-	}
-      }
-      bam_hdr_t* hdr = sam_hdr_read(samfile);
+    // Check bam file, the index is only loaded once junctions are counted
+    BamInput* bam = in.bam(c.bamFile, false);
+    if (bam == NULL) return 1;
+    else {
+      bam_hdr_t* hdr = bam->hdr;
       for(int32_t refIndex=0; refIndex < hdr->n_targets; ++refIndex) c.nchr.insert(std::make_pair(hdr->target_name[refIndex], refIndex));
       
 	// Get sample name
@@ -508,9 +531,6 @@ namespace bamstats
 	std::cerr << "Only one sample (@RG:SM) is allowed per input BAM file " << c.bamFile.string() << std::endl;
 	return 1;
       } else c.sampleName = sampleName;
-      bam_hdr_destroy(hdr);
-      hts_idx_destroy(idx);
-      sam_close(samfile);
     }
 
     // Check region file
@@ -524,6 +544,24 @@ namespace bamstats
       else c.inputFileFormat = 0;
     }
 
+    // Shard of a distributed run
+    c.shard.key = shardKey(argc, argv);
+    if (vm.count("shard")) {
+      if (!parseShard(shard, c.shard)) return 1;
+      hts_idx_t* idx = bam->index(true);
+      if (idx == NULL) return 1;
+      assignShard(idx, bam->hdr, c.shard);
+    }
+
+    return 0;
+  }
+
+
+  int count_junction(int argc, char **argv) {
+    CountJunctionConfig c;
+    InputContext in;
+    if (parseCountJunction(argc, argv, c, in)) return 1;
+
     // Show cmd
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
@@ -531,7 +569,7 @@ namespace bamstats
     for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
     std::cout << std::endl;
 
-    return countJunctionRun(c);
+    return countJunctionRun(c, in);
   }
   
 
@@ -38,20 +38,26 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #include "version.h"
 #include "util.h"
+#include "pipeline.h"
+#include "input.h"
 #include "gtf.h"
 #include "gff3.h"
 #include "bed.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "cache.h"
 
 
 namespace bamstats
 {
 
   struct CountRNAConfig {
+    typedef std::map<std::string, int32_t> TChrMap;
     uint8_t inputFileFormat;   // 0 = gtf, 1 = bed, 2 = gff3
     uint8_t inputBamFormat; // 0 = bam, 1 = bed
     uint16_t stranded;  // 0 = unstranded, 1 = stranded, 2 = stranded (opposite)
     uint16_t minQual;
-    std::map<std::string, int32_t> nchr;
+    TChrMap nchr;
     std::string sampleName;
     std::string idname;
     std::string feature;
@@ -60,11 +66,13 @@ namespace bamstats
     boost::filesystem::path bedFile;
     boost::filesystem::path bamFile;
     boost::filesystem::path outfile;
+    Checkpoint checkpoint;
+    Shard shard;
   };
 
   template<typename TConfig, typename TGenomicRegions, typename TFeatureCounter>
   inline int32_t
-  bed_counter(TConfig const& c, TGenomicRegions& gRegions, TFeatureCounter& fc) {
+  bed_counter(TConfig const& c, TGenomicRegions const& gRegions, TFeatureCounter& fc) {
     typedef typename TGenomicRegions::value_type TChromosomeRegions;
 
     // Parse BED file
@@ -77,9 +85,6 @@ namespace bamstats
       ++show_progress;
       if (gRegions[refIndex].empty()) continue;
 
-      // Sort by position
-      std::sort(gRegions[refIndex].begin(), gRegions[refIndex].end(), SortIntervalStart<IntervalLabel>());
-
       // Flag feature positions
       typedef boost::dynamic_bitset<> TBitSet;
       TBitSet featureBitMap(250000000);
@@ -159,32 +164,40 @@ namespace bamstats
 
 
   template<typename TConfig, typename TGenomicRegions, typename TFeatureCounter>
-  inline int32_t
-  bam_counter(TConfig const& c, TGenomicRegions& gRegions, TFeatureCounter& fc) {
+  struct RnaCountAnalysis {
     typedef typename TGenomicRegions::value_type TChromosomeRegions;
-    
-    // Load bam file
-    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-    hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
-
-    // Parse BAM file
-    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
-    boost::progress_display show_progress( hdr->n_targets );
-
-    // Pair qualities and features
     typedef boost::unordered_map<std::size_t, int32_t> TFeatures;
-    TFeatures features;
+    typedef boost::dynamic_bitset<> TBitSet;
+
+    TConfig const& c;
+    bam_hdr_t* hdr;
+    TGenomicRegions const& gRegions;
+    TFeatureCounter& fc;
+    int32_t refIndex;
+    int32_t maxFeatureLength;
+    int32_t lastAlignedPos;
+    std::set<std::size_t> lastAlignedPosReads;
+    TFeatures features;  // Features of first reads
+    TBitSet featureBitMap;
+
+    RnaCountAnalysis(TConfig const& conf, bam_hdr_t* h, TGenomicRegions const& gr, TFeatureCounter& f) : c(conf), hdr(h), gRegions(gr), fc(f), refIndex(-1), maxFeatureLength(0), lastAlignedPos(0) {}
+
+    static int32_t
+    requiredFields() {
+      return samCoreFields;
+    }
 
-    // Iterate chromosomes
-    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
-      ++show_progress;
-      if (gRegions[refIndex].empty()) continue;
+    void
+    _loadChromosome(int32_t tid) {
+      refIndex = tid;
+      features.clear();
+      lastAlignedPosReads.clear();
+      lastAlignedPos = 0;
+      maxFeatureLength = 0;
+      featureBitMap.clear();
+      if ((refIndex < 0) || (gRegions[refIndex].empty())) return;
 
-      // Sort by position
-      std::sort(gRegions[refIndex].begin(), gRegions[refIndex].end(), SortIntervalStart<IntervalLabel>());
-      int32_t maxFeatureLength = 0;
+      // Regions are sorted by position
       for(uint32_t i = 0; i < gRegions[refIndex].size(); ++i) {
 	if ((gRegions[refIndex][i].end - gRegions[refIndex][i].start) > maxFeatureLength) {
 	  maxFeatureLength = gRegions[refIndex][i].end - gRegions[refIndex][i].start;
@@ -192,168 +205,255 @@ namespace bamstats
       }
 
       // Flag feature positions
-      typedef boost::dynamic_bitset<> TBitSet;
-      TBitSet featureBitMap(hdr->target_len[refIndex]);
+      featureBitMap.resize(hdr->target_len[refIndex]);
       for(uint32_t i = 0; i < gRegions[refIndex].size(); ++i)
 	for(int32_t k = gRegions[refIndex][i].start; k < gRegions[refIndex][i].end; ++k) featureBitMap[k] = 1;
+    }
 
-      // Count reads
-      hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-      bam1_t* rec = bam_init1();
-      int32_t lastAlignedPos = 0;
-      std::set<std::size_t> lastAlignedPosReads;
-      while (sam_itr_next(samfile, iter, rec) >= 0) {
-	if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
-	if ((rec->core.flag & BAM_FPAIRED) && ((rec->core.flag & BAM_FMUNMAP) || (rec->core.tid != rec->core.mtid))) continue; 
-	if (rec->core.qual < c.minQual) continue; // Low quality pair
-
-	if (rec->core.flag & BAM_FPAIRED) {
-	  // Clean-up the read store for identical alignment positions
-	  if (rec->core.pos > lastAlignedPos) {
-	    lastAlignedPosReads.clear();
-	    lastAlignedPos = rec->core.pos;
-	  }
+    // Records need to arrive in coordinate order
+    bool
+    process(bam1_t* rec) {
+      if (rec->core.tid != refIndex) _loadChromosome(rec->core.tid);
+      if ((refIndex < 0) || (gRegions[refIndex].empty())) return true;
+
+      if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) return true;
+      if ((rec->core.flag & BAM_FPAIRED) && ((rec->core.flag & BAM_FMUNMAP) || (rec->core.tid != rec->core.mtid))) return true;
+      if (rec->core.qual < c.minQual) return true; // Low quality pair
+
+      if (rec->core.flag & BAM_FPAIRED) {
+	// Clean-up the read store for identical alignment positions
+	if (rec->core.pos > lastAlignedPos) {
+	  lastAlignedPosReads.clear();
+	  lastAlignedPos = rec->core.pos;
 	}
+      }
 
-	// Get read sequence
-	std::string sequence;
-	sequence.resize(rec->core.l_qseq);
-	uint8_t* seqptr = bam_get_seq(rec);
-	for (int32_t i = 0; i < rec->core.l_qseq; ++i) sequence[i] = "=ACMGRSVTWYHKDBN"[bam_seqi(seqptr, i)];
-
-	// Parse CIGAR
-	uint32_t* cigar = bam_get_cigar(rec);
-	int32_t gp = rec->core.pos; // Genomic position
-	int32_t sp = 0; // Sequence position
-	typedef std::vector<int32_t> TFeaturePos;
-	TFeaturePos featurepos;
-	for (std::size_t i = 0; i < rec->core.n_cigar; ++i) {
-	  if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
-	  else if (bam_cigar_op(cigar[i]) == BAM_CINS) sp += bam_cigar_oplen(cigar[i]);
-	  else if (bam_cigar_op(cigar[i]) == BAM_CDEL) gp += bam_cigar_oplen(cigar[i]);
-	  else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) gp += bam_cigar_oplen(cigar[i]);
-	  else if (bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP) {
-	    //Nop
-	  } else if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
-	    for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]); ++k, ++sp, ++gp)
-	      if (featureBitMap[gp]) featurepos.push_back(gp);
-	  } else {
-	    std::cerr << "Unknown Cigar options" << std::endl;
-	    return 1;
-	  }
+      // Parse CIGAR
+      uint32_t* cigar = bam_get_cigar(rec);
+      int32_t gp = rec->core.pos; // Genomic position
+      int32_t sp = 0; // Sequence position
+      typedef std::vector<int32_t> TFeaturePos;
+      TFeaturePos featurepos;
+      for (std::size_t i = 0; i < rec->core.n_cigar; ++i) {
+	if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
+	else if (bam_cigar_op(cigar[i]) == BAM_CINS) sp += bam_cigar_oplen(cigar[i]);
+	else if (bam_cigar_op(cigar[i]) == BAM_CDEL) gp += bam_cigar_oplen(cigar[i]);
+	else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) gp += bam_cigar_oplen(cigar[i]);
+	else if (bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP) {
+	  //Nop
+	} else if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
+	  for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]); ++k, ++sp, ++gp)
+	    if (featureBitMap[gp]) featurepos.push_back(gp);
+	} else {
+	  std::cerr << "Unknown Cigar options" << std::endl;
+	  return false;
 	}
+      }
 
-	// Find feature
-	bool ambiguous = false;
-	int32_t featureid = -1;  // No feature by default
-	if (!featurepos.empty()) {
-	  int32_t fpfirst = featurepos[0];
-	  int32_t fplast = featurepos[featurepos.size()-1];
-	  typename TChromosomeRegions::const_iterator vIt = std::lower_bound(gRegions[refIndex].begin(), gRegions[refIndex].end(), IntervalLabel(std::max(0, fpfirst - maxFeatureLength)), SortIntervalStart<IntervalLabel>());
-	  for(; vIt != gRegions[refIndex].end(); ++vIt) {
-	    if (vIt->end <= fpfirst) continue;
-	    if (vIt->start > fplast) break; // Sorted intervals so we can stop searching
-	    for(TFeaturePos::const_iterator fIt = featurepos.begin(); fIt != featurepos.end(); ++fIt) {
-	      if ((vIt->start <= *fIt) && (vIt->end > *fIt) && (featureid != vIt->lid)) {
-		if (!_strandOkay(rec, vIt->strand, c.stranded)) continue;
-		if (featureid == -1) featureid = vIt->lid;
-		else {
-		  ambiguous = true;
-		  break;
-		}
+      // Find feature
+      bool ambiguous = false;
+      int32_t featureid = -1;  // No feature by default
+      if (!featurepos.empty()) {
+	int32_t fpfirst = featurepos[0];
+	int32_t fplast = featurepos[featurepos.size()-1];
+	typename TChromosomeRegions::const_iterator vIt = std::lower_bound(gRegions[refIndex].begin(), gRegions[refIndex].end(), IntervalLabel(std::max(0, fpfirst - maxFeatureLength)), SortIntervalStart<IntervalLabel>());
+	for(; vIt != gRegions[refIndex].end(); ++vIt) {
+	  if (vIt->end <= fpfirst) continue;
+	  if (vIt->start > fplast) break; // Sorted intervals so we can stop searching
+	  for(TFeaturePos::const_iterator fIt = featurepos.begin(); fIt != featurepos.end(); ++fIt) {
+	    if ((vIt->start <= *fIt) && (vIt->end > *fIt) && (featureid != vIt->lid)) {
+	      if (!_strandOkay(rec, vIt->strand, c.stranded)) continue;
+	      if (featureid == -1) featureid = vIt->lid;
+	      else {
+		ambiguous = true;
+		break;
 	      }
 	    }
 	  }
 	}
-	if (ambiguous) continue; // Ambiguous read
-
-	if (rec->core.flag & BAM_FPAIRED) {
-	  // First or Second Read?	
-	  if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
-	    // First read
-	    lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
-	    std::size_t hv = hash_pair(rec);
-	    features[hv] = featureid;
-	  } else {
-	    // Second read
-	    std::size_t hv = hash_pair_mate(rec);
-	    if (features.find(hv) == features.end()) continue; // Mate discarded
-	    int32_t featuremate = features[hv];
-	    features[hv] = -1;
+      }
+      if (ambiguous) return true; // Ambiguous read
+
+      if (rec->core.flag & BAM_FPAIRED) {
+	// First or Second Read?	
+	if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
+	  // First read
+	  lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
+	  std::size_t hv = hash_pair(rec);
+	  features[hv] = featureid;
+	} else {
+	  // Second read
+	  std::size_t hv = hash_pair_mate(rec);
+	  if (features.find(hv) == features.end()) return true; // Mate discarded
+	  int32_t featuremate = features[hv];
+	  features[hv] = -1;
 	    
-	    // Check feature agreement
-	    if ((featureid == -1) && (featuremate == -1)) continue; // No feature
-	    else if ((featureid == -1) && (featuremate != -1)) featureid = featuremate;
-	    else if ((featureid != -1) && (featuremate == -1)) featuremate = featureid;
-	    else {
-	      // Both reads have a feature assignment
-	      if (featureid != featuremate) continue; // Feature disagreement
-	    }
-
-	    // Hurray, we finally have a valid pair
-	    ++fc[featureid];
+	  // Check feature agreement
+	  if ((featureid == -1) && (featuremate == -1)) return true; // No feature
+	  else if ((featureid == -1) && (featuremate != -1)) featureid = featuremate;
+	  else if ((featureid != -1) && (featuremate == -1)) featuremate = featureid;
+	  else {
+	    // Both reads have a feature assignment
+	    if (featureid != featuremate) return true; // Feature disagreement
 	  }
-	} else {
-	  // Single-end
-	  if (featureid != -1) ++fc[featureid];
+
+	  // Hurray, we finally have a valid pair
+	  ++fc[featureid];
 	}
+      } else {
+	// Single-end
+	if (featureid != -1) ++fc[featureid];
       }
-      // Clean-up
-      bam_destroy1(rec);
-      hts_itr_destroy(iter);
-      features.clear();
+      return true;
     }
-	  
-    // clean-up
-    bam_hdr_destroy(hdr);
-    hts_idx_destroy(idx);
-    sam_close(samfile);
+
+    bool
+    finish() {
+      _loadChromosome(-1);
+      return true;
+    }
+  };
+
+
+  template<typename TConfig, typename TGenomicRegions, typename TFeatureCounter>
+  inline int32_t
+  bam_counter(TConfig const& c, InputContext& in, TGenomicRegions const& gRegions, TFeatureCounter& fc) {
+    // Load bam file
+    BamInput* bam = in.bam(c.bamFile, false);
+    if (bam == NULL) return 1;
+    hts_idx_t* idx = bam->index(true);
+    if (idx == NULL) return 1;
+    samFile* samfile = bam->samfile;
+    bam_hdr_t* hdr = bam->hdr;
+    requireFields(samfile, RnaCountAnalysis<TConfig, TGenomicRegions, TFeatureCounter>::requiredFields());
+
+    // Parse BAM file
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
+    boost::progress_display show_progress( hdr->n_targets );
+
+    // Feature counter
+    RnaCountAnalysis<TConfig, TGenomicRegions, TFeatureCounter> ra(c, hdr, gRegions, fc);
+
+    // Resume after the last completed chromosome
+    int32_t doneIndex = -1;
+    if (c.checkpoint.enabled) {
+      CheckpointReader ckpt;
+      if (ckpt.open(c.checkpoint.file("count_rna.ckpt"), c.checkpoint.key)) {
+	ckpt.io(doneIndex);
+	ckpt.io(fc);
+	if (!ckpt.ok) {
+	  std::cerr << "Checkpoint " << c.checkpoint.file("count_rna.ckpt").string() << " is truncated, please remove it!" << std::endl;
+	  return 1;
+	}
+      }
+    }
+
+    // Iterate chromosomes
+    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
+      ++show_progress;
+      if ((refIndex <= doneIndex) || (!c.shard.contains(refIndex)) || (gRegions[refIndex].empty())) continue;
+
+      // Count reads
+      BamRecordStream stream(samfile, hdr, sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]));
+      bam1_t* rec = NULL;
+      while ((rec = stream.next()) != NULL) {
+	if (!ra.process(rec)) return 1;
+      }
+
+      // Counts of this chromosome are final
+      if (c.checkpoint.enabled) {
+	CheckpointWriter ckpt;
+	if (!ckpt.open(c.checkpoint.file("count_rna.ckpt"), c.checkpoint.key)) return 1;
+	ckpt.io(refIndex);
+	ckpt.io(fc);
+	if (!ckpt.commit()) return 1;
+      }
+    }
+    ra.finish();
     return 0;
   }
 
-  
-  template<typename TConfig>
+
+  // Feature counts summed over the partial outputs of a sharded run
+  template<typename TConfig, typename TFeatureCounter>
   inline int32_t
-  countRNARun(TConfig const& c) {
+  shard_counter(TConfig const& c, TFeatureCounter& fc) {
+    std::size_t nfeatures = fc.size();
+    for(uint32_t k = 0; k < c.shard.parts.size(); ++k) {
+      CheckpointReader part;
+      if (!c.shard.open(part, k)) return 1;
+      part.io(fc);
+      if ((!part.ok) || (fc.size() != nfeatures)) {
+	std::cerr << "Partial output " << c.shard.parts[k].string() << " does not match the annotation!" << std::endl;
+	return 1;
+      }
+    }
+    return 0;
+  }
 
-#ifdef PROFILE
-    ProfilerStart("alfred.prof");
-#endif
 
-    // Parse GTF file
+  template<typename TConfig, typename TGenomicRegions, typename TGeneIds, typename TProteinCoding>
+  inline int32_t
+  parseAnnotation(TConfig const& c, TGenomicRegions& gRegions, TGeneIds& geneIds, TProteinCoding& pCoding) {
+    gRegions.resize(c.nchr.size(), typename TGenomicRegions::value_type());
+    int32_t tf = 0;
+    if (c.inputFileFormat == 0) tf = parseGTF(c, gRegions, geneIds, pCoding);
+    else if (c.inputFileFormat == 1) tf = parseBED(c, gRegions, geneIds, pCoding);
+    else if (c.inputFileFormat == 2) tf = parseGFF3(c, gRegions, geneIds, pCoding);
+    if (tf == 0) std::cerr << "Error parsing GTF/GFF3/BED file!" << std::endl;
+
+    // Sort by position
+    for(uint32_t refIndex = 0; refIndex < gRegions.size(); ++refIndex) std::sort(gRegions[refIndex].begin(), gRegions[refIndex].end(), SortIntervalStart<IntervalLabel>());
+    return tf;
+  }
+
+  // Parsed annotation of count_rna, regions are sorted by position
+  struct RnaAnnotation {
     typedef std::vector<IntervalLabel> TChromosomeRegions;
     typedef std::vector<TChromosomeRegions> TGenomicRegions;
-    TGenomicRegions gRegions;
-    gRegions.resize(c.nchr.size(), TChromosomeRegions());
     typedef std::vector<std::string> TGeneIds;
-    TGeneIds geneIds;
     typedef std::vector<bool> TProteinCoding;
+
+    TGenomicRegions gRegions;
+    TGeneIds geneIds;
     TProteinCoding pCoding;
-    int32_t tf = 0;
-    if (c.inputFileFormat == 0) tf = parseGTF(c, gRegions, geneIds, pCoding);
-    else if (c.inputFileFormat == 1) tf = parseBED(c, gRegions, geneIds, pCoding);
-    else if (c.inputFileFormat == 2) tf = parseGFF3(c, gRegions, geneIds, pCoding);
-    if (tf == 0) {
-      std::cerr << "Error parsing GTF/GFF3/BED file!" << std::endl;
-      return 1;
+    int32_t nfeatures;
+
+    RnaAnnotation() : nfeatures(0) {}
+
+    inline uint64_t
+    bytes() const {
+      uint64_t nbytes = pCoding.size() / 8;
+      for(uint32_t i = 0; i < gRegions.size(); ++i) nbytes += sizeof(TChromosomeRegions) + gRegions[i].size() * sizeof(IntervalLabel);
+      for(uint32_t i = 0; i < geneIds.size(); ++i) nbytes += sizeof(std::string) + geneIds[i].size();
+      return nbytes;
     }
+  };
+
+  // Jobs of serve and batch parse an annotation once and share it, NULL on a parse error
+  template<typename TConfig>
+  inline boost::shared_ptr<RnaAnnotation const>
+  loadAnnotation(TConfig const& c) {
+    boost::shared_ptr<RnaAnnotation const> anno;
+    std::string key = annotationKey("rna", c);
+    if (cacheLookup(key, anno)) return anno;
+    boost::shared_ptr<RnaAnnotation> parsed(new RnaAnnotation());
+    parsed->nfeatures = parseAnnotation(c, parsed->gRegions, parsed->geneIds, parsed->pCoding);
+    if (parsed->nfeatures == 0) return anno;
+    cacheStore(key, boost::shared_ptr<RnaAnnotation const>(parsed), parsed->bytes());
+    return parsed;
+  }
+
 
+  template<typename TConfig, typename TGenomicRegions, typename TGeneIds, typename TProteinCoding, typename TFeatureCounter>
+  inline void
+  countRNAOut(TConfig const& c, TGenomicRegions const& gRegions, TGeneIds const& geneIds, TProteinCoding const& pCoding, TFeatureCounter const& fc) {
     // Get gene lengh
     typedef std::vector<uint32_t> TGeneLength;
     TGeneLength geneLength(geneIds.size(), 0);
     getGeneLength(gRegions, geneLength);
 
-    // Feature counter
-    typedef std::vector<int32_t> TFeatureCounter;
-    TFeatureCounter fc(tf, 0);
-    int32_t retparse = 1;
-    if (c.inputBamFormat == 0) retparse = bam_counter(c, gRegions, fc);
-    else if (c.inputBamFormat == 1) retparse = bed_counter(c, gRegions, fc);
-    if (retparse != 0) {
-      std::cerr << "Error feature counting!" << std::endl;
-      return 1;
-    }
-
     // Reads mapped to protein-coding sequences in the alignment
     uint64_t totalReadProtein = 0;
     TFeatureCounter pGenes;
@@ -401,8 +501,46 @@ namespace bamstats
       for(uint32_t idval = 0; idval < geneIds.size(); ++idval) fcfile << geneIds[idval] << "\t" << fc[idval] << std::endl;
     }
     fcfile.close();
+  }
+
+  
+  template<typename TConfig>
+  inline int32_t
+  countRNARun(TConfig const& c, InputContext& in) {
+
+#ifdef PROFILE
+    ProfilerStart("alfred.prof");
+#endif
+
+    // Parse GTF file
+    boost::shared_ptr<RnaAnnotation const> anno = loadAnnotation(c);
+    if (!anno) return 1;
+
+    // Feature counter
+    typedef std::vector<int32_t> TFeatureCounter;
+    TFeatureCounter fc(anno->nfeatures, 0);
+    int32_t retparse = 1;
+    if (c.shard.merging()) retparse = shard_counter(c, fc);
+    else if (c.inputBamFormat == 0) retparse = bam_counter(c, in, anno->gRegions, fc);
+    else if (c.inputBamFormat == 1) retparse = bed_counter(c, anno->gRegions, fc);
+    if (retparse != 0) {
+      std::cerr << "Error feature counting!" << std::endl;
+      return 1;
+    }
+
+    // Partial counts of a shard, the count table is written by merge_shards
+    if (c.shard.index) {
+      CheckpointWriter part;
+      if (!c.shard.open(part, c.outfile)) return 1;
+      part.io(fc);
+      if (!part.commit()) return 1;
+    } else {
+      // Output count table
+      countRNAOut(c, anno->gRegions, anno->geneIds, anno->pCoding, fc);
+      c.checkpoint.clear("count_rna.ckpt");
+    }
     
-    now = boost::posix_time::second_clock::local_time();
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
     
 #ifdef PROFILE
@@ -413,8 +551,9 @@ namespace bamstats
   }
 
 
-  int count_rna(int argc, char **argv) {
-    CountRNAConfig c;
+  int parseCountRNA(int argc, char **argv, CountRNAConfig& c, InputContext& in) {
+    boost::filesystem::path checkpointDir;
+    std::string shard;
 
     // Parameter
     boost::program_options::options_description generic("Generic options");
@@ -424,6 +563,8 @@ namespace bamstats
       ("stranded,s", boost::program_options::value<uint16_t>(&c.stranded)->default_value(0), "strand-specific counting (0: unstranded, 1: stranded, 2: reverse stranded)")
       ("normalize,n", boost::program_options::value<std::string>(&c.normalize)->default_value("raw"), "normalization [raw|fpkm|fpkm_uq]")
       ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("gene.count"), "output file")
+      ("checkpoint-dir", boost::program_options::value<boost::filesystem::path>(&checkpointDir), "resume an interrupted run from this directory (optional)")
+      ("shard", boost::program_options::value<std::string>(&shard), "only process shard i/n of the genome, merge with merge_shards (optional)")
       ;
 
     boost::program_options::options_description gtfopt("GTF/GFF3 input file options");
@@ -466,7 +607,7 @@ namespace bamstats
     }
 
     // Check bam file
-    if (!(boost::filesystem::exists(c.bamFile) && boost::filesystem::is_regular_file(c.bamFile) && boost::filesystem::file_size(c.bamFile))) {
+    if ((!in.opened(c.bamFile)) && (!(boost::filesystem::exists(c.bamFile) && boost::filesystem::is_regular_file(c.bamFile) && boost::filesystem::file_size(c.bamFile)))) {
       std::cerr << "Alignment file is missing: " << c.bamFile.string() << std::endl;
       return 1;
     } else {
@@ -496,19 +637,9 @@ namespace bamstats
 	for(TChrSet::iterator itc = chrSet.begin(); itc != chrSet.end(); ++itc, ++refIndex) c.nchr.insert(std::make_pair(*itc, refIndex));
       } else {
 	c.inputBamFormat = 0;
-	samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-	if (samfile == NULL) {
-	  std::cerr << "Fail to open file " << c.bamFile.string() << std::endl;
-	  return 1;
-	}
-	hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-	if (idx == NULL) {
-	  if (bam_index_build(c.bamFile.string().c_str(), 0) != 0) {
-	    std::cerr << "Fail to open index for " << c.bamFile.string() << std::endl;
-	    return 1;
-	  }
-	}
-	bam_hdr_t* hdr = sam_hdr_read(samfile);
+	BamInput* bam = in.bam(c.bamFile, false);
+	if (bam == NULL) return 1;
+	bam_hdr_t* hdr = bam->hdr;
 	for(int32_t refIndex=0; refIndex < hdr->n_targets; ++refIndex) c.nchr.insert(std::make_pair(hdr->target_name[refIndex], refIndex));
 	
 	// Get sample name
@@ -517,9 +648,6 @@ namespace bamstats
 	  std::cerr << "Only one sample (@RG:SM) is allowed per input BAM file " << c.bamFile.string() << std::endl;
 	  return 1;
 	} else c.sampleName = sampleName;
-	bam_hdr_destroy(hdr);
-	hts_idx_destroy(idx);
-	sam_close(samfile);
       }
     }
 
@@ -534,6 +662,42 @@ namespace bamstats
       else c.inputFileFormat = 0;
     }
 
+    // Checkpoints, taken after each chromosome
+    if (vm.count("checkpoint-dir")) {
+      if (c.inputBamFormat != 0) {
+	std::cerr << "Checkpoints require a BAM/CRAM input file!" << std::endl;
+	return 1;
+      }
+      std::vector<boost::filesystem::path> inputs;
+      inputs.push_back(c.bamFile);
+      if (c.inputFileFormat == 1) inputs.push_back(c.bedFile);
+      else inputs.push_back(c.gtfFile);
+      if (!c.checkpoint.init(checkpointDir, checkpointKey(argc, argv, inputs))) return 1;
+    }
+
+    // Shard of a distributed run
+    c.shard.key = shardKey(argc, argv);
+    if (vm.count("shard")) {
+      if (!parseShard(shard, c.shard)) return 1;
+      if (c.inputBamFormat != 0) {
+	std::cerr << "Shards require a BAM/CRAM input file!" << std::endl;
+	return 1;
+      }
+      BamInput* bam = in.bam(c.bamFile, false);
+      hts_idx_t* idx = bam->index(true);
+      if (idx == NULL) return 1;
+      assignShard(idx, bam->hdr, c.shard);
+    }
+
+    return 0;
+  }
+
+
+  int count_rna(int argc, char **argv) {
+    CountRNAConfig c;
+    InputContext in;
+    if (parseCountRNA(argc, argv, c, in)) return 1;
+
     // Show cmd
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
@@ -541,7 +705,7 @@ namespace bamstats
     for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
     std::cout << std::endl;
 
-    return countRNARun(c);
+    return countRNARun(c, in);
   }
   
 
@@ -0,0 +1,280 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef COVCACHE_H
+#define COVCACHE_H
+
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
+
+
+namespace bamstats
+{
+
+  // Coverage cache layout (BGZF)
+  //   magic, profile, min. mapping quality, sample name, chromosome names and lengths
+  //   per chromosome: tid, flag, number of runs, (run length, coverage) runs
+  // The index (<cache>.idx) holds the virtual offset of every chromosome and the total aligned bases
+  static char const coverageMagic[8] = {'A', 'L', 'F', 'C', 'O', 'V', '1', '\0'};
+
+  inline bool
+  _bgzfWriteString(BGZF* fp, std::string const& str) {
+    uint32_t len = str.size();
+    if (bgzf_write(fp, &len, sizeof(uint32_t)) < 0) return false;
+    if ((len) && (bgzf_write(fp, str.c_str(), len) < 0)) return false;
+    return true;
+  }
+
+  inline bool
+  _bgzfReadString(BGZF* fp, std::string& str) {
+    uint32_t len = 0;
+    if (bgzf_read(fp, &len, sizeof(uint32_t)) != sizeof(uint32_t)) return false;
+    str.resize(len);
+    if ((len) && (bgzf_read(fp, &str[0], len) != (ssize_t) len)) return false;
+    return true;
+  }
+
+  // Only regular files are probed, streams cannot be rewound
+  inline bool
+  isCoverageCache(boost::filesystem::path const& path) {
+    if (!(boost::filesystem::exists(path) && boost::filesystem::is_regular_file(path) && boost::filesystem::file_size(path))) return false;
+    BGZF* fp = bgzf_open(path.string().c_str(), "r");
+    if (fp == NULL) return false;
+    char magic[8];
+    bool cache = ((bgzf_read(fp, magic, 8) == 8) && (std::memcmp(magic, coverageMagic, 8) == 0));
+    bgzf_close(fp);
+    return cache;
+  }
+
+  struct CoverageWriter {
+    BGZF* fp;
+    boost::filesystem::path path;
+    std::vector<int64_t> offsets;
+    std::vector<uint32_t> lengths;
+
+    CoverageWriter() : fp(NULL) {}
+
+    ~CoverageWriter() {
+      if (fp != NULL) bgzf_close(fp);
+    }
+
+    inline bool
+    open(boost::filesystem::path const& p, std::string const& profile, uint16_t const minQual, std::string const& sampleName, bam_hdr_t const* hdr) {
+      path = p;
+      // The index is only written once the cache is complete, a stale one must not validate a truncated cache
+      boost::filesystem::remove(boost::filesystem::path(path.string() + ".idx"));
+      fp = bgzf_open(path.string().c_str(), "w");
+      if (fp == NULL) {
+	std::cerr << "Fail to open file " << path.string() << std::endl;
+	return false;
+      }
+      offsets.resize(hdr->n_targets, -1);
+      lengths.assign(hdr->target_len, hdr->target_len + hdr->n_targets);
+      int32_t nchr = hdr->n_targets;
+      if (bgzf_write(fp, coverageMagic, 8) < 0) return false;
+      if (!_bgzfWriteString(fp, profile)) return false;
+      if (bgzf_write(fp, &minQual, sizeof(uint16_t)) < 0) return false;
+      if (!_bgzfWriteString(fp, sampleName)) return false;
+      if (bgzf_write(fp, &nchr, sizeof(int32_t)) < 0) return false;
+      for(int32_t refIndex = 0; refIndex < nchr; ++refIndex) {
+	if (!_bgzfWriteString(fp, std::string(hdr->target_name[refIndex]))) return false;
+	if (bgzf_write(fp, &hdr->target_len[refIndex], sizeof(uint32_t)) < 0) return false;
+      }
+      // Chromosome records start in a fresh block
+      if (bgzf_flush(fp) < 0) return false;
+      return true;
+    }
+
+    // Run-length encoded coverage of one chromosome, an empty vector is all zero
+    template<typename TCoverage>
+    inline bool
+    write(int32_t const tid, bool const flag, TCoverage const& cov) {
+      std::vector<uint32_t> runs;
+      std::vector<uint16_t> values;
+      if (cov.empty()) {
+	runs.push_back(lengths[tid]);
+	values.push_back(0);
+      } else {
+	uint32_t run = 1;
+	for(uint32_t i = 1; i < cov.size(); ++i) {
+	  if (cov[i] == cov[i-1]) ++run;
+	  else {
+	    runs.push_back(run);
+	    values.push_back(cov[i-1]);
+	    run = 1;
+	  }
+	}
+	runs.push_back(run);
+	values.push_back(cov[cov.size() - 1]);
+      }
+      offsets[tid] = bgzf_tell(fp);
+      uint8_t fl = (flag) ? 1 : 0;
+      uint32_t nruns = runs.size();
+      bool ok = ((bgzf_write(fp, &tid, sizeof(int32_t)) >= 0) && (bgzf_write(fp, &fl, sizeof(uint8_t)) >= 0) && (bgzf_write(fp, &nruns, sizeof(uint32_t)) >= 0));
+      for(uint32_t i = 0; (ok) && (i < nruns); ++i) ok = ((bgzf_write(fp, &runs[i], sizeof(uint32_t)) >= 0) && (bgzf_write(fp, &values[i], sizeof(uint16_t)) >= 0));
+      if (!ok) std::cerr << "Fail to write coverage cache " << path.string() << std::endl;
+      return ok;
+    }
+
+    // Chromosomes never written are stored as empty, then the index is written
+    inline bool
+    close(uint64_t const alignedBases) {
+      for(int32_t tid = 0; tid < (int32_t) offsets.size(); ++tid) {
+	if (offsets[tid] == -1) {
+	  if (!write(tid, false, std::vector<uint16_t>())) return false;
+	}
+      }
+      int32_t ret = bgzf_close(fp);
+      fp = NULL;
+      if (ret != 0) {
+	std::cerr << "Fail to close file " << path.string() << std::endl;
+	return false;
+      }
+      std::ofstream idxOut((path.string() + ".idx").c_str(), std::ios_base::out | std::ios_base::binary);
+      uint32_t nchr = offsets.size();
+      idxOut.write(coverageMagic, 8);
+      idxOut.write((char*) &alignedBases, sizeof(uint64_t));
+      idxOut.write((char*) &nchr, sizeof(uint32_t));
+      for(uint32_t tid = 0; tid < nchr; ++tid) idxOut.write((char*) &offsets[tid], sizeof(int64_t));
+      idxOut.close();
+      if (idxOut.fail()) {
+	std::cerr << "Fail to write coverage cache index " << path.string() << ".idx" << std::endl;
+	return false;
+      }
+      return true;
+    }
+
+  private:
+    CoverageWriter(CoverageWriter const&);
+    CoverageWriter& operator=(CoverageWriter const&);
+  };
+
+  struct CoverageReader {
+    BGZF* fp;
+    bam_hdr_t* hdr;
+    std::string profile;
+    uint16_t minQual;
+    std::string sampleName;
+    uint64_t alignedBases;
+    std::vector<int64_t> offsets;
+
+    CoverageReader() : fp(NULL), hdr(NULL), minQual(0), alignedBases(0) {}
+
+    ~CoverageReader() {
+      if (hdr != NULL) bam_hdr_destroy(hdr);
+      if (fp != NULL) bgzf_close(fp);
+    }
+
+    // The cache needs to match the filter profile and mapping quality threshold of the command
+    inline bool
+    open(boost::filesystem::path const& path, std::string const& prof, uint16_t const qual) {
+      fp = bgzf_open(path.string().c_str(), "r");
+      if (fp == NULL) {
+	std::cerr << "Fail to open file " << path.string() << std::endl;
+	return false;
+      }
+      char magic[8];
+      int32_t nchr = 0;
+      if ((bgzf_read(fp, magic, 8) != 8) || (std::memcmp(magic, coverageMagic, 8) != 0) || (!_bgzfReadString(fp, profile)) || (bgzf_read(fp, &minQual, sizeof(uint16_t)) != sizeof(uint16_t)) || (!_bgzfReadString(fp, sampleName)) || (bgzf_read(fp, &nchr, sizeof(int32_t)) != sizeof(int32_t))) {
+	std::cerr << "Fail to read coverage cache header for " << path.string() << std::endl;
+	return false;
+      }
+      hdr = bam_hdr_init();
+      hdr->n_targets = nchr;
+      hdr->target_len = (uint32_t*) calloc(nchr, sizeof(uint32_t));
+      hdr->target_name = (char**) calloc(nchr, sizeof(char*));
+      for(int32_t refIndex = 0; refIndex < nchr; ++refIndex) {
+	std::string name;
+	if ((!_bgzfReadString(fp, name)) || (bgzf_read(fp, &hdr->target_len[refIndex], sizeof(uint32_t)) != sizeof(uint32_t))) {
+	  std::cerr << "Fail to read coverage cache header for " << path.string() << std::endl;
+	  return false;
+	}
+	hdr->target_name[refIndex] = strdup(name.c_str());
+      }
+      if (profile != prof) {
+	std::cerr << "Coverage cache " << path.string() << " holds the " << profile << " profile, " << prof << " is required" << std::endl;
+	return false;
+      }
+      if (minQual != qual) {
+	std::cerr << "Coverage cache " << path.string() << " was built with min. mapping quality " << minQual << std::endl;
+	return false;
+      }
+
+      // Load index
+      std::ifstream idxIn((path.string() + ".idx").c_str(), std::ios_base::in | std::ios_base::binary);
+      uint32_t n = 0;
+      if ((!idxIn.read(magic, 8)) || (std::memcmp(magic, coverageMagic, 8) != 0) || (!idxIn.read((char*) &alignedBases, sizeof(uint64_t))) || (!idxIn.read((char*) &n, sizeof(uint32_t))) || (n != (uint32_t) nchr)) {
+	std::cerr << "Fail to open index for " << path.string() << std::endl;
+	return false;
+      }
+      offsets.resize(n);
+      for(uint32_t tid = 0; tid < n; ++tid) idxIn.read((char*) &offsets[tid], sizeof(int64_t));
+      idxIn.close();
+      return true;
+    }
+
+    // Decode the coverage of one chromosome
+    template<typename TCoverage>
+    inline bool
+    read(int32_t const tid, bool& flag, TCoverage& cov) {
+      int32_t rtid = -1;
+      uint8_t fl = 0;
+      uint32_t nruns = 0;
+      if ((bgzf_seek(fp, offsets[tid], SEEK_SET) < 0) || (bgzf_read(fp, &rtid, sizeof(int32_t)) != sizeof(int32_t)) || (rtid != tid) || (bgzf_read(fp, &fl, sizeof(uint8_t)) != sizeof(uint8_t)) || (bgzf_read(fp, &nruns, sizeof(uint32_t)) != sizeof(uint32_t))) {
+	std::cerr << "Corrupted coverage cache record for " << hdr->target_name[tid] << std::endl;
+	return false;
+      }
+      flag = (fl != 0);
+      cov.resize(hdr->target_len[tid]);
+      uint32_t pos = 0;
+      for(uint32_t i = 0; i < nruns; ++i) {
+	uint32_t run = 0;
+	uint16_t value = 0;
+	if ((bgzf_read(fp, &run, sizeof(uint32_t)) != sizeof(uint32_t)) || (bgzf_read(fp, &value, sizeof(uint16_t)) != sizeof(uint16_t)) || (pos + run > cov.size())) {
+	  std::cerr << "Corrupted coverage cache record for " << hdr->target_name[tid] << std::endl;
+	  return false;
+	}
+	std::fill(cov.begin() + pos, cov.begin() + pos + run, value);
+	pos += run;
+      }
+      return true;
+    }
+
+  private:
+    CoverageReader(CoverageReader const&);
+    CoverageReader& operator=(CoverageReader const&);
+  };
+
+}
+
+#endif
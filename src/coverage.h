@@ -0,0 +1,235 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <iostream>
+#include <vector>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <boost/tokenizer.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/progress.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <htslib/sam.h>
+
+#include "version.h"
+#include "util.h"
+#include "pipeline.h"
+#include "input.h"
+#include "covcache.h"
+#include "count_dna.h"
+#include "tracks.h"
+
+namespace bamstats
+{
+
+  struct CoverageConfig {
+    uint16_t minQual;
+    bool dna;
+    bool tracks;
+    std::string sampleName;
+    boost::filesystem::path bamFile;
+    boost::filesystem::path outprefix;
+  };
+
+
+  // One pass over the alignments, the coverage of every filter profile goes to its own cache
+  template<typename TConfig>
+  inline int32_t
+  coverageRun(TConfig const& c, InputContext& in) {
+
+#ifdef PROFILE
+    ProfilerStart("alfred.prof");
+#endif
+
+    // Load bam file
+    BamInput* bam = in.bam(c.bamFile, true);
+    if (bam == NULL) return 1;
+    samFile* samfile = bam->samfile;
+    bam_hdr_t* hdr = bam->hdr;
+    requireFields(samfile, samCoreFields);
+
+    // Filter profiles
+    CountDNAConfig dc;
+    dc.minQual = c.minQual;
+    dc.hasIntervalFile = false;
+    dc.hasCoverageCache = false;
+    dc.sampleName = c.sampleName;
+    dc.validChr.resize(hdr->n_targets, true);
+    dc.bamFile = c.bamFile;
+    TrackConfig tc;
+    tc.minQual = c.minQual;
+    tc.normalize = 0;
+    tc.hasCoverageCache = false;
+    tc.sampleName = c.sampleName;
+    tc.bamFile = c.bamFile;
+    CoverageWriter dnaCache;
+    CoverageWriter trackCache;
+    boost::scoped_ptr<DnaCountAnalysis<CountDNAConfig> > da;
+    boost::scoped_ptr<TrackAnalysis<TrackConfig> > ta;
+    if (c.dna) {
+      if (!dnaCache.open(boost::filesystem::path(c.outprefix.string() + ".dna.cov"), "dna", c.minQual, c.sampleName, hdr)) return 1;
+      da.reset(new DnaCountAnalysis<CountDNAConfig>(dc, hdr, &dnaCache));
+    }
+    if (c.tracks) {
+      if (!trackCache.open(boost::filesystem::path(c.outprefix.string() + ".tracks.cov"), "tracks", c.minQual, c.sampleName, hdr)) return 1;
+      ta.reset(new TrackAnalysis<TrackConfig>(tc, hdr, &trackCache));
+    }
+
+    // Parse BAM file
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
+    boost::progress_display show_progress( hdr->n_targets );
+    int32_t refIndex = -1;
+    int32_t lastTid = -1;
+    int32_t lastPos = -1;
+    bool unplaced = false;
+    BamRecordStream stream(samfile, hdr, NULL);
+    bam1_t* rec = NULL;
+    while ((rec = stream.next()) != NULL) {
+      // Every chromosome is written to the caches once, reads without a position come last
+      if (rec->core.tid >= 0) {
+	if ((unplaced) || (rec->core.tid < lastTid) || ((rec->core.tid == lastTid) && (rec->core.pos < lastPos))) {
+	  std::cerr << "Alignments are not coordinate-sorted: " << bam_get_qname(rec) << std::endl;
+	  return 1;
+	}
+	lastTid = rec->core.tid;
+	lastPos = rec->core.pos;
+      } else unplaced = true;
+      if ((!(rec->core.flag & BAM_FUNMAP)) && (rec->core.tid != refIndex)) {
+	refIndex = rec->core.tid;
+	++show_progress;
+      }
+      if ((da) && (!da->process(rec))) return 1;
+      if ((ta) && (!ta->process(rec))) return 1;
+    }
+
+    // Close caches
+    if ((da) && ((!da->finish()) || (!dnaCache.close(0)))) return 1;
+    if ((ta) && ((!ta->finish()) || (!trackCache.close(ta->totalPairs)))) return 1;
+
+    now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+
+#ifdef PROFILE
+    ProfilerStop();
+#endif
+
+    return 0;
+  }
+
+
+  int coverage(int argc, char **argv) {
+    CoverageConfig c;
+    InputContext in;
+    std::string profiles;
+
+    // Parameter
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ("map-qual,m", boost::program_options::value<uint16_t>(&c.minQual)->default_value(10), "min. mapping quality")
+      ("profile,p", boost::program_options::value<std::string>(&profiles)->default_value("dna,tracks"), "filter profiles [dna|tracks], comma-separated")
+      ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outprefix)->default_value("coverage"), "output prefix, writes <prefix>.<profile>.cov")
+      ;
+
+    boost::program_options::options_description hidden("Hidden options");
+    hidden.add_options()
+      ("input-file", boost::program_options::value<boost::filesystem::path>(&c.bamFile), "input bam file")
+      ;
+
+    boost::program_options::positional_options_description pos_args;
+    pos_args.add("input-file", -1);
+
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic).add(hidden);
+    boost::program_options::options_description visible_options;
+    visible_options.add(generic);
+
+    // Parse command-line
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmdline_options).positional(pos_args).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if ((vm.count("help")) || (!vm.count("input-file"))) {
+      std::cout << std::endl;
+      std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] <aligned.bam>" << std::endl;
+      std::cout << visible_options << "\n";
+      std::cout << "Profiles (use the cache in place of the BAM file with the same -m):" << std::endl;
+      std::cout << "    dna          fragment mid-points, input of count_dna" << std::endl;
+      std::cout << "    tracks       paired-end read coverage, input of tracks" << std::endl;
+      std::cout << std::endl;
+      return 1;
+    }
+
+    // Filter profiles
+    c.dna = false;
+    c.tracks = false;
+    typedef boost::tokenizer< boost::char_separator<char> > Tokenizer;
+    boost::char_separator<char> sep(",");
+    Tokenizer tokens(profiles, sep);
+    for(Tokenizer::iterator tokIter = tokens.begin(); tokIter != tokens.end(); ++tokIter) {
+      if (*tokIter == "dna") c.dna = true;
+      else if (*tokIter == "tracks") c.tracks = true;
+      else {
+	std::cerr << "Unknown filter profile: " << *tokIter << std::endl;
+	return 1;
+      }
+    }
+    if ((!c.dna) && (!c.tracks)) {
+      std::cerr << "No filter profile selected!" << std::endl;
+      return 1;
+    }
+
+    // Check bam file, coverage is computed in a single sequential pass
+    BamInput* bam = in.bam(c.bamFile, true);
+    if (bam == NULL) return 1;
+    std::string sampleName;
+    if (!getSMTag(std::string(bam->hdr->text), c.bamFile.stem().string(), sampleName)) {
+      std::cerr << "Only one sample (@RG:SM) is allowed per input BAM file " << c.bamFile.string() << std::endl;
+      return 1;
+    } else c.sampleName = sampleName;
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "alfred ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    return coverageRun(c, in);
+  }
+
+}
+
+#endif
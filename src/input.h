@@ -0,0 +1,249 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <iostream>
+#include <vector>
+#include <map>
+
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <htslib/faidx.h>
+#include <htslib/sam.h>
+#include <htslib/vcf.h>
+
+
+namespace bamstats
+{
+
+  // Index of one alignment file is loaded or built by one job at a time, jobs of serve and batch may share it
+  inline boost::mutex&
+  indexMutex(boost::filesystem::path const& path) {
+    static boost::mutex mtx;
+    static std::map<std::string, boost::shared_ptr<boost::mutex> > locks;
+    boost::mutex::scoped_lock lock(mtx);
+    boost::shared_ptr<boost::mutex>& m = locks[boost::filesystem::absolute(path).string()];
+    if (!m) m.reset(new boost::mutex());
+    return *m;
+  }
+
+  // One alignment file, the index is only loaded when a command asks for it
+  struct BamInput {
+    boost::filesystem::path path;
+    samFile* samfile;
+    bam_hdr_t* hdr;
+    hts_idx_t* idx;
+
+    BamInput() : samfile(NULL), hdr(NULL), idx(NULL) {}
+
+    ~BamInput() {
+      if (idx != NULL) hts_idx_destroy(idx);
+      if (hdr != NULL) bam_hdr_destroy(hdr);
+      if (samfile != NULL) sam_close(samfile);
+    }
+
+    // Standard input ("-") or a named pipe, only readable front to back
+    inline bool
+    isStream() const {
+      return ((path.string() == "-") || ((boost::filesystem::exists(path)) && (!boost::filesystem::is_regular_file(path)) && (!boost::filesystem::is_directory(path))));
+    }
+
+    inline bool
+    open(boost::filesystem::path const& p, bool const sequential) {
+      path = p;
+      if ((sequential) && (isStream())) {
+	// Nothing to check, the header read below fails on empty input
+      } else if (!(boost::filesystem::exists(path) && boost::filesystem::is_regular_file(path) && boost::filesystem::file_size(path))) {
+	std::cerr << "Alignment file is missing: " << path.string() << std::endl;
+	return false;
+      }
+      samfile = sam_open(path.string().c_str(), "r");
+      if (samfile == NULL) {
+	std::cerr << "Fail to open file " << path.string() << std::endl;
+	return false;
+      }
+      hdr = sam_hdr_read(samfile);
+      if (hdr == NULL) {
+	std::cerr << "Fail to open header for " << path.string() << std::endl;
+	return false;
+      }
+      return true;
+    }
+
+    // Load the index on first use, a missing index is only built if asked for
+    inline hts_idx_t*
+    index(bool const build) {
+      if ((idx == NULL) && (isStream())) {
+	std::cerr << "An index is required, streamed input is not supported for " << path.string() << std::endl;
+	return NULL;
+      }
+      if (idx == NULL) {
+	boost::mutex::scoped_lock lock(indexMutex(path));
+	idx = sam_index_load(samfile, path.string().c_str());
+	if ((idx == NULL) && (build)) {
+	  if (bam_index_build(path.string().c_str(), 0) == 0) idx = sam_index_load(samfile, path.string().c_str());
+	}
+	if (idx == NULL) std::cerr << "Fail to open index for " << path.string() << std::endl;
+      }
+      return idx;
+    }
+
+    // Index if there is one, used by commands that only take a shortcut with it
+    inline hts_idx_t*
+    existingIndex() {
+      if ((idx == NULL) && (!isStream())) {
+	boost::mutex::scoped_lock lock(indexMutex(path));
+	idx = sam_index_load(samfile, path.string().c_str());
+      }
+      return idx;
+    }
+
+  private:
+    BamInput(BamInput const&);
+    BamInput& operator=(BamInput const&);
+  };
+
+  // Output alignment file, closed on every exit path
+  struct BamOutput {
+    samFile* fp;
+
+    BamOutput() : fp(NULL) {}
+
+    ~BamOutput() {
+      close();
+    }
+
+    inline bool
+    open(boost::filesystem::path const& p, char const* mode) {
+      fp = sam_open(p.string().c_str(), mode);
+      if (fp == NULL) std::cerr << "Fail to open file " << p.string() << std::endl;
+      return (fp != NULL);
+    }
+
+    inline int
+    close() {
+      int ret = (fp != NULL) ? sam_close(fp) : 0;
+      fp = NULL;
+      return ret;
+    }
+
+  private:
+    BamOutput(BamOutput const&);
+    BamOutput& operator=(BamOutput const&);
+  };
+
+  // All input handles of one command, opened once during option parsing and handed to the run function
+  struct InputContext {
+    std::vector<BamInput*> bams;
+    faidx_t* fai;
+    htsFile* bcffile;
+    bcf_hdr_t* bcfhdr;
+    hts_idx_t* bcfidx;
+
+    InputContext() : fai(NULL), bcffile(NULL), bcfhdr(NULL), bcfidx(NULL) {}
+
+    ~InputContext() {
+      for(uint32_t i = 0; i < bams.size(); ++i) delete bams[i];
+      if (fai != NULL) fai_destroy(fai);
+      if (bcfidx != NULL) hts_idx_destroy(bcfidx);
+      if (bcfhdr != NULL) bcf_hdr_destroy(bcfhdr);
+      if (bcffile != NULL) bcf_close(bcffile);
+    }
+
+    // Opens an alignment file, or returns the handle if another parser of the same command opened it already
+    // Sequential readers also accept standard input and named pipes
+    inline BamInput*
+    bam(boost::filesystem::path const& p, bool const sequential) {
+      for(uint32_t i = 0; i < bams.size(); ++i)
+	if (bams[i]->path == p) return bams[i];
+      BamInput* b = new BamInput();
+      if (!b->open(p, sequential)) {
+	delete b;
+	return NULL;
+      }
+      bams.push_back(b);
+      return b;
+    }
+
+    inline bool
+    opened(boost::filesystem::path const& p) const {
+      for(uint32_t i = 0; i < bams.size(); ++i)
+	if (bams[i]->path == p) return true;
+      return false;
+    }
+
+    inline bool
+    genome(boost::filesystem::path const& p) {
+      if (fai != NULL) return true;
+      if (!(boost::filesystem::exists(p) && boost::filesystem::is_regular_file(p) && boost::filesystem::file_size(p))) {
+	std::cerr << "Input reference file is missing: " << p.string() << std::endl;
+	return false;
+      }
+      fai = fai_load(p.string().c_str());
+      if (fai == NULL) {
+	if (fai_build(p.string().c_str()) == -1) {
+	  std::cerr << "Fail to open genome fai index for " << p.string() << std::endl;
+	  return false;
+	} else fai = fai_load(p.string().c_str());
+      }
+      return (fai != NULL);
+    }
+
+    inline bool
+    variants(boost::filesystem::path const& p) {
+      if (bcffile != NULL) return true;
+      if (!(boost::filesystem::exists(p) && boost::filesystem::is_regular_file(p) && boost::filesystem::file_size(p))) {
+	std::cerr << "Input VCF/BCF file is missing: " << p.string() << std::endl;
+	return false;
+      }
+      bcffile = bcf_open(p.string().c_str(), "r");
+      if (bcffile == NULL) {
+	std::cerr << "Fail to open file " << p.string() << std::endl;
+	return false;
+      }
+      bcfidx = bcf_index_load(p.string().c_str());
+      if (bcfidx == NULL) {
+	std::cerr << "Fail to open index file for " << p.string() << std::endl;
+	return false;
+      }
+      bcfhdr = bcf_hdr_read(bcffile);
+      if (bcfhdr == NULL) {
+	std::cerr << "Fail to open header for " << p.string() << std::endl;
+	return false;
+      }
+      return true;
+    }
+
+  private:
+    InputContext(InputContext const&);
+    InputContext& operator=(InputContext const&);
+  };
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef INTERVALTREE_H
+#define INTERVALTREE_H
+
+#include <vector>
+#include <algorithm>
+
+#include "util.h"
+
+namespace bamstats
+{
+
+  // Implicit augmented interval tree over start-sorted, right-open intervals
+  template<typename TInterval>
+  struct IntervalTree {
+    typedef std::vector<TInterval> TIntervals;
+    TIntervals itv;
+    std::vector<int32_t> maxEnd;
+    int32_t rootK;
+
+    template<typename TRegions>
+    explicit IntervalTree(TRegions const& regions) : rootK(-1) {
+      itv.reserve(regions.size());
+      for(typename TRegions::const_iterator it = regions.begin(); it != regions.end(); ++it)
+	if (it->start < it->end) itv.push_back(*it);
+      std::sort(itv.begin(), itv.end(), SortIntervalStart<TInterval>());
+      _index();
+    }
+
+    inline uint32_t size() const { return itv.size(); }
+
+    // Node i at level k spans the sorted intervals [i - 2^k + 1, i + 2^k - 1]
+    inline void
+    _index() {
+      int64_t n = itv.size();
+      maxEnd.resize(n);
+      if (n == 0) return;
+      int64_t lastI = 0;
+      int32_t last = 0;
+      for(int64_t i = 0; i < n; i += 2) {
+	lastI = i;
+	last = maxEnd[i] = itv[i].end;
+      }
+      int32_t k = 1;
+      for(; ((int64_t) 1 << k) <= n; ++k) {
+	int64_t x = (int64_t) 1 << (k - 1);
+	int64_t i0 = (x << 1) - 1;
+	int64_t step = x << 2;
+	for(int64_t i = i0; i < n; i += step) {
+	  int32_t el = maxEnd[i - x];
+	  int32_t er = (i + x < n) ? maxEnd[i + x] : last;
+	  maxEnd[i] = std::max(itv[i].end, std::max(el, er));
+	}
+	lastI = ((lastI >> k) & 1) ? lastI - x : lastI + x;
+	if ((lastI < n) && (maxEnd[lastI] > last)) last = maxEnd[lastI];
+      }
+      rootK = k - 1;
+    }
+
+    // Indices of all intervals overlapping [qs, qe), sorted by interval start
+    inline void
+    overlap(int32_t qs, int32_t qe, std::vector<uint32_t>& hits) const {
+      hits.clear();
+      int64_t n = itv.size();
+      if (n == 0) return;
+      struct Node { int64_t x; int32_t k; int32_t w; };
+      Node stack[64];
+      int32_t t = 0;
+      stack[t].k = rootK;
+      stack[t].x = ((int64_t) 1 << rootK) - 1;
+      stack[t++].w = 0;
+      while (t) {
+	Node z = stack[--t];
+	if (z.k <= 3) {
+	  // Small subtree, scan all nodes
+	  int64_t i0 = z.x >> z.k << z.k;
+	  int64_t i1 = std::min(n, i0 + ((int64_t) 1 << (z.k + 1)) - 1);
+	  for(int64_t i = i0; ((i < i1) && (itv[i].start < qe)); ++i)
+	    if (qs < itv[i].end) hits.push_back(i);
+	} else if (z.w == 0) {
+	  // Revisit z after its left child
+	  int64_t y = z.x - ((int64_t) 1 << (z.k - 1));
+	  stack[t].k = z.k;
+	  stack[t].x = z.x;
+	  stack[t++].w = 1;
+	  if ((y >= n) || (maxEnd[y] > qs)) {
+	    stack[t].k = z.k - 1;
+	    stack[t].x = y;
+	    stack[t++].w = 0;
+	  }
+	} else if ((z.x < n) && (itv[z.x].start < qe)) {
+	  if (qs < itv[z.x].end) hits.push_back(z.x);
+	  stack[t].k = z.k - 1;
+	  stack[t].x = z.x + ((int64_t) 1 << (z.k - 1));
+	  stack[t++].w = 0;
+	}
+      }
+    }
+  };
+
+}
+
+#endif
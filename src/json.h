@@ -24,29 +24,34 @@ Contact: Tobias Rausch (rausch@embl.de)
 #ifndef JSON_H
 #define JSON_H
 
+#include <sstream>
+#include <limits>
+
 #include <boost/progress.hpp>
 #include <boost/iostreams/filtering_streambuf.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/copy.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 
 #include "tsv.h"
 
 namespace bamstats
 {
-  
 
-  template<typename TConfig, typename TRGMap>
-  inline void
-  qcJsonOut(TConfig const& c, bam_hdr_t const* hdr, TRGMap const& rgMap, BedCounts const& be, ReferenceFeatures const& rf) {
-    std::string filename = c.outfile.string();
-    if (c.format == "both") filename += ".json.gz";
-    
-    boost::iostreams::filtering_ostream rfile;
-    rfile.push(boost::iostreams::gzip_compressor());
-    rfile.push(boost::iostreams::file_sink(filename.c_str(), std::ios_base::out | std::ios_base::binary));
+  // JSON has no NaN or infinity, ratios of empty counts are written as null
+  inline std::string
+  _jsonRatio(double const v) {
+    if ((v != v) || (v > std::numeric_limits<double>::max()) || (v < -std::numeric_limits<double>::max())) return "null";
+    char buf[32];
+    return std::string(buf, formatDouble(v, buf, sizeof(buf)));
+  }
 
+
+  template<typename TWriter, typename TConfig, typename TRGMap>
+  inline void
+  _qcJson(TWriter& rfile, TConfig const& c, bam_hdr_t const* hdr, TRGMap const& rgMap, BedCounts const& be, ReferenceFeatures const& rf) {
     // Sample information
     rfile << "{\"samples\": [{";
     rfile << "\"id\": \"" << c.sampleName << "\",";
@@ -81,26 +86,26 @@ namespace bamstats
 	rfile << "\"" << c.sampleName << "\"" << ",";
 	rfile << "\"" << itRg->first << "\"" << ",";
 	rfile << itRg->second.rc.qcfail << ",";
-	rfile << (double) itRg->second.rc.qcfail / (double) totalReadCount << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.qcfail / (double) totalReadCount) << ",";
 	rfile << itRg->second.rc.dup << ",";
-	rfile << (double) itRg->second.rc.dup / (double) totalReadCount << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.dup / (double) totalReadCount) << ",";
 	rfile << itRg->second.rc.unmap << ",";
-	rfile << (double) itRg->second.rc.unmap / (double) totalReadCount << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.unmap / (double) totalReadCount) << ",";
 	rfile << mappedCount << ",";
-	rfile << (double) mappedCount / (double) totalReadCount << ",";
+	rfile << _jsonRatio((double) mappedCount / (double) totalReadCount) << ",";
 	rfile << itRg->second.rc.mapped1 << ",";
 	rfile << itRg->second.rc.mapped2 << ",";
-	rfile << (double) itRg->second.rc.mapped2 / (double) itRg->second.rc.mapped1 << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.mapped2 / (double) itRg->second.rc.mapped1) << ",";
 	rfile << itRg->second.rc.forward << ",";
-	rfile << (double) itRg->second.rc.forward / (double) mappedCount << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.forward / (double) mappedCount) << ",";
 	rfile << itRg->second.rc.reverse << ",";
-	rfile << (double) itRg->second.rc.reverse / (double) mappedCount << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.reverse / (double) mappedCount) << ",";
 	rfile << itRg->second.rc.secondary << ",";
-	rfile << (double) itRg->second.rc.secondary / (double) mappedCount << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.secondary / (double) mappedCount) << ",";
 	rfile << itRg->second.rc.supplementary << ",";
-	rfile << (double) itRg->second.rc.supplementary / (double) mappedCount << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.supplementary / (double) mappedCount) << ",";
 	rfile << itRg->second.rc.spliced << ",";
-	rfile << (double) itRg->second.rc.spliced / (double) mappedCount << ",";
+	rfile << _jsonRatio((double) itRg->second.rc.spliced / (double) mappedCount) << ",";
 
 	// Paired counts
 	int64_t paired = itRg->second.pc.paired / 2;
@@ -132,20 +137,20 @@ namespace bamstats
 	rfile << rf.ncount << ",";
 	rfile << alignedbases << ",";
 	rfile << itRg->second.bc.matchCount << ",";
-	rfile << (double) itRg->second.bc.matchCount / (double) alignedbases << ",";
+	rfile << _jsonRatio((double) itRg->second.bc.matchCount / (double) alignedbases) << ",";
 	rfile << itRg->second.bc.mismatchCount << ",";
-	rfile << (double) itRg->second.bc.mismatchCount / (double) alignedbases << ",";
+	rfile << _jsonRatio((double) itRg->second.bc.mismatchCount / (double) alignedbases) << ",";
 	rfile << itRg->second.bc.delCount << ",";
-	rfile << (double) itRg->second.bc.delCount / (double) alignedbases << ",";
-	rfile << delFrac << ",";
+	rfile << _jsonRatio((double) itRg->second.bc.delCount / (double) alignedbases) << ",";
+	rfile << _jsonRatio(delFrac) << ",";
 	rfile << itRg->second.bc.insCount << ",";
-	rfile << (double) itRg->second.bc.insCount / (double) alignedbases << ",";
-	rfile << insFrac << ",";
+	rfile << _jsonRatio((double) itRg->second.bc.insCount / (double) alignedbases) << ",";
+	rfile << _jsonRatio(insFrac) << ",";
 	rfile << itRg->second.bc.softClipCount << ",";
-	rfile << (double) itRg->second.bc.softClipCount / (double) alignedbases << ",";
+	rfile << _jsonRatio((double) itRg->second.bc.softClipCount / (double) alignedbases) << ",";
 	rfile << itRg->second.bc.hardClipCount << ",";
-	rfile << (double) itRg->second.bc.hardClipCount / (double) alignedbases << ",";
-	rfile << errRate << ",";
+	rfile << _jsonRatio((double) itRg->second.bc.hardClipCount / (double) alignedbases) << ",";
+	rfile << _jsonRatio(errRate) << ",";
 
 	// Median coverage, read length, etc.
 	int32_t deflayout = _defLayout(itRg);
@@ -161,11 +166,11 @@ namespace bamstats
 	rfile << "\"" << _defLayoutToString(deflayout) << "\"" << ",";
 	rfile << medISize << ",";
 	rfile <<  medianFromHistogram(itRg->second.bc.bpWithCoverage) << ",";
-	rfile << ssdcov << ",";
+	rfile << _jsonRatio(ssdcov) << ",";
 	rfile << itRg->second.bc.nd << ",";
-	rfile << fraccovbp << ",";
-	rfile << pbc1 << ",";
-	rfile << pbc2 << ",";
+	rfile << _jsonRatio(fraccovbp) << ",";
+	rfile << _jsonRatio(pbc1) << ",";
+	rfile << _jsonRatio(pbc2) << ",";
 	rfile << medianFromHistogram(itRg->second.qc.qcount);
 
 	// Bed metrics
@@ -178,20 +183,20 @@ namespace bamstats
 	  rfile << ",";
 	  rfile << rf.totalBedSize << ",";
 	  rfile << alignedBedBases << ",";
-	  rfile << fractioninbed << ",";
-	  rfile << enrichment;
+	  rfile << _jsonRatio(fractioninbed) << ",";
+	  rfile << _jsonRatio(enrichment);
 	}
 	if (c.isMitagged) {
 	  rfile << ",";
 	  rfile << itRg->second.rc.mitagged << ",";
-	  rfile << (double) itRg->second.rc.mitagged / (double) totalReadCount << ",";
+	  rfile << _jsonRatio((double) itRg->second.rc.mitagged / (double) totalReadCount) << ",";
 	  rfile << itRg->second.rc.umi.count();
 	}
 	if (c.isHaplotagged) {
 	  int32_t n50ps = n50PhasedBlockLength(itRg->second.rc.brange);
 	  rfile << ",";
 	  rfile << itRg->second.rc.haplotagged << ",";
-	  rfile << (double) itRg->second.rc.haplotagged / (double) totalReadCount << ",";
+	  rfile << _jsonRatio((double) itRg->second.rc.haplotagged / (double) totalReadCount) << ",";
 	  rfile << phasedBlocks(itRg->second.rc.brange) << ",";
 	  rfile << n50ps;
 	}
@@ -214,7 +219,7 @@ namespace bamstats
       rfile << "\"metrics\": [";
 
       // Base content
-      {
+      if (c.metrics & qcBaseComposition) {
 	rfile << "{\"id\": \"baseContent\",";
 	rfile << "\"title\": \"Base content distribution\",";
 	rfile << "\"x\": {\"data\": [{\"values\": [";
@@ -276,7 +281,8 @@ namespace bamstats
       {
 	uint32_t lastValidRL = _lastNonZeroIdx(itRg->second.rc.lRc, itRg->second.rc.maxReadLength);
 	float lastFrac = _lastPercentage(itRg->second.rc.lRc, itRg->second.rc.maxReadLength);
-	rfile << ",{\"id\": \"readLength\",";
+	if (c.metrics & qcBaseComposition) rfile << ",";
+	rfile << "{\"id\": \"readLength\",";
 	rfile << "\"title\": \"Read length distribution\",";
 	if (lastFrac > 0) {
 	  rfile << "\"subtitle\": \"" << lastFrac << "% of all reads >= " << itRg->second.rc.maxReadLength << "bp\",";
@@ -296,7 +302,7 @@ namespace bamstats
       }
       
       // Mean Base Quality
-      {
+      if (c.metrics & qcBaseComposition) {
 	rfile << ",{\"id\": \"baseQuality\",";	
 	rfile << "\"title\": \"Mean base quality distribution\",";
 	rfile << "\"x\": {\"data\": [{\"values\": [";
@@ -335,7 +341,7 @@ namespace bamstats
       }
 
       // Coverage Histogram
-      {
+      if (c.metrics & qcCoverage) {
 	uint32_t lastValidCO = _lastNonZeroIdx(itRg->second.bc.bpWithCoverage, itRg->second.bc.maxCoverage);
 	float lastFrac = _lastPercentage(itRg->second.bc.bpWithCoverage, itRg->second.bc.maxCoverage);
 	rfile << ",{\"id\": \"coverageHistogram\", \"title\": \"Coverage histogram\",";
@@ -357,7 +363,7 @@ namespace bamstats
       }
 
       // Insert Size Histogram
-      {
+      if (c.metrics & qcInsertSize) {
 	uint32_t lastValidIS = _lastNonZeroIdxISize(itRg->second.pc, itRg->second.pc.maxInsertSize);	
 	// Only output for PE data
 	if (lastValidIS > 0) {
@@ -407,7 +413,7 @@ namespace bamstats
       }
 
       // Bed specific data
-      if (c.hasRegionFile) {
+      if ((c.hasRegionFile) && (c.metrics & qcCoverage)) {
 	// On target rate
 	{
 	  rfile << ",{\"id\": \"onTarget\",";
@@ -450,7 +456,7 @@ namespace bamstats
       }
 
       // InDel Size
-      {
+      if (c.metrics & qcErrors) {
 	rfile << ",{\"id\": \"indelSize\", \"title\": \"InDel Size\",";
 	rfile << "\"x\": {\"data\": [{\"values\": [";
 	uint32_t lastSize = itRg->second.bc.delSize.size();
@@ -479,7 +485,7 @@ namespace bamstats
 
 
       // GC Content
-      {
+      if (c.metrics & qcGC) {
 	rfile << ",{\"id\": \"gcContent\", \"title\": \"GC content\",";
 	rfile << "\"x\": {\"data\": [{\"values\": [";
 	double refTotal = 0;
@@ -525,7 +531,7 @@ namespace bamstats
       }
 
       // Homopolymer InDel Context
-      {
+      if (c.metrics & qcErrors) {
 	rfile << ",{\"id\": \"homIndelContext\", \"title\": \"InDel Context\",";
 	rfile << "\"x\": {\"data\": [{\"values\": [\"A\",\"C\",\"G\",\"T\",\"N\",\"None\"]";
 	rfile << "}], \"axis\": {\"title\": \"Homopolymer\"}},";
@@ -571,7 +577,7 @@ namespace bamstats
 	    rfile << gcfrac << ",";
 	    rfile << itRg->second.rc.mappedchr[i] << ",";
 	    rfile << frac << ",";
-	    rfile << obsexprat;
+	    rfile << _jsonRatio(obsexprat);
 	    rfile << "]";
 	  }
 	}
@@ -583,7 +589,156 @@ namespace bamstats
       rfile << "]}";
     }
     rfile << "]}]}" << std::endl;
-    rfile.pop();
+  }
+
+  template<typename TConfig, typename TRGMap>
+  inline void
+  qcJsonOut(TConfig const& c, bam_hdr_t const* hdr, TRGMap const& rgMap, BedCounts const& be, ReferenceFeatures const& rf) {
+    std::string filename = c.outfile.string();
+    if (c.format == "both") filename += ".json.gz";
+    GzipWriter rfile(filename);
+    _qcJson(rfile, c, hdr, rgMap, be, rf);
+    rfile.close();
+  }
+
+
+  // Chunked JSON: magic, length of the index (4 bytes, little endian), the index and one gzip member per chunk
+  // The index gives the summary and every metric as [offset, length] relative to the end of the index, so a viewer reads only what it shows
+  static char const jsonChunkMagic[8] = {'A', 'L', 'F', 'J', 'S', 'O', 'N', 'C'};
+
+  typedef std::pair<std::size_t, std::size_t> TJsonRange;
+  typedef std::vector<std::pair<std::string, TJsonRange> > TJsonChildren;
+
+  inline std::size_t
+  _jsonSkip(std::string const& s, std::size_t pos) {
+    while ((pos < s.size()) && ((s[pos] == ' ') || (s[pos] == '\t') || (s[pos] == '\n') || (s[pos] == '\r'))) ++pos;
+    return pos;
+  }
+
+  // End of the value that starts at pos
+  inline std::size_t
+  _jsonValueEnd(std::string const& s, std::size_t pos) {
+    int32_t depth = 0;
+    bool inString = false;
+    bool escape = false;
+    for(; pos < s.size(); ++pos) {
+      char ch = s[pos];
+      if (inString) {
+	if (escape) escape = false;
+	else if (ch == '\\') escape = true;
+	else if (ch == '"') {
+	  inString = false;
+	  if (!depth) return pos + 1;
+	}
+      }
+      else if (ch == '"') inString = true;
+      else if ((ch == '{') || (ch == '[')) ++depth;
+      else if ((ch == '}') || (ch == ']')) {
+	if (!depth) return pos;
+	if (!--depth) return pos + 1;
+      }
+      else if ((!depth) && ((ch == ',') || (ch == ' ') || (ch == '\t') || (ch == '\n') || (ch == '\r'))) return pos;
+    }
+    return pos;
+  }
+
+  // Members of an object or elements of an array, elements have an empty key
+  inline void
+  _jsonChildren(std::string const& s, TJsonRange const& r, TJsonChildren& children) {
+    children.clear();
+    if ((r.first >= r.second) || ((s[r.first] != '{') && (s[r.first] != '['))) return;
+    bool isObject = (s[r.first] == '{');
+    std::size_t pos = _jsonSkip(s, r.first + 1);
+    while ((pos + 1 < r.second) && (s[pos] != '}') && (s[pos] != ']')) {
+      std::string key;
+      if (isObject) {
+	std::size_t keyEnd = _jsonValueEnd(s, pos);
+	key = s.substr(pos + 1, keyEnd - pos - 2);
+	pos = _jsonSkip(s, _jsonSkip(s, keyEnd) + 1);
+      }
+      std::size_t valueEnd = _jsonValueEnd(s, pos);
+      children.push_back(std::make_pair(key, TJsonRange(pos, valueEnd)));
+      pos = _jsonSkip(s, valueEnd);
+      if ((pos < r.second) && (s[pos] == ',')) pos = _jsonSkip(s, pos + 1);
+    }
+  }
+
+  inline TJsonRange
+  _jsonMember(std::string const& s, TJsonRange const& r, std::string const& key) {
+    TJsonChildren children;
+    _jsonChildren(s, r, children);
+    for(uint32_t i = 0; i < children.size(); ++i)
+      if (children[i].first == key) return children[i].second;
+    return TJsonRange(0, 0);
+  }
+
+  // The value as it is written in the JSON text, null if it is missing
+  inline std::string
+  _jsonRaw(std::string const& s, TJsonRange const& r) {
+    if (r.first >= r.second) return "null";
+    return s.substr(r.first, r.second - r.first);
+  }
+
+  // Compresses a value into the chunk area and writes its position to the index
+  inline void
+  _jsonChunk(std::string const& s, TJsonRange const& r, std::string& chunks, StringWriter& index) {
+    std::size_t offset = chunks.size();
+    {
+      boost::iostreams::filtering_ostream gz;
+      gz.push(boost::iostreams::gzip_compressor());
+      gz.push(boost::iostreams::back_inserter(chunks));
+      gz.write(s.c_str() + r.first, r.second - r.first);
+    }
+    index << "[" << offset << ", " << (chunks.size() - offset) << "]";
+  }
+
+  template<typename TConfig, typename TRGMap>
+  inline void
+  qcJsonChunkedOut(TConfig const& c, bam_hdr_t const* hdr, TRGMap const& rgMap, BedCounts const& be, ReferenceFeatures const& rf) {
+    // Same JSON as qcJsonOut, cut into the summary and one chunk per metric
+    StringWriter json;
+    _qcJson(json, c, hdr, rgMap, be, rf);
+    std::string const& s = json.str;
+    std::string chunks;
+    StringWriter index;
+    index << "{\"format\": \"alfred-chunked-json\", \"version\": 1, \"samples\": [";
+    TJsonChildren samples;
+    _jsonChildren(s, _jsonMember(s, TJsonRange(_jsonSkip(s, 0), s.size()), "samples"), samples);
+    for(uint32_t i = 0; i < samples.size(); ++i) {
+      TJsonRange const& sample = samples[i].second;
+      if (i > 0) index << ", ";
+      index << "{\"id\": " << _jsonRaw(s, _jsonMember(s, sample, "id")) << ", \"summary\": ";
+      _jsonChunk(s, _jsonMember(s, sample, "summary"), chunks, index);
+      index << ", \"readGroups\": [";
+      TJsonChildren readGroups;
+      _jsonChildren(s, _jsonMember(s, sample, "readGroups"), readGroups);
+      for(uint32_t j = 0; j < readGroups.size(); ++j) {
+	TJsonRange const& rg = readGroups[j].second;
+	if (j > 0) index << ", ";
+	index << "{\"id\": " << _jsonRaw(s, _jsonMember(s, rg, "id")) << ", \"metrics\": [";
+	TJsonChildren metrics;
+	_jsonChildren(s, _jsonMember(s, rg, "metrics"), metrics);
+	for(uint32_t k = 0; k < metrics.size(); ++k) {
+	  TJsonRange const& metric = metrics[k].second;
+	  if (k > 0) index << ", ";
+	  index << "{\"id\": " << _jsonRaw(s, _jsonMember(s, metric, "id")) << ", \"title\": " << _jsonRaw(s, _jsonMember(s, metric, "title")) << ", \"type\": " << _jsonRaw(s, _jsonMember(s, metric, "type")) << ", \"chunk\": ";
+	  _jsonChunk(s, metric, chunks, index);
+	  index << "}";
+	}
+	index << "]}";
+      }
+      index << "]}";
+    }
+    index << "]}";
+
+    std::ofstream ofile(c.outfile.string().c_str(), std::ios_base::out | std::ios_base::binary);
+    uint32_t len = index.str.size();
+    char lenBytes[4] = {(char) (len & 0xff), (char) ((len >> 8) & 0xff), (char) ((len >> 16) & 0xff), (char) ((len >> 24) & 0xff)};
+    ofile.write(jsonChunkMagic, sizeof(jsonChunkMagic));
+    ofile.write(lenBytes, sizeof(lenBytes));
+    ofile.write(index.str.c_str(), index.str.size());
+    ofile.write(chunks.c_str(), chunks.size());
+    ofile.close();
   }
  
 }
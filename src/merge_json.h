@@ -0,0 +1,320 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+
+#ifndef MERGE_JSON_H
+#define MERGE_JSON_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/file.hpp>
+
+#include "version.h"
+#include "util.h"
+#include "pipeline.h"
+#include "writer.h"
+
+namespace bamstats
+{
+
+  struct MergeJsonConfig {
+    uint16_t nthreads;
+    boost::filesystem::path outfile;
+    std::vector<boost::filesystem::path> files;
+  };
+
+  typedef BoundedQueue<std::string*> TJsonChunkQueue;
+
+  // Copies the elements of the top-level "samples" array, without the brackets and leading white space
+  struct JsonSamplesScanner {
+    int32_t depth;
+    int32_t state;  // 0 = searching, 1 = inside the samples array, 2 = done
+    bool inString;
+    bool escape;
+    bool isValue;
+    bool started;
+    std::string token;
+    std::string key;
+
+    JsonSamplesScanner() : depth(0), state(0), inString(false), escape(false), isValue(false), started(false) {}
+
+    inline void
+    feed(char const* buf, std::size_t const n, std::string& out) {
+      for(std::size_t i = 0; ((i < n) && (state != 2)); ++i) {
+	char c = buf[i];
+	if (inString) {
+	  if (escape) escape = false;
+	  else if (c == '\\') escape = true;
+	  else if (c == '"') {
+	    inString = false;
+	    if (state == 0) key = token;
+	  }
+	  if ((state == 0) && (inString)) token += c;
+	} else if (c == '"') {
+	  inString = true;
+	  token.clear();
+	} else if ((c == '[') || (c == '{')) {
+	  if ((state == 0) && (c == '[') && (depth == 1) && (isValue)) {
+	    state = 1;
+	    ++depth;
+	    continue;
+	  }
+	  ++depth;
+	} else if ((c == ']') || (c == '}')) {
+	  if ((state == 1) && (depth == 2)) {
+	    state = 2;
+	    continue;
+	  }
+	  --depth;
+	} else if ((state == 0) && (c == ':')) {
+	  isValue = ((depth == 1) && (key == "samples"));
+	  continue;
+	}
+	if (state == 0) {
+	  if ((c != ' ') && (c != '\t') && (c != '\n') && (c != '\r')) isValue = false;
+	} else {
+	  if ((!started) && ((c == ' ') || (c == '\t') || (c == '\n') || (c == '\r'))) continue;
+	  started = true;
+	  out += c;
+	}
+      }
+    }
+  };
+
+  // Decompresses input files in turn, the samples of each file go to the queue of that file
+  struct JsonInputStage {
+    static const std::size_t chunkSize = 1 << 18;
+
+    std::vector<boost::filesystem::path> const& files;
+    std::vector<TJsonChunkQueue*>& queues;
+    std::vector<uint8_t>& failed;
+    uint32_t& nextFile;
+    boost::mutex& mtx;
+
+    JsonInputStage(std::vector<boost::filesystem::path> const& f, std::vector<TJsonChunkQueue*>& q, std::vector<uint8_t>& fl, uint32_t& n, boost::mutex& m) : files(f), queues(q), failed(fl), nextFile(n), mtx(m) {}
+
+    void operator()() {
+      while (true) {
+	uint32_t k = 0;
+	{
+	  boost::mutex::scoped_lock lock(mtx);
+	  if (nextFile >= files.size()) return;
+	  k = nextFile++;
+	}
+	if (!_samples(files[k], *queues[k])) failed[k] = 1;
+	queues[k]->close();
+      }
+    }
+
+    inline bool
+    _push(TJsonChunkQueue& q, std::string*& chunk) {
+      if (!q.push(chunk)) {
+	delete chunk;
+	chunk = NULL;
+	return false;
+      }
+      chunk = new std::string();
+      chunk->reserve(chunkSize);
+      return true;
+    }
+
+    inline bool
+    _samples(boost::filesystem::path const& f, TJsonChunkQueue& q) {
+      std::ifstream file(f.string().c_str(), std::ios_base::in | std::ios_base::binary);
+      if (!file.is_open()) return false;
+      // Plain JSON is accepted as well, gzip is told by its magic bytes
+      char magic[2] = {0, 0};
+      file.read(magic, 2);
+      file.clear();
+      file.seekg(0);
+      boost::iostreams::filtering_istream dataIn;
+      if ((magic[0] == '\x1f') && (magic[1] == '\x8b')) dataIn.push(boost::iostreams::gzip_decompressor());
+      dataIn.push(file);
+      JsonSamplesScanner scan;
+      std::string* chunk = new std::string();
+      chunk->reserve(chunkSize);
+      std::vector<char> buf(1 << 16);
+      try {
+	while ((scan.state != 2) && (dataIn)) {
+	  dataIn.read(&buf[0], buf.size());
+	  scan.feed(&buf[0], dataIn.gcount(), *chunk);
+	  if ((chunk->size() >= chunkSize) && (!_push(q, chunk))) return false;
+	}
+      } catch (std::exception const&) {
+	delete chunk;
+	return false;
+      }
+      if ((!chunk->empty()) && (!_push(q, chunk))) return false;
+      delete chunk;
+      return (scan.state == 2);
+    }
+  };
+
+  inline void
+  _drainJsonQueue(TJsonChunkQueue& q) {
+    q.close();
+    std::string* chunk = NULL;
+    while (q.pop(chunk)) delete chunk;
+  }
+
+  template<typename TConfig>
+  inline int32_t
+  mergeJsonRun(TConfig const& c) {
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Merge " << c.files.size() << " JSON files" << std::endl;
+
+    // Inputs are decompressed ahead of the output, each with a few chunks in flight
+    uint32_t nthreads = std::min((uint32_t) std::max((uint16_t) 1, c.nthreads), (uint32_t) c.files.size());
+    std::vector<TJsonChunkQueue*> queues(c.files.size());
+    for(uint32_t k = 0; k < queues.size(); ++k) queues[k] = new TJsonChunkQueue(4);
+    std::vector<uint8_t> failed(c.files.size(), 0);
+    uint32_t nextFile = 0;
+    boost::mutex mtx;
+    boost::thread_group workers;
+    for(uint32_t t = 0; t < nthreads; ++t) workers.create_thread(JsonInputStage(c.files, queues, failed, nextFile, mtx));
+    GzipWriter out(c.outfile);
+
+    // Samples in input order
+    bool ok = true;
+    bool first = true;
+    out << "{\"samples\": [";
+    for(uint32_t k = 0; ((ok) && (k < c.files.size())); ++k) {
+      bool firstChunk = true;
+      std::string* chunk = NULL;
+      while (queues[k]->pop(chunk)) {
+	if ((firstChunk) && (!first)) out << ',';
+	firstChunk = false;
+	first = false;
+	out << *chunk;
+	delete chunk;
+      }
+      if (failed[k]) {
+	std::cerr << "No samples array in " << c.files[k].string() << ", the file is truncated or not a JSON file of alfred qc!" << std::endl;
+	ok = false;
+      }
+    }
+    out << "]}";
+
+    // Stop the inputs early on errors
+    if (!ok) {
+      {
+	boost::mutex::scoped_lock lock(mtx);
+	nextFile = c.files.size();
+      }
+      for(uint32_t k = 0; k < queues.size(); ++k) queues[k]->close();
+    }
+    workers.join_all();
+    bool outOk = out.close();
+    for(uint32_t k = 0; k < queues.size(); ++k) {
+      _drainJsonQueue(*queues[k]);
+      delete queues[k];
+    }
+    if (!outOk) std::cerr << "Fail to write " << c.outfile.string() << std::endl;
+    if ((!ok) || (!outOk)) {
+      boost::filesystem::remove(c.outfile);
+      return 1;
+    }
+
+    // Done
+    now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+    return 0;
+  }
+
+
+  int merge_json(int argc, char **argv) {
+    MergeJsonConfig c;
+
+    // Parameter
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ("threads,t", boost::program_options::value<uint16_t>(&c.nthreads)->default_value(2), "number of decompression threads")
+      ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("multisample.json.gz"), "gzipped output file")
+      ;
+
+    boost::program_options::options_description hidden("Hidden options");
+    hidden.add_options()
+      ("input-file", boost::program_options::value< std::vector<boost::filesystem::path> >(&c.files), "input json files")
+      ;
+
+    boost::program_options::positional_options_description pos_args;
+    pos_args.add("input-file", -1);
+
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic).add(hidden);
+    boost::program_options::options_description visible_options;
+    visible_options.add(generic);
+
+    // Parse command-line
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmdline_options).positional(pos_args).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if ((vm.count("help")) || (!vm.count("input-file"))) {
+      std::cout << std::endl;
+      std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] <sample1.json.gz> <sample2.json.gz> ..." << std::endl;
+      std::cout << visible_options << "\n";
+      return 1;
+    }
+
+    // Check input files
+    for(uint32_t k = 0; k < c.files.size(); ++k) {
+      if (!(boost::filesystem::exists(c.files[k]) && boost::filesystem::is_regular_file(c.files[k]) && boost::filesystem::file_size(c.files[k]))) {
+	std::cerr << "Input JSON file is missing: " << c.files[k].string() << std::endl;
+	return 1;
+      }
+      if ((boost::filesystem::exists(c.outfile)) && (boost::filesystem::equivalent(c.files[k], c.outfile))) {
+	std::cerr << "Output file is also an input file: " << c.outfile.string() << std::endl;
+	return 1;
+      }
+    }
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "alfred ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    return mergeJsonRun(c);
+  }
+
+}
+
+#endif
@@ -0,0 +1,184 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+
+#ifndef MERGE_SHARDS_H
+#define MERGE_SHARDS_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <boost/filesystem.hpp>
+
+#include "version.h"
+#include "util.h"
+#include "input.h"
+#include "shard.h"
+#include "qc.h"
+#include "count_dna.h"
+#include "count_rna.h"
+#include "count_junction.h"
+
+namespace bamstats
+{
+
+  // Parses the command line of the shards, the command then reads its counts from the partial outputs
+  template<typename TParse, typename TConfig>
+  inline bool
+  mergeConfig(std::vector<std::string> const& args, std::vector<boost::filesystem::path> const& parts, TParse parse, TConfig& c, InputContext& in) {
+    std::vector<char*> argv;
+    for(uint32_t i = 0; i < args.size(); ++i) argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(NULL);
+    if (parse((int) args.size(), &argv[0], c, in)) return false;
+    c.shard.parts = parts;
+    return true;
+  }
+
+  int merge_shards(int argc, char **argv) {
+    std::vector<boost::filesystem::path> files;
+
+    // Parameter
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ;
+
+    boost::program_options::options_description hidden("Hidden options");
+    hidden.add_options()
+      ("input-file", boost::program_options::value< std::vector<boost::filesystem::path> >(&files), "partial outputs")
+      ;
+
+    boost::program_options::positional_options_description pos_args;
+    pos_args.add("input-file", -1);
+
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic).add(hidden);
+    boost::program_options::options_description visible_options;
+    visible_options.add(generic);
+
+    // Parse command-line
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmdline_options).positional(pos_args).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if ((vm.count("help")) || (!vm.count("input-file"))) {
+      std::cout << std::endl;
+      std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] <out.shard1ofN> <out.shard2ofN> ... <out.shardNofN>" << std::endl;
+      std::cout << visible_options << "\n";
+      return 1;
+    }
+
+    // All partial outputs need to come from the same command line and cover every shard once
+    std::string key;
+    uint32_t count = 0;
+    std::vector<boost::filesystem::path> parts;
+    for(uint32_t k = 0; k < files.size(); ++k) {
+      CheckpointReader part;
+      if (!part.open(files[k])) {
+	std::cerr << "Not a partial output of a sharded run: " << files[k].string() << std::endl;
+	return 1;
+      }
+      uint32_t index = 0;
+      uint32_t n = 0;
+      part.io(index);
+      part.io(n);
+      if ((!part.ok) || (index < 1) || (index > n)) {
+	std::cerr << "Not a partial output of a sharded run: " << files[k].string() << std::endl;
+	return 1;
+      }
+      if (k == 0) {
+	key = part.key;
+	count = n;
+	parts.resize(count);
+      } else if ((part.key != key) || (n != count)) {
+	std::cerr << "Partial output " << files[k].string() << " belongs to a different run!" << std::endl;
+	return 1;
+      }
+      if (!parts[index - 1].empty()) {
+	std::cerr << "Shard " << index << " is given twice!" << std::endl;
+	return 1;
+      }
+      parts[index - 1] = files[k];
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+      if (parts[i].empty()) {
+	std::cerr << "Partial output of shard " << (i + 1) << "/" << count << " is missing!" << std::endl;
+	return 1;
+      }
+    }
+
+    // Command line of the shards
+    std::vector<std::string> args;
+    std::size_t start = 0;
+    for(std::size_t end = key.find('\n'); end != std::string::npos; end = key.find('\n', start)) {
+      args.push_back(key.substr(start, end - start));
+      start = end + 1;
+    }
+    if (args.empty()) {
+      std::cerr << "Partial outputs carry no command line!" << std::endl;
+      return 1;
+    }
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "alfred ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    // The merged output goes to the output file of the original command line
+    InputContext in;
+    if (args[0] == "qc") {
+      ConfigQC c;
+      if (!mergeConfig(args, parts, parseQc, c, in)) return 1;
+      return bamStatsRun(c, in);
+    } else if (args[0] == "count_dna") {
+      CountDNAConfig c;
+      if (!mergeConfig(args, parts, parseCountDNA, c, in)) return 1;
+      return countDNARun(c, in);
+    } else if (args[0] == "count_rna") {
+      CountRNAConfig c;
+      if (!mergeConfig(args, parts, parseCountRNA, c, in)) return 1;
+      return countRNARun(c, in);
+    } else if (args[0] == "count_jct") {
+      CountJunctionConfig c;
+      if (!mergeConfig(args, parts, parseCountJunction, c, in)) return 1;
+      return countJunctionRun(c, in);
+    }
+    std::cerr << "Command " << args[0] << " cannot be sharded!" << std::endl;
+    return 1;
+  }
+
+}
+
+#endif
@@ -25,13 +25,16 @@ Contact: Tobias Rausch (rausch@embl.de)
 #define MOTIF_H
 
 #include <limits>
+#include <deque>
 
 #include <boost/multi_array.hpp>
+#include <boost/math/special_functions/round.hpp>
 #include <boost/dynamic_bitset.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <boost/progress.hpp>
+#include <boost/thread.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filter/zlib.hpp>
@@ -41,6 +44,12 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <htslib/faidx.h>
 
 #include "util.h"
+#include "cache.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))))
+#define MOTIF_AVX2
+#include <immintrin.h>
+#endif
 
 namespace bamstats
 {
@@ -165,46 +174,446 @@ namespace bamstats
     }
   }
 
-  template<typename TConfig, typename TBitSet, typename TMotifHits>
+  inline uint8_t
+  _nt4(char const c) {
+    switch (c) {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+    default: return 4;
+    }
+  }
+
+  // Up to 8 motifs scored together, lane 2m holds the forward and lane 2m+1 the reverse strand of motif m
+  struct PwmBlock {
+    static const int32_t lanes = 16;
+    int32_t maxlen;
+    std::vector<uint32_t> motifs;
+    std::vector<int16_t> table; // [column][base][lane] quantised scaled PWM scores
+    std::vector<int16_t> suffix; // [column][lane] best achievable score of the remaining columns
+    int16_t cutoff[16];
+    int16_t len[16];
+  };
+
+  // Candidate window start within a run and the lane mask (2 bits per lane) that passed the integer cutoff
+  typedef std::vector<std::pair<int32_t, uint32_t> > TPwmCandidates;
+
+  // Lookahead pruning counts, windows abandoned before the last column
+  struct PwmScanStats {
+    uint64_t windows;
+    uint64_t pruned;
+    uint64_t columns;
+    uint64_t maxColumns;
+
+    PwmScanStats() : windows(0), pruned(0), columns(0), maxColumns(0) {}
+
+    inline void
+    add(PwmScanStats const& st) {
+      windows += st.windows;
+      pruned += st.pruned;
+      columns += st.columns;
+      maxColumns += st.maxColumns;
+    }
+  };
+
+  inline void
+  _reportPruning(PwmScanStats const& st) {
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Motif windows pruned early: " << (st.windows ? (100.0 * st.pruned) / st.windows : 0) << "%, PWM columns skipped: " << (st.maxColumns ? (100.0 * (st.maxColumns - st.columns)) / st.maxColumns : 0) << "%" << std::endl;
+  }
+
   inline void
-  scorePwm(TConfig const& c, char const* seq, TBitSet const& evalPos, Pwm const& inpwm, TMotifHits& mh) {
-    Pwm pwmFwd(inpwm);
-    scale(pwmFwd);
-    Pwm pwmRev;
-    revComp(inpwm, pwmRev);
-    scale(pwmRev);
-    int32_t motiflen = pwmFwd.matrix.shape()[1];
-    //std::cerr << _minScore(pwmFwd) << ',' << _maxScore(pwmFwd) << std::endl;
-    //std::cerr << _minScore(pwmRev) << ',' << _maxScore(pwmRev) << std::endl;
-    
-    // Parse sequence
-    for(uint32_t pos = 0; pos < evalPos.size() - motiflen + 1; ++pos) {
-      if (evalPos[pos]) {
-	std::string ref = boost::to_upper_copy(std::string(seq + pos, seq + pos + motiflen));
-	double scoreFwd = 0;
-	double scoreRev = 0;
-	int32_t k = 0;
-	for(; k < motiflen; ++k) {
-	  if (evalPos[pos+k]) {
-	    int32_t n = 4;
-	    if (ref[k] == 'A') n = 0;
-	    else if (ref[k] == 'C') n = 1;
-	    else if (ref[k] == 'G') n = 2;
-	    else if (ref[k] == 'T') n = 3;
-	    if (n < 4) {
-	      scoreFwd += pwmFwd.matrix[n][k];
-	      scoreRev += pwmRev.matrix[n][k];
-	    } else break;
-	  } else break;
+  _pwmCandidatesScalar(PwmBlock const& blk, uint8_t const* code, int32_t n, TPwmCandidates& cand, PwmScanStats& st) {
+    int16_t acc[16];
+    for(int32_t p = 0; p < n; ++p) {
+      for(int32_t l = 0; l < 16; ++l) acc[l] = 0;
+      int32_t kmax = std::min(blk.maxlen, n - p);
+      int16_t remaining = (int16_t) std::min(n - p, 32767);
+      int32_t k = 0;
+      for(; k < kmax; ++k) {
+	// Stop once no lane can reach its cutoff
+	int16_t const* suf = &blk.suffix[k * 16];
+	bool reachable = false;
+	for(int32_t l = 0; ((l < 16) && (!reachable)); ++l) reachable = ((acc[l] + suf[l] > blk.cutoff[l]) && (blk.len[l] <= remaining));
+	if (!reachable) break;
+	int16_t const* col = &blk.table[(k * 4 + code[p + k]) * 16];
+	for(int32_t l = 0; l < 16; ++l) acc[l] = (int16_t) (acc[l] + col[l]);
+      }
+      ++st.windows;
+      st.columns += k;
+      st.maxColumns += kmax;
+      if (k < kmax) {
+	++st.pruned;
+	continue;
+      }
+      uint32_t mask = 0;
+      for(int32_t l = 0; l < 16; ++l)
+	if ((acc[l] > blk.cutoff[l]) && (blk.len[l] <= remaining)) mask |= (3 << (2 * l));
+      if (mask) cand.push_back(std::make_pair(p, mask));
+    }
+  }
+
+#ifdef MOTIF_AVX2
+  __attribute__((target("avx2")))
+  inline void
+  _pwmCandidatesAvx2(PwmBlock const& blk, uint8_t const* code, int32_t n, TPwmCandidates& cand, PwmScanStats& st) {
+    __m256i cutoff = _mm256_loadu_si256((__m256i const*) blk.cutoff);
+    __m256i len = _mm256_loadu_si256((__m256i const*) blk.len);
+    int16_t const* tab = &blk.table[0];
+    int16_t const* suf = &blk.suffix[0];
+    for(int32_t p = 0; p < n; ++p) {
+      __m256i acc = _mm256_setzero_si256();
+      int32_t kmax = std::min(blk.maxlen, n - p);
+      __m256i tooLong = _mm256_cmpgt_epi16(len, _mm256_set1_epi16((int16_t) std::min(n - p, 32767)));
+      int32_t k = 0;
+      for(; k < kmax; ++k) {
+	__m256i reach = _mm256_adds_epi16(acc, _mm256_loadu_si256((__m256i const*) (suf + k * 16)));
+	if (!_mm256_movemask_epi8(_mm256_andnot_si256(tooLong, _mm256_cmpgt_epi16(reach, cutoff)))) break;
+	acc = _mm256_add_epi16(acc, _mm256_loadu_si256((__m256i const*) (tab + (k * 4 + code[p + k]) * 16)));
+      }
+      ++st.windows;
+      st.columns += k;
+      st.maxColumns += kmax;
+      if (k < kmax) {
+	++st.pruned;
+	continue;
+      }
+      __m256i hit = _mm256_andnot_si256(tooLong, _mm256_cmpgt_epi16(acc, cutoff));
+      uint32_t mask = (uint32_t) _mm256_movemask_epi8(hit);
+      if (mask) cand.push_back(std::make_pair(p, mask));
+    }
+  }
+
+  inline bool
+  _hasAvx2() {
+    return __builtin_cpu_supports("avx2");
+  }
+#else
+  inline bool
+  _hasAvx2() {
+    return false;
+  }
+#endif
+
+  // Maximal runs of evaluated ACGT bases in 2-bit codes, run r spans code[offset[r], offset[r+1])
+  struct EncodedRuns {
+    std::vector<uint32_t> start;
+    std::vector<uint32_t> offset;
+    std::vector<uint8_t> code;
+
+    EncodedRuns() : offset(1, 0) {}
+  };
+
+  template<typename TBitSet>
+  inline void
+  _encodeRuns(char const* seq, TBitSet const& evalPos, EncodedRuns& er) {
+    typename TBitSet::size_type pos = evalPos.find_first();
+    while (pos != TBitSet::npos) {
+      typename TBitSet::size_type runEnd = pos;
+      for(; ((runEnd < evalPos.size()) && (evalPos[runEnd])); ++runEnd) {
+	uint8_t n = _nt4(seq[runEnd]);
+	if (n > 3) break;
+	er.code.push_back(n);
+      }
+      if (runEnd > pos) {
+	er.start.push_back(pos);
+	er.offset.push_back(er.code.size());
+      }
+      if (runEnd >= evalPos.size()) break;
+      pos = evalPos.find_next(runEnd);
+    }
+  }
+
+  // Runs of ACGT bases in [beg, end), all positions are evaluated
+  inline void
+  _encodeRuns(char const* seq, int32_t beg, int32_t end, EncodedRuns& er) {
+    int32_t pos = beg;
+    while (pos < end) {
+      int32_t runEnd = pos;
+      for(; runEnd < end; ++runEnd) {
+	uint8_t n = _nt4(seq[runEnd]);
+	if (n > 3) break;
+	er.code.push_back(n);
+      }
+      if (runEnd > pos) {
+	er.start.push_back(pos);
+	er.offset.push_back(er.code.size());
+      }
+      pos = runEnd + 1;
+    }
+  }
+
+  struct PwmScanner {
+    std::vector<Pwm> fwd;  // Scaled PWMs, exact scores decide on hits
+    std::vector<Pwm> rev;
+    std::vector<std::vector<double> > fwdSuffix;  // Best achievable score from column k on
+    std::vector<std::vector<double> > revSuffix;
+    std::vector<PwmBlock> blocks;
+    double threshold;
+    double pvalue;  // 0: scaled score threshold, otherwise integer cutoffs from exact score distributions
+    bool avx2;
+
+    static const int32_t pvalueBins = 4096;
+
+    PwmScanner(std::vector<Pwm> const& pwms, double const thres, double const pval) : threshold(thres), pvalue(pval), avx2(_hasAvx2()) {
+      rev.resize(pwms.size());
+      fwdSuffix.resize(pwms.size());
+      revSuffix.resize(pwms.size());
+      for(uint32_t i = 0; i < pwms.size(); ++i) {
+	fwd.push_back(pwms[i]);
+	scale(fwd[i]);
+	revComp(pwms[i], rev[i]);
+	scale(rev[i]);
+	_suffixMax(fwd[i], fwdSuffix[i]);
+	_suffixMax(rev[i], revSuffix[i]);
+      }
+
+      // Block motifs of similar length
+      std::vector<std::pair<int32_t, uint32_t> > bylen;
+      for(uint32_t i = 0; i < pwms.size(); ++i) bylen.push_back(std::make_pair((int32_t) pwms[i].matrix.shape()[1], i));
+      std::sort(bylen.begin(), bylen.end());
+      for(uint32_t i = 0; i < bylen.size(); i += PwmBlock::lanes / 2) {
+	blocks.push_back(PwmBlock());
+	PwmBlock& blk = blocks.back();
+	for(uint32_t j = i; ((j < bylen.size()) && (j < i + PwmBlock::lanes / 2)); ++j) blk.motifs.push_back(bylen[j].second);
+	blk.maxlen = bylen[i + blk.motifs.size() - 1].first;
+	blk.table.resize(blk.maxlen * 4 * PwmBlock::lanes, 0);
+	blk.suffix.resize((blk.maxlen + 1) * PwmBlock::lanes, 0);
+	for(int32_t l = 0; l < PwmBlock::lanes; ++l) {
+	  blk.cutoff[l] = std::numeric_limits<int16_t>::max();
+	  blk.len[l] = 0;
+	}
+	for(uint32_t m = 0; m < blk.motifs.size(); ++m) {
+	  if (pvalue > 0) {
+	    _quantisePvalue(fwd[blk.motifs[m]], blk, 2 * m);
+	    _quantisePvalue(rev[blk.motifs[m]], blk, 2 * m + 1);
+	  } else {
+	    _quantise(fwd[blk.motifs[m]], blk, 2 * m);
+	    _quantise(rev[blk.motifs[m]], blk, 2 * m + 1);
+	  }
+	  _suffixMax(blk, 2 * m);
+	  _suffixMax(blk, 2 * m + 1);
 	}
-	if ((k == motiflen) && ((scoreFwd > c.motifScoreQuantile) || (scoreRev > c.motifScoreQuantile))) {
-	  //std::cerr << "Genom:" << ref << "," << ref << std::endl;
-	  //std::cerr << "Query:" << _maxSimpleMotif(pwmFwd) << "," << _maxSimpleMotif(pwmRev) << std::endl;
-	  mh.push_back(pos);
+      }
+    }
+
+    // Approximate memory footprint, used by the alfred serve cache
+    inline uint64_t
+    bytes() const {
+      uint64_t n = sizeof(PwmScanner);
+      for(uint32_t i = 0; i < fwd.size(); ++i) n += 2 * (fwd[i].matrix.num_elements() + fwdSuffix[i].size()) * sizeof(double);
+      for(uint32_t b = 0; b < blocks.size(); ++b) n += sizeof(PwmBlock) + (blocks[b].table.size() + blocks[b].suffix.size()) * sizeof(int16_t);
+      return n;
+    }
+
+    // Integer scores are a filter only, the rounding error of a lane is at most len/2
+    inline void
+    _quantise(Pwm const& pwm, PwmBlock& blk, int32_t lane) {
+      int32_t motiflen = pwm.matrix.shape()[1];
+      double bound = 0;
+      for(int32_t k = 0; k < motiflen; ++k) {
+	double maxAbs = 0;
+	for(uint32_t b = 0; b < 4; ++b) maxAbs = std::max(maxAbs, std::abs(pwm.matrix[b][k]));
+	bound += maxAbs;
+      }
+      double sc = 32000.0 / std::max(bound, 1e-6);
+      for(int32_t k = 0; k < motiflen; ++k)
+	for(uint32_t b = 0; b < 4; ++b)
+	  blk.table[(k * 4 + b) * PwmBlock::lanes + lane] = (int16_t) boost::math::round(pwm.matrix[b][k] * sc);
+      double cut = std::floor(threshold * sc - 0.5 * motiflen) - 1;
+      blk.cutoff[lane] = (int16_t) std::max(-32768.0, std::min(32767.0, cut));
+      blk.len[lane] = motiflen;
+    }
+
+    // Column-shifted scores on a grid of pvalueBins, the integer score itself decides on hits
+    inline void
+    _quantisePvalue(Pwm const& pwm, PwmBlock& blk, int32_t lane) {
+      int32_t motiflen = pwm.matrix.shape()[1];
+      std::vector<double> colMin(motiflen);
+      double range = 0;
+      for(int32_t k = 0; k < motiflen; ++k) {
+	colMin[k] = pwm.matrix[0][k];
+	double colMax = pwm.matrix[0][k];
+	for(uint32_t b = 1; b < 4; ++b) {
+	  colMin[k] = std::min(colMin[k], pwm.matrix[b][k]);
+	  colMax = std::max(colMax, pwm.matrix[b][k]);
 	}
+	range += colMax - colMin[k];
       }
+      double sc = pvalueBins / std::max(range, 1e-6);
+      for(int32_t k = 0; k < motiflen; ++k)
+	for(uint32_t b = 0; b < 4; ++b)
+	  blk.table[(k * 4 + b) * PwmBlock::lanes + lane] = (int16_t) boost::math::round((pwm.matrix[b][k] - colMin[k]) * sc);
+      blk.cutoff[lane] = _pvalueCutoff(blk, lane, motiflen);
+      blk.len[lane] = motiflen;
     }
-  }
+
+    // Exact score distribution under a uniform background, hits need P(score >= cutoff + 1) <= pvalue
+    inline int16_t
+    _pvalueCutoff(PwmBlock const& blk, int32_t lane, int32_t motiflen) const {
+      std::vector<double> dist(1, 1.0);
+      std::vector<double> next;
+      for(int32_t k = 0; k < motiflen; ++k) {
+	int16_t const* q = &blk.table[(k * 4) * PwmBlock::lanes + lane];
+	int32_t colMax = 0;
+	for(uint32_t b = 0; b < 4; ++b) colMax = std::max(colMax, (int32_t) q[b * PwmBlock::lanes]);
+	next.assign(dist.size() + colMax, 0);
+	for(uint32_t sc = 0; sc < dist.size(); ++sc) {
+	  if (dist[sc] == 0) continue;
+	  for(uint32_t b = 0; b < 4; ++b) next[sc + q[b * PwmBlock::lanes]] += 0.25 * dist[sc];
+	}
+	dist.swap(next);
+      }
+      double tail = 0;
+      int32_t minScore = dist.size();
+      for(; minScore > 0; --minScore) {
+	if (tail + dist[minScore - 1] > pvalue) break;
+	tail += dist[minScore - 1];
+      }
+      return (int16_t) std::min(minScore - 1, 32767);
+    }
+
+    inline void
+    _suffixMax(PwmBlock& blk, int32_t lane) {
+      for(int32_t k = blk.len[lane] - 1; k >= 0; --k) {
+	int16_t best = blk.table[(k * 4) * PwmBlock::lanes + lane];
+	for(uint32_t b = 1; b < 4; ++b) best = std::max(best, blk.table[(k * 4 + b) * PwmBlock::lanes + lane]);
+	blk.suffix[k * PwmBlock::lanes + lane] = (int16_t) (blk.suffix[(k + 1) * PwmBlock::lanes + lane] + best);
+      }
+    }
+
+    inline void
+    _suffixMax(Pwm const& pwm, std::vector<double>& suffix) {
+      int32_t motiflen = pwm.matrix.shape()[1];
+      suffix.assign(motiflen + 1, 0);
+      for(int32_t k = motiflen - 1; k >= 0; --k) {
+	double best = pwm.matrix[0][k];
+	for(uint32_t b = 1; b < 4; ++b) best = std::max(best, pwm.matrix[b][k]);
+	suffix[k] = suffix[k + 1] + best;
+      }
+    }
+
+    // Exact score with lookahead, stops once the threshold is out of reach
+    inline bool
+    _exceeds(Pwm const& pwm, std::vector<double> const& suffix, uint8_t const* code) const {
+      int32_t motiflen = pwm.matrix.shape()[1];
+      double score = 0;
+      for(int32_t k = 0; k < motiflen; ++k) {
+	if (score + suffix[k] <= threshold) return false;
+	score += pwm.matrix[code[k]][k];
+      }
+      return (score > threshold);
+    }
+
+    // Only strands whose lane passed the integer filter are verified
+    inline bool
+    _hit(uint32_t idx, uint32_t lanes, uint8_t const* code) const {
+      if ((lanes & 3) && (_exceeds(fwd[idx], fwdSuffix[idx], code))) return true;
+      return ((lanes & 12) && (_exceeds(rev[idx], revSuffix[idx], code)));
+    }
+
+    // Hits (motif index, window start) of all motifs in block b
+    template<typename THits>
+    inline void
+    scanBlock(uint32_t b, EncodedRuns const& er, THits& hits, PwmScanStats& st) const {
+      TPwmCandidates cand;
+      PwmBlock const& blk = blocks[b];
+      for(uint32_t r = 0; r < er.start.size(); ++r) {
+	uint8_t const* code = &er.code[er.offset[r]];
+	int32_t runlen = er.offset[r+1] - er.offset[r];
+	cand.clear();
+#ifdef MOTIF_AVX2
+	if (avx2) _pwmCandidatesAvx2(blk, code, runlen, cand, st);
+	else _pwmCandidatesScalar(blk, code, runlen, cand, st);
+#else
+	_pwmCandidatesScalar(blk, code, runlen, cand, st);
+#endif
+	for(uint32_t i = 0; i < cand.size(); ++i) {
+	  for(uint32_t m = 0; m < blk.motifs.size(); ++m) {
+	    uint32_t lanes = (cand[i].second >> (4 * m)) & 15;
+	    if (lanes) {
+	      uint32_t idx = blk.motifs[m];
+	      if ((pvalue > 0) || (_hit(idx, lanes, code + cand[i].first))) hits.push_back(std::make_pair(idx, (int32_t) (er.start[r] + cand[i].first)));
+	    }
+	  }
+	}
+      }
+    }
+
+    // Motif hits (window starts) for all positions set in evalPos, sorted per motif
+    template<typename TBitSet, typename TMotifHits>
+    inline void
+    scan(char const* seq, TBitSet const& evalPos, std::vector<TMotifHits>& mh) const {
+      mh.resize(fwd.size());
+      EncodedRuns er;
+      _encodeRuns(seq, evalPos, er);
+      std::vector<std::pair<uint32_t, int32_t> > hits;
+      PwmScanStats st;
+      for(uint32_t b = 0; b < blocks.size(); ++b) {
+	hits.clear();
+	scanBlock(b, er, hits, st);
+	for(uint32_t i = 0; i < hits.size(); ++i) mh[hits[i].first].push_back(hits[i].second);
+      }
+    }
+  };
+
+
+  // Motif scanning work shared between the reference loader and the scoring threads
+  struct MotifChrTask {
+    int32_t refIndex;
+    uint32_t pending;
+    EncodedRuns runs;
+  };
+
+  struct MotifScanQueue {
+    boost::mutex mtx;
+    boost::condition_variable cond;
+    std::deque<std::pair<MotifChrTask*, uint32_t> > work;  // (chromosome, motif block)
+    uint32_t inflight;
+    bool done;
+
+    MotifScanQueue() : inflight(0), done(false) {}
+  };
+
+  template<typename TGenomicRegions>
+  struct MotifScanWorker {
+    PwmScanner const& scanner;
+    MotifScanQueue& queue;
+    TGenomicRegions& regions;  // Per-thread hit intervals
+    PwmScanStats& stats;
+
+    MotifScanWorker(PwmScanner const& s, MotifScanQueue& q, TGenomicRegions& r, PwmScanStats& st) : scanner(s), queue(q), regions(r), stats(st) {}
+
+    void operator()() {
+      std::vector<std::pair<uint32_t, int32_t> > hits;
+      while (true) {
+	std::pair<MotifChrTask*, uint32_t> item;
+	{
+	  boost::mutex::scoped_lock lock(queue.mtx);
+	  while ((queue.work.empty()) && (!queue.done)) queue.cond.wait(lock);
+	  if (queue.work.empty()) return;
+	  item = queue.work.front();
+	  queue.work.pop_front();
+	}
+	hits.clear();
+	scanner.scanBlock(item.second, item.first->runs, hits, stats);
+	int32_t refIndex = item.first->refIndex;
+	for(uint32_t i = 0; i < hits.size(); ++i) {
+	  int32_t motiflen = scanner.fwd[hits[i].first].matrix.shape()[1];
+	  _insertInterval(regions[refIndex], hits[i].second, hits[i].second + motiflen, '*', hits[i].first, 0);
+	}
+	{
+	  boost::mutex::scoped_lock lock(queue.mtx);
+	  if (--item.first->pending == 0) {
+	    delete item.first;
+	    --queue.inflight;
+	    queue.cond.notify_all();
+	  }
+	}
+      }
+    }
+  };
 
   template<typename TConfig>
   inline bool
@@ -314,18 +723,35 @@ namespace bamstats
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Motif file parsing" << std::endl;
 
-    // Generate PWMs
-    std::vector<Pwm> pwms;
-    parseJasparPwm(c, pwms);
+    // Generate PWMs, alfred serve keeps the scanner of a motif file and threshold
+    boost::shared_ptr<PwmScanner const> cachedScanner;
+    std::string key;
+    if (sharedCache() != NULL) key = "pwm\t" + fileKey(c.motifFile) + '\t' + boost::lexical_cast<std::string>(c.motifScoreQuantile) + '\t' + boost::lexical_cast<std::string>(c.motifPvalue);
+    if (!cacheLookup(key, cachedScanner)) {
+      std::vector<Pwm> pwms;
+      parseJasparPwm(c, pwms);
+      cachedScanner.reset(new PwmScanner(pwms, c.motifScoreQuantile, c.motifPvalue));
+      cacheStore(key, cachedScanner, cachedScanner->bytes());
+    }
+    PwmScanner const& scanner = *cachedScanner;
 
     // Motif search
     now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Motif search" << std::endl;
     boost::progress_display show_progress(c.nchr.size());
 
-    // Iterate chromosomes
+    // Scoring threads, each with its own hit buffer
+    uint16_t nthreads = std::max((uint16_t) 1, c.nthreads);
+    std::vector<TGenomicRegions> threadRegions(nthreads, TGenomicRegions(overlappingRegions.size()));
+    std::vector<PwmScanStats> threadStats(nthreads);
+    MotifScanQueue queue;
+    boost::thread_group workers;
+    for(uint16_t t = 0; t < nthreads; ++t) workers.create_thread(MotifScanWorker<TGenomicRegions>(scanner, queue, threadRegions[t], threadStats[t]));
+
+    // Load chromosomes while the previous ones are scored
     faidx_t* fai = fai_load(c.genome.string().c_str());
     char* seq = NULL;
+    boost::shared_ptr<std::string const> seqHold;
     for(int32_t refIndex=0; refIndex < (int32_t) c.nchr.size(); ++refIndex) {
       ++show_progress;
 
@@ -338,77 +764,61 @@ namespace bamstats
       }
       int32_t seqlen = faidx_seq_len(fai, tname.c_str());
 
-      // Pre-process bed file so we can speed-up motif search
+      // Flag peak neighbourhoods so we can speed-up motif search
       typedef boost::dynamic_bitset<> TBitSet;
       TBitSet evalPos(seqlen, false);
-      std::ifstream chrFile(c.infile.string().c_str(), std::ifstream::in);
-      if (chrFile.is_open()) {
-	while (chrFile.good()) {
-	  std::string chrFromFile;
-	  getline(chrFile, chrFromFile);
-	  typedef boost::tokenizer< boost::char_separator<char> > Tokenizer;
-	  boost::char_separator<char> sep(" \t,;");
-	  Tokenizer tokens(chrFromFile, sep);
-	  Tokenizer::iterator tokIter = tokens.begin();
-	  if (tokIter!=tokens.end()) {
-	    std::string chrName = *tokIter++;
-	    if (c.nchr.find(chrName)->second != refIndex) continue;
-	    int32_t start = boost::lexical_cast<int32_t>(*tokIter++);
-	    int32_t end = boost::lexical_cast<int32_t>(*tokIter++);
-	    std::string name = "NA";
-	    if (start >= end) continue;  // Bed has right-open intervals
-	    int32_t realstart = std::max(0, start - c.maxDistance);
-            int32_t realend = std::min(seqlen, end + c.maxDistance);
-	    for(int32_t i = realstart; i < realend; ++i) evalPos[i] = true;
-	  }
-	}
-	chrFile.close();
+      for(uint32_t k = 0; k < c.peaks[refIndex].size(); ++k) {
+	int32_t realstart = std::max(0, c.peaks[refIndex][k].start - c.maxDistance);
+	int32_t realend = std::min(seqlen, c.peaks[refIndex][k].end + c.maxDistance);
+	for(int32_t i = realstart; i < realend; ++i) evalPos[i] = true;
       }
 
       // Anything to annotate on this chromosome?
-      if (evalPos.count()) {
-	seqlen = -1;
-	seq = faidx_fetch_seq(fai, tname.c_str(), 0, faidx_seq_len(fai, tname.c_str()) + 1, &seqlen);
-
-	// Blacklist Ns
-	for(int32_t i = 0; i < seqlen; ++i) {
-	  if ((seq[i] == 'n') || (seq[i] == 'N')) evalPos[i] = false;
-	}
-	
-	// Score PWMs
-	for(uint32_t i = 0; i<pwms.size(); ++i) {
-	  typedef std::vector<int32_t> TMotifHits;
-	  TMotifHits mh;
-	  scorePwm(c, seq, evalPos, pwms[i], mh);
-
-	  int32_t motiflen = pwms[i].matrix.shape()[1];
-	  for(uint32_t hit = 0; hit < mh.size(); ++hit) {
-	    _insertInterval(overlappingRegions[refIndex], mh[hit], mh[hit] + motiflen, '*', i, 0);
-	  }
-	}
-
-	// Clean-up
-	if (seq != NULL) free(seq);
+      if ((evalPos.count()) && (!scanner.blocks.empty())) {
+	seq = fetchChromosome(fai, c.genome, tname, seqHold);
+
+	// Encode evaluated positions, Ns end a run
+	MotifChrTask* task = new MotifChrTask();
+	task->refIndex = refIndex;
+	task->pending = scanner.blocks.size();
+	_encodeRuns(seq, evalPos, task->runs);
+	releaseChromosome(seq, seqHold);
+
+	// Queue motif blocks, at most two chromosomes are in flight
+	boost::mutex::scoped_lock lock(queue.mtx);
+	while (queue.inflight >= 2) queue.cond.wait(lock);
+	++queue.inflight;
+	for(uint32_t b = 0; b < scanner.blocks.size(); ++b) queue.work.push_back(std::make_pair(task, b));
+	queue.cond.notify_all();
       }
     }
+    fai_destroy(fai);
+    {
+      boost::mutex::scoped_lock lock(queue.mtx);
+      queue.done = true;
+      queue.cond.notify_all();
+    }
+    workers.join_all();
+
+    // Merge thread buffers
+    PwmScanStats st;
+    for(uint16_t t = 0; t < nthreads; ++t) {
+      st.add(threadStats[t]);
+      for(uint32_t refIndex = 0; refIndex < overlappingRegions.size(); ++refIndex)
+	overlappingRegions[refIndex].insert(overlappingRegions[refIndex].end(), threadRegions[t][refIndex].begin(), threadRegions[t][refIndex].end());
+    }
+    _reportPruning(st);
 
     // Assign Motif Ids
-    for(uint32_t i = 0; i<pwms.size(); ++i) motifIds.push_back(pwms[i].symbol);
+    for(uint32_t i = 0; i < scanner.fwd.size(); ++i) motifIds.push_back(scanner.fwd[i].symbol);
 
     return motifIds.size();
   }
 
   
-  template<typename TConfig, typename TGenomicRegions, typename TMotifIds>
-  inline int32_t
-  parseJaspar(TConfig const& c, TGenomicRegions& gRegions, TMotifIds& motifIds) {
-    typedef typename TGenomicRegions::value_type TChromosomeRegions;
-
-    // Overlapping intervals for each label
-    TGenomicRegions overlappingRegions;
-    overlappingRegions.resize(gRegions.size(), TChromosomeRegions());
-    parseJasparAll(c, overlappingRegions, motifIds);
-    
+  template<typename TGenomicRegions>
+  inline void
+  _flattenMotifHits(TGenomicRegions& overlappingRegions, TGenomicRegions& gRegions) {
     // Make intervals non-overlapping for each label
     for(uint32_t refIndex = 0; refIndex < overlappingRegions.size(); ++refIndex) {
       // Sort by ID
@@ -432,7 +842,18 @@ namespace bamstats
       // Process last id
       for(typename TIdIntervals::iterator it = idIntervals.begin(); it != idIntervals.end(); ++it) gRegions[refIndex].push_back(IntervalLabel(it->lower(), it->upper(), runningStrand, runningId));
     }
+  }
+  
+  template<typename TConfig, typename TGenomicRegions, typename TMotifIds>
+  inline int32_t
+  parseJaspar(TConfig const& c, TGenomicRegions& gRegions, TMotifIds& motifIds) {
+    typedef typename TGenomicRegions::value_type TChromosomeRegions;
 
+    // Overlapping intervals for each label
+    TGenomicRegions overlappingRegions;
+    overlappingRegions.resize(gRegions.size(), TChromosomeRegions());
+    parseJasparAll(c, overlappingRegions, motifIds);
+    _flattenMotifHits(overlappingRegions, gRegions);
     return motifIds.size();
   }
   
@@ -0,0 +1,515 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef MOTIFINDEX_H
+#define MOTIFINDEX_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/progress.hpp>
+
+#include <htslib/faidx.h>
+
+#include "util.h"
+#include "motif.h"
+
+namespace bamstats
+{
+
+  // Motif index layout (native byte order):
+  // magic, version, quantile, p-value, motifs (length, matrix id, symbol), zlib chunks of position-sorted hits, chromosome table, table offset
+  static const char motifIndexMagic[8] = {'A', 'L', 'F', 'M', 'O', 'T', 'I', 'F'};
+  static const uint32_t motifIndexVersion = 2;
+  static const uint32_t motifIndexChunkHits = 65536;
+  static const int32_t motifIndexTileSize = 1048576;
+
+  struct MotifIndexConfig {
+    uint16_t nthreads;
+    float motifScoreQuantile;
+    double motifPvalue;
+    boost::filesystem::path motifFile;
+    boost::filesystem::path genome;
+    boost::filesystem::path outfile;
+  };
+
+  struct MotifIndexChunk {
+    int32_t firstPos;
+    int32_t lastPos;
+    uint32_t nhits;
+    uint64_t offset;
+    uint32_t size;
+  };
+
+  struct MotifIndex {
+    typedef std::vector<MotifIndexChunk> TChunks;
+    typedef std::map<std::string, TChunks> TChrChunks;
+    float quantile;
+    double pvalue;
+    std::vector<int32_t> motifLen;
+    std::vector<std::string> matrixIds;
+    std::vector<std::string> symbols;
+    TChrChunks chunks;
+  };
+
+  // Hit window start and motif index
+  typedef std::vector<std::pair<int32_t, uint32_t> > TMotifIndexHits;
+
+  template<typename TValue>
+  inline void
+  _writeBin(std::ostream& out, TValue const& val) {
+    out.write((char const*) &val, sizeof(TValue));
+  }
+
+  inline void
+  _writeBin(std::ostream& out, std::string const& str) {
+    _writeBin(out, (uint32_t) str.size());
+    out.write(str.c_str(), str.size());
+  }
+
+  template<typename TValue>
+  inline bool
+  _readBin(std::istream& in, TValue& val) {
+    in.read((char*) &val, sizeof(TValue));
+    return in.good();
+  }
+
+  inline bool
+  _readBin(std::istream& in, std::string& str) {
+    uint32_t len = 0;
+    if (!_readBin(in, len)) return false;
+    str.resize(len);
+    if (len) in.read(&str[0], len);
+    return in.good();
+  }
+
+  inline bool
+  _isMotifIndex(boost::filesystem::path const& p) {
+    std::ifstream in(p.string().c_str(), std::ios_base::in | std::ios_base::binary);
+    char magic[8];
+    in.read(magic, 8);
+    return ((in.good()) && (std::equal(magic, magic + 8, motifIndexMagic)));
+  }
+
+  inline bool
+  _readMotifIndex(boost::filesystem::path const& p, MotifIndex& mi) {
+    std::ifstream in(p.string().c_str(), std::ios_base::in | std::ios_base::binary);
+    char magic[8];
+    in.read(magic, 8);
+    if ((!in.good()) || (!std::equal(magic, magic + 8, motifIndexMagic))) return false;
+    uint32_t version = 0;
+    if ((!_readBin(in, version)) || (version != motifIndexVersion)) return false;
+    uint32_t nmotifs = 0;
+    if ((!_readBin(in, mi.quantile)) || (!_readBin(in, mi.pvalue)) || (!_readBin(in, nmotifs))) return false;
+    mi.motifLen.resize(nmotifs);
+    mi.matrixIds.resize(nmotifs);
+    mi.symbols.resize(nmotifs);
+    for(uint32_t i = 0; i < nmotifs; ++i) {
+      if ((!_readBin(in, mi.motifLen[i])) || (!_readBin(in, mi.matrixIds[i])) || (!_readBin(in, mi.symbols[i]))) return false;
+    }
+
+    // Chromosome table
+    uint64_t tableOffset = 0;
+    in.seekg(-((int64_t) sizeof(uint64_t)), std::ios_base::end);
+    if (!_readBin(in, tableOffset)) return false;
+    in.seekg(tableOffset, std::ios_base::beg);
+    uint32_t nchr = 0;
+    if (!_readBin(in, nchr)) return false;
+    for(uint32_t k = 0; k < nchr; ++k) {
+      std::string chrName;
+      uint32_t nchunks = 0;
+      if ((!_readBin(in, chrName)) || (!_readBin(in, nchunks))) return false;
+      MotifIndex::TChunks& ch = mi.chunks[chrName];
+      ch.resize(nchunks);
+      for(uint32_t i = 0; i < nchunks; ++i) {
+	if ((!_readBin(in, ch[i].firstPos)) || (!_readBin(in, ch[i].lastPos)) || (!_readBin(in, ch[i].nhits)) || (!_readBin(in, ch[i].offset)) || (!_readBin(in, ch[i].size))) return false;
+      }
+    }
+    return true;
+  }
+
+  // Delta-coded positions and motif indices, zlib compressed
+  inline void
+  _writeMotifChunk(std::ofstream& out, TMotifIndexHits const& hits, uint32_t beg, uint32_t end, MotifIndex::TChunks& chunks) {
+    std::vector<char> raw;
+    raw.reserve((end - beg) * 6);
+    int32_t lastPos = 0;
+    for(uint32_t i = beg; i < end; ++i) {
+      uint32_t delta = hits[i].first - lastPos;
+      uint16_t motif = hits[i].second;
+      raw.insert(raw.end(), (char const*) &delta, (char const*) &delta + sizeof(delta));
+      raw.insert(raw.end(), (char const*) &motif, (char const*) &motif + sizeof(motif));
+      lastPos = hits[i].first;
+    }
+    std::vector<char> comp;
+    {
+      boost::iostreams::filtering_ostream zout;
+      zout.push(boost::iostreams::zlib_compressor());
+      zout.push(boost::iostreams::back_inserter(comp));
+      zout.write(&raw[0], raw.size());
+    }
+    MotifIndexChunk chunk;
+    chunk.firstPos = hits[beg].first;
+    chunk.lastPos = hits[end - 1].first;
+    chunk.nhits = end - beg;
+    chunk.offset = out.tellp();
+    chunk.size = comp.size();
+    out.write(&comp[0], comp.size());
+    chunks.push_back(chunk);
+  }
+
+  inline bool
+  _loadMotifChunk(std::ifstream& in, MotifIndexChunk const& chunk, TMotifIndexHits& hits) {
+    std::vector<char> comp(chunk.size);
+    in.seekg(chunk.offset, std::ios_base::beg);
+    in.read(&comp[0], chunk.size);
+    if (!in.good()) return false;
+    std::vector<char> raw;
+    raw.reserve(chunk.nhits * 6);
+    {
+      boost::iostreams::filtering_istream zin;
+      zin.push(boost::iostreams::zlib_decompressor());
+      zin.push(boost::iostreams::array_source(&comp[0], comp.size()));
+      boost::iostreams::copy(zin, boost::iostreams::back_inserter(raw));
+    }
+    if (raw.size() != chunk.nhits * 6) return false;
+    hits.resize(chunk.nhits);
+    int32_t lastPos = 0;
+    for(uint32_t i = 0; i < chunk.nhits; ++i) {
+      uint32_t delta = 0;
+      uint16_t motif = 0;
+      std::copy(&raw[i * 6], &raw[i * 6] + sizeof(delta), (char*) &delta);
+      std::copy(&raw[i * 6 + 4], &raw[i * 6 + 4] + sizeof(motif), (char*) &motif);
+      lastPos += delta;
+      hits[i] = std::make_pair(lastPos, (uint32_t) motif);
+    }
+    return true;
+  }
+
+
+  struct MotifTileWorker {
+    PwmScanner const& scanner;
+    EncodedRuns const& runs;
+    uint32_t& nextBlock;
+    boost::mutex& mtx;
+    std::vector<std::pair<uint32_t, int32_t> >& hits;
+    PwmScanStats& stats;
+
+    MotifTileWorker(PwmScanner const& s, EncodedRuns const& r, uint32_t& nb, boost::mutex& m, std::vector<std::pair<uint32_t, int32_t> >& h, PwmScanStats& st) : scanner(s), runs(r), nextBlock(nb), mtx(m), hits(h), stats(st) {}
+
+    void operator()() {
+      while (true) {
+	uint32_t b = 0;
+	{
+	  boost::mutex::scoped_lock lock(mtx);
+	  if (nextBlock >= scanner.blocks.size()) return;
+	  b = nextBlock++;
+	}
+	scanner.scanBlock(b, runs, hits, stats);
+      }
+    }
+  };
+
+  template<typename TConfig>
+  inline int32_t
+  motifIndexRun(TConfig const& c) {
+
+#ifdef PROFILE
+    ProfilerStart("alfred.prof");
+#endif
+
+    // Generate PWMs
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Motif file parsing" << std::endl;
+    std::vector<Pwm> pwms;
+    if (!parseJasparPwm(c, pwms)) return 1;
+    if (pwms.size() > 65536) {
+      std::cerr << "Motif index supports at most 65536 motifs!" << std::endl;
+      return 1;
+    }
+    PwmScanner scanner(pwms, c.motifScoreQuantile, c.motifPvalue);
+    int32_t maxlen = 0;
+    for(uint32_t i = 0; i < pwms.size(); ++i) maxlen = std::max(maxlen, (int32_t) pwms[i].matrix.shape()[1]);
+
+    // Header
+    std::ofstream out(c.outfile.string().c_str(), std::ios_base::out | std::ios_base::binary);
+    out.write(motifIndexMagic, 8);
+    _writeBin(out, motifIndexVersion);
+    _writeBin(out, c.motifScoreQuantile);
+    _writeBin(out, c.motifPvalue);
+    _writeBin(out, (uint32_t) pwms.size());
+    for(uint32_t i = 0; i < pwms.size(); ++i) {
+      _writeBin(out, (int32_t) pwms[i].matrix.shape()[1]);
+      _writeBin(out, pwms[i].matrixId);
+      _writeBin(out, pwms[i].symbol);
+    }
+
+    // Scan the genome tile by tile, motif blocks of a tile are scored in parallel
+    now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Genome-wide motif search" << std::endl;
+    faidx_t* fai = fai_load(c.genome.string().c_str());
+    int32_t nchr = faidx_nseq(fai);
+    boost::progress_display show_progress(nchr);
+    uint16_t nthreads = std::max((uint16_t) 1, c.nthreads);
+    MotifIndex::TChrChunks chrChunks;
+    std::vector<std::string> chrNames;
+    uint64_t totalHits = 0;
+    std::vector<PwmScanStats> threadStats(nthreads);
+    for(int32_t refIndex = 0; refIndex < nchr; ++refIndex) {
+      ++show_progress;
+      std::string chrName(faidx_iseq(fai, refIndex));
+      chrNames.push_back(chrName);
+      MotifIndex::TChunks& chunks = chrChunks[chrName];
+      int32_t seqlen = -1;
+      char* seq = faidx_fetch_seq(fai, chrName.c_str(), 0, faidx_seq_len(fai, chrName.c_str()), &seqlen);
+      if (seq == NULL) continue;
+      TMotifIndexHits pending;
+      for(int32_t tileStart = 0; tileStart < seqlen; tileStart += motifIndexTileSize) {
+	int32_t tileEnd = std::min(seqlen, tileStart + motifIndexTileSize);
+	EncodedRuns runs;
+	_encodeRuns(seq, tileStart, std::min(seqlen, tileEnd + maxlen - 1), runs);
+
+	std::vector<std::vector<std::pair<uint32_t, int32_t> > > threadHits(nthreads);
+	uint32_t nextBlock = 0;
+	boost::mutex mtx;
+	boost::thread_group workers;
+	for(uint16_t t = 0; t < nthreads; ++t) workers.create_thread(MotifTileWorker(scanner, runs, nextBlock, mtx, threadHits[t], threadStats[t]));
+	workers.join_all();
+
+	// Hits starting in the next tile are found again there
+	uint32_t firstNew = pending.size();
+	for(uint16_t t = 0; t < nthreads; ++t)
+	  for(uint32_t i = 0; i < threadHits[t].size(); ++i)
+	    if (threadHits[t][i].second < tileEnd) pending.push_back(std::make_pair(threadHits[t][i].second, threadHits[t][i].first));
+	std::sort(pending.begin() + firstNew, pending.end());
+
+	// Flush full chunks
+	uint32_t beg = 0;
+	for(; beg + motifIndexChunkHits <= pending.size(); beg += motifIndexChunkHits) _writeMotifChunk(out, pending, beg, beg + motifIndexChunkHits, chunks);
+	totalHits += beg;
+	pending.erase(pending.begin(), pending.begin() + beg);
+      }
+      if (!pending.empty()) _writeMotifChunk(out, pending, 0, pending.size(), chunks);
+      totalHits += pending.size();
+      free(seq);
+    }
+    fai_destroy(fai);
+
+    // Chromosome table
+    uint64_t tableOffset = out.tellp();
+    _writeBin(out, (uint32_t) chrNames.size());
+    for(uint32_t k = 0; k < chrNames.size(); ++k) {
+      MotifIndex::TChunks const& chunks = chrChunks[chrNames[k]];
+      _writeBin(out, chrNames[k]);
+      _writeBin(out, (uint32_t) chunks.size());
+      for(uint32_t i = 0; i < chunks.size(); ++i) {
+	_writeBin(out, chunks[i].firstPos);
+	_writeBin(out, chunks[i].lastPos);
+	_writeBin(out, chunks[i].nhits);
+	_writeBin(out, chunks[i].offset);
+	_writeBin(out, chunks[i].size);
+      }
+    }
+    _writeBin(out, tableOffset);
+    out.close();
+
+    PwmScanStats st;
+    for(uint16_t t = 0; t < nthreads; ++t) st.add(threadStats[t]);
+    _reportPruning(st);
+    now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Indexed " << totalHits << " motif hits." << std::endl;
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+
+#ifdef PROFILE
+    ProfilerStop();
+#endif
+
+    return 0;
+  }
+
+
+  // Motif hits fully contained in the merged peak windows, same hits as a direct scan of these windows
+  template<typename TConfig, typename TGenomicRegions, typename TMotifIds>
+  inline int32_t
+  parseMotifIndex(TConfig const& c, TGenomicRegions& gRegions, TMotifIds& motifIds) {
+    typedef typename TGenomicRegions::value_type TChromosomeRegions;
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Motif index query" << std::endl;
+
+    MotifIndex mi;
+    if (!_readMotifIndex(c.motifFile, mi)) {
+      std::cerr << "Motif index cannot be parsed: " << c.motifFile.string() << std::endl;
+      return 0;
+    }
+    std::ifstream in(c.motifFile.string().c_str(), std::ios_base::in | std::ios_base::binary);
+
+    TGenomicRegions overlappingRegions;
+    overlappingRegions.resize(gRegions.size(), TChromosomeRegions());
+    boost::progress_display show_progress(c.nchr.size());
+    for(typename TConfig::TChrMap::const_iterator itChr = c.nchr.begin(); itChr != c.nchr.end(); ++itChr) {
+      ++show_progress;
+      int32_t refIndex = itChr->second;
+      MotifIndex::TChrChunks::const_iterator itChunks = mi.chunks.find(itChr->first);
+      if ((itChunks == mi.chunks.end()) || (itChunks->second.empty())) continue;
+      MotifIndex::TChunks const& chunks = itChunks->second;
+
+      // Merge peak windows
+      std::vector<std::pair<int32_t, int32_t> > windows;
+      for(uint32_t k = 0; k < c.peaks[refIndex].size(); ++k) windows.push_back(std::make_pair(std::max(0, c.peaks[refIndex][k].start - c.maxDistance), c.peaks[refIndex][k].end + c.maxDistance));
+      std::sort(windows.begin(), windows.end());
+      std::vector<std::pair<int32_t, int32_t> > merged;
+      for(uint32_t k = 0; k < windows.size(); ++k) {
+	if ((!merged.empty()) && (windows[k].first <= merged.back().second)) merged.back().second = std::max(merged.back().second, windows[k].second);
+	else merged.push_back(windows[k]);
+      }
+
+      // Query chunks, only the most recently decompressed chunk is kept (a one-entry LRU), so windows that share it reuse it
+      // A window that starts in a chunk before the loaded one decompresses that chunk again
+      TMotifIndexHits hits;
+      int32_t loaded = -1;
+      uint32_t firstChunk = 0;
+      for(uint32_t k = 0; k < merged.size(); ++k) {
+	int32_t ws = merged[k].first;
+	int32_t we = merged[k].second;
+	for(; ((firstChunk < chunks.size()) && (chunks[firstChunk].lastPos < ws)); ++firstChunk);
+	for(uint32_t i = firstChunk; i < chunks.size(); ++i) {
+	  if (chunks[i].firstPos >= we) break;
+	  if (loaded != (int32_t) i) {
+	    if (!_loadMotifChunk(in, chunks[i], hits)) {
+	      std::cerr << "Motif index chunk cannot be read: " << c.motifFile.string() << std::endl;
+	      return 0;
+	    }
+	    loaded = i;
+	  }
+	  TMotifIndexHits::const_iterator it = std::lower_bound(hits.begin(), hits.end(), std::make_pair(ws, (uint32_t) 0));
+	  for(; ((it != hits.end()) && (it->first < we)); ++it) {
+	    int32_t motiflen = mi.motifLen[it->second];
+	    if (it->first + motiflen <= we) _insertInterval(overlappingRegions[refIndex], it->first, it->first + motiflen, '*', it->second, 0);
+	  }
+	}
+      }
+    }
+    _flattenMotifHits(overlappingRegions, gRegions);
+
+    // Assign Motif Ids
+    for(uint32_t i = 0; i < mi.symbols.size(); ++i) motifIds.push_back(mi.symbols[i]);
+    return motifIds.size();
+  }
+
+
+  int motif_index(int argc, char **argv) {
+    MotifIndexConfig c;
+
+    // Parameter
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ("reference,r", boost::program_options::value<boost::filesystem::path>(&c.genome), "reference file")
+      ("quantile,q", boost::program_options::value<float>(&c.motifScoreQuantile)->default_value(0.95), "motif quantile score [0,1]")
+      ("pvalue,p", boost::program_options::value<double>(&c.motifPvalue)->default_value(0), "motif p-value threshold, replaces the quantile score if >0")
+      ("threads,t", boost::program_options::value<uint16_t>(&c.nthreads)->default_value(1), "number of threads")
+      ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("motif.idx"), "motif index output file")
+      ;
+
+    boost::program_options::options_description hidden("Hidden options");
+    hidden.add_options()
+      ("input-file", boost::program_options::value<boost::filesystem::path>(&c.motifFile), "motif file")
+      ;
+
+    boost::program_options::positional_options_description pos_args;
+    pos_args.add("input-file", -1);
+
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic).add(hidden);
+    boost::program_options::options_description visible_options;
+    visible_options.add(generic);
+
+    // Parse command-line
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmdline_options).positional(pos_args).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if ((vm.count("help")) || (!vm.count("input-file")) || (!vm.count("reference"))) {
+      std::cout << std::endl;
+      std::cout << "Usage: alfred " << argv[0] << " [OPTIONS] -r <genome.fa> -o <motif.idx> <motif.jaspar.gz>" << std::endl;
+      std::cout << visible_options << "\n";
+      return 1;
+    }
+
+    // Check p-value
+    if ((c.motifPvalue < 0) || (c.motifPvalue >= 1)) {
+      std::cerr << "Motif p-value threshold must be in [0,1)." << std::endl;
+      return 1;
+    }
+
+    // Check motif file
+    if (!(boost::filesystem::exists(c.motifFile) && boost::filesystem::is_regular_file(c.motifFile) && boost::filesystem::file_size(c.motifFile))) {
+      std::cerr << "Input motif file is missing: " << c.motifFile.string() << std::endl;
+      return 1;
+    }
+
+    // Check reference
+    if (!(boost::filesystem::exists(c.genome) && boost::filesystem::is_regular_file(c.genome) && boost::filesystem::file_size(c.genome))) {
+      std::cerr << "Reference file is missing: " << c.genome.string() << std::endl;
+      return 1;
+    } else {
+      faidx_t* fai = fai_load(c.genome.string().c_str());
+      if (fai == NULL) {
+	if (fai_build(c.genome.string().c_str()) == -1) {
+	  std::cerr << "Fail to open genome fai index for " << c.genome.string() << std::endl;
+	  return 1;
+	} else fai = fai_load(c.genome.string().c_str());
+      }
+      fai_destroy(fai);
+    }
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "alfred ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    return motifIndexRun(c);
+  }
+
+}
+
+#endif
@@ -0,0 +1,235 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <vector>
+#include <deque>
+
+#include <boost/thread.hpp>
+
+#include <htslib/sam.h>
+
+
+namespace bamstats
+{
+
+  // Alignment flags, positions and CIGAR, all that counting and coverage analyses look at
+  static int32_t const samCoreFields = SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT;
+
+  // Skip decoding of unused CRAM fields, BAM records are always decoded in full
+  inline void
+  requireFields(samFile* samfile, int32_t const fields) {
+    hts_set_opt(samfile, CRAM_OPT_REQUIRED_FIELDS, fields);
+  }
+
+  // Decoded records move between the reader and the analysis stages in pooled batches
+  struct BamBatch {
+    uint32_t n;
+    std::vector<bam1_t*> recs;
+
+    explicit BamBatch(uint32_t const cap) : n(0), recs(cap) {
+      for(uint32_t i = 0; i < cap; ++i) recs[i] = bam_init1();
+    }
+
+    ~BamBatch() {
+      for(uint32_t i = 0; i < recs.size(); ++i) bam_destroy1(recs[i]);
+    }
+
+  private:
+    BamBatch(BamBatch const&);
+    BamBatch& operator=(BamBatch const&);
+  };
+
+  template<typename TItem>
+  struct BoundedQueue {
+    boost::mutex mtx;
+    boost::condition_variable notEmpty;
+    boost::condition_variable notFull;
+    std::deque<TItem> items;
+    uint32_t capacity;
+    bool closed;
+
+    explicit BoundedQueue(uint32_t const cap) : capacity(cap), closed(false) {}
+
+    // False if the queue has been closed
+    inline bool
+    push(TItem const& item) {
+      boost::mutex::scoped_lock lock(mtx);
+      while ((items.size() >= capacity) && (!closed)) notFull.wait(lock);
+      if (closed) return false;
+      items.push_back(item);
+      notEmpty.notify_one();
+      return true;
+    }
+
+    // False once the queue is closed and drained
+    inline bool
+    pop(TItem& item) {
+      boost::mutex::scoped_lock lock(mtx);
+      while ((items.empty()) && (!closed)) notEmpty.wait(lock);
+      if (items.empty()) return false;
+      item = items.front();
+      items.pop_front();
+      notFull.notify_one();
+      return true;
+    }
+
+    inline void
+    close() {
+      boost::mutex::scoped_lock lock(mtx);
+      closed = true;
+      notEmpty.notify_all();
+      notFull.notify_all();
+    }
+  };
+
+  typedef BoundedQueue<BamBatch*> TBamBatchQueue;
+
+  // Fills free batches from an index iterator or, without one, sequentially
+  struct BamReaderStage {
+    samFile* samfile;
+    bam_hdr_t* hdr;
+    hts_itr_t* iter;
+    TBamBatchQueue& freeBatches;
+    TBamBatchQueue& fullBatches;
+
+    BamReaderStage(samFile* s, bam_hdr_t* h, hts_itr_t* it, TBamBatchQueue& fb, TBamBatchQueue& ub) : samfile(s), hdr(h), iter(it), freeBatches(fb), fullBatches(ub) {}
+
+    void operator()() {
+      BamBatch* batch = NULL;
+      while (freeBatches.pop(batch)) {
+	batch->n = 0;
+	while (batch->n < batch->recs.size()) {
+	  int32_t ret = (iter != NULL) ? sam_itr_next(samfile, iter, batch->recs[batch->n]) : sam_read1(samfile, hdr, batch->recs[batch->n]);
+	  if (ret < 0) break;
+	  ++batch->n;
+	}
+	bool eof = (batch->n < batch->recs.size());
+	if ((batch->n) && (!fullBatches.push(batch))) break;
+	if (eof) break;
+      }
+      fullBatches.close();
+    }
+  };
+
+  // Reader thread plus batch pool, the iterator is owned and destroyed after the reader has stopped
+  struct BamPipeline {
+    static const uint32_t batchSize = 512;
+
+    TBamBatchQueue freeBatches;
+    TBamBatchQueue fullBatches;
+    std::vector<BamBatch*> batches;
+    hts_itr_t* iter;
+    bool aborted;
+    boost::thread reader;
+
+    BamPipeline(samFile* samfile, bam_hdr_t* hdr, hts_itr_t* it, uint32_t const nbatches) : freeBatches(nbatches), fullBatches(nbatches), batches(nbatches), iter(it), aborted(false) {
+      for(uint32_t i = 0; i < nbatches; ++i) {
+	batches[i] = new BamBatch(batchSize);
+	freeBatches.push(batches[i]);
+      }
+      reader = boost::thread(BamReaderStage(samfile, hdr, iter, freeBatches, fullBatches));
+    }
+
+    ~BamPipeline() {
+      abort();
+      reader.join();
+      if (iter != NULL) hts_itr_destroy(iter);
+      for(uint32_t i = 0; i < batches.size(); ++i) delete batches[i];
+    }
+
+    inline void
+    abort() {
+      freeBatches.close();
+      fullBatches.close();
+    }
+  };
+
+  // Ordered consumption, decoding runs ahead on the reader thread
+  struct BamRecordStream {
+    BamPipeline pipe;
+    BamBatch* batch;
+    uint32_t i;
+
+    BamRecordStream(samFile* samfile, bam_hdr_t* hdr, hts_itr_t* iter) : pipe(samfile, hdr, iter, 4), batch(NULL), i(0) {}
+
+    // Valid until the next call, NULL at the end of the input
+    inline bam1_t*
+    next() {
+      if (batch != NULL) {
+	if (++i < batch->n) return batch->recs[i];
+	pipe.freeBatches.push(batch);
+	batch = NULL;
+      }
+      if (!pipe.fullBatches.pop(batch)) {
+	batch = NULL;
+	return NULL;
+      }
+      i = 0;
+      return batch->recs[0];
+    }
+  };
+
+  template<typename TWorker>
+  struct BamWorkerStage {
+    BamPipeline& pipe;
+    TWorker& worker;
+    boost::mutex& mtx;
+
+    BamWorkerStage(BamPipeline& p, TWorker& w, boost::mutex& m) : pipe(p), worker(w), mtx(m) {}
+
+    void operator()() {
+      BamBatch* batch = NULL;
+      while (pipe.fullBatches.pop(batch)) {
+	bool ok = true;
+	for(uint32_t i = 0; ((ok) && (i < batch->n)); ++i) ok = worker(batch->recs[i]);
+	pipe.freeBatches.push(batch);
+	if (!ok) {
+	  boost::mutex::scoped_lock lock(mtx);
+	  pipe.aborted = true;
+	  pipe.abort();
+	  return;
+	}
+      }
+    }
+  };
+
+  // Unordered reduction, each worker keeps its own state and the caller merges them afterwards
+  // A worker returns false to stop the pipeline
+  template<typename TWorker>
+  inline bool
+  processBamRecords(samFile* samfile, bam_hdr_t* hdr, hts_itr_t* iter, std::vector<TWorker>& workers) {
+    BamPipeline pipe(samfile, hdr, iter, 4 * workers.size());
+    boost::mutex mtx;
+    boost::thread_group threads;
+    for(uint32_t t = 0; t < workers.size(); ++t) threads.create_thread(BamWorkerStage<TWorker>(pipe, workers[t], mtx));
+    threads.join_all();
+    return (!pipe.aborted);
+  }
+
+}
+
+#endif
@@ -42,6 +42,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <htslib/faidx.h>
 
 #include "bamstats.h"
+#include "checkpoint.h"
 #include "util.h"
 #include "version.h"
 
@@ -56,8 +57,10 @@ struct ConfigQC {
   bool isMitagged;
   bool secondary;
   bool supplementary;
+  bool unsorted;
   float nXChrLen;
   uint32_t minChrLen;
+  uint32_t metrics;
   std::string rgname;
   std::string sampleName;
   std::string format;
@@ -65,15 +68,19 @@ struct ConfigQC {
   boost::filesystem::path genome;
   boost::filesystem::path regionFile;
   boost::filesystem::path bamFile;
+  Checkpoint checkpoint;
+  Shard shard;
 };
 
 
-int qc(int argc, char **argv) {
-  ConfigQC c;
+int parseQc(int argc, char **argv, ConfigQC& c, InputContext& in) {
   c.isHaplotagged = false;
   c.isMitagged = false;
   c.minChrLen = 10000000;
   std::string sampleName;
+  std::string metrics;
+  boost::filesystem::path checkpointDir;
+  std::string shard;
   
   // Parameter
   boost::program_options::options_description generic("Generic options");
@@ -82,10 +89,14 @@ int qc(int argc, char **argv) {
     ("reference,r", boost::program_options::value<boost::filesystem::path>(&c.genome), "reference fasta file (required)")
     ("bed,b", boost::program_options::value<boost::filesystem::path>(&c.regionFile), "bed file with target regions (optional)")
     ("name,a", boost::program_options::value<std::string>(&sampleName), "sample name (optional, otherwise SM tag is used)")
-    ("format,f", boost::program_options::value<std::string>(&c.format)->default_value("tsv"), "output format [tsv|json]")
+    ("format,f", boost::program_options::value<std::string>(&c.format)->default_value("tsv"), "output format [tsv|json|both|chunked]")
     ("outfile,o", boost::program_options::value<boost::filesystem::path>(&c.outfile)->default_value("qc.tsv.gz"), "gzipped output file")
     ("secondary,s", "evaluate secondary alignments")
     ("supplementary,u", "evaluate supplementary alignments") 
+    ("unsorted", "input is unsorted or name-sorted")
+    ("metrics", boost::program_options::value<std::string>(&metrics)->default_value("all"), "metric groups [coverage|isize|bases|errors|gc|umi|haplotype|all], comma-separated")
+    ("checkpoint-dir", boost::program_options::value<boost::filesystem::path>(&checkpointDir), "resume an interrupted run from this directory (optional)")
+    ("shard", boost::program_options::value<std::string>(&shard), "only process shard i/n of the genome, merge with merge_shards (optional)")
     ;
 
   boost::program_options::options_description rgopt("Read-group options");
@@ -97,6 +108,7 @@ int qc(int argc, char **argv) {
   boost::program_options::options_description hidden("Hidden options");
   hidden.add_options()
     ("nxchrlen,n", boost::program_options::value<float>(&c.nXChrLen)->default_value(0.95), "N95 chromosome length to trim mapping table [0,1]")
+    ("checkpoint-interval", boost::program_options::value<uint32_t>(&c.checkpoint.interval)->default_value(60), "min. seconds between checkpoints")
     ("input-file", boost::program_options::value<boost::filesystem::path>(&c.bamFile), "input bam file")
     ;
 
@@ -128,6 +140,13 @@ int qc(int argc, char **argv) {
   // Supplementary alignments
   if (vm.count("supplementary")) c.supplementary = true;
   else c.supplementary = false;
+
+  // Unsorted input
+  if (vm.count("unsorted")) c.unsorted = true;
+  else c.unsorted = false;
+
+  // Metric groups
+  if (!parseMetrics(metrics, c.metrics)) return 1;
   
   // Check N95
   if (c.nXChrLen > 1) c.nXChrLen = 1;
@@ -144,47 +163,19 @@ int qc(int argc, char **argv) {
   }
   
   // Check genome
-  if (!(boost::filesystem::exists(c.genome) && boost::filesystem::is_regular_file(c.genome) && boost::filesystem::file_size(c.genome))) {
-    std::cerr << "Input reference file is missing: " << c.genome.string() << std::endl;
-    return 1;
-  } else {
-    faidx_t* fai = fai_load(c.genome.string().c_str());
-    if (fai == NULL) {
-      if (fai_build(c.genome.string().c_str()) == -1) {
-	std::cerr << "Fail to open genome fai index for " << c.genome.string() << std::endl;
-	return 1;
-      } else fai = fai_load(c.genome.string().c_str());
-    }
-    fai_destroy(fai);
-  }
+  if (!in.genome(c.genome)) return 1;
 
-  // Check bam file
-  if (!(boost::filesystem::exists(c.bamFile) && boost::filesystem::is_regular_file(c.bamFile) && boost::filesystem::file_size(c.bamFile))) {
-    std::cerr << "Alignment file is missing: " << c.bamFile.string() << std::endl;
-    return 1;
-  }
-  samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-  if (samfile == NULL) {
-    std::cerr << "Fail to open file " << c.bamFile.string() << std::endl;
-    return 1;
-  }
-  hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-  if (idx == NULL) {
-    if (bam_index_build(c.bamFile.string().c_str(), 0) != 0) {
-      std::cerr << "Fail to open index for " << c.bamFile.string() << std::endl;
-      return 1;
-    }
-  }
-  bam_hdr_t* hdr = sam_hdr_read(samfile);
-  faidx_t* fai = fai_load(c.genome.string().c_str());
+  // Check bam file, qc streams the alignments and never needs an index
+  BamInput* bam = in.bam(c.bamFile, true);
+  if (bam == NULL) return 1;
+  bam_hdr_t* hdr = bam->hdr;
   for(int32_t refIndex=0; refIndex < hdr->n_targets; ++refIndex) {
     std::string tname(hdr->target_name[refIndex]);
-    if (!faidx_has_seq(fai, tname.c_str())) {
+    if (!faidx_has_seq(in.fai, tname.c_str())) {
       std::cerr << "BAM file chromosome " << hdr->target_name[refIndex] << " is NOT present in your reference file " << c.genome.string() << std::endl;
       return 1;
     }
   }
-  fai_destroy(fai);
   if (!vm.count("name")) {
     if (!getSMTag(std::string(hdr->text), c.bamFile.stem().string(), sampleName)) {
       std::cerr << "Only one sample (@RG:SM) is allowed per input BAM file " << c.bamFile.string() << std::endl;
@@ -197,9 +188,6 @@ int qc(int argc, char **argv) {
       return 1;
     }
   }
-  bam_hdr_destroy(hdr);
-  hts_idx_destroy(idx);
-  sam_close(samfile);
   
   // Check region file
   if (vm.count("bed")) {
@@ -208,7 +196,7 @@ int qc(int argc, char **argv) {
       return 1;
     }
     std::string oldChr;
-    faidx_t* fai = fai_load(c.genome.string().c_str());
+    faidx_t* fai = in.fai;
     if (is_gz(c.regionFile)) {
       std::ifstream file(c.regionFile.string().c_str(), std::ios_base::in | std::ios_base::binary);
       boost::iostreams::filtering_streambuf<boost::iostreams::input> dataIn;
@@ -257,10 +245,48 @@ int qc(int argc, char **argv) {
 	interval_file.close();
       }
     }
-    fai_destroy(fai);
     c.hasRegionFile = true;
   } else c.hasRegionFile = false;
 
+  // Shard of a distributed run, chromosomes are fetched through the index
+  c.shard.key = shardKey(argc, argv);
+  if (vm.count("shard")) {
+    if (!parseShard(shard, c.shard)) return 1;
+    if ((c.unsorted) || (vm.count("checkpoint-dir"))) {
+      std::cerr << "Shards cannot be combined with --unsorted or --checkpoint-dir!" << std::endl;
+      return 1;
+    }
+    hts_idx_t* idx = bam->index(false);
+    if (idx == NULL) return 1;
+    assignShard(idx, hdr, c.shard);
+  }
+
+  // Checkpoints, taken at chromosome boundaries of coordinate-sorted input
+  if (vm.count("checkpoint-dir")) {
+    if (c.unsorted) {
+      std::cerr << "Checkpoints require coordinate-sorted input, --unsorted is not supported!" << std::endl;
+      return 1;
+    }
+    if (bam->isStream()) {
+      std::cerr << "Checkpoints require a regular input file, streamed input is not supported!" << std::endl;
+      return 1;
+    }
+    std::vector<boost::filesystem::path> inputs;
+    inputs.push_back(c.bamFile);
+    inputs.push_back(c.genome);
+    if (c.hasRegionFile) inputs.push_back(c.regionFile);
+    if (!c.checkpoint.init(checkpointDir, checkpointKey(argc, argv, inputs))) return 1;
+  }
+
+  return 0;
+}
+
+
+int qc(int argc, char **argv) {
+  ConfigQC c;
+  InputContext in;
+  if (parseQc(argc, argv, c, in)) return 1;
+
   // Show cmd
   boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
   std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
@@ -268,7 +294,7 @@ int qc(int argc, char **argv) {
   for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
   std::cout << std::endl;
 
-  return bamStatsRun(c); 
+  return bamStatsRun(c, in);
 }
 
 }
@@ -25,8 +25,10 @@ Contact: Tobias Rausch (rausch@embl.de)
 #define QCSTRUCT_H
 
 #include <limits>
+#include <iostream>
 
 #include <boost/dynamic_bitset.hpp>
+#include <boost/tokenizer.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
@@ -44,6 +46,49 @@ Contact: Tobias Rausch (rausch@embl.de)
 namespace bamstats
 {
 
+  // QC metric groups, selected with qc --metrics
+  static uint32_t const qcCoverage = 1;
+  static uint32_t const qcInsertSize = 2;
+  static uint32_t const qcBaseComposition = 4;
+  static uint32_t const qcErrors = 8;
+  static uint32_t const qcGC = 16;
+  static uint32_t const qcUMI = 32;
+  static uint32_t const qcHaplotype = 64;
+  static uint32_t const qcAll = 127;
+
+  // Metric groups that need the reference sequence of the current chromosome
+  static uint32_t const qcReference = qcCoverage | qcErrors | qcGC;
+
+  // Metric groups that need the read sequence
+  static uint32_t const qcSequence = qcBaseComposition | qcErrors;
+
+  inline bool
+  parseMetrics(std::string const& str, uint32_t& metrics) {
+    metrics = 0;
+    typedef boost::tokenizer< boost::char_separator<char> > Tokenizer;
+    boost::char_separator<char> sep(",");
+    Tokenizer tokens(str, sep);
+    for(Tokenizer::iterator tokIter = tokens.begin(); tokIter != tokens.end(); ++tokIter) {
+      if (*tokIter == "all") metrics |= qcAll;
+      else if (*tokIter == "coverage") metrics |= qcCoverage;
+      else if (*tokIter == "isize") metrics |= qcInsertSize;
+      else if (*tokIter == "bases") metrics |= qcBaseComposition;
+      else if (*tokIter == "errors") metrics |= qcErrors;
+      else if (*tokIter == "gc") metrics |= qcGC;
+      else if (*tokIter == "umi") metrics |= qcUMI;
+      else if (*tokIter == "haplotype") metrics |= qcHaplotype;
+      else {
+	std::cerr << "Unknown metric group: " << *tokIter << std::endl;
+	return false;
+      }
+    }
+    if (!metrics) {
+      std::cerr << "No metric group selected!" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
   struct ChrGC {
     uint32_t ncount;
     uint32_t gccount;
@@ -231,6 +276,108 @@ namespace bamstats
       bedGcContent.resize(102, 0);
     }
   };
+
+  // Checkpoint state, per-chromosome buffers such as the bp-level coverage are summarized before a checkpoint is taken
+  template<typename TArchive>
+  inline void
+  checkpointIO(TArchive& ar, ChrGC& v) {
+    ar.io(v.ncount);
+    ar.io(v.gccount);
+  }
+
+  template<typename TArchive>
+  inline void
+  checkpointIO(TArchive& ar, ReferenceFeatures& v) {
+    ar.io(v.referencebp);
+    ar.io(v.ncount);
+    ar.io(v.chrGC);
+    ar.io(v.refGcContent);
+  }
+
+  template<typename TArchive>
+  inline void
+  checkpointIO(TArchive& ar, BaseCounts& v) {
+    ar.io(v.n1);
+    ar.io(v.n2);
+    ar.io(v.nd);
+    ar.io(v.matchCount);
+    ar.io(v.mismatchCount);
+    ar.io(v.delCount);
+    ar.io(v.insCount);
+    ar.io(v.softClipCount);
+    ar.io(v.hardClipCount);
+    ar.io(v.delHomACGTN);
+    ar.io(v.insHomACGTN);
+    ar.io(v.delSize);
+    ar.io(v.insSize);
+    ar.io(v.bpWithCoverage);
+  }
+
+  template<typename TArchive>
+  inline void
+  checkpointIO(TArchive& ar, ReadCounts& v) {
+    ar.io(v.secondary);
+    ar.io(v.qcfail);
+    ar.io(v.dup);
+    ar.io(v.supplementary);
+    ar.io(v.unmap);
+    ar.io(v.forward);
+    ar.io(v.reverse);
+    ar.io(v.spliced);
+    ar.io(v.mapped1);
+    ar.io(v.mapped2);
+    ar.io(v.haplotagged);
+    ar.io(v.mitagged);
+    ar.io(v.mappedchr);
+    ar.io(v.lRc);
+    ar.io(v.nCount);
+    ar.io(v.aCount);
+    ar.io(v.cCount);
+    ar.io(v.gCount);
+    ar.io(v.tCount);
+    ar.io(v.bqCount);
+    ar.io(v.gcContent);
+    ar.io(v.umi);
+    ar.io(v.brange);
+  }
+
+  template<typename TArchive>
+  inline void
+  checkpointIO(TArchive& ar, PairCounts& v) {
+    ar.io(v.paired);
+    ar.io(v.mapped);
+    ar.io(v.mappedSameChr);
+    ar.io(v.mappedProper);
+    for(uint32_t i = 0; i < 4; ++i) ar.io(v.orient[i]);
+    ar.io(v.totalISizeCount);
+    ar.io(v.fPlus);
+    ar.io(v.rPlus);
+    ar.io(v.fMinus);
+    ar.io(v.rMinus);
+  }
+
+  template<typename TArchive>
+  inline void
+  checkpointIO(TArchive& ar, QualCounts& v) {
+    ar.io(v.qcount);
+  }
+
+  template<typename TArchive>
+  inline void
+  checkpointIO(TArchive& ar, ReadGroupStats& v) {
+    ar.io(v.bc);
+    ar.io(v.rc);
+    ar.io(v.pc);
+    ar.io(v.qc);
+  }
+
+  template<typename TArchive>
+  inline void
+  checkpointIO(TArchive& ar, BedCounts& v) {
+    ar.io(v.gCov);
+    ar.io(v.onTarget);
+    ar.io(v.bedGcContent);
+  }
   
 }
 
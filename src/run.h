@@ -0,0 +1,299 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef RUN_H
+#define RUN_H
+
+#include <iostream>
+#include <vector>
+#include <fstream>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/progress.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <htslib/sam.h>
+
+#include "version.h"
+#include "util.h"
+#include "pipeline.h"
+#include "bamstats.h"
+#include "count_dna.h"
+#include "count_rna.h"
+#include "tracks.h"
+#include "qc.h"
+
+namespace bamstats
+{
+
+  struct RunConfig {
+    bool hasQc;
+    bool hasCountDNA;
+    bool hasTracks;
+    bool hasCountRNA;
+    ConfigQC qc;
+    CountDNAConfig dna;
+    TrackConfig tracks;
+    CountRNAConfig rna;
+    boost::filesystem::path bamFile;
+  };
+
+
+  template<typename TConfig>
+  inline int32_t
+  analysisRun(TConfig& c, InputContext& in) {
+
+#ifdef PROFILE
+    ProfilerStart("alfred.prof");
+#endif
+
+    // Load bam file, opened once by the option parsers of all analyses
+    BamInput* bam = in.bam(c.bamFile, true);
+    if (bam == NULL) return 1;
+    samFile* samfile = bam->samfile;
+    bam_hdr_t* hdr = bam->hdr;
+    if (c.hasQc) hts_set_fai_filename(samfile, c.qc.genome.string().c_str());
+
+    // Feature annotation
+    typedef RnaAnnotation::TGenomicRegions TGenomicRegions;
+    typedef std::vector<int32_t> TFeatureCounter;
+    TFeatureCounter fc;
+    boost::shared_ptr<RnaAnnotation const> anno;
+    if (c.hasCountRNA) {
+      anno = loadAnnotation(c.rna);
+      if (!anno) return 1;
+      fc.resize(anno->nfeatures, 0);
+    }
+
+    // Enabled analyses, released on every exit path
+    boost::scoped_ptr<QcAnalysis<ConfigQC> > qa;
+    boost::scoped_ptr<DnaCountAnalysis<CountDNAConfig> > da;
+    boost::scoped_ptr<TrackAnalysis<TrackConfig> > ta;
+    boost::scoped_ptr<RnaCountAnalysis<CountRNAConfig, TGenomicRegions, TFeatureCounter> > ra;
+    if (c.hasQc) {
+      qa.reset(new QcAnalysis<ConfigQC>(c.qc, hdr, in.fai));
+      if (!qa->init()) return 1;
+    }
+    if (c.hasCountDNA) da.reset(new DnaCountAnalysis<CountDNAConfig>(c.dna, hdr));
+    if (c.hasTracks) ta.reset(new TrackAnalysis<TrackConfig>(c.tracks, hdr));
+    if (c.hasCountRNA) ra.reset(new RnaCountAnalysis<CountRNAConfig, TGenomicRegions, TFeatureCounter>(c.rna, hdr, anno->gRegions, fc));
+
+    // Decode the fields any of the enabled analyses needs
+    int32_t fields = 0;
+    if (qa) fields |= qa->requiredFields();
+    if (da) fields |= da->requiredFields();
+    if (ta) fields |= ta->requiredFields();
+    if (ra) fields |= ra->requiredFields();
+    requireFields(samfile, fields);
+
+    // Parse BAM file once, every record is handed to all analyses
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
+    boost::progress_display show_progress( hdr->n_targets );
+    int32_t refIndex = -1;
+    int32_t lastTid = -1;
+    int32_t lastPos = -1;
+    bool unplaced = false;
+    bool sorted = !((c.hasQc) && (c.qc.unsorted));
+    BamRecordStream stream(samfile, hdr, NULL);
+    bam1_t* rec = NULL;
+    while ((rec = stream.next()) != NULL) {
+      // The per-chromosome analyses need coordinate order, reads without a position come last
+      if ((sorted) && (rec->core.tid >= 0)) {
+	if ((unplaced) || (rec->core.tid < lastTid) || ((rec->core.tid == lastTid) && (rec->core.pos < lastPos))) {
+	  std::cerr << "Alignments are not coordinate-sorted: " << bam_get_qname(rec) << std::endl;
+	  return 1;
+	}
+	lastTid = rec->core.tid;
+	lastPos = rec->core.pos;
+      } else if (sorted) unplaced = true;
+      if ((!(rec->core.flag & BAM_FUNMAP)) && (rec->core.tid != refIndex)) {
+	refIndex = rec->core.tid;
+	++show_progress;
+      }
+      if ((qa) && (!qa->process(rec))) return 1;
+      if ((da) && (!da->process(rec))) return 1;
+      if ((ta) && (!ta->process(rec))) return 1;
+      if ((ra) && (!ra->process(rec))) return 1;
+    }
+
+    // Output
+    if (qa) qa->finish();
+    if ((da) && (!da->finish())) return 1;
+    if ((ta) && (!ta->finish())) return 1;
+    if (ra) {
+      ra->finish();
+      countRNAOut(c.rna, anno->gRegions, anno->geneIds, anno->pCoding, fc);
+    }
+
+    now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] Done." << std::endl;
+    
+#ifdef PROFILE
+    ProfilerStop();
+#endif
+
+    return 0;
+  }
+
+
+  int run(int argc, char **argv) {
+    RunConfig c;
+    InputContext in;
+    c.hasQc = false;
+    c.hasCountDNA = false;
+    c.hasTracks = false;
+    c.hasCountRNA = false;
+
+    // Split analyses, each one starts with "--"
+    int32_t nargs = argc;
+    for(int i = 1; i < argc; ++i) {
+      if (std::string(argv[i]) == "--") {
+	nargs = i;
+	break;
+      }
+    }
+
+    // Parameter
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ;
+
+    boost::program_options::options_description hidden("Hidden options");
+    hidden.add_options()
+      ("input-file", boost::program_options::value<boost::filesystem::path>(&c.bamFile), "input bam file")
+      ;
+
+    boost::program_options::positional_options_description pos_args;
+    pos_args.add("input-file", -1);
+
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic).add(hidden);
+    boost::program_options::options_description visible_options;
+    visible_options.add(generic);
+
+    // Parse command-line
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(nargs, argv).options(cmdline_options).positional(pos_args).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if ((vm.count("help")) || (!vm.count("input-file")) || (nargs == argc)) {
+      std::cout << std::endl;
+      std::cout << "Usage: alfred " << argv[0] << " <aligned.bam> -- <analysis> [OPTIONS] [-- <analysis> [OPTIONS]]..." << std::endl;
+      std::cout << visible_options << "\n";
+      std::cout << "Analyses (options as for the stand-alone command, without the input file):" << std::endl;
+      std::cout << "    qc           alignment quality control" << std::endl;
+      std::cout << "    count_dna    counting DNA reads in windows" << std::endl;
+      std::cout << "    count_rna    counting RNA reads in features" << std::endl;
+      std::cout << "    tracks       create browser tracks" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Example: alfred " << argv[0] << " <aligned.bam> -- qc -r <ref.fa> -o qc.tsv.gz -- count_dna -o cov.gz -- tracks -o track.gz" << std::endl;
+      std::cout << std::endl;
+      return 1;
+    }
+
+    // All analyses read the input front to back, so standard input and named pipes work as well
+    if (in.bam(c.bamFile, true) == NULL) return 1;
+
+    // Parse the options of each analysis
+    for(int i = nargs; i < argc; ) {
+      std::vector<std::string> args;
+      for(++i; (i < argc) && (std::string(argv[i]) != "--"); ++i) args.push_back(std::string(argv[i]));
+      if (args.empty()) {
+	std::cerr << "Missing analysis after --" << std::endl;
+	return 1;
+      }
+      args.push_back(c.bamFile.string());
+      std::vector<char*> aargv;
+      for(uint32_t k = 0; k < args.size(); ++k) aargv.push_back(const_cast<char*>(args[k].c_str()));
+      int aargc = aargv.size();
+      std::string analysis = args[0];
+      bool duplicate = false;
+      if (analysis == "qc") {
+	if (c.hasQc) duplicate = true;
+	else if (parseQc(aargc, &aargv[0], c.qc, in)) return 1;
+	c.hasQc = true;
+      } else if (analysis == "count_dna") {
+	if (c.hasCountDNA) duplicate = true;
+	else if (parseCountDNA(aargc, &aargv[0], c.dna, in)) return 1;
+	c.hasCountDNA = true;
+      } else if (analysis == "tracks") {
+	if (c.hasTracks) duplicate = true;
+	else if (parseTracks(aargc, &aargv[0], c.tracks, in)) return 1;
+	c.hasTracks = true;
+      } else if (analysis == "count_rna") {
+	if (c.hasCountRNA) duplicate = true;
+	else if (parseCountRNA(aargc, &aargv[0], c.rna, in)) return 1;
+	if (c.rna.inputBamFormat != 0) {
+	  std::cerr << "count_rna requires a BAM/CRAM input file in alfred " << argv[0] << std::endl;
+	  return 1;
+	}
+	c.hasCountRNA = true;
+      } else {
+	std::cerr << "Unknown analysis: " << analysis << std::endl;
+	return 1;
+      }
+      if (duplicate) {
+	std::cerr << "Analysis " << analysis << " is given more than once!" << std::endl;
+	return 1;
+      }
+    }
+
+    // Only qc supports unsorted input
+    if ((c.hasQc) && (c.qc.unsorted) && ((c.hasCountDNA) || (c.hasTracks) || (c.hasCountRNA))) {
+      std::cerr << "Unsorted input is only supported for qc!" << std::endl;
+      return 1;
+    }
+
+    // A shared pass cannot resume the analyses independently
+    if (((c.hasQc) && (c.qc.checkpoint.enabled)) || ((c.hasCountRNA) && (c.rna.checkpoint.enabled))) {
+      std::cerr << "Checkpoints are not supported in alfred " << argv[0] << ", run the analysis on its own!" << std::endl;
+      return 1;
+    }
+    if (((c.hasQc) && (c.qc.shard.index)) || ((c.hasCountRNA) && (c.rna.shard.index)) || ((c.hasCountDNA) && (c.dna.shard.index))) {
+      std::cerr << "Shards are not supported in alfred " << argv[0] << ", run the analysis on its own!" << std::endl;
+      return 1;
+    }
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "alfred ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    return analysisRun(c, in);
+  }
+
+}
+
+#endif
@@ -0,0 +1,315 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include "version.h"
+#include "util.h"
+#include "pipeline.h"
+#include "cache.h"
+
+namespace bamstats
+{
+
+  // Entry point of a command, argv[0] is the command name
+  typedef int (*TCommandFn)(int, char**);
+
+  struct ServeConfig {
+    uint16_t nthreads;
+    uint32_t timeout;  // Seconds to wait for a request
+    uint32_t cacheSize;  // MB
+    boost::filesystem::path socket;
+  };
+
+  typedef BoundedQueue<int> TConnectionQueue;
+
+  // Set by SIGTERM or SIGINT, the accept loop stops and running jobs complete
+  inline volatile sig_atomic_t&
+  serveStop() {
+    static volatile sig_atomic_t stop = 0;
+    return stop;
+  }
+
+  extern "C" inline void
+  _serveSignal(int) {
+    serveStop() = 1;
+  }
+
+  // A request is one line of tab-separated arguments starting with the command, the reply is "exit <code>"
+  // Clients that have not sent a request within timeout seconds, or idle while the server shuts down, are dropped
+  inline bool
+  _readRequest(int fd, uint32_t const timeout, std::vector<std::string>& args) {
+    std::string line;
+    char buf[4096];
+    time_t deadline = time(NULL) + timeout;
+    while (line.find('\n') == std::string::npos) {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int ready = poll(&pfd, 1, 1000);
+      if ((ready < 0) && (errno != EINTR)) break;
+      if (((ready <= 0) && (serveStop())) || (time(NULL) >= deadline)) {
+	std::cerr << "Request timed out" << std::endl;
+	return false;
+      }
+      if (ready <= 0) continue;
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if ((n < 0) && (errno == EINTR)) continue;
+      if ((n <= 0) || (line.size() + n > (1 << 20))) break;
+      line.append(buf, n);
+    }
+    std::string::size_type eol = line.find('\n');
+    if (eol == std::string::npos) {
+      std::cerr << "Malformed request" << std::endl;
+      return false;
+    }
+    line.resize(eol);
+    if ((!line.empty()) && (line[line.size() - 1] == '\r')) line.resize(line.size() - 1);
+    args.clear();
+    std::string::size_type start = 0;
+    while (start <= line.size()) {
+      std::string::size_type tab = line.find('\t', start);
+      if (tab == std::string::npos) tab = line.size();
+      args.push_back(line.substr(start, tab - start));
+      start = tab + 1;
+    }
+    if ((args.empty()) || (args[0].empty())) {
+      std::cerr << "Malformed request" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  inline void
+  _writeReply(int fd, int32_t const code) {
+    std::string reply = "exit " + boost::lexical_cast<std::string>(code) + '\n';
+    std::size_t done = 0;
+    while (done < reply.size()) {
+      ssize_t n = send(fd, reply.c_str() + done, reply.size() - done, MSG_NOSIGNAL);
+      if ((n < 0) && (errno == EINTR)) continue;
+      if (n <= 0) return;
+      done += n;
+    }
+  }
+
+  // Runs the jobs of accepted connections, one at a time
+  struct ServeWorker {
+    TConnectionQueue& connections;
+    TCommandFn dispatch;
+    uint32_t timeout;
+
+    ServeWorker(TConnectionQueue& q, TCommandFn d, uint32_t const t) : connections(q), dispatch(d), timeout(t) {}
+
+    void operator()() {
+      int fd = -1;
+      while (connections.pop(fd)) {
+	std::vector<std::string> args;
+	int32_t code = 1;
+	if (_readRequest(fd, timeout, args)) {
+	  std::vector<char*> argv(args.size() + 1, (char*) NULL);
+	  for(uint32_t i = 0; i < args.size(); ++i) argv[i] = &args[i][0];
+	  try {
+	    code = dispatch(args.size(), &argv[0]);
+	  } catch (std::exception const& e) {
+	    std::cerr << "Job " << args[0] << " failed: " << e.what() << std::endl;
+	    code = 1;
+	  }
+	}
+	_writeReply(fd, code);
+	close(fd);
+      }
+    }
+  };
+
+  template<typename TConfig>
+  inline int32_t
+  serveRun(TConfig const& c, TCommandFn dispatch) {
+    // Refuse to take over the socket of a running server
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::string path = c.socket.string();
+    if (path.size() >= sizeof(addr.sun_path)) {
+      std::cerr << "Socket path is too long: " << path << std::endl;
+      return 1;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+      std::cerr << "Fail to create socket: " << strerror(errno) << std::endl;
+      return 1;
+    }
+    if (boost::filesystem::exists(c.socket)) {
+      if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+	std::cerr << "Another server is listening on " << path << std::endl;
+	close(sock);
+	return 1;
+      }
+      close(sock);
+      sock = socket(AF_UNIX, SOCK_STREAM, 0);
+      unlink(path.c_str());
+    }
+    if ((bind(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) || (listen(sock, 64) != 0)) {
+      std::cerr << "Fail to listen on " << path << ": " << strerror(errno) << std::endl;
+      close(sock);
+      return 1;
+    }
+
+    // Cached resources are shared by all jobs
+    ResourceCache cache((uint64_t) c.cacheSize * 1024 * 1024);
+    sharedCache() = &cache;
+
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Listening on " << path << std::endl;
+
+    // Shutdown signals are handled by the accept loop only, workers block them
+    serveStop() = 0;
+    struct sigaction action, oldTerm, oldInt;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _serveSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, &oldTerm);
+    sigaction(SIGINT, &action, &oldInt);
+    sigset_t shutdown, oldMask;
+    sigemptyset(&shutdown);
+    sigaddset(&shutdown, SIGTERM);
+    sigaddset(&shutdown, SIGINT);
+
+    // Accepted connections wait for a free worker
+    uint16_t nthreads = std::max((uint16_t) 1, c.nthreads);
+    TConnectionQueue connections(4 * nthreads);
+    boost::thread_group workers;
+    pthread_sigmask(SIG_BLOCK, &shutdown, &oldMask);
+    for(uint16_t t = 0; t < nthreads; ++t) workers.create_thread(ServeWorker(connections, dispatch, std::max((uint32_t) 1, c.timeout)));
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    bool failed = false;
+    while (!serveStop()) {
+      struct pollfd pfd;
+      pfd.fd = sock;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int ready = poll(&pfd, 1, 1000);
+      if ((ready < 0) && (errno != EINTR)) {
+	std::cerr << "Fail to wait for connections: " << strerror(errno) << std::endl;
+	failed = true;
+	break;
+      }
+      if (ready <= 0) continue;
+      int fd = accept(sock, NULL, NULL);
+      if (fd < 0) {
+	if ((errno == EINTR) || (errno == EAGAIN) || (errno == ECONNABORTED)) continue;
+	std::cerr << "Fail to accept connection: " << strerror(errno) << std::endl;
+	failed = true;
+	break;
+      }
+      connections.push(fd);
+    }
+
+    // Queued and running jobs complete before the socket is removed
+    close(sock);
+    unlink(path.c_str());
+    connections.close();
+    workers.join_all();
+    sharedCache() = NULL;
+    sigaction(SIGTERM, &oldTerm, NULL);
+    sigaction(SIGINT, &oldInt, NULL);
+
+    now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Shut down" << std::endl;
+    return failed ? 1 : 0;
+  }
+
+
+  int serve(int argc, char **argv, TCommandFn dispatch) {
+    ServeConfig c;
+
+    // Parameter
+    boost::program_options::options_description generic("Generic options");
+    generic.add_options()
+      ("help,?", "show help message")
+      ("socket,s", boost::program_options::value<boost::filesystem::path>(&c.socket)->default_value("alfred.sock"), "Unix socket to listen on")
+      ("threads,t", boost::program_options::value<uint16_t>(&c.nthreads)->default_value(2), "number of concurrent jobs")
+      ("timeout,w", boost::program_options::value<uint32_t>(&c.timeout)->default_value(60), "seconds to wait for the request of a connection")
+      ("cache,m", boost::program_options::value<uint32_t>(&c.cacheSize)->default_value(4096), "memory for cached references and annotations in MB")
+      ;
+
+    boost::program_options::options_description cmdline_options;
+    cmdline_options.add(generic);
+    boost::program_options::options_description visible_options;
+    visible_options.add(generic);
+
+    // Parse command-line
+    boost::program_options::variables_map vm;
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+    boost::program_options::notify(vm);
+
+    // Check command line arguments
+    if (vm.count("help")) {
+      std::cout << std::endl;
+      std::cout << "Usage: alfred " << argv[0] << " [OPTIONS]" << std::endl;
+      std::cout << visible_options << "\n";
+      return 1;
+    }
+
+    // Show cmd
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
+    std::cout << "alfred ";
+    for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
+    std::cout << std::endl;
+
+    return serveRun(c, dispatch);
+  }
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <htslib/sam.h>
+
+#include "checkpoint.h"
+
+namespace bamstats
+{
+
+  // One part of a genome-wide run, shard i of n covers the chromosomes [begin, end)
+  // Partial outputs store the command line without --shard, merge_shards re-runs the command on them
+  struct Shard {
+    uint32_t index;  // 1-based, 0 if the run is not sharded
+    uint32_t count;
+    int32_t begin;
+    int32_t end;
+    std::string key;
+    std::vector<boost::filesystem::path> parts;  // Partial outputs in shard order, only set by merge_shards
+
+    Shard() : index(0), count(0), begin(0), end(0) {}
+
+    inline bool
+    merging() const {
+      return !parts.empty();
+    }
+
+    // Reads without coordinates belong to the last shard
+    inline bool
+    last() const {
+      return ((index == 0) || (index == count));
+    }
+
+    inline bool
+    contains(int32_t const refIndex) const {
+      return ((index == 0) || ((refIndex >= begin) && (refIndex < end)));
+    }
+
+    inline boost::filesystem::path
+    partial(boost::filesystem::path const& outfile) const {
+      return boost::filesystem::path(outfile.string() + ".shard" + boost::lexical_cast<std::string>(index) + "of" + boost::lexical_cast<std::string>(count));
+    }
+
+    bool
+    open(CheckpointWriter& part, boost::filesystem::path const& outfile) const {
+      if (!part.open(partial(outfile), key)) return false;
+      uint32_t i = index;
+      uint32_t n = count;
+      part.io(i);
+      part.io(n);
+      return true;
+    }
+
+    // Partial output k, counts are added to the state the caller reads into
+    bool
+    open(CheckpointReader& part, uint32_t const k) const {
+      if (!part.open(parts[k], key)) return false;
+      uint32_t i = 0;
+      uint32_t n = 0;
+      part.io(i);
+      part.io(n);
+      part.accumulate = true;
+      return part.ok;
+    }
+  };
+
+  // The command line identifies the run, all shards of a run share it
+  inline std::string
+  shardKey(int argc, char** argv) {
+    std::string key;
+    for(int i = 0; i < argc; ++i) {
+      std::string arg(argv[i]);
+      if (arg == "--shard") ++i;
+      else if (arg.compare(0, 8, "--shard=") != 0) key += arg + '\n';
+    }
+    return key;
+  }
+
+  // Parse i/n
+  inline bool
+  parseShard(std::string const& str, Shard& s) {
+    std::size_t sep = str.find('/');
+    try {
+      if (sep != std::string::npos) {
+	s.index = boost::lexical_cast<uint32_t>(str.substr(0, sep));
+	s.count = boost::lexical_cast<uint32_t>(str.substr(sep + 1));
+      }
+    } catch (boost::bad_lexical_cast&) {
+      s.index = 0;
+    }
+    if ((sep == std::string::npos) || (s.index < 1) || (s.index > s.count)) {
+      std::cerr << "Shard needs to be given as i/n with 1 <= i <= n: " << str << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Balance the shards by the mapped reads of each chromosome as given in the index, by length if it has no counts
+  // A chromosome goes to the shard that holds its mid-point in the cumulative distribution, so the shards are contiguous
+  inline void
+  assignShard(hts_idx_t* idx, bam_hdr_t* hdr, Shard& s) {
+    std::vector<uint64_t> weight(hdr->n_targets, 0);
+    uint64_t total = 0;
+    for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+      uint64_t mapped = 0;
+      uint64_t unmapped = 0;
+      if (hts_idx_get_stat(idx, refIndex, &mapped, &unmapped) == 0) weight[refIndex] = mapped;
+      total += weight[refIndex];
+    }
+    if (!total) {
+      for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+	weight[refIndex] = hdr->target_len[refIndex];
+	total += weight[refIndex];
+      }
+    }
+    s.begin = hdr->n_targets;
+    s.end = hdr->n_targets;
+    uint64_t cumsum = 0;
+    for(int32_t refIndex = 0; refIndex < hdr->n_targets; ++refIndex) {
+      uint32_t k = (total) ? std::min((uint64_t) s.count - 1, ((cumsum + weight[refIndex] / 2) * s.count) / total) : 0;
+      cumsum += weight[refIndex];
+      if ((k + 1 == s.index) && (s.begin == hdr->n_targets)) s.begin = refIndex;
+      if (k + 1 > s.index) {
+	s.end = refIndex;
+	break;
+      }
+    }
+    if (s.begin > s.end) s.begin = s.end;
+  }
+
+}
+
+#endif
@@ -53,6 +53,10 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #include "util.h"
 #include "variants.h"
+#include "pipeline.h"
+#include "input.h"
+#include "checkpoint.h"
+#include "cache.h"
 
 namespace bamstats
 {
@@ -60,6 +64,7 @@ namespace bamstats
   struct SplitConfig {
     bool assign;
     bool interleaved;
+    uint16_t nthreads;
     unsigned short minMapQual;
     std::string sample;
     boost::filesystem::path genome;
@@ -67,177 +72,196 @@ namespace bamstats
     boost::filesystem::path h2bam;
     boost::filesystem::path bamfile;
     boost::filesystem::path vcffile;
+    Checkpoint checkpoint;
+  };
+
+  // Haplotype of a single read (0: unassigned), false on unknown CIGAR operations
+  template<typename TConfig, typename TPhasedVariants>
+  inline bool
+  _readHaplotype(TConfig const& c, bam1_t* rec, char const* seq, TPhasedVariants const& pv, int32_t& hp) {
+    hp = 0;
+    if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) return true;
+    if ((rec->core.qual < c.minMapQual) || (rec->core.tid<0)) return true;
+    if ((rec->core.flag & BAM_FPAIRED) && (rec->core.flag & BAM_FMUNMAP)) return true;
+    uint32_t hp1votes = 0;
+    uint32_t hp2votes = 0;
+    uint32_t vIdx = pv.lowerBound(rec->core.pos);
+    uint32_t vIdxEnd = pv.upperBound(lastAlignedPosition(rec));
+    if (vIdx < vIdxEnd) {
+      // Read sequence is only decoded for non-SNV markers
+      std::string sequence;
+	  
+      // Parse CIGAR
+      uint32_t* cigar = bam_get_cigar(rec);
+      for(;vIdx < vIdxEnd; ++vIdx) {
+	int32_t gp = rec->core.pos; // Genomic position
+	int32_t sp = 0; // Sequence position
+	bool varFound = false;
+	for (std::size_t i = 0; ((i < rec->core.n_cigar) && (!varFound)); ++i) {
+	  if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CINS) sp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CDEL) gp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) gp += bam_cigar_oplen(cigar[i]);
+	  else if (bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP) {
+	    //Nop
+	  } else if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
+	    if (gp + (int32_t) bam_cigar_oplen(cigar[i]) < pv.pos[vIdx]) {
+	      gp += bam_cigar_oplen(cigar[i]);
+	      sp += bam_cigar_oplen(cigar[i]);
+	    } else {
+	      for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]); ++k, ++sp, ++gp) {
+		if (gp == pv.pos[vIdx]) {
+		  varFound = true;
+		  int32_t allele = _readAllele(pv, vIdx, seq, rec, sp, sequence);
+		  if (allele == 2) {
+		    // ALT supporting read
+		    if (pv.hap(vIdx)) ++hp1votes;
+		    else ++hp2votes;
+		  } else if (allele == 1) {
+		    // REF supporting read
+		    if (pv.hap(vIdx)) ++hp2votes;
+		    else ++hp1votes;
+		  }
+		}
+	      }
+	    }
+	  } else {
+	    std::cerr << "Unknown Cigar options" << std::endl;
+	    return false;
+	  }
+	}
+      }
+      if (hp1votes > 2*hp2votes) hp = 1;
+      else if (hp2votes > 2*hp1votes) hp = 2;
+    }
+    return true;
+  }
+
+  // Per-thread haplotype read sets
+  template<typename TConfig, typename TPhasedVariants>
+  struct HaplotypeWorker {
+    TConfig const* c;
+    char const* seq;
+    TPhasedVariants const* pv;
+    std::set<std::size_t> h1;
+    std::set<std::size_t> h2;
+
+    HaplotypeWorker(TConfig const& conf, char const* s, TPhasedVariants const& p) : c(&conf), seq(s), pv(&p) {}
+
+    inline bool
+    operator()(bam1_t* rec) {
+      int32_t hp = 0;
+      if (!_readHaplotype(*c, rec, seq, *pv, hp)) return false;
+      if (hp == 1) h1.insert(hash_pair(rec));
+      else if (hp == 2) h2.insert(hash_pair(rec));
+      return true;
+    }
   };
 
   template<typename TConfig>
   inline int32_t
-  phaseBamRun(TConfig const& c) {
+  phaseBamRun(TConfig const& c, InputContext& in) {
 
 #ifdef PROFILE
     ProfilerStart("alfred.prof");
 #endif
 
-    // Load bam files
-    samFile* samfile = sam_open(c.bamfile.string().c_str(), "r");
+    // Load bam files, reads are fetched per chromosome so an existing index is required
+    BamInput* bam = in.bam(c.bamfile, false);
+    if (bam == NULL) return 1;
+    hts_idx_t* idx = bam->index(false);
+    if (idx == NULL) return 1;
+    samFile* samfile = bam->samfile;
+    bam_hdr_t* hdr = bam->hdr;
     hts_set_fai_filename(samfile, c.genome.string().c_str());
-    hts_idx_t* idx = sam_index_load(samfile, c.bamfile.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
 
     // Load bcf file
-    htsFile* ibcffile = bcf_open(c.vcffile.string().c_str(), "r");
-    hts_idx_t* bcfidx = bcf_index_load(c.vcffile.string().c_str());
-    bcf_hdr_t* bcfhdr = bcf_hdr_read(ibcffile);
+    htsFile* ibcffile = in.bcffile;
+    hts_idx_t* bcfidx = in.bcfidx;
+    bcf_hdr_t* bcfhdr = in.bcfhdr;
 
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Assign reads to haplotypes" << std::endl;
     boost::progress_display show_progress(hdr->n_targets);
 
+    // Resume after the last completed chromosome, outputs are cut back to their size at that point
+    int32_t doneIndex = -1;
+    uint32_t assignedReadsH1 = 0;
+    uint32_t assignedReadsH2 = 0;
+    uint32_t unassignedReads = 0;
+    uint32_t ambiguousReads = 0;
+    if (c.checkpoint.enabled) {
+      CheckpointReader ckpt;
+      if (ckpt.open(c.checkpoint.file("split.ckpt"), c.checkpoint.key)) {
+	uint64_t h1size = 0;
+	uint64_t h2size = 0;
+	ckpt.io(doneIndex);
+	ckpt.io(assignedReadsH1);
+	ckpt.io(assignedReadsH2);
+	ckpt.io(unassignedReads);
+	ckpt.io(ambiguousReads);
+	ckpt.io(h1size);
+	ckpt.io(h2size);
+	if (!ckpt.ok) {
+	  std::cerr << "Checkpoint " << c.checkpoint.file("split.ckpt").string() << " is truncated, please remove it!" << std::endl;
+	  return 1;
+	}
+	if ((!truncateOutput(c.h1bam, h1size)) || ((!c.interleaved) && (!truncateOutput(c.h2bam, h2size)))) {
+	  std::cerr << "Output files are shorter than at the last checkpoint, starting from the beginning" << std::endl;
+	  doneIndex = -1;
+	  assignedReadsH1 = 0;
+	  assignedReadsH2 = 0;
+	  unassignedReads = 0;
+	  ambiguousReads = 0;
+	}
+      }
+    }
+
     // Open output file
-    samFile* h1bam = sam_open(c.h1bam.string().c_str(), "wb");
-    if (sam_hdr_write(h1bam, hdr) != 0) {
+    BamOutput h1bam;
+    if (!h1bam.open(c.h1bam, (doneIndex == -1) ? "wb" : "ab")) return 1;
+    if ((doneIndex == -1) && (sam_hdr_write(h1bam.fp, hdr) != 0)) {
       std::cerr << "Could not write ouptut file header!" << std::endl;
       return -1;
     }
 
-    samFile* h2bam = NULL;
+    BamOutput h2bam;
     if (!c.interleaved) {
-      h2bam = sam_open(c.h2bam.string().c_str(), "wb");
-      if (sam_hdr_write(h2bam, hdr) != 0) {
+      if (!h2bam.open(c.h2bam, (doneIndex == -1) ? "wb" : "ab")) return 1;
+      if ((doneIndex == -1) && (sam_hdr_write(h2bam.fp, hdr) != 0)) {
 	std::cerr << "Could not write ouptut file header!" << std::endl;
 	return -1;
       }
     }
 
     // Assign reads to SNPs
-    uint32_t assignedReadsH1 = 0;
-    uint32_t assignedReadsH2 = 0;
-    uint32_t unassignedReads = 0;
-    uint32_t ambiguousReads = 0;
-    faidx_t* fai = fai_load(c.genome.string().c_str());
+    faidx_t* fai = in.fai;
     for (int refIndex = 0; refIndex<hdr->n_targets; ++refIndex) {
       std::string chrName(hdr->target_name[refIndex]);
       ++show_progress;
+      if (refIndex <= doneIndex) continue;
 
       // Load het. markers
-      typedef std::vector<BiallelicVariant> TPhasedVariants;
-      TPhasedVariants pv;
+      // Het. markers come sorted by position from the index iterator
+      VariantTable pv;
       if (!_loadVariants(ibcffile, bcfidx, bcfhdr, c.sample, chrName, pv)) continue;
       if (pv.empty()) continue;
-      
-      // Sort variants
-      std::sort(pv.begin(), pv.end(), SortVariants<BiallelicVariant>());
 
       // Load reference
-      int32_t seqlen = -1;
-      char* seq = NULL;
-      seq = faidx_fetch_seq(fai, chrName.c_str(), 0, hdr->target_len[refIndex], &seqlen);    
+      ChromosomeSequence chrSeq(fai, c.genome, chrName);
     
       // Assign reads to haplotypes
+      typedef HaplotypeWorker<TConfig, VariantTable> TWorker;
+      std::vector<TWorker> workers(std::max((uint16_t) 1, c.nthreads), TWorker(c, chrSeq.seq, pv));
+      hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
+      if (!processBamRecords(samfile, hdr, iter, workers)) return 1;
       std::set<std::size_t> h1;
       std::set<std::size_t> h2;
-      hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-      bam1_t* rec = bam_init1();
-      while (sam_itr_next(samfile, iter, rec) >= 0) {
-	if (rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
-	if ((rec->core.qual < c.minMapQual) || (rec->core.tid<0)) continue;
-	if ((rec->core.flag & BAM_FPAIRED) && (rec->core.flag & BAM_FMUNMAP)) continue;
-	uint32_t hp1votes = 0;
-	uint32_t hp2votes = 0;
-	TPhasedVariants::const_iterator vIt = std::lower_bound(pv.begin(), pv.end(), BiallelicVariant(rec->core.pos), SortVariants<BiallelicVariant>());
-	TPhasedVariants::const_iterator vItEnd = std::upper_bound(pv.begin(), pv.end(), BiallelicVariant(lastAlignedPosition(rec)), SortVariants<BiallelicVariant>());
-	if (vIt != vItEnd) {
-	  // Get read sequence
-	  std::string sequence;
-	  sequence.resize(rec->core.l_qseq);
-	  uint8_t* seqptr = bam_get_seq(rec);
-	  for (int32_t i = 0; i < rec->core.l_qseq; ++i) sequence[i] = "=ACMGRSVTWYHKDBN"[bam_seqi(seqptr, i)];
-	  
-	  // Parse CIGAR
-	  uint32_t* cigar = bam_get_cigar(rec);
-	  for(;vIt != vItEnd; ++vIt) {
-	    int32_t gp = rec->core.pos; // Genomic position
-	    int32_t sp = 0; // Sequence position
-	    bool varFound = false;
-	    for (std::size_t i = 0; ((i < rec->core.n_cigar) && (!varFound)); ++i) {
-	      if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CINS) sp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CSOFT_CLIP) sp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CDEL) gp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) gp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CHARD_CLIP) {
-		//Nop
-	      } else if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
-		if (gp + (int32_t) bam_cigar_oplen(cigar[i]) < vIt->pos) {
-		  gp += bam_cigar_oplen(cigar[i]);
-		  sp += bam_cigar_oplen(cigar[i]);
-		} else {
-		  for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]); ++k, ++sp, ++gp) {
-		    if (gp == vIt->pos) {
-		      varFound = true;
-		      // Check REF allele
-		      if (vIt->ref == std::string(seq + gp, seq + gp + vIt->ref.size())) {
-			// Check ALT allele
-			if ((sp + vIt->alt.size() < sequence.size()) && (sp + vIt->ref.size() < sequence.size())) {
-			  if (vIt->ref.size() == vIt->alt.size()) {
-			    // SNP
-			    if ((sequence.substr(sp, vIt->alt.size()) == vIt->alt) && (sequence.substr(sp, vIt->ref.size()) != vIt->ref)) {
-			      // ALT supporting read
-			      if (vIt->hap) ++hp1votes;
-			      else ++hp2votes;
-			    } else if ((sequence.substr(sp, vIt->alt.size()) != vIt->alt) && (sequence.substr(sp, vIt->ref.size()) == vIt->ref)) {
-			      // REF supporting read
-			      if (vIt->hap) ++hp2votes;
-			      else ++hp1votes;
-			    }
-			  } else if (vIt->ref.size() < vIt->alt.size()) {
-			    // Insertion
-			    int32_t diff = vIt->alt.size() - vIt->ref.size();
-			    std::string refProbe = vIt->ref + std::string(seq + gp + vIt->ref.size(), seq + gp + vIt->ref.size() + diff);
-			    if ((sequence.substr(sp, vIt->alt.size()) == vIt->alt) && (sequence.substr(sp, vIt->alt.size()) != refProbe)) {
-			      // ALT supporting read
-			      if (vIt->hap) ++hp1votes;
-			      else ++hp2votes;
-			    } else if ((sequence.substr(sp, vIt->alt.size()) != vIt->alt) && (sequence.substr(sp, vIt->alt.size()) == refProbe)) {
-			      // REF supporting read
-			      if (vIt->hap) ++hp2votes;
-			      else ++hp1votes;
-			    }
-			  } else {
-			    // Deletion
-			    int32_t diff = vIt->ref.size() - vIt->alt.size();
-			    std::string altProbe = vIt->alt + std::string(seq + gp + vIt->ref.size(), seq + gp + vIt->ref.size() + diff);
-			    if ((sequence.substr(sp, vIt->ref.size()) == altProbe) && (sequence.substr(sp, vIt->ref.size()) != vIt->ref)) {
-			      // ALT supporting read
-			      if (vIt->hap) ++hp1votes;
-			      else ++hp2votes;
-			    } else if ((sequence.substr(sp, vIt->ref.size()) != altProbe) && (sequence.substr(sp, vIt->ref.size()) == vIt->ref)) {
-			      // REF supporting read
-			      if (vIt->hap) ++hp2votes;
-			      else ++hp1votes;
-			    }
-			  }
-			}
-		      }
-		    }
-		  }
-		}
-	      } else {
-		std::cerr << "Unknown Cigar options" << std::endl;
-		return 1;
-	      }
-	    }
-	  }
-	  int32_t hp = 0;
-	  if (hp1votes > 2*hp2votes) hp = 1;
-	  else if (hp2votes > 2*hp1votes) hp = 2;
-	  if (hp) {
-	    if (hp == 1) h1.insert(hash_pair(rec));
-	    else h2.insert(hash_pair(rec));
-	  }
-	}
+      for(uint32_t t = 0; t < workers.size(); ++t) {
+	h1.insert(workers[t].h1.begin(), workers[t].h1.end());
+	h2.insert(workers[t].h2.begin(), workers[t].h2.end());
       }
-      bam_destroy1(rec);
-      hts_itr_destroy(iter);
 
       // Random number generator
       typedef boost::mt19937 RNGType;
@@ -246,9 +270,9 @@ namespace bamstats
       boost::variate_generator< RNGType, boost::uniform_int<> > dice(rng, one_or_two);
     
       // Fetch all pairs
-      hts_itr_t* itr = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-      bam1_t* r = bam_init1();
-      while (sam_itr_next(samfile, itr, r) >= 0) {
+      BamRecordStream stream(samfile, hdr, sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]));
+      bam1_t* r = NULL;
+      while ((r = stream.next()) != NULL) {
 	if (r->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP)) continue;
 	if ((r->core.qual < c.minMapQual) || (r->core.tid<0)) continue;
 	if ((r->core.flag & BAM_FPAIRED) && (r->core.flag & BAM_FMUNMAP)) continue;
@@ -267,19 +291,19 @@ namespace bamstats
 	    int32_t hrnd = dice();
 	    if (hrnd == 1) {
 	      bam_aux_append(r, "HP", 'i', 4, (uint8_t*)&hrnd);
-	      if (!sam_write1(h1bam, hdr, r)) {
+	      if (!sam_write1(h1bam.fp, hdr, r)) {
 		std::cerr << "Could not write to bam file!" << std::endl;
 		return -1;
 	      }
 	    } else {
 	      bam_aux_append(r, "HP", 'i', 4, (uint8_t*)&hrnd);
 	      if (!c.interleaved) {
-		if (!sam_write1(h2bam, hdr, r)) {
+		if (!sam_write1(h2bam.fp, hdr, r)) {
 		  std::cerr << "Could not write to bam file!" << std::endl;
 		  return -1;
 		}
 	      } else {
-		if (!sam_write1(h1bam, hdr, r)) {
+		if (!sam_write1(h1bam.fp, hdr, r)) {
 		  std::cerr << "Could not write to bam file!" << std::endl;
 		  return -1;
 		}
@@ -290,7 +314,7 @@ namespace bamstats
 	  int32_t hp = 1;
 	  ++assignedReadsH1;
 	  bam_aux_append(r, "HP", 'i', 4, (uint8_t*)&hp);
-	  if (!sam_write1(h1bam, hdr, r)) {
+	  if (!sam_write1(h1bam.fp, hdr, r)) {
 	    std::cerr << "Could not write to bam file!" << std::endl;
 	    return -1;
 	  }
@@ -299,41 +323,48 @@ namespace bamstats
 	  ++assignedReadsH2;
 	  bam_aux_append(r, "HP", 'i', 4, (uint8_t*)&hp);
 	  if (!c.interleaved) {
-	    if (!sam_write1(h2bam, hdr, r)) {
+	    if (!sam_write1(h2bam.fp, hdr, r)) {
 	      std::cerr << "Could not write to bam file!" << std::endl;
 	      return -1;
 	    }
 	  } else {
-	    if (!sam_write1(h1bam, hdr, r)) {
+	    if (!sam_write1(h1bam.fp, hdr, r)) {
 	      std::cerr << "Could not write to bam file!" << std::endl;
 	      return -1;
 	    }
 	  }
 	}
       }
-      bam_destroy1(r);
-      hts_itr_destroy(itr);
-      if (seq != NULL) free(seq);
+
+      // Reads of this chromosome are on disk
+      if (c.checkpoint.enabled) {
+	if ((!flushBam(h1bam.fp)) || ((h2bam.fp != NULL) && (!flushBam(h2bam.fp)))) {
+	  std::cerr << "Could not write to bam file!" << std::endl;
+	  return -1;
+	}
+	uint64_t h1size = boost::filesystem::file_size(c.h1bam);
+	uint64_t h2size = (h2bam.fp != NULL) ? boost::filesystem::file_size(c.h2bam) : 0;
+	CheckpointWriter ckpt;
+	if (!ckpt.open(c.checkpoint.file("split.ckpt"), c.checkpoint.key)) return 1;
+	ckpt.io(refIndex);
+	ckpt.io(assignedReadsH1);
+	ckpt.io(assignedReadsH2);
+	ckpt.io(unassignedReads);
+	ckpt.io(ambiguousReads);
+	ckpt.io(h1size);
+	ckpt.io(h2size);
+	if (!ckpt.commit()) return 1;
+      }
     }
-    fai_destroy(fai);
-    
-    // Close bam
-    bam_hdr_destroy(hdr);
-    hts_idx_destroy(idx);
-    sam_close(samfile);
     
     // Close output BAMs
-    sam_close(h1bam);
+    h1bam.close();
     bam_index_build(c.h1bam.string().c_str(), 0);
     if (!c.interleaved) {
-      sam_close(h2bam);
+      h2bam.close();
       bam_index_build(c.h2bam.string().c_str(), 0);
     }
-    
-    // Close BCF
-    bcf_hdr_destroy(bcfhdr);
-    hts_idx_destroy(bcfidx);
-    bcf_close(ibcffile);
+    c.checkpoint.clear("split.ckpt");
     
     // End
     now = boost::posix_time::second_clock::local_time();
@@ -352,6 +383,8 @@ namespace bamstats
 
   int split(int argc, char **argv) {
     SplitConfig c;
+    InputContext in;
+    boost::filesystem::path checkpointDir;
 
     // Parameter
     boost::program_options::options_description generic("Generic options");
@@ -365,6 +398,8 @@ namespace bamstats
       ("vcffile,v", boost::program_options::value<boost::filesystem::path>(&c.vcffile), "input phased VCF/BCF file")
       ("assign,a", "assign unphased reads randomly")
       ("interleaved,i", "single haplotype-tagged BAM")
+      ("threads,t", boost::program_options::value<uint16_t>(&c.nthreads)->default_value(1), "number of read processing threads")
+      ("checkpoint-dir", boost::program_options::value<boost::filesystem::path>(&checkpointDir), "resume an interrupted run from this directory (optional)")
       ;
 
     boost::program_options::options_description hidden("Hidden options");
@@ -402,55 +437,21 @@ namespace bamstats
     else c.interleaved = true;
 
     // Check input BAM file
-    if (vm.count("input-file")) {
-      if (!(boost::filesystem::exists(c.bamfile) && boost::filesystem::is_regular_file(c.bamfile) && boost::filesystem::file_size(c.bamfile))) {
-	std::cerr << "Input BAM file is missing: " << c.bamfile.string() << std::endl;
-	return 1;
-      }
-      samFile* samfile = sam_open(c.bamfile.string().c_str(), "r");
-      if (samfile == NULL) {
-	std::cerr << "Fail to open file " << c.bamfile.string() << std::endl;
-	return 1;
-      }
-      hts_idx_t* idx = sam_index_load(samfile, c.bamfile.string().c_str());
-      if (idx == NULL) {
-	std::cerr << "Fail to open index for " << c.bamfile.string() << std::endl;
-	return 1;
-      }
-      bam_hdr_t* hdr = sam_hdr_read(samfile);
-      if (hdr == NULL) {
-	std::cerr << "Fail to open header for " << c.bamfile.string() << std::endl;
-	return 1;
-      }
-      bam_hdr_destroy(hdr);
-      hts_idx_destroy(idx);
-      sam_close(samfile);
-    }
+    if (in.bam(c.bamfile, false) == NULL) return 1;
+
+    // Check reference
+    if (!in.genome(c.genome)) return 1;
   
     // Check VCF/BCF file
-    if (vm.count("vcffile")) {
-      if (!(boost::filesystem::exists(c.vcffile) && boost::filesystem::is_regular_file(c.vcffile) && boost::filesystem::file_size(c.vcffile))) {
-	std::cerr << "Input VCF/BCF file is missing: " << c.vcffile.string() << std::endl;
-	return 1;
-      }
-      htsFile* ifile = bcf_open(c.vcffile.string().c_str(), "r");
-      if (ifile == NULL) {
-	std::cerr << "Fail to open file " << c.vcffile.string() << std::endl;
-	return 1;
-      }
-      hts_idx_t* bcfidx = bcf_index_load(c.vcffile.string().c_str());
-      if (bcfidx == NULL) {
-	std::cerr << "Fail to open index file for " << c.vcffile.string() << std::endl;
-	return 1;
-      }
-      bcf_hdr_t* hdr = bcf_hdr_read(ifile);
-      if (hdr == NULL) {
-	std::cerr << "Fail to open header for " << c.vcffile.string() << std::endl;
-	return 1;
-      }
-      bcf_hdr_destroy(hdr);
-      hts_idx_destroy(bcfidx);
-      bcf_close(ifile);
+    if (!in.variants(c.vcffile)) return 1;
+
+    // Checkpoints, taken after each chromosome
+    if (vm.count("checkpoint-dir")) {
+      std::vector<boost::filesystem::path> inputs;
+      inputs.push_back(c.bamfile);
+      inputs.push_back(c.genome);
+      inputs.push_back(c.vcffile);
+      if (!c.checkpoint.init(checkpointDir, checkpointKey(argc, argv, inputs))) return 1;
     }
 
     // Show cmd
@@ -460,7 +461,7 @@ namespace bamstats
     for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
     std::cout << std::endl;
     
-    return phaseBamRun(c);
+    return phaseBamRun(c, in);
 }
 
 
@@ -37,6 +37,9 @@ Contact: Tobias Rausch (rausch@embl.de)
 
 #include "version.h"
 #include "util.h"
+#include "pipeline.h"
+#include "input.h"
+#include "covcache.h"
 
 
 namespace bamstats
@@ -46,6 +49,7 @@ namespace bamstats
     uint16_t minQual;
     uint32_t normalize;
     float resolution;
+    bool hasCoverageCache;
     std::string sampleName;
     std::string format;
     boost::filesystem::path bamFile;
@@ -60,265 +64,306 @@ namespace bamstats
   };
   
   template<typename TConfig>
-  inline int32_t
-  create_tracks(TConfig const& c) {
-    // Load bam file
-    samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-    hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-    bam_hdr_t* hdr = sam_hdr_read(samfile);
-
-    // Pair qualities and features
-    typedef boost::unordered_map<std::size_t, uint8_t> TQualities;
-    TQualities qualities;
-
-    // Normalize read-counts
-    double normFactor = 1;
-    if (c.normalize) {
-      uint64_t totalPairs = 0;
-      boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-      std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Total read count normalization" << std::endl;
-      boost::progress_display show_progress( hdr->n_targets );
-      for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
-	++show_progress;
-
-	hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-	bam1_t* rec = bam_init1();
-	int32_t lastAlignedPos = 0;
-	std::set<std::size_t> lastAlignedPosReads;
-	while (sam_itr_next(samfile, iter, rec) >= 0) {
-	  if ((rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP | BAM_FMUNMAP)) || (rec->core.tid != rec->core.mtid) || (!(rec->core.flag & BAM_FPAIRED))) continue;
-	  if (rec->core.qual < c.minQual) continue;
-	  
-	  // Clean-up the read store for identical alignment positions
-	  if (rec->core.pos > lastAlignedPos) {
-	    lastAlignedPosReads.clear();
-	    lastAlignedPos = rec->core.pos;
-	  }
-	
-	  if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
-	    // First read
-	    lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
-	    std::size_t hv = hash_pair(rec);
-	    qualities[hv] = rec->core.qual;
-	  } else {
-	    // Second read
-	    std::size_t hv = hash_pair_mate(rec);
-	    if (qualities.find(hv) == qualities.end()) continue; // Mate discarded
-	    uint8_t pairQuality = std::min((uint8_t) qualities[hv], (uint8_t) rec->core.qual);
-	    qualities[hv] = 0;
-	    
-	    // Pair quality
-	    if (pairQuality < c.minQual) continue; // Low quality pair
-	    
-	  
-	    // Get bases
-	    uint32_t* cigar = bam_get_cigar(rec);
-	    for (std::size_t i = 0; i < rec->core.n_cigar; ++i) {
-	      if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
-		totalPairs += bam_cigar_oplen(cigar[i]);
-	      }
-	    }
-	  }
-	}
-	// Clean-up
-	bam_destroy1(rec);
-	hts_itr_destroy(iter);
-	qualities.clear();
+  struct TrackAnalysis {
+    typedef uint16_t TCount;
+    typedef std::vector<TCount> TCoverage;
+    typedef std::vector<uint32_t> TAlignedBlocks;  // start, length
+    typedef boost::unordered_map<std::size_t, TAlignedBlocks> TMateBlocks;
+    typedef std::list<Track> TrackLine;
+
+    TConfig const& c;
+    bam_hdr_t* hdr;
+    int32_t refIndex;
+    bool validPairs;
+    uint64_t totalPairs;
+    int32_t lastAlignedPos;
+    std::set<std::size_t> lastAlignedPosReads;
+    TMateBlocks mateBlocks;
+    TCoverage cov;
+    CoverageWriter* cache;  // Pair coverage goes to a coverage cache instead of track lines
+    boost::filesystem::path tmpfile;
+    std::ofstream tmpOut;
+    boost::iostreams::filtering_ostream dataOut;
+
+    TrackAnalysis(TConfig const& conf, bam_hdr_t* h, CoverageWriter* w = NULL) : c(conf), hdr(h), refIndex(-1), validPairs(false), totalPairs(0), lastAlignedPos(0), cache(w) {
+      if (cache != NULL) return;
+
+      // Open output file
+      dataOut.push(boost::iostreams::gzip_compressor());
+      dataOut.push(boost::iostreams::file_sink(c.outfile.string().c_str(), std::ios_base::out | std::ios_base::binary));
+      if (c.format == "bedgraph") {
+	// bedgraph
+	dataOut << "track type=bedGraph name=\"" << c.sampleName << "\" description=\"" << c.sampleName << "\" visibility=full color=44,162,95" << std::endl;
+      } else {
+	// bed
+	dataOut << "chr\tstart\tend\tid\t" << c.sampleName << std::endl;
+      }
+
+      // Raw track lines wait in a temporary file until the total read count is known
+      if (c.normalize) {
+	tmpfile = boost::filesystem::path(c.outfile.string() + ".tmp");
+	tmpOut.open(tmpfile.string().c_str(), std::ios_base::out | std::ios_base::binary);
       }
-      // Normalize to 100bp paired-end reads
-      normFactor = ((double) ((uint64_t) (c.normalize)) / (double) totalPairs) * 100 * 2;
     }
-    
-    // Open output file
-    boost::iostreams::filtering_ostream dataOut;
-    dataOut.push(boost::iostreams::gzip_compressor());
-    dataOut.push(boost::iostreams::file_sink(c.outfile.string().c_str(), std::ios_base::out | std::ios_base::binary));
-    if (c.format == "bedgraph") {
-      // bedgraph
-      dataOut << "track type=bedGraph name=\"" << c.sampleName << "\" description=\"" << c.sampleName << "\" visibility=full color=44,162,95" << std::endl;
-    } else {
-      // bed
-      dataOut << "chr\tstart\tend\tid\t" << c.sampleName << std::endl;
+
+    static int32_t
+    requiredFields() {
+      return samCoreFields;
     }
 
-    // Iterate chromosomes
-    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
-    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
-    boost::progress_display show_progress( hdr->n_targets );
-    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
-      ++show_progress;
+    void
+    _writeTrack(int32_t tid, Track const& t, double normFactor) {
+      if (c.format == "bedgraph") dataOut << hdr->target_name[tid] << "\t" << t.start << "\t" << t.end << "\t" << normFactor * t.score << std::endl;
+      else dataOut << hdr->target_name[tid] << "\t" << t.start << "\t" << t.end << "\t" << hdr->target_name[tid] << ":" << t.start << "-" << t.end << "\t" << normFactor * t.score << std::endl;
+    }
 
-      // Find valid pairs
-      std::set<std::size_t> validPairs;
-      {
-	hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-	bam1_t* rec = bam_init1();
-	int32_t lastAlignedPos = 0;
-	std::set<std::size_t> lastAlignedPosReads;
-	while (sam_itr_next(samfile, iter, rec) >= 0) {
-	  if ((rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP | BAM_FMUNMAP)) || (rec->core.tid != rec->core.mtid) || (!(rec->core.flag & BAM_FPAIRED))) continue;
-	  if (rec->core.qual < c.minQual) continue;
-
-	  // Clean-up the read store for identical alignment positions
-	  if (rec->core.pos > lastAlignedPos) {
-	    lastAlignedPosReads.clear();
-	    lastAlignedPos = rec->core.pos;
+    // Coverage track of the current chromosome, the merging of neighbouring tracks is invariant to the normalization factor
+    void
+    _trackLine() {
+      TrackLine tl;
+      uint32_t wb = 0;
+      uint32_t we = 0;
+      double wval = cov[0];
+      for(uint32_t i = 1; i<cov.size(); ++i) {
+	if (cov[i] == wval) ++we;
+	else {
+	  tl.push_back(Track(wb, we+1, wval));
+	  wb = i;
+	  we = i;
+	  wval = cov[i];
+	}
+      }
+      tl.push_back(Track(wb, we+1, wval));
+
+      // Reduce file size
+      if ((c.resolution > 0) && (c.resolution < 1)) {
+	double red = 1;
+	uint32_t origs = tl.size();
+	while ((tl.size() > 1) && (red > c.resolution)) {
+	  TrackLine::iterator idx = tl.begin();
+	  TrackLine::iterator idxNext = tl.begin();
+	  ++idxNext;
+	  std::vector<double> errs;
+	  for(;idxNext != tl.end(); ++idx, ++idxNext) {
+	    uint32_t w1 = idx->end - idx->start;
+	    uint32_t w2 = idxNext->end - idxNext->start;
+	    double nwavg = (w1 * idx->score + w2 * idxNext->score) / (w1 + w2);
+	    double nerr = w1 * ((idx->score - nwavg) * (idx->score - nwavg));
+	    nerr += w2 * ((idxNext->score - nwavg) * (idxNext->score - nwavg));
+	    errs.push_back(nerr);
 	  }
-	
-	  if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
-	    // First read
-	    lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
-	    std::size_t hv = hash_pair(rec);
-	    qualities[hv] = rec->core.qual;
-	  } else {
-	    // Second read
-	    std::size_t hv = hash_pair_mate(rec);
-	    if (qualities.find(hv) == qualities.end()) continue; // Mate discarded
-	    uint8_t pairQuality = std::min((uint8_t) qualities[hv], (uint8_t) rec->core.qual);
-	    qualities[hv] = 0;
-
-	    // Pair quality
-	    if (pairQuality < c.minQual) continue; // Low quality pair
-
-	    // Insert valid pair
-	    validPairs.insert(hash_pair_mate(rec));
+	  std::sort(errs.begin(), errs.end());
+	  uint32_t bpidx = (red - c.resolution) * tl.size();
+	  if (bpidx > 0) bpidx = bpidx - 1;
+	  double thres = errs[bpidx];
+	  idx = tl.begin();
+	  idxNext = tl.begin();
+	  ++idxNext;
+	  while(idxNext != tl.end()) {
+	    uint32_t w1 = idx->end - idx->start;
+	    uint32_t w2 = idxNext->end - idxNext->start;
+	    double nwavg = (w1 * idx->score + w2 * idxNext->score) / (w1 + w2);
+	    double nerr = w1 * ((idx->score - nwavg) * (idx->score - nwavg));
+	    nerr += w2 * ((idxNext->score - nwavg) * (idxNext->score - nwavg));
+	    if (nerr <= thres) {
+	      ++idxNext;
+	      uint32_t oldst = idx->start;
+	      tl.erase(idx++);
+	      idx->start = oldst;
+	      idx->score = nwavg;
+	    } else {
+	      ++idxNext;
+	      ++idx;
+	    }
 	  }
+	  red = (double) tl.size() / (double) origs;
+	}
+      }
+      if (c.normalize) {
+	uint32_t ntracks = tl.size();
+	tmpOut.write((char*) &refIndex, sizeof(int32_t));
+	tmpOut.write((char*) &ntracks, sizeof(uint32_t));
+	for(TrackLine::iterator idx = tl.begin(); idx != tl.end(); ++idx) {
+	  tmpOut.write((char*) &idx->start, sizeof(uint32_t));
+	  tmpOut.write((char*) &idx->end, sizeof(uint32_t));
+	  tmpOut.write((char*) &idx->score, sizeof(double));
 	}
-	// Clean-up
-	bam_destroy1(rec);
-	hts_itr_destroy(iter);
-	qualities.clear();
+      } else {
+	for(TrackLine::iterator idx = tl.begin(); idx != tl.end(); ++idx) _writeTrack(refIndex, *idx, 1);
       }
+    }
+
+    // False if the coverage cache cannot be written
+    bool
+    _flush() {
+      bool ok = true;
+      if ((refIndex >= 0) && (validPairs)) {
+	if (cache != NULL) ok = cache->write(refIndex, true, cov);
+	else _trackLine();
+      }
+      cov.clear();
+      mateBlocks.clear();
+      lastAlignedPosReads.clear();
+      lastAlignedPos = 0;
+      validPairs = false;
+      return ok;
+    }
 
-      // Create Coverage track
-      typedef uint16_t TCount;
+    void
+    _addCoverage(TAlignedBlocks const& blocks) {
       uint32_t maxCoverage = std::numeric_limits<TCount>::max();
-      typedef std::vector<TCount> TCoverage;
-      TCoverage cov(hdr->target_len[refIndex], 0);
-      if (validPairs.size()) {
-	hts_itr_t* iter = sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]);
-	bam1_t* rec = bam_init1();
-	int32_t lastAlignedPos = 0;
-	std::set<std::size_t> lastAlignedPosReads;
-	while (sam_itr_next(samfile, iter, rec) >= 0) {
-	  if ((rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP | BAM_FMUNMAP)) || (rec->core.tid != rec->core.mtid) || (!(rec->core.flag & BAM_FPAIRED))) continue;
-	  if (rec->core.qual < c.minQual) continue;
-
-	  // Clean-up the read store for identical alignment positions
-	  if (rec->core.pos > lastAlignedPos) {
-	    lastAlignedPosReads.clear();
-	    lastAlignedPos = rec->core.pos;
-	  }
+      for(uint32_t i = 0; i < blocks.size(); i += 2) {
+	for(uint32_t rp = blocks[i]; rp < blocks[i] + blocks[i+1]; ++rp) {
+	  if (cov[rp] < maxCoverage) ++cov[rp];
+	}
+      }
+    }
 
-	  std::size_t hv = 0;
-	  if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) hv = hash_pair(rec);
-	  else hv = hash_pair_mate(rec);
-	  if (validPairs.find(hv) != validPairs.end()) {
-
-	    // Reference pointer
-	    uint32_t rp = rec->core.pos;
-	    
-	    // Parse the CIGAR
-	    uint32_t* cigar = bam_get_cigar(rec);
-	    for (std::size_t i = 0; i < rec->core.n_cigar; ++i) {
-	      if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
-		// match or mismatch
-		for(std::size_t k = 0; k<bam_cigar_oplen(cigar[i]);++k) {
-		  if (cov[rp] < maxCoverage) ++cov[rp];
-		  ++rp;
-		}
-	      }
-	      else if (bam_cigar_op(cigar[i]) == BAM_CDEL) rp += bam_cigar_oplen(cigar[i]);
-	      else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) rp += bam_cigar_oplen(cigar[i]);
-	    }
-	  }
+    // Records need to arrive in coordinate order, pairs are valid once the second mate passed all filters
+    bool
+    process(bam1_t* rec) {
+      if (rec->core.tid != refIndex) {
+	if (!_flush()) return false;
+	refIndex = rec->core.tid;
+      }
+      if ((rec->core.flag & (BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP | BAM_FSUPPLEMENTARY | BAM_FUNMAP | BAM_FMUNMAP)) || (rec->core.tid != rec->core.mtid) || (!(rec->core.flag & BAM_FPAIRED))) return true;
+      if (rec->core.qual < c.minQual) return true;
+
+      // Clean-up the read store for identical alignment positions
+      if (rec->core.pos > lastAlignedPos) {
+	lastAlignedPosReads.clear();
+	lastAlignedPos = rec->core.pos;
+      }
+
+      // Aligned blocks
+      TAlignedBlocks blocks;
+      uint32_t rp = rec->core.pos;
+      uint32_t* cigar = bam_get_cigar(rec);
+      for (std::size_t i = 0; i < rec->core.n_cigar; ++i) {
+	if ((bam_cigar_op(cigar[i]) == BAM_CMATCH) || (bam_cigar_op(cigar[i]) == BAM_CEQUAL) || (bam_cigar_op(cigar[i]) == BAM_CDIFF)) {
+	  blocks.push_back(rp);
+	  blocks.push_back(bam_cigar_oplen(cigar[i]));
+	  rp += bam_cigar_oplen(cigar[i]);
 	}
-	// Clean-up
-	bam_destroy1(rec);
-	hts_itr_destroy(iter);
-
-	// Coverage track
-	typedef std::list<Track> TrackLine;
-	TrackLine tl;
-	uint32_t wb = 0;
-	uint32_t we = 0;
-	double wval = cov[0];
-	for(uint32_t i = 1; i<cov.size(); ++i) {
-	  if (cov[i] == wval) ++we;
-	  else {
-	    tl.push_back(Track(wb, we+1, normFactor * wval));
-	    wb = i;
-	    we = i;
-	    wval = cov[i];
-	  }
+	else if (bam_cigar_op(cigar[i]) == BAM_CDEL) rp += bam_cigar_oplen(cigar[i]);
+	else if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) rp += bam_cigar_oplen(cigar[i]);
+      }
+
+      if ((rec->core.pos < rec->core.mpos) || ((rec->core.pos == rec->core.mpos) && (lastAlignedPosReads.find(hash_string(bam_get_qname(rec))) == lastAlignedPosReads.end()))) {
+	// First read
+	lastAlignedPosReads.insert(hash_string(bam_get_qname(rec)));
+	mateBlocks[hash_pair(rec)].swap(blocks);
+      } else {
+	// Second read
+	typename TMateBlocks::iterator itMate = mateBlocks.find(hash_pair_mate(rec));
+	if (itMate == mateBlocks.end()) return true; // Mate discarded
+
+	// Valid pair
+	if (!validPairs) {
+	  cov.resize(hdr->target_len[refIndex], 0);
+	  validPairs = true;
 	}
-	tl.push_back(Track(wb, we+1, normFactor * wval));
-
-	// Reduce file size
-	if ((c.resolution > 0) && (c.resolution < 1)) {
-	  double red = 1;
-	  uint32_t origs = tl.size();
-	  while ((tl.size() > 1) && (red > c.resolution)) {
-	    TrackLine::iterator idx = tl.begin();
-	    TrackLine::iterator idxNext = tl.begin();
-	    ++idxNext;
-	    std::vector<double> errs;
-	    for(;idxNext != tl.end(); ++idx, ++idxNext) {
-	      uint32_t w1 = idx->end - idx->start;
-	      uint32_t w2 = idxNext->end - idxNext->start;
-	      double nwavg = (w1 * idx->score + w2 * idxNext->score) / (w1 + w2);
-	      double nerr = w1 * ((idx->score - nwavg) * (idx->score - nwavg));
-	      nerr += w2 * ((idxNext->score - nwavg) * (idxNext->score - nwavg));
-	      errs.push_back(nerr);
-	    }
-	    std::sort(errs.begin(), errs.end());
-	    uint32_t bpidx = (red - c.resolution) * tl.size();
-	    if (bpidx > 0) bpidx = bpidx - 1;
-	    double thres = errs[bpidx];
-	    idx = tl.begin();
-	    idxNext = tl.begin();
-	    ++idxNext;
-	    while(idxNext != tl.end()) {
-	      uint32_t w1 = idx->end - idx->start;
-	      uint32_t w2 = idxNext->end - idxNext->start;
-	      double nwavg = (w1 * idx->score + w2 * idxNext->score) / (w1 + w2);
-	      double nerr = w1 * ((idx->score - nwavg) * (idx->score - nwavg));
-	      nerr += w2 * ((idxNext->score - nwavg) * (idxNext->score - nwavg));
-	      if (nerr <= thres) {
-		++idxNext;
-		uint32_t oldst = idx->start;
-		tl.erase(idx++);
-		idx->start = oldst;
-		idx->score = nwavg;
-	      } else {
-		++idxNext;
-		++idx;
-	      }
-	    }
-	    red = (double) tl.size() / (double) origs;
+	_addCoverage(itMate->second);
+	_addCoverage(blocks);
+	for(uint32_t i = 0; i < blocks.size(); i += 2) totalPairs += blocks[i+1];
+	mateBlocks.erase(itMate);
+      }
+      return true;
+    }
+
+    bool
+    finish() {
+      if (!_flush()) return false;
+      refIndex = -1;
+      if (cache != NULL) return true;
+      if (c.normalize) {
+	tmpOut.close();
+
+	// Normalize to 100bp paired-end reads
+	double normFactor = ((double) ((uint64_t) (c.normalize)) / (double) totalPairs) * 100 * 2;
+	std::ifstream tmpIn(tmpfile.string().c_str(), std::ios_base::in | std::ios_base::binary);
+	int32_t tid = 0;
+	uint32_t ntracks = 0;
+	while (tmpIn.read((char*) &tid, sizeof(int32_t))) {
+	  tmpIn.read((char*) &ntracks, sizeof(uint32_t));
+	  Track t(0, 0, 0);
+	  for(uint32_t i = 0; i < ntracks; ++i) {
+	    tmpIn.read((char*) &t.start, sizeof(uint32_t));
+	    tmpIn.read((char*) &t.end, sizeof(uint32_t));
+	    tmpIn.read((char*) &t.score, sizeof(double));
+	    _writeTrack(tid, t, normFactor);
 	  }
 	}
-	if (c.format == "bedgraph") {
-	  for(TrackLine::iterator idx = tl.begin(); idx != tl.end(); ++idx) dataOut << hdr->target_name[refIndex] << "\t" << idx->start << "\t" << idx->end << "\t" << idx->score << std::endl;
-	} else {
-	  for(TrackLine::iterator idx = tl.begin(); idx != tl.end(); ++idx) dataOut << hdr->target_name[refIndex] << "\t" << idx->start << "\t" << idx->end << "\t" << hdr->target_name[refIndex] << ":" << idx->start << "-" << idx->end << "\t" << idx->score << std::endl;
-	}
+	tmpIn.close();
+	boost::filesystem::remove(tmpfile);
       }
+      dataOut.pop();
+      return true;
     }
-    
-    // clean-up
-    bam_hdr_destroy(hdr);
-    hts_idx_destroy(idx);
-    sam_close(samfile);
-    dataOut.pop();
-    
+  };
+
+
+  // Track lines from the pair coverage of a coverage cache
+  template<typename TConfig>
+  inline int32_t
+  cache_tracks(TConfig const& c) {
+    CoverageReader cache;
+    if (!cache.open(c.bamFile, "tracks", c.minQual)) return 1;
+    bam_hdr_t* hdr = cache.hdr;
+
+    TrackAnalysis<TConfig> ta(c, hdr);
+    ta.totalPairs = cache.alignedBases;
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "Coverage cache parsing" << std::endl;
+    boost::progress_display show_progress( hdr->n_targets );
+    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
+      ++show_progress;
+      if (!cache.read(refIndex, ta.validPairs, ta.cov)) return 1;
+      ta.refIndex = refIndex;
+      if (!ta._flush()) return 1;
+    }
+    if (!ta.finish()) return 1;
     return 0;
   }
 
+  
+  template<typename TConfig>
+  inline int32_t
+  create_tracks(TConfig const& c, InputContext& in) {
+    if (c.hasCoverageCache) return cache_tracks(c);
+
+    // Load bam file
+    BamInput* bam = in.bam(c.bamFile, false);
+    if (bam == NULL) return 1;
+    hts_idx_t* idx = bam->index(true);
+    if (idx == NULL) return 1;
+    samFile* samfile = bam->samfile;
+    bam_hdr_t* hdr = bam->hdr;
+    requireFields(samfile, TrackAnalysis<TConfig>::requiredFields());
+
+    // Coverage tracks
+    TrackAnalysis<TConfig> ta(c, hdr);
+
+    // Iterate chromosomes
+    boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+    std::cout << '[' << boost::posix_time::to_simple_string(now) << "] " << "BAM file parsing" << std::endl;
+    boost::progress_display show_progress( hdr->n_targets );
+    for(int32_t refIndex=0; refIndex < (int32_t) hdr->n_targets; ++refIndex) {
+      ++show_progress;
+
+      BamRecordStream stream(samfile, hdr, sam_itr_queryi(idx, refIndex, 0, hdr->target_len[refIndex]));
+      bam1_t* rec = NULL;
+      while ((rec = stream.next()) != NULL) {
+	if (!ta.process(rec)) return 1;
+      }
+    }
+    if (!ta.finish()) return 1;
+    
+    return 0;
+  }
 
-  int tracks(int argc, char **argv) {
-    TrackConfig c;
 
+  int parseTracks(int argc, char **argv, TrackConfig& c, InputContext& in) {
     // Parameter
     boost::program_options::options_description generic("Generic options");
     generic.add_options()
@@ -361,28 +406,14 @@ namespace bamstats
       return 1;
     }
 
-    // Check bam file
-    if (!(boost::filesystem::exists(c.bamFile) && boost::filesystem::is_regular_file(c.bamFile) && boost::filesystem::file_size(c.bamFile))) {
-      std::cerr << "Alignment file is missing: " << c.bamFile.string() << std::endl;
-      return 1;
-    } else {
-      samFile* samfile = sam_open(c.bamFile.string().c_str(), "r");
-      if (samfile == NULL) {
-	std::cerr << "Fail to open file " << c.bamFile.string() << std::endl;
-	return 1;
-      }
-      hts_idx_t* idx = sam_index_load(samfile, c.bamFile.string().c_str());
-      if (idx == NULL) {
-	if (bam_index_build(c.bamFile.string().c_str(), 0) != 0) {
-	  std::cerr << "Fail to open index for " << c.bamFile.string() << std::endl;
-	  return 1;
-	}
-      }
-      bam_hdr_t* hdr = sam_hdr_read(samfile);
-      if (hdr == NULL) {
-	std::cerr << "Fail to open header for " << c.bamFile.string() << std::endl;
-	return 1;
-      }
+    // Check bam file or coverage cache, the index is only loaded once the tracks are computed
+    CoverageReader cache;
+    c.hasCoverageCache = isCoverageCache(c.bamFile);
+    if ((c.hasCoverageCache) && (!cache.open(c.bamFile, "tracks", c.minQual))) return 1;
+    else if ((!c.hasCoverageCache) && (in.bam(c.bamFile, false) == NULL)) return 1;
+    else if (c.hasCoverageCache) c.sampleName = cache.sampleName;
+    else {
+      bam_hdr_t* hdr = in.bam(c.bamFile, false)->hdr;
 
       // Get sample name
       std::string sampleName;
@@ -390,13 +421,17 @@ namespace bamstats
 	std::cerr << "Only one sample (@RG:SM) is allowed per input BAM file " << c.bamFile.string() << std::endl;
 	return 1;
       } else c.sampleName = sampleName;
-
-      // Clean-up
-      bam_hdr_destroy(hdr);
-      hts_idx_destroy(idx);
-      sam_close(samfile);
     }
 
+    return 0;
+  }
+
+
+  int tracks(int argc, char **argv) {
+    TrackConfig c;
+    InputContext in;
+    if (parseTracks(argc, argv, c, in)) return 1;
+
     // Show cmd
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
     std::cout << '[' << boost::posix_time::to_simple_string(now) << "] ";
@@ -404,7 +439,7 @@ namespace bamstats
     for(int i=0; i<argc; ++i) { std::cout << argv[i] << ' '; }
     std::cout << std::endl;
 
-    return create_tracks(c);
+    return create_tracks(c, in);
   }
 
   
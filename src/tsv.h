@@ -32,6 +32,7 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <boost/iostreams/device/file.hpp>
 
 #include "qcstruct.h"
+#include "writer.h"
 
 namespace bamstats
 {
@@ -187,10 +188,8 @@ namespace bamstats
     std::string filename = c.outfile.string();
     if (c.format == "both") filename += ".tsv.gz";
     
-    // Outfile
-    boost::iostreams::filtering_ostream rcfile;
-    rcfile.push(boost::iostreams::gzip_compressor());
-    rcfile.push(boost::iostreams::file_sink(filename.c_str(), std::ios_base::out | std::ios_base::binary));
+    // Outfile, compressed on a separate thread
+    GzipWriter rcfile(filename);
 
     // Output header
     rcfile << "# This file was produced by alfred v" << alfredVersionNumber << "." << std::endl;
@@ -281,43 +280,45 @@ namespace bamstats
       }
     }
 
-    // Output mean base quality
-    rcfile << "# Mean base quality (BQ)." << std::endl;
-    rcfile << "# Use `zgrep ^BQ <outfile> | cut -f 2-` to extract this part." << std::endl;
-    rcfile << "BQ\tSample\tPosition\tBaseQual\tLibrary" << std::endl;
-    for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-      uint32_t lastValidBQIdx = _lastNonZeroIdxACGTN(itRg->second.rc);
-      for(uint32_t i = 0; i <= lastValidBQIdx; ++i) {
-	uint64_t bcount = itRg->second.rc.aCount[i] + itRg->second.rc.cCount[i] + itRg->second.rc.gCount[i] + itRg->second.rc.tCount[i] + itRg->second.rc.nCount[i];
-	if (bcount > 0) rcfile << "BQ\t" << c.sampleName << "\t" << i << "\t" << (double) (itRg->second.rc.bqCount[i]) / (double) (bcount) << "\t" << itRg->first << std::endl;
-	else rcfile << "BQ\t" << c.sampleName << "\t" << i << "\tNA\t" << itRg->first << std::endl;
+    if (c.metrics & qcBaseComposition) {
+      // Output mean base quality
+      rcfile << "# Mean base quality (BQ)." << std::endl;
+      rcfile << "# Use `zgrep ^BQ <outfile> | cut -f 2-` to extract this part." << std::endl;
+      rcfile << "BQ\tSample\tPosition\tBaseQual\tLibrary" << std::endl;
+      for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	uint32_t lastValidBQIdx = _lastNonZeroIdxACGTN(itRg->second.rc);
+	for(uint32_t i = 0; i <= lastValidBQIdx; ++i) {
+	  uint64_t bcount = itRg->second.rc.aCount[i] + itRg->second.rc.cCount[i] + itRg->second.rc.gCount[i] + itRg->second.rc.tCount[i] + itRg->second.rc.nCount[i];
+	  if (bcount > 0) rcfile << "BQ\t" << c.sampleName << "\t" << i << "\t" << (double) (itRg->second.rc.bqCount[i]) / (double) (bcount) << "\t" << itRg->first << std::endl;
+	  else rcfile << "BQ\t" << c.sampleName << "\t" << i << "\tNA\t" << itRg->first << std::endl;
+	}
       }
-    }
 
-    // Output per base ACGTN content
-    rcfile << "# Base content (BC)." << std::endl;
-    rcfile << "# Use `zgrep ^BC <outfile> | cut -f 2-` to extract this part." << std::endl;
-    rcfile << "BC\tSample\tPosition\tBase\tCount\tFraction\tLibrary" << std::endl;
-    for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-      uint32_t lastValidBQIdx = 0;
-      for(uint32_t i = lastValidBQIdx + 1; i < itRg->second.rc.nCount.size(); ++i) {
-	uint64_t bcount = itRg->second.rc.aCount[i] + itRg->second.rc.cCount[i] + itRg->second.rc.gCount[i] + itRg->second.rc.tCount[i] + itRg->second.rc.nCount[i];
-	if (bcount > 0) lastValidBQIdx = i;
-      }
-      for(uint32_t i = 0; i <= lastValidBQIdx; ++i) {
-	uint64_t bcount = itRg->second.rc.aCount[i] + itRg->second.rc.cCount[i] + itRg->second.rc.gCount[i] + itRg->second.rc.tCount[i] + itRg->second.rc.nCount[i];
-	if (bcount > 0) {
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tA\t" << itRg->second.rc.aCount[i] << "\t" << (double) itRg->second.rc.aCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tC\t" << itRg->second.rc.cCount[i] << "\t" << (double) itRg->second.rc.cCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tG\t" << itRg->second.rc.gCount[i] << "\t" << (double) itRg->second.rc.gCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tT\t" << itRg->second.rc.tCount[i] << "\t" << (double) itRg->second.rc.tCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tN\t" << itRg->second.rc.nCount[i] << "\t" << (double) itRg->second.rc.nCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
-	} else {
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tA\t" << itRg->second.rc.aCount[i] << "\tNA\t" << itRg->first << std::endl;
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tC\t" << itRg->second.rc.cCount[i] << "\tNA\t" << itRg->first << std::endl;
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tG\t" << itRg->second.rc.gCount[i] << "\tNA\t" << itRg->first << std::endl;
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tT\t" << itRg->second.rc.tCount[i] << "\tNA\t" << itRg->first << std::endl;
-	  rcfile << "BC\t" << c.sampleName << "\t" << i << "\tN\t" << itRg->second.rc.nCount[i] << "\tNA\t" << itRg->first << std::endl;
+      // Output per base ACGTN content
+      rcfile << "# Base content (BC)." << std::endl;
+      rcfile << "# Use `zgrep ^BC <outfile> | cut -f 2-` to extract this part." << std::endl;
+      rcfile << "BC\tSample\tPosition\tBase\tCount\tFraction\tLibrary" << std::endl;
+      for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	uint32_t lastValidBQIdx = 0;
+	for(uint32_t i = lastValidBQIdx + 1; i < itRg->second.rc.nCount.size(); ++i) {
+	  uint64_t bcount = itRg->second.rc.aCount[i] + itRg->second.rc.cCount[i] + itRg->second.rc.gCount[i] + itRg->second.rc.tCount[i] + itRg->second.rc.nCount[i];
+	  if (bcount > 0) lastValidBQIdx = i;
+	}
+	for(uint32_t i = 0; i <= lastValidBQIdx; ++i) {
+	  uint64_t bcount = itRg->second.rc.aCount[i] + itRg->second.rc.cCount[i] + itRg->second.rc.gCount[i] + itRg->second.rc.tCount[i] + itRg->second.rc.nCount[i];
+	  if (bcount > 0) {
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tA\t" << itRg->second.rc.aCount[i] << "\t" << (double) itRg->second.rc.aCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tC\t" << itRg->second.rc.cCount[i] << "\t" << (double) itRg->second.rc.cCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tG\t" << itRg->second.rc.gCount[i] << "\t" << (double) itRg->second.rc.gCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tT\t" << itRg->second.rc.tCount[i] << "\t" << (double) itRg->second.rc.tCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tN\t" << itRg->second.rc.nCount[i] << "\t" << (double) itRg->second.rc.nCount[i] / (double) bcount << "\t" << itRg->first << std::endl;
+	  } else {
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tA\t" << itRg->second.rc.aCount[i] << "\tNA\t" << itRg->first << std::endl;
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tC\t" << itRg->second.rc.cCount[i] << "\tNA\t" << itRg->first << std::endl;
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tG\t" << itRg->second.rc.gCount[i] << "\tNA\t" << itRg->first << std::endl;
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tT\t" << itRg->second.rc.tCount[i] << "\tNA\t" << itRg->first << std::endl;
+	    rcfile << "BC\t" << c.sampleName << "\t" << i << "\tN\t" << itRg->second.rc.nCount[i] << "\tNA\t" << itRg->first << std::endl;
+	  }
 	}
       }
     }
@@ -340,23 +341,25 @@ namespace bamstats
       }
     }    
 
-    // Output coverage histograms
-    rcfile << "# Coverage histogram (CO)." << std::endl;
-    rcfile << "# Use `zgrep ^CO <outfile> | cut -f 2-` to extract this part." << std::endl;
-    rcfile << "CO\tSample\tCoverage\tCount\tQuantile\tLibrary" << std::endl;
-    for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-      uint32_t lastValidCO = 0;
-      for(uint32_t i = 0; i < itRg->second.bc.bpWithCoverage.size(); ++i)
-	if (itRg->second.bc.bpWithCoverage[i] > 0) lastValidCO = i;
-      // Ignore last bucket that collects all higher coverage bases
-      uint64_t totalCO = 0;
-      for(uint32_t i = 0; i < itRg->second.bc.bpWithCoverage.size() - 1; ++i) totalCO += itRg->second.bc.bpWithCoverage[i];
-      uint64_t cumsum = 0;
-      for(uint32_t i = 0; i <= lastValidCO; ++i) {
-	double quant = 0;
-	if (totalCO > 0) quant = (double) cumsum / (double) totalCO;
-	rcfile << "CO\t" << c.sampleName << "\t" << i << "\t" << itRg->second.bc.bpWithCoverage[i] << "\t" << quant << "\t" << itRg->first << std::endl;
-	cumsum += itRg->second.bc.bpWithCoverage[i];
+    if (c.metrics & qcCoverage) {
+      // Output coverage histograms
+      rcfile << "# Coverage histogram (CO)." << std::endl;
+      rcfile << "# Use `zgrep ^CO <outfile> | cut -f 2-` to extract this part." << std::endl;
+      rcfile << "CO\tSample\tCoverage\tCount\tQuantile\tLibrary" << std::endl;
+      for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	uint32_t lastValidCO = 0;
+	for(uint32_t i = 0; i < itRg->second.bc.bpWithCoverage.size(); ++i)
+	  if (itRg->second.bc.bpWithCoverage[i] > 0) lastValidCO = i;
+	// Ignore last bucket that collects all higher coverage bases
+	uint64_t totalCO = 0;
+	for(uint32_t i = 0; i < itRg->second.bc.bpWithCoverage.size() - 1; ++i) totalCO += itRg->second.bc.bpWithCoverage[i];
+	uint64_t cumsum = 0;
+	for(uint32_t i = 0; i <= lastValidCO; ++i) {
+	  double quant = 0;
+	  if (totalCO > 0) quant = (double) cumsum / (double) totalCO;
+	  rcfile << "CO\t" << c.sampleName << "\t" << i << "\t" << itRg->second.bc.bpWithCoverage[i] << "\t" << quant << "\t" << itRg->first << std::endl;
+	  cumsum += itRg->second.bc.bpWithCoverage[i];
+	}
       }
     }
 
@@ -376,123 +379,129 @@ namespace bamstats
       }
     }
     
-    // Output insert size histograms
-    rcfile << "# Insert size histogram (IS)." << std::endl;
-    rcfile << "# Use `zgrep ^IS <outfile> | cut -f 2-` to extract this part." << std::endl;
-    rcfile << "IS\tSample\tInsertSize\tCount\tLayout\tQuantile\tLibrary" << std::endl;
-    for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-      uint32_t lastValidISIdx = _lastNonZeroIdxISize(itRg->second.pc);
-      // Ignore last bucket that collects all other pairs
-      uint64_t totalFR = 0;
-      for(uint32_t i = 0; i < itRg->second.pc.fPlus.size() - 1; ++i) totalFR += itRg->second.pc.fPlus[i] + itRg->second.pc.fMinus[i] + itRg->second.pc.rPlus[i] + itRg->second.pc.rMinus[i];
-      uint64_t cumsum = 0;
-      for(uint32_t i = 0; i <= lastValidISIdx; ++i) {
-	double quant = 0;
-	if (totalFR > 0) quant = (double) cumsum / (double) totalFR;
-	rcfile << "IS\t" << c.sampleName << "\t" << i << "\t" << itRg->second.pc.fPlus[i] << "\tF+\t" << quant << "\t" << itRg->first << std::endl;
-	rcfile << "IS\t" << c.sampleName << "\t" << i << "\t" << itRg->second.pc.fMinus[i] << "\tF-\t" << quant << "\t" << itRg->first << std::endl;
-	rcfile << "IS\t" << c.sampleName << "\t" << i << "\t" << itRg->second.pc.rPlus[i] << "\tR+\t" << quant << "\t" << itRg->first << std::endl;
-	rcfile << "IS\t" << c.sampleName << "\t" << i << "\t" << itRg->second.pc.rMinus[i] << "\tR-\t" << quant << "\t" << itRg->first << std::endl;		
-	cumsum += itRg->second.pc.fPlus[i] + itRg->second.pc.fMinus[i] + itRg->second.pc.rPlus[i] + itRg->second.pc.rMinus[i];
+    if (c.metrics & qcInsertSize) {
+      // Output insert size histograms
+      rcfile << "# Insert size histogram (IS)." << std::endl;
+      rcfile << "# Use `zgrep ^IS <outfile> | cut -f 2-` to extract this part." << std::endl;
+      rcfile << "IS\tSample\tInsertSize\tCount\tLayout\tQuantile\tLibrary" << std::endl;
+      for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	uint32_t lastValidISIdx = _lastNonZeroIdxISize(itRg->second.pc);
+	// Ignore last bucket that collects all other pairs
+	uint64_t totalFR = 0;
+	for(uint32_t i = 0; i < itRg->second.pc.fPlus.size() - 1; ++i) totalFR += itRg->second.pc.fPlus[i] + itRg->second.pc.fMinus[i] + itRg->second.pc.rPlus[i] + itRg->second.pc.rMinus[i];
+	uint64_t cumsum = 0;
+	for(uint32_t i = 0; i <= lastValidISIdx; ++i) {
+	  double quant = 0;
+	  if (totalFR > 0) quant = (double) cumsum / (double) totalFR;
+	  rcfile << "IS\t" << c.sampleName << "\t" << i << "\t" << itRg->second.pc.fPlus[i] << "\tF+\t" << quant << "\t" << itRg->first << std::endl;
+	  rcfile << "IS\t" << c.sampleName << "\t" << i << "\t" << itRg->second.pc.fMinus[i] << "\tF-\t" << quant << "\t" << itRg->first << std::endl;
+	  rcfile << "IS\t" << c.sampleName << "\t" << i << "\t" << itRg->second.pc.rPlus[i] << "\tR+\t" << quant << "\t" << itRg->first << std::endl;
+	  rcfile << "IS\t" << c.sampleName << "\t" << i << "\t" << itRg->second.pc.rMinus[i] << "\tR-\t" << quant << "\t" << itRg->first << std::endl;		
+	  cumsum += itRg->second.pc.fPlus[i] + itRg->second.pc.fMinus[i] + itRg->second.pc.rPlus[i] + itRg->second.pc.rMinus[i];
+	}
       }
     }
 
-    // Homopolymer InDel context
-    rcfile << "# InDel context (IC)." << std::endl;
-    rcfile << "# Use `zgrep ^IC <outfile> | cut -f 2-` to extract this part." << std::endl;
-    rcfile << "IC\tSample\tLibrary\tInDel\tHomopolymer\tCount\tFraction" << std::endl;
-    for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-      double total = 0;
-      for(uint32_t i = 0; i < itRg->second.bc.delHomACGTN.size(); ++i) total += itRg->second.bc.delHomACGTN[i];
-      for(uint32_t i = 0; i < itRg->second.bc.delHomACGTN.size(); ++i) {
-	double frac = 0;
-	if (total > 0) frac = (double) itRg->second.bc.delHomACGTN[i] / total;
-	rcfile << "IC\t" << c.sampleName << "\t" << itRg->first << "\tDEL\t";
-	if (i == 0) rcfile << 'A';
-	else if (i == 1) rcfile << 'C';
-	else if (i == 2) rcfile << 'G';
-	else if (i == 3) rcfile << 'T';
-	else if (i == 4) rcfile << 'N';
-	else rcfile << "None";
-	rcfile << "\t" << itRg->second.bc.delHomACGTN[i] << "\t" << frac << std::endl;
+    if (c.metrics & qcErrors) {
+      // Homopolymer InDel context
+      rcfile << "# InDel context (IC)." << std::endl;
+      rcfile << "# Use `zgrep ^IC <outfile> | cut -f 2-` to extract this part." << std::endl;
+      rcfile << "IC\tSample\tLibrary\tInDel\tHomopolymer\tCount\tFraction" << std::endl;
+      for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	double total = 0;
+	for(uint32_t i = 0; i < itRg->second.bc.delHomACGTN.size(); ++i) total += itRg->second.bc.delHomACGTN[i];
+	for(uint32_t i = 0; i < itRg->second.bc.delHomACGTN.size(); ++i) {
+	  double frac = 0;
+	  if (total > 0) frac = (double) itRg->second.bc.delHomACGTN[i] / total;
+	  rcfile << "IC\t" << c.sampleName << "\t" << itRg->first << "\tDEL\t";
+	  if (i == 0) rcfile << 'A';
+	  else if (i == 1) rcfile << 'C';
+	  else if (i == 2) rcfile << 'G';
+	  else if (i == 3) rcfile << 'T';
+	  else if (i == 4) rcfile << 'N';
+	  else rcfile << "None";
+	  rcfile << "\t" << itRg->second.bc.delHomACGTN[i] << "\t" << frac << std::endl;
+	}
       }
-    }
-    for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-      double total = 0;
-      for(uint32_t i = 0; i < itRg->second.bc.insHomACGTN.size(); ++i) total += itRg->second.bc.insHomACGTN[i];
-      for(uint32_t i = 0; i < itRg->second.bc.insHomACGTN.size(); ++i) {
-	double frac = 0;
-	if (total > 0) frac = (double) itRg->second.bc.insHomACGTN[i] / total;
-	rcfile << "IC\t" << c.sampleName << "\t" << itRg->first << "\tINS\t";
-	if (i == 0) rcfile << 'A';
-	else if (i == 1) rcfile << 'C';
-	else if (i == 2) rcfile << 'G';
-	else if (i == 3) rcfile << 'T';
-	else if (i == 4) rcfile << 'N';
-	else rcfile << "None";
-	rcfile << "\t" << itRg->second.bc.insHomACGTN[i] << "\t" << frac << std::endl;
+      for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	double total = 0;
+	for(uint32_t i = 0; i < itRg->second.bc.insHomACGTN.size(); ++i) total += itRg->second.bc.insHomACGTN[i];
+	for(uint32_t i = 0; i < itRg->second.bc.insHomACGTN.size(); ++i) {
+	  double frac = 0;
+	  if (total > 0) frac = (double) itRg->second.bc.insHomACGTN[i] / total;
+	  rcfile << "IC\t" << c.sampleName << "\t" << itRg->first << "\tINS\t";
+	  if (i == 0) rcfile << 'A';
+	  else if (i == 1) rcfile << 'C';
+	  else if (i == 2) rcfile << 'G';
+	  else if (i == 3) rcfile << 'T';
+	  else if (i == 4) rcfile << 'N';
+	  else rcfile << "None";
+	  rcfile << "\t" << itRg->second.bc.insHomACGTN[i] << "\t" << frac << std::endl;
+	}
       }
-    }
 
-    // InDel size
-    rcfile << "# InDel size (IZ)." << std::endl;
-    rcfile << "# Use `zgrep ^IZ <outfile> | cut -f 2-` to extract this part." << std::endl;
-    rcfile << "IZ\tSample\tLibrary\tInDel\tSize\tCount" << std::endl;
-    for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-      for(uint32_t i = 1; i < itRg->second.bc.delSize.size(); ++i) 
-	rcfile << "IZ\t" << c.sampleName << "\t" << itRg->first << "\tDEL\t" << i << "\t" << itRg->second.bc.delSize[i] << std::endl;
-      for(uint32_t i = 1; i < itRg->second.bc.insSize.size(); ++i) 
-	rcfile << "IZ\t" << c.sampleName << "\t" << itRg->first << "\tINS\t" << i << "\t" << itRg->second.bc.insSize[i] << std::endl;
+      // InDel size
+      rcfile << "# InDel size (IZ)." << std::endl;
+      rcfile << "# Use `zgrep ^IZ <outfile> | cut -f 2-` to extract this part." << std::endl;
+      rcfile << "IZ\tSample\tLibrary\tInDel\tSize\tCount" << std::endl;
+      for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	for(uint32_t i = 1; i < itRg->second.bc.delSize.size(); ++i) 
+	  rcfile << "IZ\t" << c.sampleName << "\t" << itRg->first << "\tDEL\t" << i << "\t" << itRg->second.bc.delSize[i] << std::endl;
+	for(uint32_t i = 1; i < itRg->second.bc.insSize.size(); ++i) 
+	  rcfile << "IZ\t" << c.sampleName << "\t" << itRg->first << "\tINS\t" << i << "\t" << itRg->second.bc.insSize[i] << std::endl;
+      }
     }
 
-    // Reference GC content
-    rcfile << "# Chromosome GC-content (CG)." << std::endl;
-    rcfile << "# Use `zgrep ^CG <outfile> | cut -f 2-` to extract this part." << std::endl;
-    rcfile << "CG\tChromosome\tSize\tnumN\tnumGC\tGCfraction" << std::endl;
-    for(uint32_t i = 0; i < rf.chrGC.size(); ++i) {
-      // Only chromosomes with mapped data
-      if (rf.chrGC[i].ncount + rf.chrGC[i].gccount > 0) {
-	double total = hdr->target_len[i] - rf.chrGC[i].ncount;
-	if (total > 0) {
-	  double frac = (double) rf.chrGC[i].gccount / total;
-	  rcfile << "CG\t" << hdr->target_name[i] << "\t" << hdr->target_len[i] << "\t" << rf.chrGC[i].ncount << "\t" << rf.chrGC[i].gccount << "\t" << frac << std::endl;
+    if (c.metrics & qcGC) {
+      // Reference GC content
+      rcfile << "# Chromosome GC-content (CG)." << std::endl;
+      rcfile << "# Use `zgrep ^CG <outfile> | cut -f 2-` to extract this part." << std::endl;
+      rcfile << "CG\tChromosome\tSize\tnumN\tnumGC\tGCfraction" << std::endl;
+      for(uint32_t i = 0; i < rf.chrGC.size(); ++i) {
+	// Only chromosomes with mapped data
+	if (rf.chrGC[i].ncount + rf.chrGC[i].gccount > 0) {
+	  double total = hdr->target_len[i] - rf.chrGC[i].ncount;
+	  if (total > 0) {
+	    double frac = (double) rf.chrGC[i].gccount / total;
+	    rcfile << "CG\t" << hdr->target_name[i] << "\t" << hdr->target_len[i] << "\t" << rf.chrGC[i].ncount << "\t" << rf.chrGC[i].gccount << "\t" << frac << std::endl;
+	  }
 	}
       }
-    }
 
-    // GC-content
-    rcfile << "# GC-content (GC)." << std::endl;
-    rcfile << "# Use `zgrep ^GC <outfile> | cut -f 2-` to extract this part." << std::endl;
-    rcfile << "GC\tSample\tLibrary\tGCcontent\tfractionOfReads" << std::endl;
-    {
-      double total = 0;
-      for(uint32_t i = 0; i < 102; ++i) total += rf.refGcContent[i];
-      for(uint32_t i = 0; i < 102; ++i) {
-	double frac = 0;
-	if (total > 0) frac = (double) rf.refGcContent[i] / total;
-	rcfile << "GC\tReference\tReference\t" << (double) i / (double) 101 << "\t" << frac << std::endl;
+      // GC-content
+      rcfile << "# GC-content (GC)." << std::endl;
+      rcfile << "# Use `zgrep ^GC <outfile> | cut -f 2-` to extract this part." << std::endl;
+      rcfile << "GC\tSample\tLibrary\tGCcontent\tfractionOfReads" << std::endl;
+      {
+	double total = 0;
+	for(uint32_t i = 0; i < 102; ++i) total += rf.refGcContent[i];
+	for(uint32_t i = 0; i < 102; ++i) {
+	  double frac = 0;
+	  if (total > 0) frac = (double) rf.refGcContent[i] / total;
+	  rcfile << "GC\tReference\tReference\t" << (double) i / (double) 101 << "\t" << frac << std::endl;
+	}
       }
-    }
-    if (c.hasRegionFile) {
-      double total = 0;
-      for(uint32_t i = 0; i < 102; ++i) total += be.bedGcContent[i];
-      for(uint32_t i = 0; i < 102; ++i) {
-	double frac = 0;
-	if (total > 0) frac = (double) be.bedGcContent[i] / total;
-	rcfile << "GC\tTarget\tTarget\t" << (double) i / (double) 101 << "\t" << frac << std::endl;
+      if (c.hasRegionFile) {
+	double total = 0;
+	for(uint32_t i = 0; i < 102; ++i) total += be.bedGcContent[i];
+	for(uint32_t i = 0; i < 102; ++i) {
+	  double frac = 0;
+	  if (total > 0) frac = (double) be.bedGcContent[i] / total;
+	  rcfile << "GC\tTarget\tTarget\t" << (double) i / (double) 101 << "\t" << frac << std::endl;
+	}
       }
-    }
-    for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
-      double total = 0;
-      for(uint32_t i = 0; i < 102; ++i) total += itRg->second.rc.gcContent[i];
-      for(uint32_t i = 0; i < 102; ++i) {
-	double frac = 0;
-	if (total > 0) frac = (double) itRg->second.rc.gcContent[i] / total;
-	rcfile << "GC\t" << c.sampleName << "\t" << itRg->first << "\t" << (double) i / (double) 101 << "\t" << frac << std::endl;
+      for(typename TRGMap::const_iterator itRg = rgMap.begin(); itRg != rgMap.end(); ++itRg) {
+	double total = 0;
+	for(uint32_t i = 0; i < 102; ++i) total += itRg->second.rc.gcContent[i];
+	for(uint32_t i = 0; i < 102; ++i) {
+	  double frac = 0;
+	  if (total > 0) frac = (double) itRg->second.rc.gcContent[i] / total;
+	  rcfile << "GC\t" << c.sampleName << "\t" << itRg->first << "\t" << (double) i / (double) 101 << "\t" << frac << std::endl;
+	}
       }
     }
 
-    if (c.hasRegionFile) {
+    if ((c.hasRegionFile) && (c.metrics & qcCoverage)) {
       // Output avg. bed coverage
       rcfile << "# Avg. target coverage (TC)." << std::endl;
       rcfile << "# Use `zgrep ^TC <outfile> | cut -f 2-` to extract this part." << std::endl;
@@ -33,6 +33,9 @@ Contact: Tobias Rausch (rausch@embl.de)
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/math/distributions/binomial.hpp>
+#include <boost/math/special_functions/gamma.hpp>
+#include <boost/math/special_functions/log1p.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <htslib/sam.h>
 
@@ -48,18 +51,76 @@ namespace bamstats
   };
 
 
+  inline double
+  _logBinomPdf(uint32_t k, uint32_t n, double logp, double logq) {
+    return boost::math::lgamma((double) n + 1) - boost::math::lgamma((double) k + 1) - boost::math::lgamma((double) (n - k) + 1) + k * logp + (n - k) * logq;
+  }
+
+  // Two-sided exact binomial test, sums all outcomes at most as likely as x
   inline double
   binomTest(uint32_t x, uint32_t n, double p) {
-    boost::math::binomial binomialdist(n, p);
-    double cutoff = pdf(binomialdist, x);
-    double pval = 0.0;
-    for(uint32_t k = 0; k <= n; ++k) {
-      double p = pdf(binomialdist, k);
-      if (p <= cutoff) pval +=p;
+    if ((n == 0) || (x > n)) return 1.0;
+    if ((p <= 0) || (p >= 1)) {
+      if (p <= 0) return (x == 0) ? 1.0 : 0.0;
+      return (x == n) ? 1.0 : 0.0;
+    }
+
+    // Symmetric case, both tails via the regularised incomplete beta
+    if (p == 0.5) {
+      uint32_t lower = std::min(x, n - x);
+      if (2 * lower >= n) return 1.0;
+      boost::math::binomial binomialdist(n, p);
+      return std::min(1.0, 2.0 * cdf(binomialdist, lower));
+    }
+
+    // Walk out from the mode, pdf ratios are cheap multiplies in mode-scaled space
+    double logp = std::log(p);
+    double logq = boost::math::log1p(-p);
+    uint32_t mode = std::min(n, (uint32_t) ((n + 1) * p));
+    double logmode = _logBinomPdf(mode, n, logp, logq);
+    double cutoff = std::exp(_logBinomPdf(x, n, logp, logq) - logmode) * (1 + 1e-7);
+    double odds = p / (1 - p);
+    double pval = (1.0 <= cutoff) ? 1.0 : 0.0;
+    double t = 1.0;
+    for(uint32_t k = mode; k < n; ++k) {
+      t *= odds * (double) (n - k) / (double) (k + 1);
+      if (t == 0) break;
+      if (t <= cutoff) pval += t;
+    }
+    t = 1.0;
+    for(uint32_t k = mode; k > 0; --k) {
+      t *= (double) k / ((double) (n - k + 1) * odds);
+      if (t == 0) break;
+      if (t <= cutoff) pval += t;
     }
-    return pval;
+    return std::min(1.0, pval * std::exp(logmode));
   }
 
+  struct BinomialTest {
+    typedef boost::unordered_map<uint64_t, double> TPValueCache;
+    double p;
+    TPValueCache cache;
+
+    explicit BinomialTest(double prob) : p(prob) {}
+
+    // Depths repeat heavily, memoise by (x, n)
+    inline double
+    operator()(uint32_t x, uint32_t n) {
+      uint64_t key = ((uint64_t) n << 32) | (uint64_t) x;
+      TPValueCache::const_iterator it = cache.find(key);
+      if (it != cache.end()) return it->second;
+      double pval = binomTest(x, n, p);
+      cache.insert(std::make_pair(key, pval));
+      return pval;
+    }
+
+    template<typename TCounts, typename TPValues>
+    inline void
+    batch(TCounts const& x, TCounts const& n, TPValues& pval) {
+      pval.resize(x.size());
+      for(std::size_t i = 0; i < x.size(); ++i) pval[i] = (*this)(x[i], n[i]);
+    }
+  };
 
   
   inline unsigned hash_string(const char *s) {
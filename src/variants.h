@@ -32,28 +32,149 @@ Contact: Tobias Rausch (rausch@embl.de)
 namespace bamstats
 {
 
-  struct BiallelicVariant {
-    int32_t pos;
-    std::string ref;
-    std::string alt;
-    bool hap;
-
-    explicit BiallelicVariant(int32_t p) : pos(p), ref(""), alt(""), hap(0) {}
-    BiallelicVariant(int32_t p, std::string const& r, std::string  const& a, bool h) : pos(p), ref(r), alt(a), hap(h) {}
-  };
+  inline uint8_t
+  _encodeBase(std::string const& allele) {
+    if (allele.size() != 1) return 4;
+    switch (allele[0]) {
+    case 'A': return 0;
+    case 'C': return 1;
+    case 'G': return 2;
+    case 'T': return 3;
+    default: return 4;
+    }
+  }
+
+  // Bi-allelic het. markers as struct-of-arrays, an SNV takes 5 bytes, other alleles go to a side pool
+  struct VariantTable {
+    typedef boost::unordered_map<uint32_t, uint32_t> TPoolIndex;
+    std::vector<int32_t> pos;
+    std::vector<uint8_t> code; // ref (bits 0-1), alt (bits 2-3), haplotype (bit 4), pooled alleles (bit 5)
+    std::vector<std::string> pool;
+    TPoolIndex poolIdx;
+
+    inline uint32_t size() const { return pos.size(); }
+    inline bool empty() const { return pos.empty(); }
+    inline bool hap(uint32_t i) const { return (code[i] & 16); }
+    inline bool isSnv(uint32_t i) const { return !(code[i] & 32); }
+    inline char refBase(uint32_t i) const { return "ACGT"[code[i] & 3]; }
+    inline char altBase(uint32_t i) const { return "ACGT"[(code[i] >> 2) & 3]; }
+
+    inline std::string const& poolRef(uint32_t i) const { return pool[poolIdx.find(i)->second]; }
+    inline std::string const& poolAlt(uint32_t i) const { return pool[poolIdx.find(i)->second + 1]; }
+
+    inline std::string
+    ref(uint32_t i) const {
+      if (isSnv(i)) return std::string(1, refBase(i));
+      return poolRef(i);
+    }
 
+    inline std::string
+    alt(uint32_t i) const {
+      if (isSnv(i)) return std::string(1, altBase(i));
+      return poolAlt(i);
+    }
 
-  template<typename TRecord>
-  struct SortVariants : public std::binary_function<TRecord, TRecord, bool> {
-    inline bool operator()(TRecord const& s1, TRecord const& s2) const {
-      return s1.pos < s2.pos;
+    inline void
+    push_back(int32_t p, std::string const& r, std::string const& a, bool h) {
+      uint8_t rc = _encodeBase(r);
+      uint8_t ac = _encodeBase(a);
+      uint8_t hbit = h ? 16 : 0;
+      if ((rc < 4) && (ac < 4)) code.push_back(rc | (ac << 2) | hbit);
+      else {
+	poolIdx.insert(std::make_pair((uint32_t) pos.size(), (uint32_t) pool.size()));
+	pool.push_back(r);
+	pool.push_back(a);
+	code.push_back(32 | hbit);
+      }
+      pos.push_back(p);
+    }
+
+    // Copy marker i of another table with a new haplotype
+    inline void
+    append(VariantTable const& src, uint32_t i, bool h) {
+      if (src.isSnv(i)) {
+	code.push_back((src.code[i] & 15) | (h ? 16 : 0));
+	pos.push_back(src.pos[i]);
+      } else push_back(src.pos[i], src.poolRef(i), src.poolAlt(i), h);
+    }
+
+    // First marker with position >= p, the loop compiles to conditional moves
+    inline uint32_t
+    lowerBound(int32_t p) const {
+      uint32_t n = pos.size();
+      if (!n) return 0;
+      int32_t const* base = &pos[0];
+      while (n > 1) {
+	uint32_t half = n / 2;
+	base = (base[half] < p) ? base + half : base;
+	n -= half;
+      }
+      return (base - &pos[0]) + (*base < p);
+    }
+
+    // First marker with position > p
+    inline uint32_t
+    upperBound(int32_t p) const {
+      uint32_t n = pos.size();
+      if (!n) return 0;
+      int32_t const* base = &pos[0];
+      while (n > 1) {
+	uint32_t half = n / 2;
+	base = (base[half] <= p) ? base + half : base;
+	n -= half;
+      }
+      return (base - &pos[0]) + (*base <= p);
     }
   };
 
+  // Allele supported by a read at marker i (0: none, 1: REF, 2: ALT), sp is the read position aligned to the marker
+  inline int32_t
+  _readAllele(VariantTable const& vt, uint32_t i, char const* seq, bam1_t const* rec, int32_t sp, std::string& sequence) {
+    int32_t gp = vt.pos[i];
+    if (vt.isSnv(i)) {
+      if ((seq[gp] != vt.refBase(i)) || (sp + 1 >= rec->core.l_qseq)) return 0;
+      // nt16 read base against the 2-bit alleles
+      uint8_t base = bam_seqi(bam_get_seq(rec), sp);
+      if (base == (1 << ((vt.code[i] >> 2) & 3))) return 2;
+      else if (base == (1 << (vt.code[i] & 3))) return 1;
+      return 0;
+    }
+
+    // Check REF allele
+    std::string const& ref = vt.poolRef(i);
+    std::string const& alt = vt.poolAlt(i);
+    if (ref.compare(0, ref.size(), seq + gp, ref.size()) != 0) return 0;
+    if ((sp + alt.size() >= (uint32_t) rec->core.l_qseq) || (sp + ref.size() >= (uint32_t) rec->core.l_qseq)) return 0;
+    if (sequence.empty()) {
+      sequence.resize(rec->core.l_qseq);
+      uint8_t* seqptr = bam_get_seq(rec);
+      for (int32_t k = 0; k < rec->core.l_qseq; ++k) sequence[k] = "=ACMGRSVTWYHKDBN"[bam_seqi(seqptr, k)];
+    }
+
+    // Check ALT allele
+    if (ref.size() == alt.size()) {
+      // MNP
+      if ((sequence.compare(sp, alt.size(), alt) == 0) && (sequence.compare(sp, ref.size(), ref) != 0)) return 2;
+      else if ((sequence.compare(sp, alt.size(), alt) != 0) && (sequence.compare(sp, ref.size(), ref) == 0)) return 1;
+    } else if (ref.size() < alt.size()) {
+      // Insertion
+      int32_t diff = alt.size() - ref.size();
+      std::string refProbe = ref + std::string(seq + gp + ref.size(), seq + gp + ref.size() + diff);
+      if ((sequence.compare(sp, alt.size(), alt) == 0) && (sequence.compare(sp, alt.size(), refProbe) != 0)) return 2;
+      else if ((sequence.compare(sp, alt.size(), alt) != 0) && (sequence.compare(sp, alt.size(), refProbe) == 0)) return 1;
+    } else {
+      // Deletion
+      int32_t diff = ref.size() - alt.size();
+      std::string altProbe = alt + std::string(seq + gp + ref.size(), seq + gp + ref.size() + diff);
+      if ((sequence.compare(sp, ref.size(), altProbe) == 0) && (sequence.compare(sp, ref.size(), ref) != 0)) return 2;
+      else if ((sequence.compare(sp, ref.size(), altProbe) != 0) && (sequence.compare(sp, ref.size(), ref) == 0)) return 1;
+    }
+    return 0;
+  }
+
   template<typename TVariants>
   inline bool
   _loadVariants(htsFile* ifile, hts_idx_t* bcfidx, bcf_hdr_t* hdr, std::string const& sample, std::string const& chrom, TVariants& pV) {
-    typedef typename TVariants::value_type TVariant;
     
     int32_t sampleIndex = -1;
     for (int i = 0; i < bcf_hdr_nsamples(hdr); ++i)
@@ -81,7 +202,7 @@ namespace bamstats
 	    if (gt_type == 1) {
 	      if (rec->pos != lastpos) {
 		// Only one variant per position
-		pV.push_back(TVariant(rec->pos, std::string(rec->d.allele[0]), std::string(rec->d.allele[1]), bcf_gt_allele(gt[sampleIndex*2])));
+		pV.push_back(rec->pos, std::string(rec->d.allele[0]), std::string(rec->d.allele[1]), bcf_gt_allele(gt[sampleIndex*2]));
 		lastpos = rec->pos;
 	      }
 	    }
@@ -95,6 +216,55 @@ namespace bamstats
     return true;
   }
 
+  // Het. bi-allelic sites of many samples, each BCF record is decoded once
+  template<typename TVariants, typename TSampleHets>
+  inline bool
+  _loadVariants(htsFile* ifile, hts_idx_t* bcfidx, bcf_hdr_t* hdr, std::vector<int32_t> const& sampleIndex, std::string const& chrom, TVariants& sites, std::vector<std::string>& ids, TSampleHets& hets) {
+    hets.clear();
+    hets.resize(sampleIndex.size());
+    
+    // Genotypes
+    int ngt = 0;
+    int32_t* gt = NULL;
+
+    // Collect het. bi-allelic variants for this chromosome
+    int32_t chrid = bcf_hdr_name2id(hdr, chrom.c_str());
+    std::vector<int32_t> lastpos(sampleIndex.size(), -1);
+    if (chrid < 0) return false;
+    hts_itr_t* itervcf = bcf_itr_querys(bcfidx, hdr, chrom.c_str());
+    if (itervcf != NULL) {
+      bcf1_t* rec = bcf_init1();
+      while (bcf_itr_next(ifile, itervcf, rec) >= 0) {
+	// Only bi-allelic variants
+	if (rec->n_allele == 2) {
+	  bcf_unpack(rec, BCF_UN_ALL);
+	  bcf_get_genotypes(hdr, rec, &gt, &ngt);
+	  int32_t siteIdx = -1;
+	  for(uint32_t s = 0; s < sampleIndex.size(); ++s) {
+	    int32_t* sgt = gt + sampleIndex[s] * 2;
+	    if ((bcf_gt_allele(sgt[0]) != -1) && (bcf_gt_allele(sgt[1]) != -1) && (!bcf_gt_is_missing(sgt[0])) && (!bcf_gt_is_missing(sgt[1]))) {
+	      int gt_type = bcf_gt_allele(sgt[0]) + bcf_gt_allele(sgt[1]);
+	      if ((gt_type == 1) && (rec->pos != lastpos[s])) {
+		// Only one variant per position and sample
+		if (siteIdx < 0) {
+		  siteIdx = sites.size();
+		  sites.push_back(rec->pos, std::string(rec->d.allele[0]), std::string(rec->d.allele[1]), false);
+		  ids.push_back(std::string(rec->d.id));
+		}
+		hets[s].push_back(std::make_pair((uint32_t) siteIdx, (bool) bcf_gt_allele(sgt[0])));
+		lastpos[s] = rec->pos;
+	      }
+	    }
+	  }
+	}
+      }
+      bcf_destroy(rec);
+      hts_itr_destroy(itervcf);
+    }
+    if (gt != NULL) free(gt);
+    return true;
+  }
+
   
   template<typename TVariants>
   inline bool
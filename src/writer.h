@@ -0,0 +1,228 @@
+/*
+============================================================================
+Alfred: BAM alignment statistics
+============================================================================
+Copyright (C) 2017-2018 Tobias Rausch
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+============================================================================
+Contact: Tobias Rausch (rausch@embl.de)
+============================================================================
+*/
+
+
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/device/file.hpp>
+
+#include "pipeline.h"
+
+namespace bamstats
+{
+
+  typedef BoundedQueue<std::string*> TTextChunkQueue;
+
+  // Decimal digits of an integer, written backwards from the end of a buffer of at least 21 characters
+  template<typename TUnsigned>
+  inline char*
+  _formatUnsigned(TUnsigned v, char* end) {
+    do {
+      *--end = (char) ('0' + (v % 10));
+      v /= 10;
+    } while (v);
+    return end;
+  }
+
+  // Same text as operator<< on a default stream, i.e. %g with 6 significant digits
+  inline std::size_t
+  formatDouble(double const v, char* buf, std::size_t const n) {
+    int32_t len = snprintf(buf, n, "%g", v);
+    return (len < 0) ? 0 : std::min((std::size_t) len, n - 1);
+  }
+
+  // Takes complete chunks off the writer and compresses them
+  struct GzipCompressStage {
+    boost::filesystem::path outfile;
+    TTextChunkQueue& queue;
+    bool& ok;
+
+    GzipCompressStage(boost::filesystem::path const& o, TTextChunkQueue& q, bool& k) : outfile(o), queue(q), ok(k) {}
+
+    void operator()() {
+      boost::iostreams::filtering_ostream dataOut;
+      dataOut.push(boost::iostreams::gzip_compressor());
+      dataOut.push(boost::iostreams::file_sink(outfile.string().c_str(), std::ios_base::out | std::ios_base::binary));
+      std::string* chunk = NULL;
+      while (queue.pop(chunk)) {
+	if (ok) dataOut.write(chunk->c_str(), chunk->size());
+	if (!dataOut) ok = false;
+	delete chunk;
+      }
+      dataOut.pop();
+    }
+  };
+
+  // operator<< chains of a std::ostream on top of write() and put() of the derived writer, std::endl ends a line without flushing
+  template<typename TDerived>
+  struct TextFormatter {
+    inline TDerived&
+    self() {
+      return static_cast<TDerived&>(*this);
+    }
+
+    template<typename TUnsigned>
+    inline TDerived&
+    _unsigned(TUnsigned const v) {
+      char tmp[24];
+      char* p = _formatUnsigned(v, tmp + sizeof(tmp));
+      return self().write(p, tmp + sizeof(tmp) - p);
+    }
+
+    template<typename TUnsigned, typename TSigned>
+    inline TDerived&
+    _signed(TSigned const v) {
+      char tmp[24];
+      char* p = _formatUnsigned((TUnsigned) ((v < 0) ? (TUnsigned) 0 - (TUnsigned) v : (TUnsigned) v), tmp + sizeof(tmp));
+      if (v < 0) *--p = '-';
+      return self().write(p, tmp + sizeof(tmp) - p);
+    }
+
+    inline TDerived& operator<<(char const* s) { return self().write(s, strlen(s)); }
+    inline TDerived& operator<<(std::string const& s) { return self().write(s.c_str(), s.size()); }
+    inline TDerived& operator<<(char const c) { return self().put(c); }
+    inline TDerived& operator<<(signed char const c) { return self().put((char) c); }
+    inline TDerived& operator<<(unsigned char const c) { return self().put((char) c); }
+    inline TDerived& operator<<(bool const v) { return self().put((v) ? '1' : '0'); }
+    inline TDerived& operator<<(short const v) { return _signed<unsigned short>(v); }
+    inline TDerived& operator<<(unsigned short const v) { return _unsigned(v); }
+    inline TDerived& operator<<(int const v) { return _signed<unsigned int>(v); }
+    inline TDerived& operator<<(unsigned int const v) { return _unsigned(v); }
+    inline TDerived& operator<<(long const v) { return _signed<unsigned long>(v); }
+    inline TDerived& operator<<(unsigned long const v) { return _unsigned(v); }
+    inline TDerived& operator<<(long long const v) { return _signed<unsigned long long>(v); }
+    inline TDerived& operator<<(unsigned long long const v) { return _unsigned(v); }
+    inline TDerived& operator<<(float const v) { return operator<<((double) v); }
+
+    inline TDerived&
+    operator<<(double const v) {
+      char tmp[32];
+      return self().write(tmp, formatDouble(v, tmp, sizeof(tmp)));
+    }
+
+    inline TDerived&
+    operator<<(std::ostream& (*manip)(std::ostream&)) {
+      if (manip == static_cast<std::ostream& (*)(std::ostream&)>(std::endl)) self().put('\n');
+      return self();
+    }
+
+    // Anything else is formatted as a stream would do it
+    template<typename T>
+    inline TDerived&
+    operator<<(T const& v) {
+      std::ostringstream s;
+      s << v;
+      return operator<<(s.str());
+    }
+  };
+
+  // Gzipped text output, formatted into a large buffer that is compressed on a separate thread
+  struct GzipWriter : public TextFormatter<GzipWriter> {
+    static const std::size_t bufferSize = 1 << 20;
+
+    TTextChunkQueue queue;
+    std::string* buf;
+    bool ok;
+    boost::thread compressor;
+
+    explicit GzipWriter(boost::filesystem::path const& outfile) : queue(4), buf(new std::string()), ok(true) {
+      buf->reserve(bufferSize);
+      compressor = boost::thread(GzipCompressStage(outfile, queue, ok));
+    }
+
+    ~GzipWriter() {
+      close();
+    }
+
+    // Waits for the compressor, false if the output could not be written
+    inline bool
+    close() {
+      if (buf != NULL) {
+	if (!buf->empty()) _handOff();
+	delete buf;
+	buf = NULL;
+	queue.close();
+	compressor.join();
+      }
+      return ok;
+    }
+
+    inline void
+    _handOff() {
+      if (!queue.push(buf)) delete buf;
+      buf = new std::string();
+      buf->reserve(bufferSize);
+    }
+
+    inline GzipWriter&
+    write(char const* s, std::size_t const n) {
+      buf->append(s, n);
+      if (buf->size() >= bufferSize) _handOff();
+      return *this;
+    }
+
+    inline GzipWriter&
+    put(char const c) {
+      buf->push_back(c);
+      if (buf->size() >= bufferSize) _handOff();
+      return *this;
+    }
+
+  private:
+    GzipWriter(GzipWriter const&);
+    GzipWriter& operator=(GzipWriter const&);
+  };
+
+  // Text kept in memory
+  struct StringWriter : public TextFormatter<StringWriter> {
+    std::string str;
+
+    inline StringWriter&
+    write(char const* s, std::size_t const n) {
+      str.append(s, n);
+      return *this;
+    }
+
+    inline StringWriter&
+    put(char const c) {
+      str.push_back(c);
+      return *this;
+    }
+  };
+
+}
+
+#endif